@@ -1,54 +1,75 @@
 #include "AddApplication.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
+#include <thread>
 
-#include "HTMLFileProcessor.h"
-#include "OpenDocProcessor.h"
+#include <sys/stat.h>
+
+#include <libxml/parser.h>
+
+#include "DirectoryWalker.h"
+#include "FileExtractor.h"
+#include "LocalDatabases.h"
 
 
 namespace filesystem = std::filesystem;
 
-const char* const html_mime_types[] = {"text/html", nullptr};
 
-const char* const open_doc_mime_types[] = {
-  "application/vnd.oasis.opendocument.text",
-  "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
-  nullptr
-};
+/*
+Rough number of tokens of a text, since the tokenizer of the model is not
+known here. Good enough to keep requests under the server limits.
+*/
+static size_t estimate_tokens(const std::string& text)
+{
+  return text.size() / 4 + 1;
+}
 
 
-AddApplication::AddApplication():
-  database(),
-  magic_hdl(magic_open(MAGIC_MIME_TYPE))
+/*
+Strings of an optional array member, such as glob patterns.
+*/
+static std::vector<std::string> get_strings_setting(const Json::Value& settings,
+  const char* key)
 {
-  using std::placeholders::_1;
+  std::vector<std::string> strings;
 
-  if (!magic_hdl)
-  {
-    throw std::runtime_error("magic_open() failed");
-  }
+  Json::Value value = get_json_member_with_type(settings, key,
+    Json::ValueType::arrayValue, false);
 
-  if (magic_load(magic_hdl, nullptr) != 0)
+  for (const Json::Value& element : value)
   {
-    clean_up();
-    const char* err = magic_error(magic_hdl);
-    std::string msg = "magic_load() failed: ";
-    msg += (err ? err : "unknown error");
-    throw std::runtime_error(msg);
+    if (!element.isString())
+    {
+      std::string msg("Member with the key \"");
+      msg += key;
+      msg += "\" is not an array of strings";
+      throw std::runtime_error(msg);
+    }
+    strings.push_back(element.asString());
   }
 
-  file_processors.emplace_back(html_mime_types, [&] {
-    auto func = std::bind(std::mem_fn(&AddApplication::on_text_unit), this,
-      _1);
-    return std::make_unique<HTMLFileProcessor>(func);
-  });
+  return strings;
+}
 
-  file_processors.emplace_back(open_doc_mime_types, [&] {
-    auto func = std::bind(std::mem_fn(&AddApplication::on_text_unit), this,
-      _1);
-    return std::make_unique<OpenDocProcessor>(func);
-  });
+
+AddApplication::AddApplication():
+  batch_max_items(1),
+  batch_max_tokens(1),
+  extract_workers(1),
+  embedding_requests(1),
+  database_connections(1),
+  queue_size(1),
+  walk_workers(1),
+  next_file_id(1)
+{
 }
 
 
@@ -68,9 +89,6 @@ int AddApplication::run(int argc, char** argv)
 
   config_root = get_settings_from_default_json_file();
 
-  std::string embd_api_url;
-  std::string model_name;
-
   Json::Value embd_serv = get_json_member_with_type(config_root,
     "embeddingsHttp", Json::ValueType::objectValue, false);
 
@@ -86,11 +104,147 @@ int AddApplication::run(int argc, char** argv)
     model_name = model_id_obj.asString();
   }
 
+  batch_max_items = get_positive_setting(embd_serv, "batchMaxItems", 64);
+  batch_max_tokens = get_positive_setting(embd_serv, "batchMaxTokens", 8192);
+
   if (embd_api_url.empty())
     embd_api_url = "http://localhost:8080/v1/embeddings";
 
+  // Named as in the embeddings cache: without a model name, the server
+  // decides which model is used.
+  model_info.model_id(model_name.empty() ? embd_api_url : model_name);
+
+  if (std::strcmp(argv[1], "--rebuild-index") == 0)
+    return rebuild_index();
+
+  std::shared_ptr<EmbeddingCache> embeddings_cache =
+    EmbeddingCache::open_from_settings(embd_serv);
+
+  read_ingest_settings();
+
+  office_pool = LibreOfficePool::open_from_settings(
+    get_json_member_with_type(config_root, "libreOffice",
+      Json::ValueType::objectValue, false));
+
+  // The connections are opened and set up one after the other before any
+  // stage starts, so the tables are never created concurrently.
+  std::vector<std::shared_ptr<Database>> databases;
+  for (size_t idx = 0; idx < database_connections; idx++)
+  {
+    databases.push_back(connect_database());
+    databases.back()->set_database_up();
+  }
+
+  load_indexed_files(*databases.front());
+
+  HTTPModelService model_service;
   model_service.set_embeddings_api_url(embd_api_url);
   model_service.set_model_name(model_name);
+  model_service.set_max_requests_in_flight(embedding_requests);
+  model_service.set_cache(embeddings_cache);
+
+  PathQueue files_to_extract(queue_size);
+  FileQueue files_to_embed(queue_size);
+  FileQueue files_to_save(queue_size);
+
+  auto abort_queues = [&] {
+    files_to_extract.abort();
+    files_to_embed.abort();
+    files_to_save.abort();
+  };
+
+  std::vector<std::thread> threads;
+
+  // Starts the workers of a stage. The last one to finish closes the queue
+  // of the next stage.
+  auto start_stage = [&](size_t n_workers, FileQueue* output,
+    std::function<void(size_t)> work)
+  {
+    auto remaining = std::make_shared<std::atomic<size_t>>(n_workers);
+
+    for (size_t idx = 0; idx < n_workers; idx++)
+    {
+      threads.emplace_back([this, &abort_queues, remaining, output, work, idx] {
+        try
+        {
+          work(idx);
+        }
+        catch (...)
+        {
+          set_ingest_error(std::current_exception());
+          abort_queues();
+        }
+
+        if (--*remaining == 0 && output)
+          output->close();
+      });
+    }
+  };
+
+  // libxml2 sets its global state up on first use, which isn't safe from
+  // several extraction workers at once.
+  xmlInitParser();
+
+  start_stage(extract_workers, &files_to_embed, [&](size_t) {
+    extract_files(files_to_extract, files_to_embed);
+  });
+
+  // A single thread submits the embedding requests, which the model service
+  // keeps running concurrently.
+  start_stage(1, &files_to_save, [&](size_t) {
+    embed_files(model_service, files_to_embed, files_to_save);
+  });
+
+  start_stage(database_connections, nullptr, [&](size_t idx) {
+    save_files(*databases[idx], files_to_save);
+  });
+
+  try
+  {
+    for (int pos = 1; pos < argc; pos++)
+    {
+      filesystem::path path_obj(argv[pos]);
+      process_given_file_or_directory(path_obj, files_to_extract);
+    }
+  }
+  catch (...)
+  {
+    set_ingest_error(std::current_exception());
+    abort_queues();
+  }
+
+  files_to_extract.close();
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  if (embeddings_cache)
+  {
+    std::cerr << "Embeddings cache: " << embeddings_cache->hits() << " hits, "
+      << embeddings_cache->misses() << " misses\n";
+  }
+
+  if (ingest_error)
+    std::rethrow_exception(ingest_error);
+
+  return 0;
+}
+
+
+void AddApplication::clean_up() noexcept
+{
+}
+
+
+std::shared_ptr<Database> AddApplication::connect_database()
+{
+  // The database files of an in-process database are owned by a single
+  // instance, which every stage thread shares.
+  if (!local_database)
+    local_database = open_local_database(config_root);
+
+  if (local_database)
+    return local_database;
 
   Json::Value pgsql_settings = get_json_member_with_type(config_root,
     "postgresql", Json::ValueType::objectValue, false);
@@ -102,6 +256,7 @@ int AddApplication::run(int argc, char** argv)
     std::string password;
     std::string host;
     std::string port;
+    bool pipeline_mode = false;
 
     Json::Value value = get_json_member_with_type(pgsql_settings, "dbname",
       Json::ValueType::stringValue, false);
@@ -123,58 +278,423 @@ int AddApplication::run(int argc, char** argv)
       Json::ValueType::stringValue, false);
     if (value) port = value.asString();
 
-    database.reset(new PostgreSqlDb(dbname.empty() ? nullptr : dbname.c_str(),
+    value = get_json_member_with_type(pgsql_settings, "pipelineMode",
+      Json::ValueType::booleanValue, false);
+    if (value) pipeline_mode = value.asBool();
+
+    auto pg_database = std::make_unique<PostgreSqlDb>(
+      dbname.empty() ? nullptr : dbname.c_str(),
       user.empty() ? nullptr : user.c_str(),
       password.empty() ? nullptr : password.c_str(),
       host.empty() ? nullptr : host.c_str(),
-      port.empty() ? nullptr : port.c_str()));
+      port.empty() ? nullptr : port.c_str());
+    pg_database->set_pipeline_mode(pipeline_mode);
+    pg_database->set_model(model_info);
+
+    Json::Value index_settings = get_json_member_with_type(pgsql_settings,
+      "vectorIndex", Json::ValueType::objectValue, false);
+    if (index_settings)
+      pg_database->set_vector_index(index_settings);
+
+    Json::Value storage_settings = get_json_member_with_type(pgsql_settings,
+      "storage", Json::ValueType::objectValue, false);
+    if (storage_settings)
+      pg_database->set_storage(storage_settings);
+    return pg_database;
   }
-  else
+
+  std::cerr << "No database settings found in the settings file. "
+    "Connecting to a local PostgreSQL database with the default values...\n";
+  auto pg_database = std::make_unique<PostgreSqlDb>(nullptr, nullptr, nullptr,
+    nullptr, nullptr);
+  pg_database->set_model(model_info);
+  return pg_database;
+}
+
+
+void AddApplication::embed_files(HTTPModelService& model_service,
+  FileQueue& input, FileQueue& output)
+{
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto batch = std::make_shared<embedding_batch>();
+
+  // Files whose embeddings are all set, which the completion callbacks
+  // couldn't push to output without blocking the transfers in flight. A
+  // thread of their own waits for room in output.
+  std::deque<staged_file> completed_files;
+  std::mutex completed_mutex;
+  std::condition_variable completed_cond;
+  bool completing = true;
+
+  std::thread forwarding_thread([&] {
+    std::unique_lock<std::mutex> lock(completed_mutex);
+
+    for (;;)
+    {
+      completed_cond.wait(lock, [&] {
+        return !completed_files.empty() || !completing;
+      });
+
+      if (completed_files.empty())
+        break;
+
+      staged_file file = std::move(completed_files.front());
+      completed_files.pop_front();
+
+      lock.unlock();
+      // Dropped when the queue was aborted.
+      output.push(std::move(file));
+      lock.lock();
+
+      completed_cond.notify_all();
+    }
+  });
+
+  auto stop_forwarding = [&] {
+    {
+      std::lock_guard<std::mutex> lock(completed_mutex);
+      completing = false;
+    }
+    completed_cond.notify_all();
+    forwarding_thread.join();
+  };
+
+  // Passes on a file or a part of it. Runs on the thread of the transfers
+  // too, which must not wait.
+  auto complete_file = [&](staged_file&& file) {
+    std::lock_guard<std::mutex> lock(completed_mutex);
+    if (completed_files.empty() && output.try_push(file))
+      return;
+
+    completed_files.push_back(std::move(file));
+    completed_cond.notify_all();
+  };
+
+  // Passes on the units of a file once they have an embedding, then the
+  // last part of the file once they all have. n_done is the number of
+  // units, or 1 for the last part, which counts as one.
+  auto pass_on = [&](pending_file& owner, std::vector<TextUnit>&& units,
+    size_t n_done)
   {
-    std::cerr << "No database settings found in the settings file. "
-      "Connecting to a local PostgreSQL database with the default values...\n";
-    database.reset(new PostgreSqlDb(nullptr, nullptr, nullptr, nullptr,
-      nullptr));
-  }
+    // Parts are passed on in their order under the lock.
+    std::lock_guard<std::mutex> lock(owner.mutex);
+    owner.units_left -= n_done;
+    bool last = owner.units_left == 0;
+
+    // The units all came at once, so the file is saved whole, in a
+    // transaction with other files.
+    if (last && owner.parts_sent == 0)
+    {
+      if (!owner.file.discarded)
+      {
+        owner.file.text_units = std::move(units);
+        complete_file(std::move(owner.file));
+      }
+      return;
+    }
+
+    if (!units.empty())
+    {
+      staged_file part;
+      part.id = owner.file.id;
+      part.more_parts = true;
+      part.text_units = std::move(units);
+      owner.parts_sent++;
+      complete_file(std::move(part));
+    }
+
+    // Also when discarded, so the parts are dropped.
+    if (last)
+    {
+      owner.file.n_parts = owner.parts_sent;
+      complete_file(std::move(owner.file));
+    }
+  };
 
-  if (database)
+  auto submit_batch = [&] {
+    if (batch->text_units.empty())
+      return;
+
+    // No more requests are sent while files wait for room in output, so
+    // they can't pile up.
+    {
+      std::unique_lock<std::mutex> lock(completed_mutex);
+      completed_cond.wait(lock, [&] { return completed_files.empty(); });
+    }
+
+    std::shared_ptr<embedding_batch> full_batch = std::move(batch);
+    batch = std::make_shared<embedding_batch>();
+
+    model_service.get_embeddings_and_set_async(full_batch->text_units,
+      [&, full_batch](std::exception_ptr request_error)
+      {
+        if (request_error)
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = request_error;
+          // Stops this stage from taking new files.
+          input.abort();
+          return;
+        }
+
+        // The units move on in a part for each of their files, in the
+        // order they were cut.
+        std::vector<std::shared_ptr<pending_file>>& owners =
+          full_batch->owners;
+        for (size_t first = 0; first < owners.size(); first++)
+        {
+          std::shared_ptr<pending_file> owner = std::move(owners[first]);
+          if (!owner)
+            continue;
+
+          std::vector<TextUnit> units;
+          units.push_back(std::move(full_batch->text_units[first]));
+          for (size_t idx = first + 1; idx < owners.size(); idx++)
+          {
+            if (owners[idx] == owner)
+            {
+              units.push_back(std::move(full_batch->text_units[idx]));
+              owners[idx].reset();
+            }
+          }
+
+          size_t n_units = units.size();
+          pass_on(*owner, std::move(units), n_units);
+        }
+      });
+  };
+
+  // Files whose last part hasn't come yet, by ID.
+  std::unordered_map<uint64_t, std::shared_ptr<pending_file>> partial_files;
+
+  try
   {
-    database->set_database_up();
+    staged_file file;
+
+    for (;;)
+    {
+      if (!input.try_pop(file))
+      {
+        // No unit to pack right now, so the partial batch is sent instead of
+        // holding its files back.
+        submit_batch();
+
+        if (!input.pop(file))
+          break;
+      }
+
+      auto found = partial_files.find(file.id);
+      if (found == partial_files.end())
+      {
+        // A file with nothing to embed comes in a single part.
+        if (!file.more_parts && file.text_units.empty())
+        {
+          if (!file.discarded && !output.push(std::move(file)))
+            break;
+          continue;
+        }
+
+        auto pending = std::make_shared<pending_file>();
+        pending->file.id = file.id;
+        found = partial_files.emplace(file.id, std::move(pending)).first;
+      }
+
+      std::vector<TextUnit> units = std::move(file.text_units);
+      file.text_units.clear();
+
+      std::shared_ptr<pending_file> pending = found->second;
+      if (!file.more_parts)
+        partial_files.erase(found);
+
+      for (TextUnit& unit : units)
+      {
+        {
+          std::lock_guard<std::mutex> lock(pending->mutex);
+          pending->units_left++;
+        }
+
+        size_t tokens = estimate_tokens(unit.text());
+
+        // A unit over the token budget goes alone in its own request.
+        if (batch->text_units.size() >= batch_max_items ||
+          (!batch->text_units.empty() &&
+            batch->tokens + tokens > batch_max_tokens))
+        {
+          submit_batch();
+        }
+
+        batch->text_units.push_back(std::move(unit));
+        batch->owners.push_back(pending);
+        batch->tokens += tokens;
+      }
+
+      // The rest of the file is set from its last part.
+      if (!file.more_parts)
+      {
+        {
+          std::lock_guard<std::mutex> lock(pending->mutex);
+          pending->file = std::move(file);
+        }
+        pass_on(*pending, {}, 1);
+      }
+    }
   }
-  else
+  catch (...)
   {
-    throw std::runtime_error("database is empty");
+    // The callbacks refer to this stack frame.
+    model_service.wait_for_requests();
+    stop_forwarding();
+    throw;
   }
 
-  for (int pos = 1; pos < argc; pos++)
-  {
-    filesystem::path path_obj(argv[pos]);
-    process_given_file_or_directory(path_obj);
-  }
+  // The callbacks refer to this stack frame.
+  model_service.wait_for_requests();
+  stop_forwarding();
 
-  return 0;
+  if (error)
+    std::rethrow_exception(error);
 }
 
 
-void AddApplication::clean_up() noexcept
+void AddApplication::extract_files(PathQueue& input, FileQueue& output)
 {
-  if (magic_hdl)
+  // Created in the worker thread, since it's not thread-safe.
+  FileExtractor extractor(chunk_limits, *office_pool);
+  filesystem::path file_path;
+
+  while (input.pop(file_path))
   {
-    magic_close(magic_hdl);
-    magic_hdl = nullptr;
+    staged_file file;
+    file.file_path = file_path.string();
+
+    // A file removed or unreadable since it was found is left out, like
+    // one that fails to extract, instead of stopping the run.
+    struct stat file_stat;
+    if (stat(file_path.c_str(), &file_stat) != 0)
+    {
+      std::cerr << "Cannot get the status of file \"" << file.file_path
+        << "\": " << std::strerror(errno) << ". Skipping it.\n";
+      continue;
+    }
+
+    file.file_size = file_stat.st_size;
+    file.mtime = file_stat.st_mtim.tv_sec * 1000000000LL +
+      file_stat.st_mtim.tv_nsec;
+
+    auto indexed = indexed_files.find(file.file_path);
+    if (indexed != indexed_files.end())
+    {
+      const FileRecord& record = indexed->second;
+      file.replaces_previous = true;
+      // Saved under the path of its records, so they are replaced.
+      file.file_path = record.file_path();
+
+      if (record.file_size() == file.file_size &&
+        record.mtime() == file.mtime)
+      {
+        std::cerr << "Skipping unchanged file " << file.file_path << "\n";
+        continue;
+      }
+    }
+
+    try
+    {
+      file.content_hash = hash_file_content(file_path.c_str());
+    }
+    catch (const std::ios_base::failure& error)
+    {
+      std::cerr << error.what() << " Skipping it.\n";
+      continue;
+    }
+
+    // Only the modification time changed, which is saved so the file isn't
+    // hashed again by the next run.
+    if (file.replaces_previous &&
+      indexed->second.file_size() == file.file_size &&
+      indexed->second.content_hash() == file.content_hash)
+    {
+      std::cerr << "Skipping unchanged file " << file.file_path << "\n";
+      file.mtime_only = true;
+      if (!output.push(std::move(file)))
+        return;
+      continue;
+    }
+
+    file.id = next_file_id++;
+
+    // Each unit is sent on as soon as it's cut, in a part of its own, so it
+    // can be embedded while the rest of the file is extracted.
+    bool sending = true;
+    auto send_unit = [&](TextUnit&& unit) {
+      staged_file part;
+      part.id = file.id;
+      part.more_parts = true;
+      part.text_units.push_back(std::move(unit));
+      if (sending && !output.push(std::move(part)))
+        sending = false;
+    };
+
+    try
+    {
+      extractor.extract(file_path.c_str(), send_unit);
+    }
+    catch (const FileProcessor::file_error& error)
+    {
+      // Left out of the database, so it's tried again by the next run.
+      std::cerr << error.what() << " Skipping it.\n";
+      file.discarded = true;
+    }
+
+    // The last part, without units.
+    if (!sending || !output.push(std::move(file)))
+      return;
   }
 }
 
 
-void AddApplication::on_text_unit(const TextUnit& text_unit)
+void AddApplication::load_indexed_files(Database& database)
 {
-  text_units_staged.push_back(text_unit);
+  std::vector<FileRecord> records = database.get_file_records();
+
+  indexed_files.clear();
+  indexed_files.reserve(records.size());
+
+  for (FileRecord& record : records)
+  {
+    // Files are found by canonical paths, which older runs didn't save, so
+    // a relative path or one with dot components is resolved from here.
+    filesystem::path file_path = record.file_path();
+    if (file_path.is_relative() || file_path.lexically_normal() != file_path)
+    {
+      std::error_code error;
+      filesystem::path canonical_path = filesystem::weakly_canonical(
+        file_path, error);
+      if (!error)
+        file_path = canonical_path;
+    }
+    indexed_files[file_path.string()] = std::move(record);
+  }
 }
 
 
+FileRecord AddApplication::make_file_record(staged_file& file)
+{
+  FileRecord record;
+  record.file_path(std::move(file.file_path));
+  record.file_size(file.file_size);
+  record.mtime(file.mtime);
+  record.content_hash(file.content_hash);
+  record.replaces_previous(file.replaces_previous);
+  record.text_units(std::move(file.text_units));
+  return record;
+}
+
 
 void AddApplication::
-process_given_file_or_directory(const std::filesystem::path& path_obj)
+process_given_file_or_directory(const std::filesystem::path& path_obj,
+  PathQueue& output)
 {
   if (!filesystem::exists(path_obj))
   {
@@ -184,84 +704,184 @@ process_given_file_or_directory(const std::filesystem::path& path_obj)
     throw std::runtime_error(msg);
   }
 
-  if (filesystem::is_regular_file(path_obj))
+  // Saved with absolute paths without links or dot components, so a file
+  // given through another path is still recognized by the next run.
+  filesystem::path canonical_path = filesystem::canonical(path_obj);
+
+  if (filesystem::is_regular_file(canonical_path))
   {
-    process_one_file(path_obj);
+    output.push(canonical_path);
     return;
   }
 
-  for (const auto& entry : filesystem::recursive_directory_iterator(path_obj))
+  DirectoryWalker walker(walk_workers);
+  for (const std::string& pattern : include_globs)
+    walker.add_include_pattern(pattern);
+  for (const std::string& pattern : exclude_globs)
+    walker.add_exclude_pattern(pattern);
+
+  // The queue is closed only if the pipeline was aborted, which stops the
+  // walk.
+  walker.walk(canonical_path, [&](filesystem::path&& file_path) {
+    return output.push(std::move(file_path));
+  });
+}
+
+
+void AddApplication::read_ingest_settings()
+{
+  Json::Value ingest_settings = get_json_member_with_type(config_root,
+    "ingest", Json::ValueType::objectValue, false);
+
+  extract_workers = get_positive_setting(ingest_settings, "extractWorkers",
+    std::max(1u, std::thread::hardware_concurrency()));
+  embedding_requests = get_positive_setting(ingest_settings,
+    "embeddingRequests", 4);
+  database_connections = get_positive_setting(ingest_settings,
+    "databaseConnections", 2);
+  queue_size = get_positive_setting(ingest_settings, "queueSize", 16);
+
+  // Walking waits on the file system more than on the CPU, network mounts
+  // most of all, so there are more threads than cores by default.
+  walk_workers = get_positive_setting(ingest_settings, "walkWorkers",
+    std::max(8u, 2 * std::thread::hardware_concurrency()));
+  include_globs = get_strings_setting(ingest_settings, "includeGlobs");
+  exclude_globs = get_strings_setting(ingest_settings, "excludeGlobs");
+
+  // Units are kept under the token budget of a request by default, and
+  // only repeat text when asked to.
+  chunk_limits.max_size = get_positive_setting(ingest_settings, "unitMaxSize",
+    4096);
+
+  Json::Value overlap = get_json_member_with_type(ingest_settings,
+    "unitOverlap", Json::ValueType::intValue, false);
+  if (overlap)
   {
-    if (entry.is_regular_file())
+    if (overlap.asLargestInt() < 0 ||
+      overlap.asLargestUInt() > chunk_limits.max_size / 2)
     {
-        process_one_file(entry.path());
+      throw std::runtime_error("Member with the key \"unitOverlap\" must be "
+        "at least 0 and at most half of \"unitMaxSize\"");
     }
+    chunk_limits.overlap = overlap.asLargestUInt();
   }
 }
 
 
-void AddApplication::process_one_file(const char* file_path)
+int AddApplication::rebuild_index()
 {
-  std::cerr << "Processing file " << file_path << "\n";
-  const char* mime_type = magic_file(magic_hdl, file_path);
+  std::shared_ptr<Database> database = connect_database();
+  database->set_database_up();
+
+  try
+  {
+    database->rebuild_vector_index();
+  }
+  catch (const std::runtime_error& e)
+  {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
 
-  if (!mime_type)
+
+void AddApplication::save_file_part(Database& database, staged_file& file)
+{
+  std::shared_ptr<saving_file> saving;
   {
-    std::string msg("magic_file failed().");
+    std::lock_guard<std::mutex> lock(saving_files_mutex);
+    std::shared_ptr<saving_file>& entry = saving_files[file.id];
+    if (!entry)
+      entry = std::make_shared<saving_file>();
+    saving = entry;
+  }
+
+  std::unique_lock<std::mutex> lock(saving->mutex);
 
-    if (const char* error = magic_error(magic_hdl))
+  if (file.more_parts)
+  {
+    try
     {
-      msg += " "; msg += error;
+      database.save_file_part(file.text_units, saving->parts);
+    }
+    catch (...)
+    {
+      saving->failed = true;
+      saving->part_saved.notify_all();
+      throw;
     }
 
-    throw std::runtime_error(msg);
+    saving->parts_saved++;
+    saving->part_saved.notify_all();
+    return;
   }
 
-  std::cerr << "MIME type: " << mime_type << "\n";
-  for (processor_for_mime_type& p : file_processors)
+  // The other parts were taken from the queue before this one, so they are
+  // saved or being saved.
+  saving->part_saved.wait(lock, [&] {
+    return saving->parts_saved == file.n_parts || saving->failed;
+  });
+
   {
-    bool have_match = false;
+    std::lock_guard<std::mutex> files_lock(saving_files_mutex);
+    saving_files.erase(file.id);
+  }
+
+  // The pipeline is stopping with the error of a part.
+  if (saving->failed)
+    return;
+
+  if (file.discarded)
+  {
+    database.drop_file_parts(saving->parts);
+    return;
+  }
 
-    for (const char* const * item = p.mime_types; *item; item++)
+  FileRecord record = make_file_record(file);
+  database.save_file_record_with_parts(record, saving->parts);
+}
+
+
+void AddApplication::save_files(Database& database, FileQueue& input)
+{
+  std::vector<FileRecord> records;
+  staged_file file;
+
+  while (input.pop(file))
+  {
+    // Files already waiting are saved together in one transaction.
+    do
     {
-      if (strcmp(*item, mime_type) == 0)
+      if (file.mtime_only)
       {
-        have_match = true;
-        break;
+        database.update_file_mtime(file.file_path, file.mtime);
+        continue;
       }
-    }
 
-    if (have_match)
-    {
-      // Create the processor object if it's the case.
-      if (!p.processor)
+      // Parts are saved as they come, in a transaction of their own.
+      if (file.more_parts || file.n_parts > 0)
       {
-        if (!p.proc_factory)
-          throw std::logic_error("proc_factory is empty");
-
-        p.processor = p.proc_factory();
-        if (!p.processor)
-          throw std::logic_error("processor returned by proc_factory is empty");
-
+        save_file_part(database, file);
+        continue;
       }
 
-      p.processor->process_file(file_path);
+      records.push_back(make_file_record(file));
     }
-  }
+    while (records.size() < queue_size && input.try_pop(file));
 
-  model_service.get_embeddings_and_set(text_units_staged);
-
-  FileRecord file_record;
-  file_record.file_path(file_path);
-  file_record.text_units(text_units_staged);
-
-  database->save_file_record_with_text_units(file_record);
-
-  text_units_staged.clear();
+    if (!records.empty())
+      database.save_file_records_with_text_units(records);
+    records.clear();
+  }
 }
 
 
-void AddApplication::process_one_file(const std::filesystem::path& file_path)
+void AddApplication::set_ingest_error(std::exception_ptr error)
 {
-  process_one_file(file_path.c_str());
-}
\ No newline at end of file
+  std::lock_guard<std::mutex> lock(ingest_error_mutex);
+
+  if (!ingest_error)
+    ingest_error = error;
+}
@@ -1,45 +1,168 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <filesystem>
-#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <json/json.h>
-#include <magic.h>
 
+#include "BoundedQueue.h"
 #include "common.h"
 #include "HTTPModelService.h"
+#include "LibreOfficePool.h"
 #include "PostgreSqlDb.h"
+#include "TextChunker.h"
 
 
 class AddApplication
 {
-  struct processor_for_mime_type
+protected:
+
+  // File moving between the stages of the ingest pipeline. A file is sent in
+  // parts: from extraction to embedding as its text units are cut, then to
+  // saving as they are embedded, unless they all are at once. Only the last
+  // part has the fields after text_units set.
+  struct staged_file
+  {
+    // Tells the parts of a file from those of the files extracted along.
+    uint64_t id = 0;
+    // Set on every part but the last, which may have no text units.
+    bool more_parts = false;
+    std::vector<TextUnit> text_units;
+    // Parts sent to saving before the last one, whose units are saved ahead
+    // of the record, in the order their embeddings came.
+    size_t n_parts = 0;
+    // Set on the last part when the extraction failed, so the file is
+    // dropped with its other parts.
+    bool discarded = false;
+    std::string file_path;
+    unsigned long long file_size = 0;
+    long long mtime = 0;
+    uint64_t content_hash = 0;
+    bool replaces_previous = false;
+    // Only the modification time of the saved records is to be updated,
+    // the content being the same.
+    bool mtime_only = false;
+  };
+
+  typedef BoundedQueue<std::filesystem::path> PathQueue;
+  typedef BoundedQueue<staged_file> FileQueue;
+
+private:
+
+  // File whose text units are spread over embedding batches, which only
+  // counts them as they go by.
+  struct pending_file
+  {
+    // Its last part once it came, without text units, and its ID before.
+    staged_file file;
+    // Units without an embedding yet, plus one until the last part came.
+    size_t units_left = 1;
+    // Parts sent on to saving.
+    size_t parts_sent = 0;
+    // Guards the fields above, which the embedding stage and the callbacks
+    // of its requests update.
+    std::mutex mutex;
+  };
+
+  // Text units of one embedding request, with the file of each one.
+  struct embedding_batch
+  {
+    std::vector<TextUnit> text_units;
+    std::vector<std::shared_ptr<pending_file>> owners;
+    size_t tokens = 0;
+  };
+
+  // File whose parts are being saved, shared by the saving workers. Its last
+  // part waits for the others, which other workers may be saving.
+  struct saving_file
   {
-    typedef std::function<std::unique_ptr<FileProcessor>()> ProcessorFactory;
-
-    // Last const char* must be nullptr
-    const char* const * mime_types;
-    ProcessorFactory proc_factory;
-    std::unique_ptr<FileProcessor> processor;
-
-    processor_for_mime_type(const char* const * mime_types,
-      ProcessorFactory proc_factory) :
-      mime_types(mime_types), proc_factory(proc_factory), processor()
-    {
-    }
+    FileParts parts;
+    size_t parts_saved = 0;
+    // Set when a part failed, which stops the pipeline.
+    bool failed = false;
+    // Held while a part is saved, so they are saved one after the other.
+    std::mutex mutex;
+    std::condition_variable part_saved;
   };
 
   Json::Value config_root;
-  std::unique_ptr<Database> database;
-  std::vector<processor_for_mime_type> file_processors;
-  magic_t magic_hdl;
-  HTTPModelService model_service;
-  std::vector<TextUnit> text_units_staged;
+  std::string embd_api_url;
+  std::string model_name;
+  ModelInfo model_info;
+
+  // Limits of the embedding requests, which pack text units from many files.
+  size_t batch_max_items;
+  size_t batch_max_tokens;
+
+  // Concurrency of each stage of the ingest pipeline and capacity of the
+  // queues between them, from the "ingest" settings. embedding_requests is
+  // the number of requests kept in flight by the model service.
+  size_t extract_workers;
+  size_t embedding_requests;
+  size_t database_connections;
+  size_t queue_size;
+
+  // Threads walking the given directories, and the glob patterns of the
+  // files and directories walked, from the "ingest" settings too.
+  size_t walk_workers;
+  std::vector<std::string> include_globs;
+  std::vector<std::string> exclude_globs;
+
+  // Size of the text units extracted, from the "ingest" settings too.
+  TextChunker::limits chunk_limits;
+
+  // Offices that the extraction threads load documents into.
+  std::shared_ptr<LibreOfficePool> office_pool;
+
+  // Files saved by previous runs, by canonical path. Loaded before the
+  // pipeline starts and only read afterwards, so unchanged files are skipped
+  // without asking the database.
+  std::unordered_map<std::string, FileRecord> indexed_files;
+
+  // In-process database, shared by the stages instead of connections.
+  std::shared_ptr<Database> local_database;
+
+  // ID of the next file extracted.
+  std::atomic<uint64_t> next_file_id;
+
+  // Files with parts saved, by ID.
+  std::unordered_map<uint64_t, std::shared_ptr<saving_file>> saving_files;
+  std::mutex saving_files_mutex;
+
+  std::exception_ptr ingest_error;
+  std::mutex ingest_error_mutex;
 
   void clean_up() noexcept;
 
+  // Returns a new connection, or the database kept in the process itself
+  // when the settings select one.
+  std::shared_ptr<Database> connect_database();
+
+  void load_indexed_files(Database& database);
+
+  // Record of the last or only part of a file, taking its text units.
+  static FileRecord make_file_record(staged_file& file);
+
+  void read_ingest_settings();
+
+  // Rebuilds the vector index of the database, for --rebuild-index.
+  int rebuild_index();
+
+  // Saves the units of a part of a file ahead of its record, or the record
+  // of the file on its last part, once the other parts are saved.
+  void save_file_part(Database& database, staged_file& file);
+
+  // Keeps the first error of the pipeline, to be thrown once every stage has
+  // stopped.
+  void set_ingest_error(std::exception_ptr error);
+
 public:
 
   AddApplication();
@@ -54,12 +177,14 @@ public:
 
 protected:
 
-  virtual void on_text_unit(const TextUnit& text_unit);
+  virtual void embed_files(HTTPModelService& model_service, FileQueue& input,
+    FileQueue& output);
 
-  virtual void process_one_file(const char* file_path);
-
-  virtual void process_one_file(const std::filesystem::path& file_path);
+  virtual void extract_files(PathQueue& input, FileQueue& output);
 
   virtual void
-  process_given_file_or_directory(const std::filesystem::path& path_obj);
-};
\ No newline at end of file
+  process_given_file_or_directory(const std::filesystem::path& path_obj,
+    PathQueue& output);
+
+  virtual void save_files(Database& database, FileQueue& input);
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+
+/*
+Queue shared between threads that holds at most a fixed number of items, so
+a producer faster than its consumers blocks instead of filling memory.
+*/
+template <typename T>
+class BoundedQueue
+{
+  std::size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+public:
+
+  explicit BoundedQueue(std::size_t capacity):
+    capacity(capacity ? capacity : 1),
+    closed(false)
+  {
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  /*
+  Discards the queued items and closes the queue, waking every waiting
+  thread.
+  */
+  void abort()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.clear();
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+  /*
+  No more items will be pushed. The items already queued can still be
+  popped.
+  */
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+  /*
+  Waits for an item. Returns false when the queue is closed and empty.
+  */
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return !items.empty() || closed; });
+
+    if (items.empty())
+      return false;
+
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  /*
+  Waits until there is room for the item. Returns false, dropping the item,
+  if the queue is closed.
+  */
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+
+    if (closed)
+      return false;
+
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  /*
+  Pops an item only if one is queued already.
+  */
+  bool try_pop(T& item)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (items.empty())
+      return false;
+
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  /*
+  Pushes the item only if there is room for it right now. Returns false,
+  leaving the item as it was, when the queue is full or closed.
+  */
+  bool try_push(T& item)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (closed || items.size() >= capacity)
+      return false;
+
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+};
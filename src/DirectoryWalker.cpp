@@ -0,0 +1,329 @@
+#include "DirectoryWalker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+
+/*
+Matches the pattern with the relative path when it has a slash, with the
+name otherwise.
+*/
+static bool matches_pattern(const std::string& pattern,
+  const std::string& name, const std::string& relative_path)
+{
+  const std::string& subject = pattern.find('/') == std::string::npos ?
+    name : relative_path;
+  return fnmatch(pattern.c_str(), subject.c_str(), FNM_PATHNAME) == 0;
+}
+
+
+DirectoryWalker::DirectoryWalker(size_t n_threads):
+  n_threads(n_threads ? n_threads : 1),
+  queued(0),
+  pending(0),
+  stopping(false)
+{
+}
+
+
+void DirectoryWalker::add_exclude_pattern(const std::string& pattern)
+{
+  exclude_patterns.push_back(pattern);
+}
+
+
+void DirectoryWalker::add_include_pattern(const std::string& pattern)
+{
+  include_patterns.push_back(pattern);
+}
+
+
+bool DirectoryWalker::is_excluded(const std::string& name,
+  const std::string& relative_path) const
+{
+  for (const std::string& pattern : exclude_patterns)
+  {
+    if (matches_pattern(pattern, name, relative_path))
+      return true;
+  }
+
+  return false;
+}
+
+
+bool DirectoryWalker::is_included(const std::string& name,
+  const std::string& relative_path) const
+{
+  if (include_patterns.empty())
+    return true;
+
+  for (const std::string& pattern : include_patterns)
+  {
+    if (matches_pattern(pattern, name, relative_path))
+      return true;
+  }
+
+  return false;
+}
+
+
+void DirectoryWalker::push_directory(size_t thread_idx, directory&& dir)
+{
+  // Counted as pending first, so the walk can't be seen finished while the
+  // directory is on its way to the queue.
+  pending++;
+
+  {
+    work_queue& queue = *queues[thread_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.directories.push_back(std::move(dir));
+    queued++;
+  }
+
+  // Taking the mutex orders the notification after the check of a thread
+  // about to wait.
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+  }
+  idle_cond.notify_one();
+}
+
+
+void DirectoryWalker::read_directory(size_t thread_idx, const directory& dir,
+  const FileFunc& on_file)
+{
+  struct entry
+  {
+    ino_t inode;
+    unsigned char type;
+    std::string name;
+  };
+
+  std::unique_ptr<DIR, int (*)(DIR*)> dir_hdl(opendir(dir.path.c_str()),
+    closedir);
+  if (!dir_hdl)
+  {
+    std::string msg("Cannot open the directory \"");
+    msg += dir.path;
+    msg += "\": ";
+    msg += std::strerror(errno);
+    throw std::runtime_error(msg);
+  }
+
+  std::vector<entry> entries;
+  errno = 0;
+  while (dirent* dir_entry = readdir(dir_hdl.get()))
+  {
+    const char* name = dir_entry->d_name;
+    if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0)
+      continue;
+
+    entries.push_back({dir_entry->d_ino, dir_entry->d_type, name});
+  }
+
+  if (errno != 0)
+  {
+    std::string msg("Cannot read the directory \"");
+    msg += dir.path;
+    msg += "\": ";
+    msg += std::strerror(errno);
+    throw std::runtime_error(msg);
+  }
+
+  std::sort(entries.begin(), entries.end(),
+    [](const entry& a, const entry& b) { return a.inode < b.inode; });
+
+  int dir_fd = dirfd(dir_hdl.get());
+  std::string path_prefix = dir.path;
+  if (path_prefix.empty() || path_prefix.back() != '/')
+    path_prefix += '/';
+
+  std::vector<directory> subdirectories;
+
+  for (entry& dir_entry : entries)
+  {
+    if (stopping)
+      break;
+
+    std::string relative_path = dir.relative_path.empty() ?
+      dir_entry.name : dir.relative_path + '/' + dir_entry.name;
+
+    if (is_excluded(dir_entry.name, relative_path))
+      continue;
+
+    // The type isn't known on every file system. Entries that vanished since
+    // the directory was read are skipped.
+    struct stat entry_stat;
+    if (dir_entry.type == DT_UNKNOWN)
+    {
+      if (fstatat(dir_fd, dir_entry.name.c_str(), &entry_stat,
+        AT_SYMLINK_NOFOLLOW) != 0)
+      {
+        continue;
+      }
+
+      if (S_ISDIR(entry_stat.st_mode))
+        dir_entry.type = DT_DIR;
+      else if (S_ISREG(entry_stat.st_mode))
+        dir_entry.type = DT_REG;
+      else if (S_ISLNK(entry_stat.st_mode))
+        dir_entry.type = DT_LNK;
+    }
+
+    // Links to files are reported, links to directories not followed.
+    if (dir_entry.type == DT_LNK)
+    {
+      if (fstatat(dir_fd, dir_entry.name.c_str(), &entry_stat, 0) == 0 &&
+        S_ISREG(entry_stat.st_mode))
+      {
+        dir_entry.type = DT_REG;
+      }
+    }
+
+    if (dir_entry.type == DT_DIR)
+    {
+      subdirectories.push_back({path_prefix + dir_entry.name,
+        std::move(relative_path)});
+    }
+    else if (dir_entry.type == DT_REG &&
+      is_included(dir_entry.name, relative_path))
+    {
+      if (!on_file(std::filesystem::path(path_prefix + dir_entry.name)))
+      {
+        stop(nullptr);
+        break;
+      }
+    }
+  }
+
+  dir_hdl.reset();
+
+  // Pushed backwards, so the thread takes the lowest inode first.
+  for (auto it = subdirectories.rbegin(); it != subdirectories.rend(); ++it)
+    push_directory(thread_idx, std::move(*it));
+}
+
+
+void DirectoryWalker::stop(std::exception_ptr walk_error)
+{
+  if (walk_error)
+  {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error)
+      error = walk_error;
+  }
+
+  stopping = true;
+
+  std::lock_guard<std::mutex> lock(idle_mutex);
+  idle_cond.notify_all();
+}
+
+
+bool DirectoryWalker::take_directory(size_t thread_idx, directory& dir)
+{
+  {
+    work_queue& queue = *queues[thread_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.directories.empty())
+    {
+      dir = std::move(queue.directories.back());
+      queue.directories.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  for (size_t offset = 1; offset < n_threads; offset++)
+  {
+    work_queue& queue = *queues[(thread_idx + offset) % n_threads];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.directories.empty())
+    {
+      dir = std::move(queue.directories.front());
+      queue.directories.pop_front();
+      queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void DirectoryWalker::walk(const std::filesystem::path& directory_path,
+  const FileFunc& on_file)
+{
+  queues.clear();
+  for (size_t idx = 0; idx < n_threads; idx++)
+    queues.push_back(std::make_unique<work_queue>());
+  queued = 0;
+  pending = 0;
+  stopping = false;
+  error = nullptr;
+
+  push_directory(0, {directory_path.string(), std::string()});
+
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads - 1);
+  for (size_t idx = 1; idx < n_threads; idx++)
+  {
+    threads.emplace_back(&DirectoryWalker::walk_from_thread, this, idx,
+      std::cref(on_file));
+  }
+
+  walk_from_thread(0, on_file);
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  queues.clear();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+
+void DirectoryWalker::walk_from_thread(size_t thread_idx,
+  const FileFunc& on_file)
+{
+  directory dir;
+
+  while (!stopping)
+  {
+    if (take_directory(thread_idx, dir))
+    {
+      try
+      {
+        read_directory(thread_idx, dir, on_file);
+      }
+      catch (...)
+      {
+        stop(std::current_exception());
+      }
+
+      if (--pending == 0)
+      {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle_cond.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    idle_cond.wait(lock, [this] {
+      return queued > 0 || pending == 0 || stopping;
+    });
+
+    if (pending == 0)
+      return;
+  }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/*
+Walks directory trees with a pool of threads, each directory being read by
+one of them. A thread goes on with the directories it finds itself, depth
+first, and steals the oldest ones of another thread when it runs out, so the
+threads spread over separate subtrees. The entries of a directory are
+handled in inode order, which is close to their order on disk for most file
+systems.
+
+Glob patterns (as for fnmatch) select what's walked. A pattern with a slash
+is matched with the path relative to the walked directory, any other with
+the name alone. An excluded directory is never read, and when there are
+include patterns, only the files matching one are reported.
+*/
+class DirectoryWalker
+{
+public:
+
+  // Called from the walking threads with each regular file found. Returns
+  // false to stop the walk.
+  typedef std::function<bool(std::filesystem::path&&)> FileFunc;
+
+private:
+
+  struct directory
+  {
+    std::string path;
+    // Path from the walked directory, empty for itself.
+    std::string relative_path;
+  };
+
+  // Directories found by a thread and not read yet. The owner takes the
+  // newest, thieves the oldest.
+  struct work_queue
+  {
+    std::mutex mutex;
+    std::deque<directory> directories;
+  };
+
+  size_t n_threads;
+  std::vector<std::string> include_patterns;
+  std::vector<std::string> exclude_patterns;
+
+  // State of the walk in progress.
+  std::vector<std::unique_ptr<work_queue>> queues;
+  // Directories queued, and queued or being read.
+  std::atomic<size_t> queued;
+  std::atomic<size_t> pending;
+  std::atomic<bool> stopping;
+  std::mutex idle_mutex;
+  std::condition_variable idle_cond;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  bool is_excluded(const std::string& name,
+    const std::string& relative_path) const;
+
+  bool is_included(const std::string& name,
+    const std::string& relative_path) const;
+
+  void push_directory(size_t thread_idx, directory&& dir);
+
+  void read_directory(size_t thread_idx, const directory& dir,
+    const FileFunc& on_file);
+
+  void stop(std::exception_ptr walk_error);
+
+  // Takes a directory from the thread's queue, or from another one.
+  bool take_directory(size_t thread_idx, directory& dir);
+
+  void walk_from_thread(size_t thread_idx, const FileFunc& on_file);
+
+public:
+
+  explicit DirectoryWalker(size_t n_threads);
+
+  DirectoryWalker(const DirectoryWalker&) = delete;
+
+  DirectoryWalker& operator=(const DirectoryWalker&) = delete;
+
+  void add_exclude_pattern(const std::string& pattern);
+
+  void add_include_pattern(const std::string& pattern);
+
+  // Calls on_file with the regular files under directory_path, symbolic
+  // links to files included, and returns once they're all reported. Throws
+  // the first error of the threads.
+  void walk(const std::filesystem::path& directory_path,
+    const FileFunc& on_file);
+};
@@ -0,0 +1,357 @@
+#include "EmbeddingCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+namespace filesystem = std::filesystem;
+
+// Start of the file, followed by the records.
+static const char file_signature[8] = {'E', 'M', 'B', 'D', 'C', 'A', 'C', '2'};
+
+// Start of the files whose records have no key, which are emptied.
+static const char old_file_signature[8] =
+  {'E', 'M', 'B', 'D', 'C', 'A', 'C', '1'};
+
+
+/*
+Holds flock() on the cache file, shared between processes, while in scope.
+*/
+class file_lock
+{
+  int fd;
+
+public:
+
+  explicit file_lock(int fd): fd(fd)
+  {
+    while (flock(fd, LOCK_EX) != 0)
+    {
+      if (errno != EINTR)
+        throw system_error("flock() on the embeddings cache failed");
+    }
+  }
+
+  file_lock(const file_lock&) = delete;
+
+  file_lock& operator=(const file_lock&) = delete;
+
+  ~file_lock()
+  {
+    flock(fd, LOCK_UN);
+  }
+};
+
+
+EmbeddingCache::EmbeddingCache(const std::filesystem::path& file_path):
+  fd(-1),
+  mapping(nullptr),
+  mapping_size(0),
+  file_size(0),
+  indexed_size(sizeof(file_signature)),
+  _hits(0),
+  _misses(0)
+{
+  if (!file_path.parent_path().empty())
+    filesystem::create_directories(file_path.parent_path());
+
+  fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open the embeddings cache \"");
+    msg += file_path.string();
+    msg += "\"";
+    throw system_error(msg.c_str());
+  }
+
+  try
+  {
+    file_lock lock(fd);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+      throw system_error("fstat() on the embeddings cache failed");
+
+    char signature[sizeof(file_signature)];
+    if (file_stat.st_size >= static_cast<off_t>(sizeof(signature)) &&
+      pread(fd, signature, sizeof(signature), 0) == sizeof(signature) &&
+      std::memcmp(signature, old_file_signature, sizeof(signature)) == 0)
+    {
+      std::cerr << "The embeddings cache \"" << file_path.string()
+        << "\" has an older format and is emptied.\n";
+      if (ftruncate(fd, 0) != 0)
+        throw system_error("Cannot truncate the embeddings cache");
+      file_stat.st_size = 0;
+    }
+
+    if (file_stat.st_size == 0)
+    {
+      if (write(fd, file_signature, sizeof(file_signature)) !=
+        sizeof(file_signature))
+      {
+        throw system_error("Cannot write the embeddings cache");
+      }
+    }
+
+    index_new_records();
+
+    if (file_size < sizeof(file_signature) ||
+      std::memcmp(mapping, file_signature, sizeof(file_signature)) != 0)
+    {
+      std::string msg("\"");
+      msg += file_path.string();
+      msg += "\" is not an embeddings cache file.";
+      throw std::runtime_error(msg);
+    }
+
+    // Drop a record left incomplete by a process that was killed while
+    // appending it, so the next ones are not misaligned.
+    if (indexed_size < file_size)
+      truncate(indexed_size);
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+EmbeddingCache::~EmbeddingCache()
+{
+  clean_up();
+}
+
+
+void EmbeddingCache::clean_up() noexcept
+{
+  if (mapping)
+  {
+    munmap(const_cast<char*>(mapping), mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+
+size_t EmbeddingCache::find_record(uint64_t hash,
+  const std::string& model_id, const std::string& text) const
+{
+  // The model ID is compared with its null character, which ends it.
+  size_t model_id_size = model_id.size() + 1;
+
+  auto range = offsets.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it)
+  {
+    record_header header;
+    std::memcpy(&header, mapping + it->second, sizeof(header));
+    const char* key = mapping + it->second + sizeof(header);
+
+    if (header.key_size == model_id_size + text.size() &&
+      std::memcmp(key, model_id.c_str(), model_id_size) == 0 &&
+      std::memcmp(key + model_id_size, text.data(), text.size()) == 0)
+    {
+      return it->second;
+    }
+  }
+
+  return 0;
+}
+
+
+bool EmbeddingCache::get(const std::string& model_id, const std::string& text,
+  std::vector<float>& embedding)
+{
+  uint64_t hash = key_hash(model_id, text);
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  size_t offset = find_record(hash, model_id, text);
+  if (offset == 0)
+  {
+    _misses++;
+    return false;
+  }
+
+  record_header header;
+  std::memcpy(&header, mapping + offset, sizeof(header));
+  embedding.resize(header.dimension);
+  std::memcpy(embedding.data(), mapping + offset + sizeof(header) +
+    header.key_size, header.dimension * sizeof(float));
+  _hits++;
+  return true;
+}
+
+
+void EmbeddingCache::index_new_records()
+{
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+    throw system_error("fstat() on the embeddings cache failed");
+
+  file_size = file_stat.st_size;
+  if (file_size > mapping_size)
+    remap(file_size);
+
+  while (indexed_size + sizeof(record_header) <= file_size)
+  {
+    record_header header;
+    std::memcpy(&header, mapping + indexed_size, sizeof(header));
+
+    size_t record_size = sizeof(header) + header.key_size +
+      header.dimension * sizeof(float);
+    if (indexed_size + record_size > file_size)
+      break;
+
+    offsets.emplace(header.key_hash, indexed_size);
+    indexed_size += record_size;
+  }
+}
+
+
+uint64_t EmbeddingCache::key_hash(const std::string& model_id,
+  const std::string& text)
+{
+  // The terminating null character separates the model ID from the text.
+  uint64_t hash = hash_bytes(model_id.c_str(), model_id.size() + 1);
+  return hash_bytes(text.data(), text.size(), hash);
+}
+
+
+std::shared_ptr<EmbeddingCache>
+EmbeddingCache::open_from_settings(const Json::Value& embd_settings)
+{
+  filesystem::path file_path = get_default_cache_dir();
+  file_path.append("embeddings.cache");
+
+  Json::Value value = get_json_member_with_type(embd_settings, "cacheFile",
+    Json::ValueType::stringValue, false);
+
+  if (value)
+  {
+    if (value.asString().empty())
+      return nullptr;
+
+    file_path = value.asString();
+  }
+
+  return std::make_shared<EmbeddingCache>(file_path);
+}
+
+
+void EmbeddingCache::put(const std::string& model_id,
+  const std::vector<TextUnit>& text_units)
+{
+  std::vector<uint64_t> hashes;
+  hashes.reserve(text_units.size());
+  for (const TextUnit& unit : text_units)
+    hashes.push_back(key_hash(model_id, unit.text()));
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+
+  // The records of the units not saved yet, each text once.
+  std::string records;
+  std::unordered_set<std::string_view> texts;
+  for (size_t idx = 0; idx < text_units.size(); idx++)
+  {
+    const std::string& text = text_units[idx].text();
+    const Embedding& embedding = text_units[idx].embedding();
+    if (embedding.empty() || find_record(hashes[idx], model_id, text) != 0 ||
+      !texts.insert(text).second)
+    {
+      continue;
+    }
+
+    record_header header;
+    header.key_hash = hashes[idx];
+    header.key_size = model_id.size() + 1 + text.size();
+    header.dimension = embedding.size();
+
+    records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    records.append(model_id.c_str(), model_id.size() + 1);
+    records += text;
+    records.append(reinterpret_cast<const char*>(embedding.data()),
+      embedding.size() * sizeof(float));
+  }
+
+  if (records.empty())
+    return;
+
+  file_lock f_lock(fd);
+
+  // Records appended by other processes come first.
+  index_new_records();
+
+  // Appends are done holding the file lock, so an incomplete record here was
+  // left by a process that was killed.
+  if (indexed_size < file_size)
+    truncate(indexed_size);
+
+  size_t written = 0;
+  while (written < records.size())
+  {
+    ssize_t res = write(fd, records.data() + written,
+      records.size() - written);
+
+    if (res < 0 && errno == EINTR)
+      continue;
+
+    if (res <= 0)
+    {
+      std::runtime_error error = system_error(
+        "Cannot write the embeddings cache");
+      if (ftruncate(fd, indexed_size) != 0)
+        std::cerr << "Cannot truncate the embeddings cache\n";
+      throw error;
+    }
+
+    written += res;
+  }
+
+  index_new_records();
+}
+
+
+void EmbeddingCache::remap(size_t size)
+{
+  // Pages past the end of the file are never read, and show what's
+  // appended once the file grows.
+  size_t new_size = std::max(size, 2 * mapping_size);
+
+  void* new_mapping = mmap(nullptr, new_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (new_mapping == MAP_FAILED)
+    throw system_error("mmap() of the embeddings cache failed");
+
+  if (mapping)
+    munmap(const_cast<char*>(mapping), mapping_size);
+
+  mapping = static_cast<const char*>(new_mapping);
+  mapping_size = new_size;
+}
+
+
+void EmbeddingCache::truncate(size_t size)
+{
+  if (ftruncate(fd, size) != 0)
+    throw system_error("Cannot truncate the embeddings cache");
+  file_size = size;
+}
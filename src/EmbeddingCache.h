@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <json/json.h>
+
+#include "common.h"
+
+
+/*
+Embeddings saved on disk, keyed by model ID and text. The file is only ever
+appended to and is read through a memory mapping, so several processes can
+use it at once: appends are serialized with flock(), and readers only see
+complete records. Each record holds its key, so texts whose hashes collide
+are told apart.
+*/
+class EmbeddingCache
+{
+  // Followed by the model ID, a null character, the text, then the
+  // embedding.
+  struct record_header
+  {
+    uint64_t key_hash;
+    uint32_t key_size;
+    uint32_t dimension;
+  };
+
+  int fd;
+  const char* mapping;
+  // Bytes mapped, which grow geometrically past the end of the file so
+  // appends rarely remap it.
+  size_t mapping_size;
+  // Size of the file when it was last checked, all of it mapped.
+  size_t file_size;
+  // Offset of each record, by key hash.
+  std::unordered_multimap<uint64_t, size_t> offsets;
+  // Size of the file up to the last record indexed.
+  size_t indexed_size;
+  std::shared_mutex mutex;
+  std::atomic<size_t> _hits;
+  std::atomic<size_t> _misses;
+
+  void clean_up() noexcept;
+
+  // Offset of the record of the key, or 0 if there's none. Needs a lock.
+  size_t find_record(uint64_t hash, const std::string& model_id,
+    const std::string& text) const;
+
+  // Indexes the records appended since the last call, by this process or by
+  // others. Needs the exclusive lock.
+  void index_new_records();
+
+  static uint64_t key_hash(const std::string& model_id,
+    const std::string& text);
+
+  // Maps at least size bytes of the file.
+  void remap(size_t size);
+
+  // Truncates the file to size bytes, dropping a record left incomplete.
+  void truncate(size_t size);
+
+public:
+
+  EmbeddingCache(const std::filesystem::path& file_path);
+
+  EmbeddingCache(const EmbeddingCache&) = delete;
+
+  EmbeddingCache& operator=(const EmbeddingCache&) = delete;
+
+  virtual ~EmbeddingCache();
+
+  // Returns false, counting a miss, when there's no embedding for the text.
+  bool get(const std::string& model_id, const std::string& text,
+    std::vector<float>& embedding);
+
+  size_t hits() const
+  {
+    return _hits;
+  }
+
+  size_t misses() const
+  {
+    return _misses;
+  }
+
+  // Opens the file given by "cacheFile" in the embeddingsHttp settings, or
+  // the default one if it's not set. Returns an empty pointer if the setting
+  // is an empty string.
+  static std::shared_ptr<EmbeddingCache>
+  open_from_settings(const Json::Value& embd_settings);
+
+  // Saves the embeddings of the text units not saved yet, in a single
+  // append. Units without an embedding are skipped.
+  void put(const std::string& model_id,
+    const std::vector<TextUnit>& text_units);
+};
@@ -0,0 +1,177 @@
+#include "EmbeddingMatrix.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+namespace filesystem = std::filesystem;
+
+static const char file_signature[8] = {'E', 'M', 'B', 'D', 'M', 'A', 'T', '1'};
+
+// Floats in 64 bytes.
+static const uint32_t floats_per_line = 16;
+
+
+EmbeddingMatrix::EmbeddingMatrix(const std::filesystem::path& file_path):
+  fd(-1),
+  mapping(nullptr),
+  mapping_size(0)
+{
+  static_assert(sizeof(file_header) <= header_size, "header too large");
+
+  if (!file_path.parent_path().empty())
+    filesystem::create_directories(file_path.parent_path());
+
+  fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open the embeddings matrix \"");
+    msg += file_path.string();
+    msg += "\"";
+    throw system_error(msg.c_str());
+  }
+
+  try
+  {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+      throw system_error("fstat() on the embeddings matrix failed");
+
+    size_t file_size = file_stat.st_size;
+
+    if (file_size == 0)
+    {
+      file_size = header_size;
+      if (ftruncate(fd, file_size) != 0)
+        throw system_error("Cannot resize the embeddings matrix");
+      remap(file_size);
+      std::memcpy(header().signature, file_signature, sizeof(file_signature));
+    }
+    else
+    {
+      if (file_size < header_size)
+        throw std::runtime_error("The embeddings matrix file is truncated");
+
+      remap(file_size);
+
+      if (std::memcmp(header().signature, file_signature,
+        sizeof(file_signature)) != 0)
+      {
+        std::string msg("\"");
+        msg += file_path.string();
+        msg += "\" is not an embeddings matrix file.";
+        throw std::runtime_error(msg);
+      }
+
+      if (header_size + rows() * row_stride() * sizeof(float) > file_size)
+        throw std::runtime_error("The embeddings matrix file is truncated");
+    }
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+EmbeddingMatrix::~EmbeddingMatrix()
+{
+  clean_up();
+}
+
+
+size_t EmbeddingMatrix::append(const float* embedding, uint32_t dimension)
+{
+  if (header().dimension == 0)
+  {
+    header().dimension = dimension;
+    header().row_stride = (dimension + floats_per_line - 1) /
+      floats_per_line * floats_per_line;
+  }
+  else if (header().dimension != dimension)
+  {
+    std::string msg("Embedding of dimension ");
+    msg += std::to_string(dimension);
+    msg += " added to a matrix of dimension ";
+    msg += std::to_string(header().dimension);
+    throw std::runtime_error(msg);
+  }
+
+  size_t row_size = row_stride() * sizeof(float);
+  size_t needed = header_size + (rows() + 1) * row_size;
+
+  if (needed > mapping_size)
+  {
+    // Grows geometrically, so appending stays amortized O(1).
+    size_t new_size = std::max(needed, mapping_size * 2);
+    if (ftruncate(fd, new_size) != 0)
+      throw system_error("Cannot resize the embeddings matrix");
+    remap(new_size);
+  }
+
+  size_t idx = rows();
+  float* dest = reinterpret_cast<float*>(mapping + header_size + idx * row_size);
+  std::memcpy(dest, embedding, dimension * sizeof(float));
+  std::memset(dest + dimension, 0, (row_stride() - dimension) * sizeof(float));
+
+  // Counted only once the row is complete.
+  header().rows = idx + 1;
+  return idx;
+}
+
+
+void EmbeddingMatrix::clean_up() noexcept
+{
+  if (mapping)
+  {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+
+void EmbeddingMatrix::remap(size_t size)
+{
+  void* new_mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+    fd, 0);
+  if (new_mapping == MAP_FAILED)
+    throw system_error("mmap() of the embeddings matrix failed");
+
+  if (mapping)
+    munmap(mapping, mapping_size);
+
+  mapping = static_cast<char*>(new_mapping);
+  mapping_size = size;
+}
+
+
+void EmbeddingMatrix::sync()
+{
+  if (msync(mapping, mapping_size, MS_SYNC) != 0)
+    throw system_error("msync() of the embeddings matrix failed");
+}
+
+
+void EmbeddingMatrix::truncate(size_t n)
+{
+  if (n < rows())
+    header().rows = n;
+}
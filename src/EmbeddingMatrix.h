@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+
+/*
+Embeddings of the same dimension stored as the rows of a float matrix in a
+memory-mapped file. Every row starts on a 64-byte boundary, so it can be
+scanned with aligned SIMD loads. Not thread-safe: appending may move the
+mapping, which invalidates the pointers returned by row().
+*/
+class EmbeddingMatrix
+{
+  struct file_header
+  {
+    char signature[8];
+    uint32_t dimension;
+    // Floats from the start of a row to the start of the next one.
+    uint32_t row_stride;
+    uint64_t rows;
+  };
+
+  int fd;
+  char* mapping;
+  size_t mapping_size;
+
+  void clean_up() noexcept;
+
+  file_header& header()
+  {
+    return *reinterpret_cast<file_header*>(mapping);
+  }
+
+  const file_header& header() const
+  {
+    return *reinterpret_cast<const file_header*>(mapping);
+  }
+
+  void remap(size_t size);
+
+public:
+
+  // Rows start after this many bytes of header.
+  static const size_t header_size = 64;
+
+  explicit EmbeddingMatrix(const std::filesystem::path& file_path);
+
+  EmbeddingMatrix(const EmbeddingMatrix&) = delete;
+
+  EmbeddingMatrix& operator=(const EmbeddingMatrix&) = delete;
+
+  virtual ~EmbeddingMatrix();
+
+  // Appends a row and returns its index. The first row appended sets the
+  // dimension of the matrix.
+  size_t append(const float* embedding, uint32_t dimension);
+
+  // 0 until the first row is appended.
+  uint32_t dimension() const
+  {
+    return header().dimension;
+  }
+
+  const float* row(size_t idx) const
+  {
+    return reinterpret_cast<const float*>(mapping + header_size +
+      idx * header().row_stride * sizeof(float));
+  }
+
+  size_t rows() const
+  {
+    return header().rows;
+  }
+
+  // Floats from the start of a row to the start of the next one.
+  uint32_t row_stride() const
+  {
+    return header().row_stride;
+  }
+
+  // Writes the mapped pages to disk.
+  void sync();
+
+  // Drops the rows after the first n ones.
+  void truncate(size_t n);
+};
@@ -0,0 +1,638 @@
+#include "EmbeddingsParser.h"
+
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+
+// Longest number accepted, longer than any float printed in full.
+static const size_t max_number_size = 64;
+
+// Base64 characters decoded without being gathered first when as many are
+// found at once, and gathered before they are decoded.
+static const size_t min_direct_base64 = 256;
+static const size_t max_pending_base64 = 4096;
+
+
+static bool is_number_char(char c)
+{
+  return (c >= '0' && c <= '9') || c == '-' || c == '.' || c == 'e' ||
+    c == 'E' || c == '+';
+}
+
+
+static bool is_space(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+
+EmbeddingsParser::EmbeddingsParser(std::vector<TextUnit>& text_units):
+  text_units(text_units),
+  decode_base64(get_base64_decode_func())
+{
+  reset();
+}
+
+
+void EmbeddingsParser::append_base64(const char* first, const char* last)
+{
+  if (first == last)
+    return;
+
+  // Padding only ends the string.
+  if (base64_padded)
+    throw std::runtime_error("\"embedding\" string is not base64");
+
+  size_t n = last - first;
+
+  // Long runs of characters are decoded from the chunk, short ones, as
+  // between the "\/" of some servers, are gathered first.
+  if (base64_pending.empty() && n >= min_direct_base64)
+  {
+    size_t whole = n & ~static_cast<size_t>(3);
+    decode_base64_chars(first, whole);
+    base64_pending.assign(first + whole, last);
+    return;
+  }
+
+  base64_pending.append(first, last);
+
+  if (base64_pending.size() >= max_pending_base64)
+  {
+    size_t whole = base64_pending.size() & ~static_cast<size_t>(3);
+    decode_base64_chars(base64_pending.data(), whole);
+    base64_pending.erase(0, whole);
+  }
+}
+
+
+void EmbeddingsParser::begin_value(char c)
+{
+  bool is_number = c == '-' || (c >= '0' && c <= '9');
+
+  switch (value_role)
+  {
+  case role::root:
+    if (c != '{')
+      throw std::runtime_error("Response from API is not a JSON object");
+    break;
+  case role::data:
+    if (c != '[')
+      throw_type_error("an array");
+    data_found = true;
+    break;
+  case role::item:
+    if (c != '{')
+      throw std::runtime_error("Element of \"data\" array is not an object");
+    embedding_found = false;
+    index_found = false;
+    break;
+  case role::embedding:
+    if (c != '[' && c != '"')
+      throw_type_error("an array or a base64 string");
+    // Past the first item, the batch has a row for the index.
+    embedding_row = nullptr;
+    if (!batch.empty() && index_found && index < text_units.size() &&
+      !units_set[index])
+      embedding_row = batch.row(index);
+    embedding_bytes = 0;
+    base64_pending.clear();
+    base64_padded = false;
+    embedding_found = true;
+    break;
+  case role::embedding_value:
+    if (!is_number)
+      throw std::runtime_error("element of \"embedding\" array is not a "
+        "number");
+    break;
+  case role::index:
+    if (!is_number)
+      throw_type_error("an integer");
+    break;
+  case role::skipped:
+    break;
+  }
+
+  switch (c)
+  {
+  case '{':
+    containers.push_back(container{value_role, true});
+    current = state::first_key;
+    break;
+  case '[':
+    containers.push_back(container{value_role, false});
+    current = state::first_element;
+    break;
+  case '"':
+    in_key = false;
+    in_base64 = value_role == role::embedding;
+    escaped = false;
+    current = state::string;
+    break;
+  case 't':
+  case 'f':
+  case 'n':
+    literal.assign(1, c);
+    current = state::literal;
+    break;
+  default:
+    if (!is_number)
+      throw_syntax_error(c);
+    number.clear();
+    current = state::number;
+  }
+}
+
+
+void EmbeddingsParser::close_container(char c)
+{
+  container closed = containers.back();
+  if (closed.is_object != (c == '}'))
+    throw_syntax_error(c);
+
+  containers.pop_back();
+
+  if (closed.value_role == role::item)
+    end_item();
+  else if (closed.value_role == role::root && !data_found)
+    throw std::runtime_error("Member \"data\" was not found in object");
+
+  end_value();
+}
+
+
+void EmbeddingsParser::decode_base64_chars(const char* chars, size_t n)
+{
+  size_t size = n * 3 / 4;
+
+  if (!decode_base64(chars, n, make_embedding_room(size)))
+  {
+    throw std::runtime_error("\"embedding\" string is not base64");
+  }
+
+  embedding_bytes += size;
+}
+
+
+EmbeddingsParser::role EmbeddingsParser::element_role(role array_role)
+{
+  switch (array_role)
+  {
+  case role::data:
+    return role::item;
+  case role::embedding:
+    return role::embedding_value;
+  default:
+    return role::skipped;
+  }
+}
+
+
+void EmbeddingsParser::end_base64()
+{
+  decode_base64_chars(base64_pending.data(), base64_pending.size());
+  base64_pending.clear();
+
+  if (embedding_bytes % sizeof(float) != 0)
+    throw std::runtime_error("\"embedding\" string is not base64 of floats");
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  float* values = embedding_row ? embedding_row : embedding.data();
+  for (size_t idx = 0; idx < embedding_bytes / sizeof(float); idx++)
+  {
+    uint32_t bits;
+    std::memcpy(&bits, &values[idx], sizeof(bits));
+    bits = __builtin_bswap32(bits);
+    std::memcpy(&values[idx], &bits, sizeof(bits));
+  }
+#endif
+}
+
+
+void EmbeddingsParser::end_item()
+{
+  if (!embedding_found)
+    throw std::runtime_error("Member \"embedding\" was not found in object");
+  if (!index_found)
+    throw std::runtime_error("Member \"index\" was not found in object");
+
+  if (index >= text_units.size() || units_set[index])
+  {
+    std::string msg("Unexpected embedding index ");
+    msg += std::to_string(index);
+    msg += " in response from API";
+    throw std::runtime_error(msg);
+  }
+
+  size_t dimension = embedding_bytes / sizeof(float);
+
+  if (!embedding_row)
+  {
+    if (batch.empty())
+      batch = EmbeddingBatch(text_units.size(), dimension);
+    else if (dimension != batch.dimension())
+      throw_dimension_error();
+
+    std::memcpy(batch.row(index), embedding.data(), embedding_bytes);
+  }
+  else if (dimension != batch.dimension())
+  {
+    throw_dimension_error();
+  }
+
+  text_units[index].embedding(batch.embedding(index));
+
+  units_set[index] = true;
+  units_set_count++;
+}
+
+
+void EmbeddingsParser::end_value()
+{
+  current = containers.empty() ? state::done : state::after_value;
+}
+
+
+void EmbeddingsParser::feed(const char* data, size_t size)
+{
+  const char* p = data;
+  const char* end = data + size;
+
+  while (p < end)
+  {
+    switch (current)
+    {
+    case state::string:
+      p = scan_string(p, end);
+      continue;
+    case state::number:
+      p = scan_number(p, end);
+      continue;
+    case state::literal:
+      p = scan_literal(p, end);
+      continue;
+    default:
+      break;
+    }
+
+    char c = *p;
+    if (is_space(c))
+    {
+      p++;
+      continue;
+    }
+
+    switch (current)
+    {
+    case state::value:
+      begin_value(c);
+      break;
+    case state::first_element:
+      if (c == ']')
+      {
+        close_container(c);
+        break;
+      }
+      value_role = element_role(containers.back().value_role);
+      begin_value(c);
+      break;
+    case state::first_key:
+      if (c == '}')
+      {
+        close_container(c);
+        break;
+      }
+      // Falls through.
+    case state::key:
+      if (c != '"')
+        throw_syntax_error(c);
+      key.clear();
+      in_key = true;
+      in_base64 = false;
+      escaped = false;
+      current = state::string;
+      break;
+    case state::colon:
+      if (c != ':')
+        throw_syntax_error(c);
+      value_role = member_role();
+      current = state::value;
+      break;
+    case state::after_value:
+      if (c == ',')
+      {
+        if (containers.back().is_object)
+        {
+          current = state::key;
+        }
+        else
+        {
+          value_role = element_role(containers.back().value_role);
+          current = state::value;
+        }
+      }
+      else if (c == '}' || c == ']')
+      {
+        close_container(c);
+      }
+      else
+      {
+        throw_syntax_error(c);
+      }
+      break;
+    default:
+      throw_syntax_error(c);
+    }
+
+    // The first character of a number is scanned with the rest of it.
+    if (current != state::number)
+      p++;
+  }
+}
+
+
+void EmbeddingsParser::finish()
+{
+  if (current != state::done)
+    throw std::runtime_error("Response from API is incomplete");
+
+  if (units_set_count != text_units.size())
+  {
+    std::string msg("The number of embeddings returned was ");
+    msg += std::to_string(units_set_count);
+    msg += " for ";
+    msg += std::to_string(text_units.size());
+    msg += " strings";
+    throw std::runtime_error(msg);
+  }
+}
+
+
+uint8_t* EmbeddingsParser::make_embedding_room(size_t size)
+{
+  size_t new_bytes = embedding_bytes + size;
+
+  if (embedding_row)
+  {
+    if (new_bytes > batch.dimension() * sizeof(float))
+      throw_dimension_error();
+    return reinterpret_cast<uint8_t*>(embedding_row) + embedding_bytes;
+  }
+
+  if (embedding.size() * sizeof(float) < new_bytes)
+    embedding.resize((new_bytes + sizeof(float) - 1) / sizeof(float));
+  return reinterpret_cast<uint8_t*>(embedding.data()) + embedding_bytes;
+}
+
+
+EmbeddingsParser::role EmbeddingsParser::member_role() const
+{
+  role object_role = containers.back().value_role;
+
+  if (object_role == role::root && key == "data")
+    return role::data;
+
+  if (object_role == role::item)
+  {
+    if (key == "embedding")
+      return role::embedding;
+    if (key == "index")
+      return role::index;
+  }
+
+  return role::skipped;
+}
+
+
+void EmbeddingsParser::reset()
+{
+  containers.clear();
+  current = state::value;
+  value_role = role::root;
+  in_key = false;
+  in_base64 = false;
+  escaped = false;
+  data_found = false;
+  batch = EmbeddingBatch();
+  embedding_found = false;
+  embedding_row = nullptr;
+  embedding_bytes = 0;
+  base64_pending.clear();
+  base64_padded = false;
+  index = 0;
+  index_found = false;
+  units_set.assign(text_units.size(), false);
+  units_set_count = 0;
+}
+
+
+const char* EmbeddingsParser::scan_base64(const char* p, const char* end)
+{
+  // Looked for once, the backslashes before it being consumed one by one.
+  auto quote = static_cast<const char*>(std::memchr(p, '"', end - p));
+  const char* string_end = quote ? quote : end;
+
+  while (p < end)
+  {
+    // JSON allows "\/" for '/'.
+    if (escaped)
+    {
+      if (*p != '/')
+        throw std::runtime_error("\"embedding\" string is not base64");
+      append_base64(p, p + 1);
+      escaped = false;
+      p++;
+      continue;
+    }
+
+    // The characters up to the end of the string, or of the chunk, or to a
+    // backslash are decoded at once, the decoder rejecting anything else
+    // than base64.
+    const char* stop = string_end;
+    auto backslash = static_cast<const char*>(std::memchr(p, '\\',
+      stop - p));
+    if (backslash)
+      stop = backslash;
+
+    const char* data_end = stop;
+    while (data_end > p && data_end[-1] == '=')
+      data_end--;
+
+    append_base64(p, data_end);
+    if (data_end < stop)
+      base64_padded = true;
+
+    p = stop;
+    if (p == end)
+      break;
+
+    if (*p++ == '"')
+    {
+      end_base64();
+      end_value();
+      break;
+    }
+
+    escaped = true;
+  }
+
+  return p;
+}
+
+
+const char* EmbeddingsParser::scan_literal(const char* p, const char* end)
+{
+  const char* start = p;
+  while (p < end && std::isalpha(static_cast<unsigned char>(*p)))
+    p++;
+
+  // No literal is longer than "false".
+  if (literal.size() + (p - start) > 5)
+    throw std::runtime_error("Failed to parse response from API: "
+      "unexpected literal");
+  literal.append(start, p);
+
+  if (p == end)
+    return p;
+
+  if (literal != "true" && literal != "false" && literal != "null")
+  {
+    std::string msg("Failed to parse response from API: unexpected literal "
+      "'");
+    msg += literal;
+    msg += "'";
+    throw std::runtime_error(msg);
+  }
+
+  end_value();
+  return p;
+}
+
+
+const char* EmbeddingsParser::scan_number(const char* p, const char* end)
+{
+  const char* start = p;
+  while (p < end && is_number_char(*p))
+    p++;
+
+  if (number.size() + (p - start) > max_number_size)
+    throw std::runtime_error("Number too long in response from API");
+
+  if (p == end)
+  {
+    // The number goes on in the next chunk.
+    number.append(start, p);
+    return p;
+  }
+
+  if (number.empty())
+  {
+    set_number(start, p);
+  }
+  else
+  {
+    number.append(start, p);
+    set_number(number.data(), number.data() + number.size());
+  }
+
+  end_value();
+  return p;
+}
+
+
+const char* EmbeddingsParser::scan_string(const char* p, const char* end)
+{
+  if (in_base64)
+    return scan_base64(p, end);
+
+  while (p < end)
+  {
+    char c = *p++;
+
+    if (escaped)
+    {
+      escaped = false;
+    }
+    else if (c == '\\')
+    {
+      escaped = true;
+    }
+    else if (c == '"')
+    {
+      if (in_key)
+        current = state::colon;
+      else
+        end_value();
+      return p;
+    }
+
+    // Escape sequences are kept as they are, none of the keys looked for
+    // has one.
+    if (in_key)
+      key += c;
+  }
+
+  return p;
+}
+
+
+void EmbeddingsParser::set_number(const char* first, const char* last)
+{
+  if (value_role == role::embedding_value)
+  {
+    float value;
+    auto [ptr, ec] = std::from_chars(first, last, value);
+
+    // Values too small for a float are rounded to 0 by strtof().
+    if (ec == std::errc::result_out_of_range)
+    {
+      std::string str(first, last);
+      value = std::strtof(str.c_str(), nullptr);
+    }
+    else if (ec != std::errc() || ptr != last)
+    {
+      throw std::runtime_error("element of \"embedding\" array is not a "
+        "number");
+    }
+
+    std::memcpy(make_embedding_room(sizeof(value)), &value, sizeof(value));
+    embedding_bytes += sizeof(value);
+  }
+  else if (value_role == role::index)
+  {
+    auto [ptr, ec] = std::from_chars(first, last, index);
+    if (ec != std::errc() || ptr != last)
+      throw_type_error("an integer");
+    index_found = true;
+  }
+}
+
+
+void EmbeddingsParser::throw_dimension_error() const
+{
+  throw std::runtime_error("Embeddings of different dimensions in response "
+    "from API");
+}
+
+
+void EmbeddingsParser::throw_syntax_error(char c) const
+{
+  std::string msg("Failed to parse response from API: unexpected '");
+  msg += c;
+  msg += "'";
+  throw std::runtime_error(msg);
+}
+
+
+void EmbeddingsParser::throw_type_error(const char* type_str) const
+{
+  std::string msg("Member with the key \"");
+  msg += key;
+  msg += "\" is not ";
+  msg += type_str;
+  throw std::runtime_error(msg);
+}
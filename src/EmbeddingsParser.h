@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "VectorKernels.h"
+
+
+/*
+Incremental parser of the responses of the embeddings API, fed with the
+chunks of the body as they are received. It only builds the embeddings, in
+an EmbeddingBatch allocated once the first one gives the dimension, and sets
+on each text unit the row at its "index". An embedding is an array of
+numbers, decoded with std::from_chars, or a base64 string of little-endian
+floats, decoded with the SIMD decoder. It's decoded straight into its row
+when its index comes first, and copied there otherwise. The other members of
+the response are checked for syntax and skipped.
+*/
+class EmbeddingsParser
+{
+  // What a JSON value is in the response.
+  enum class role
+  {
+    root,
+    data,
+    item,
+    embedding,
+    embedding_value,
+    index,
+    skipped
+  };
+
+  // What the next characters are expected to be.
+  enum class state
+  {
+    value,
+    first_element,
+    first_key,
+    key,
+    colon,
+    after_value,
+    string,
+    number,
+    literal,
+    done
+  };
+
+  struct container
+  {
+    role value_role;
+    bool is_object;
+  };
+
+  std::vector<TextUnit>& text_units;
+  std::vector<container> containers;
+  state current;
+  // Role of the value starting in the state value, or being parsed in the
+  // states string, number and literal.
+  role value_role;
+  // Last key of the innermost object, kept until its value starts.
+  std::string key;
+  bool in_key;
+  // Whether the string is an embedding in base64.
+  bool in_base64;
+  bool escaped;
+  // Beginning of a number cut by the end of a chunk.
+  std::string number;
+  // Characters of the literal so far.
+  std::string literal;
+  bool data_found;
+
+  EmbeddingBatch batch;
+
+  // The item of "data" being parsed. Its embedding is decoded into its row
+  // of the batch, or into embedding when embedding_row is null.
+  std::vector<float> embedding;
+  float* embedding_row;
+  size_t embedding_bytes;
+  // Base64 characters not decoded yet.
+  std::string base64_pending;
+  bool base64_padded;
+  Base64DecodeFunc decode_base64;
+  bool embedding_found;
+  size_t index;
+  bool index_found;
+
+  // Whether each text unit has its embedding, and how many do.
+  std::vector<bool> units_set;
+  size_t units_set_count;
+
+  // Appends the base64 characters to the embedding.
+  void append_base64(const char* first, const char* last);
+
+  void begin_value(char c);
+
+  void close_container(char c);
+
+  void decode_base64_chars(const char* chars, size_t n);
+
+  // Role of the elements of an array with the given role.
+  static role element_role(role array_role);
+
+  void end_base64();
+
+  void end_item();
+
+  void end_value();
+
+  // Returns where the next bytes of the embedding go.
+  uint8_t* make_embedding_room(size_t size);
+
+  role member_role() const;
+
+  const char* scan_base64(const char* p, const char* end);
+
+  const char* scan_literal(const char* p, const char* end);
+
+  const char* scan_number(const char* p, const char* end);
+
+  const char* scan_string(const char* p, const char* end);
+
+  void set_number(const char* first, const char* last);
+
+  [[noreturn]] void throw_dimension_error() const;
+
+  [[noreturn]] void throw_syntax_error(char c) const;
+
+  [[noreturn]] void throw_type_error(const char* type_str) const;
+
+public:
+
+  explicit EmbeddingsParser(std::vector<TextUnit>& text_units);
+
+  EmbeddingsParser(const EmbeddingsParser&) = delete;
+
+  EmbeddingsParser& operator=(const EmbeddingsParser&) = delete;
+
+  void feed(const char* data, size_t size);
+
+  // Checks that the response is complete and has an embedding for every text
+  // unit.
+  void finish();
+
+  // Starts over, for another response setting the same text units.
+  void reset();
+};
@@ -0,0 +1,142 @@
+#include "FileExtractor.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "HTMLFileProcessor.h"
+#include "OfficeXmlProcessor.h"
+
+
+const char* const html_mime_types[] = {"text/html", nullptr};
+
+const char* const open_doc_mime_types[] = {
+  "application/vnd.oasis.opendocument.text",
+  "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+  nullptr
+};
+
+
+FileExtractor::FileExtractor(const TextChunker::limits& chunk_limits,
+  LibreOfficePool& office_pool):
+  chunk_limits(chunk_limits),
+  office_pool(office_pool),
+  magic_hdl(magic_open(MAGIC_MIME_TYPE))
+{
+  using std::placeholders::_1;
+
+  if (!magic_hdl)
+  {
+    throw std::runtime_error("magic_open() failed");
+  }
+
+  if (magic_load(magic_hdl, nullptr) != 0)
+  {
+    const char* err = magic_error(magic_hdl);
+    std::string msg = "magic_load() failed: ";
+    msg += (err ? err : "unknown error");
+    clean_up();
+    throw std::runtime_error(msg);
+  }
+
+  file_processors.emplace_back(html_mime_types, [&] {
+    auto func = std::bind(std::mem_fn(&FileExtractor::on_text_unit), this,
+      _1);
+    return std::make_unique<HTMLFileProcessor>(this->chunk_limits, func);
+  });
+
+  file_processors.emplace_back(open_doc_mime_types, [&] {
+    auto func = std::bind(std::mem_fn(&FileExtractor::on_text_unit), this,
+      _1);
+    return std::make_unique<OfficeXmlProcessor>(this->office_pool,
+      this->chunk_limits, func);
+  });
+}
+
+
+FileExtractor::~FileExtractor()
+{
+  clean_up();
+}
+
+
+void FileExtractor::clean_up() noexcept
+{
+  if (magic_hdl)
+  {
+    magic_close(magic_hdl);
+    magic_hdl = nullptr;
+  }
+}
+
+
+void FileExtractor::extract(const char* file_path,
+  FileProcessor::TextUnitFunc on_text_unit)
+{
+  std::cerr << "Processing file " << file_path << "\n";
+  const char* mime_type = magic_file(magic_hdl, file_path);
+
+  if (!mime_type)
+  {
+    std::string msg("magic_file failed().");
+
+    if (const char* error = magic_error(magic_hdl))
+    {
+      msg += " "; msg += error;
+    }
+
+    throw std::runtime_error(msg);
+  }
+
+  std::cerr << "MIME type: " << mime_type << "\n";
+  for (processor_for_mime_type& p : file_processors)
+  {
+    bool have_match = false;
+
+    for (const char* const * item = p.mime_types; *item; item++)
+    {
+      if (strcmp(*item, mime_type) == 0)
+      {
+        have_match = true;
+        break;
+      }
+    }
+
+    if (have_match)
+    {
+      // Create the processor object if it's the case.
+      if (!p.processor)
+      {
+        if (!p.proc_factory)
+          throw std::logic_error("proc_factory is empty");
+
+        p.processor = p.proc_factory();
+        if (!p.processor)
+          throw std::logic_error("processor returned by proc_factory is empty");
+
+      }
+
+      unit_func = std::move(on_text_unit);
+
+      try
+      {
+        p.processor->process_file(file_path);
+      }
+      catch (...)
+      {
+        unit_func = nullptr;
+        throw;
+      }
+
+      unit_func = nullptr;
+      return;
+    }
+  }
+}
+
+
+void FileExtractor::on_text_unit(TextUnit&& text_unit)
+{
+  unit_func(std::move(text_unit));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <magic.h>
+
+#include "common.h"
+#include "LibreOfficePool.h"
+#include "TextChunker.h"
+
+
+/*
+Detects the MIME type of files and extracts their text units with the
+matching FileProcessor. Not thread-safe: each thread extracting files needs
+its own FileExtractor.
+*/
+class FileExtractor
+{
+  struct processor_for_mime_type
+  {
+    typedef std::function<std::unique_ptr<FileProcessor>()> ProcessorFactory;
+
+    // Last const char* must be nullptr
+    const char* const * mime_types;
+    ProcessorFactory proc_factory;
+    std::unique_ptr<FileProcessor> processor;
+
+    processor_for_mime_type(const char* const * mime_types,
+      ProcessorFactory proc_factory) :
+      mime_types(mime_types), proc_factory(proc_factory), processor()
+    {
+    }
+  };
+
+  std::vector<processor_for_mime_type> file_processors;
+  TextChunker::limits chunk_limits;
+  LibreOfficePool& office_pool;
+  magic_t magic_hdl;
+  // Receives the units of the file being extracted.
+  FileProcessor::TextUnitFunc unit_func;
+
+  void clean_up() noexcept;
+
+public:
+
+  FileExtractor(const TextChunker::limits& chunk_limits,
+    LibreOfficePool& office_pool);
+
+  FileExtractor(const FileExtractor&) = delete;
+
+  FileExtractor& operator=(const FileExtractor&) = delete;
+
+  virtual ~FileExtractor();
+
+  // Passes each text unit of the file to on_text_unit as soon as it's cut,
+  // so a large file is never held whole. There's none when no processor
+  // handles its MIME type. Throws FileProcessor::file_error when it can't
+  // be extracted, like when the office took too long on it, after some
+  // units may have been passed.
+  void extract(const char* file_path,
+    FileProcessor::TextUnitFunc on_text_unit);
+
+protected:
+
+  virtual void on_text_unit(TextUnit&& text_unit);
+};
@@ -0,0 +1,194 @@
+#include "FlatVectorDb.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+
+namespace filesystem = std::filesystem;
+
+typedef std::pair<float, uint64_t> scored_row;
+
+// Rows kept per query by the exact scan of every embedding.
+static const size_t n_results = 20;
+
+// Below this many rows per thread, starting a thread costs more than it
+// saves.
+static const size_t min_rows_per_thread = 16384;
+
+
+/*
+Keeps the n_results rows nearest to a query in a max-heap, so the farthest
+one is replaced in O(log n_results).
+*/
+static void push_nearest(std::vector<scored_row>& heap, float distance,
+  uint64_t row)
+{
+  if (heap.size() < n_results)
+  {
+    heap.emplace_back(distance, row);
+    std::push_heap(heap.begin(), heap.end());
+  }
+  else if (distance < heap.front().first)
+  {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = scored_row(distance, row);
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+
+FlatVectorDb::FlatVectorDb(const filesystem::path& directory, Metric metric,
+  size_t max_threads):
+  LocalVectorDb(directory, metric),
+  max_threads(std::max<size_t>(max_threads, 1))
+{
+}
+
+
+std::shared_ptr<FlatVectorDb>
+FlatVectorDb::open_from_settings(const Json::Value& flat_settings)
+{
+  Json::Value value = get_json_member_with_type(flat_settings, "directory",
+    Json::ValueType::stringValue);
+  filesystem::path directory = value.asString();
+
+  Metric metric = Metric::l2;
+  value = get_json_member_with_type(flat_settings, "metric",
+    Json::ValueType::stringValue, false);
+  if (value)
+    metric = parse_metric(value.asString());
+
+  size_t threads = get_positive_setting(flat_settings, "threads",
+    std::max(1u, std::thread::hardware_concurrency()));
+
+  return std::make_shared<FlatVectorDb>(directory, metric, threads);
+}
+
+
+void FlatVectorDb::save_file_part(std::vector<TextUnit>& text_units,
+  FileParts& parts)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  append_part(text_units, parts);
+}
+
+
+void FlatVectorDb::save_file_record_with_text_units(FileRecord& record)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  append_record(record);
+}
+
+
+void
+FlatVectorDb::save_file_records_with_text_units(std::vector<FileRecord>& records)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  for (FileRecord& record : records)
+    append_record(record);
+}
+
+
+std::vector<std::vector<scored_row>>
+FlatVectorDb::scan(const std::vector<std::vector<float>>& embeddings)
+{
+  size_t n_queries = embeddings.size();
+  size_t n_rows = matrix.rows();
+  uint32_t dimension = matrix.dimension();
+
+  if (n_rows == 0)
+    return std::vector<std::vector<scored_row>>(n_queries);
+
+  for (const std::vector<float>& embedding : embeddings)
+    check_query_dimension(embedding);
+
+  size_t n_threads = std::min(max_threads,
+    std::max<size_t>(n_rows / min_rows_per_thread, 1));
+
+  // A heap per thread and query, allocated up front so the threads don't
+  // allocate.
+  std::vector<std::vector<std::vector<scored_row>>> heaps(n_threads,
+    std::vector<std::vector<scored_row>>(n_queries));
+  for (auto& thread_heaps : heaps)
+  {
+    for (std::vector<scored_row>& heap : thread_heaps)
+      heap.reserve(n_results);
+  }
+
+  auto scan_part = [&](size_t part) {
+    size_t begin = n_rows * part / n_threads;
+    size_t end = n_rows * (part + 1) / n_threads;
+    std::vector<std::vector<scored_row>>& part_heaps = heaps[part];
+
+    // Each row is loaded once for all the queries.
+    for (size_t row = begin; row < end; row++)
+    {
+      if (!records.is_live(row))
+        continue;
+
+      const float* row_data = matrix.row(row);
+      for (size_t query = 0; query < n_queries; query++)
+      {
+        push_nearest(part_heaps[query],
+          distance(row_data, embeddings[query].data(), dimension), row);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads - 1);
+  for (size_t part = 1; part < n_threads; part++)
+    threads.emplace_back(scan_part, part);
+
+  scan_part(0);
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  std::vector<std::vector<scored_row>> nearest(n_queries);
+  for (size_t query = 0; query < n_queries; query++)
+  {
+    std::vector<scored_row>& merged = nearest[query];
+    for (auto& thread_heaps : heaps)
+    {
+      merged.insert(merged.end(), thread_heaps[query].begin(),
+        thread_heaps[query].end());
+    }
+
+    std::sort(merged.begin(), merged.end());
+    if (merged.size() > n_results)
+      merged.resize(n_results);
+  }
+
+  return nearest;
+}
+
+
+std::vector<TextUnitResult>
+FlatVectorDb::search(const std::vector<float>& embedding)
+{
+  return search_batch({embedding}).front();
+}
+
+
+std::vector<std::vector<TextUnitResult>>
+FlatVectorDb::search_batch(const std::vector<std::vector<float>>& embeddings)
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  std::vector<std::vector<scored_row>> nearest = scan(embeddings);
+
+  std::vector<std::vector<TextUnitResult>> results(nearest.size());
+  for (size_t query = 0; query < nearest.size(); query++)
+  {
+    results[query].reserve(nearest[query].size());
+    for (const scored_row& scored : nearest[query])
+    {
+      results[query].push_back(records.result(scored.second,
+        kernel_to_reported_distance(metric, scored.first)));
+    }
+  }
+
+  return results;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "LocalVectorDb.h"
+
+
+/*
+Database kept in a directory by the process itself, with no server. Searches
+compare the query with every saved embedding, so the results are exact.
+Safe to share between threads: searches run concurrently, saves one at a
+time.
+*/
+class FlatVectorDb: public LocalVectorDb
+{
+  size_t max_threads;
+
+  // Kernel distance and row of the nearest live rows to each query, nearest
+  // first.
+  std::vector<std::vector<std::pair<float, uint64_t>>>
+  scan(const std::vector<std::vector<float>>& embeddings);
+
+public:
+
+  FlatVectorDb(const std::filesystem::path& directory, Metric metric,
+    size_t max_threads);
+
+  // Opens the database described by the "flatIndex" settings: "directory",
+  // "metric" ("l2" or "innerProduct") and "threads" for searching.
+  static std::shared_ptr<FlatVectorDb>
+  open_from_settings(const Json::Value& flat_settings);
+
+  virtual void save_file_part(std::vector<TextUnit>& text_units,
+    FileParts& parts) override;
+
+  virtual void
+  save_file_record_with_text_units(FileRecord& record) override;
+
+  virtual void
+  save_file_records_with_text_units(std::vector<FileRecord>& records) override;
+
+  virtual std::vector<TextUnitResult>
+  search(const std::vector<float>& embedding) override;
+
+  // Scans the embeddings once for all the queries.
+  virtual std::vector<std::vector<TextUnitResult>>
+  search_batch(const std::vector<std::vector<float>>& embeddings) override;
+};
@@ -1,29 +1,127 @@
 #include "HTMLFileProcessor.h"
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+typedef HTMLFileProcessor::tag_kind tag_kind;
+
+struct known_tag
+{
+  const char* name;
+  tag_kind kind;
+};
+
+static constexpr known_tag known_tags[] = {
+  {"p", tag_kind::new_line},
+  {"br", tag_kind::new_line},
+  {"div", tag_kind::new_line},
+  {"li", tag_kind::new_line},
+  {"tr", tag_kind::new_line},
+  {"h2", tag_kind::new_line},
+  {"h3", tag_kind::new_line},
+  {"h4", tag_kind::new_line},
+  {"td", tag_kind::cell},
+  {"h1", tag_kind::heading},
+  {"title", tag_kind::title},
+  {"style", tag_kind::skipped},
+  {"script", tag_kind::skipped},
+  {"pre", tag_kind::preformatted}
+};
+
+static constexpr size_t n_known_tags =
+  sizeof(known_tags) / sizeof(known_tags[0]);
+
+static constexpr size_t tag_table_size = 32;
+
+// Bytes of the file given to the parser at a time.
+static constexpr size_t parse_chunk_size = 256 * 1024;
+
+
+static constexpr size_t const_strlen(const char* str)
+{
+  size_t len = 0;
+  while (str[len])
+    len++;
+  return len;
+}
 
 
 /*
-Helper to compare a xmlChar* and a const char* ignoring their case.
+Hash of a tag name of len characters, ignoring the case of ASCII letters,
+with no collision between the known tags.
 */
-inline bool strs_case_equal(const xmlChar* s1, const char* s2)
+static constexpr size_t hash_tag(const char* name, size_t len)
 {
-  return (strcasecmp(reinterpret_cast<const char*>(s1), s2) == 0);
+  return ((name[0] | 0x20) + 2 * (name[len - 1] | 0x20) + len) %
+    tag_table_size;
 }
 
 
 /*
-The last const char* in strs is nullptr.
+Slots of the hash table, holding the index in known_tags plus one of the
+tag with that hash, or 0.
 */
-static const char* str_case_in(const xmlChar* str, const char* const * strs)
+static constexpr std::array<uint8_t, tag_table_size> make_tag_table()
+{
+  std::array<uint8_t, tag_table_size> table{};
+  for (size_t idx = 0; idx < n_known_tags; idx++)
+  {
+    const char* name = known_tags[idx].name;
+    table[hash_tag(name, const_strlen(name))] = idx + 1;
+  }
+  return table;
+}
+
+
+static constexpr std::array<uint8_t, tag_table_size> tag_table =
+  make_tag_table();
+
+
+static constexpr bool is_tag_table_perfect()
 {
-  for (const char* const * item = strs; *item; item++)
+  for (size_t idx = 0; idx < n_known_tags; idx++)
   {
-    if (strs_case_equal(str, *item)) return *item;
+    const char* name = known_tags[idx].name;
+    if (tag_table[hash_tag(name, const_strlen(name))] != idx + 1)
+      return false;
   }
+  return true;
+}
+
+static_assert(is_tag_table_perfect(), "Known tags collide in the hash table");
+
+
+/*
+Kind of the element with the name, through a single comparison with the
+known tag of the same hash.
+*/
+static tag_kind get_tag_kind(const xmlChar* name)
+{
+  const char* name_str = reinterpret_cast<const char*>(name);
+  size_t len = std::strlen(name_str);
+  if (len == 0)
+    return tag_kind::other;
 
-  return nullptr;
+  uint8_t slot = tag_table[hash_tag(name_str, len)];
+  if (slot == 0)
+    return tag_kind::other;
+
+  const known_tag& tag = known_tags[slot - 1];
+  if (strcasecmp(name_str, tag.name) != 0)
+    return tag_kind::other;
+
+  return tag.kind;
 }
 
 
@@ -45,54 +143,41 @@ void HTMLFileProcessor::on_read_text_func(void* ctx, const xmlChar* text,
   HTMLFileProcessor* self = static_cast<HTMLFileProcessor*>(ctx);
   const char* _text = reinterpret_cast<const char*>(text);
 
-  if (strcasecmp(self->curr_tag.c_str(), "style") == 0 ||
-    strcasecmp(self->curr_tag.c_str(), "script") == 0)
-  {
+  if (self->curr_tag == tag_kind::skipped)
     return;
-  }
 
-  if (strcasecmp(self->curr_tag.c_str(), "pre") != 0)
+  if (self->curr_tag != tag_kind::preformatted)
   {
     if (is_all_spaces(text, len)) return;
   }
 
-  self->curr_text.append(_text, len);
+  self->chunker.append(_text, len);
   self->text_retrieved = true;
 }
 
 
 void HTMLFileProcessor::on_start_element_func(void* ctx, const xmlChar* name,
-  const xmlChar** atts)
+  const xmlChar** /* atts */)
 {
   HTMLFileProcessor* self = static_cast<HTMLFileProcessor*>(ctx);
-  self->curr_tag = reinterpret_cast<const char*>(name);
-
-  const char* const tags_to_nl[] = {
-    "p", "br", "div", "li", "tr", "h2", "h3", "h4", nullptr
-  };
+  self->curr_tag = get_tag_kind(name);
 
-  if (str_case_in(name, tags_to_nl))
+  switch (self->curr_tag)
   {
-    if (!(self->curr_text.empty()) && self->text_retrieved)
-      self->curr_text += "\n";
+  case tag_kind::new_line:
+    if (!(self->chunker.empty()) && self->text_retrieved)
+      self->chunker.append("\n", 1);
     self->text_retrieved = false;
-  }
-
-  if (strs_case_equal(name, "td"))
-  {
-    self->curr_text += "  ";
-  }
-
-  if (strs_case_equal(name, "h1"))
-  {
-    if (!(self->curr_text.empty()))
-    {
-      TextUnit unit;
-      unit.text(self->curr_text);
-      self->_on_text_unit_func(unit);
-      self->curr_text.clear();
-    }
+    break;
+  case tag_kind::cell:
+    self->chunker.append("  ", 2);
+    break;
+  case tag_kind::heading:
+    self->chunker.end_unit();
     self->text_retrieved = false;
+    break;
+  default:
+    break;
   }
 }
 
@@ -101,13 +186,7 @@ void HTMLFileProcessor::on_end_document_func(void* ctx)
 {
   HTMLFileProcessor* self = static_cast<HTMLFileProcessor*>(ctx);
 
-  if (!(self->curr_text.empty()))
-  {
-    TextUnit unit;
-    unit.text(self->curr_text);
-    self->_on_text_unit_func(unit);
-    self->curr_text.clear();
-  }
+  self->chunker.end_unit();
 }
 
 
@@ -115,25 +194,18 @@ void HTMLFileProcessor::on_end_element_func(void* ctx, const xmlChar* name)
 {
   HTMLFileProcessor* self = static_cast<HTMLFileProcessor*>(ctx);
 
-  if (strs_case_equal(name, "title") && !(self->curr_text.empty()))
-  {
-    TextUnit unit;
-    unit.text(self->curr_text);
-    self->_on_text_unit_func(unit);
-    self->curr_text.clear();
-  }
+  if (get_tag_kind(name) == tag_kind::title)
+    self->chunker.end_unit();
 
-  if (strs_case_equal(name, "style") == 0 ||
-    strs_case_equal(name, "script") == 0)
-  {
-    self->curr_tag.clear();
-  }
+  self->curr_tag = tag_kind::other;
 }
 
 
 HTMLFileProcessor::
-HTMLFileProcessor(std::function<void(const TextUnit&)> on_text_unit_func) :
-  _on_text_unit_func(on_text_unit_func),
+HTMLFileProcessor(const TextChunker::limits& chunk_limits,
+  TextUnitFunc on_text_unit_func) :
+  curr_tag(tag_kind::other),
+  chunker(chunk_limits, std::move(on_text_unit_func)),
   sax_handler({}),
   text_retrieved(false)
 {
@@ -144,9 +216,101 @@ HTMLFileProcessor(std::function<void(const TextUnit&)> on_text_unit_func) :
 }
 
 
+void HTMLFileProcessor::parse_mapped_file(const char* data, size_t size,
+  const char* file_path)
+{
+  curr_tag = tag_kind::other;
+  chunker.clear();
+  text_retrieved = false;
+
+  // Created with no data, so the encoding is detected from the first chunk.
+  std::unique_ptr<htmlParserCtxt, void (*)(htmlParserCtxtPtr)> ctxt(
+    htmlCreatePushParserCtxt(&sax_handler, this, nullptr, 0, file_path,
+      XML_CHAR_ENCODING_NONE),
+    htmlFreeParserCtxt);
+  if (!ctxt)
+    throw std::runtime_error("htmlCreatePushParserCtxt() failed");
+
+  size_t offset = 0;
+  do
+  {
+    size_t chunk_size = std::min(parse_chunk_size, size - offset);
+    bool last_chunk = offset + chunk_size == size;
+    htmlParseChunk(ctxt.get(), data + offset, chunk_size, last_chunk);
+
+    // The parser keeps a copy of what it hasn't consumed yet, so the pages
+    // are released and a large file doesn't stay resident.
+    madvise(const_cast<char*>(data + offset), chunk_size, MADV_DONTNEED);
+    offset += chunk_size;
+  }
+  while (offset < size);
+
+  if (ctxt->myDoc)
+  {
+    xmlFreeDoc(ctxt->myDoc);
+    ctxt->myDoc = nullptr;
+  }
+}
+
+
 void HTMLFileProcessor::process_file(const char* file_path)
 {
-  htmlDocPtr doc = htmlSAXParseFile(file_path, nullptr, &sax_handler, this);
-  if (doc)
-    xmlFreeDoc(doc);
+  int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open the file \"");
+    msg += file_path;
+    msg += "\": ";
+    msg += std::strerror(errno);
+    throw std::runtime_error(msg);
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+  {
+    int stat_errno = errno;
+    close(fd);
+
+    std::string msg("Cannot get the status of file \"");
+    msg += file_path;
+    msg += "\": ";
+    msg += std::strerror(stat_errno);
+    throw std::runtime_error(msg);
+  }
+
+  size_t size = file_stat.st_size;
+  void* mapping = nullptr;
+  if (size > 0)
+  {
+    mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+      int mmap_errno = errno;
+      close(fd);
+
+      std::string msg("Cannot map the file \"");
+      msg += file_path;
+      msg += "\": ";
+      msg += std::strerror(mmap_errno);
+      throw std::runtime_error(msg);
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+  }
+
+  // The mapping stays valid once the file is closed.
+  close(fd);
+
+  try
+  {
+    parse_mapped_file(static_cast<const char*>(mapping), size, file_path);
+  }
+  catch (...)
+  {
+    if (mapping)
+      munmap(mapping, size);
+    throw;
+  }
+
+  if (mapping)
+    munmap(mapping, size);
 }
@@ -2,19 +2,51 @@
 
 #include "common.h"
 
+#include <cstdint>
 #include <functional>
 
 #include <libxml/HTMLparser.h>
 
+#include "TextChunker.h"
 
+
+/*
+Extracts the text of HTML files with the push parser of libxml2, fed with
+chunks of the memory-mapped file, so no document tree is ever built.
+*/
 class HTMLFileProcessor : public FileProcessor
 {
-  std::string curr_tag;
-  std::string curr_text;
-  std::function<void(const TextUnit&)> _on_text_unit_func;
+public:
+
+  // What an element does to the extracted text.
+  enum class tag_kind : uint8_t
+  {
+    other,
+    // Starts a new line: p, br, div, li, tr, h2, h3, h4.
+    new_line,
+    // Table cell, separated by spaces.
+    cell,
+    // Starts a new text unit: h1.
+    heading,
+    // Ends a text unit: title.
+    title,
+    // Text not extracted: style, script.
+    skipped,
+    preformatted
+  };
+
+private:
+
+  // Kind of the last element started, or other once an element ends.
+  tag_kind curr_tag;
+  TextChunker chunker;
   htmlSAXHandler sax_handler;
   bool text_retrieved;
 
+  // Feeds the push parser with the bytes of the file.
+  void parse_mapped_file(const char* data, size_t size,
+    const char* file_path);
+
   static void on_read_text_func(void* ctx, const xmlChar* text, int len);
 
   static void on_start_element_func(void* ctx, const xmlChar* name,
@@ -26,8 +58,9 @@ class HTMLFileProcessor : public FileProcessor
 
 public:
 
-  HTMLFileProcessor(std::function<void(const TextUnit&)> on_text_unit_func);
+  HTMLFileProcessor(const TextChunker::limits& chunk_limits,
+    TextUnitFunc on_text_unit_func);
 
   virtual void process_file(const char* file_path) override;
 
-};
\ No newline at end of file
+};
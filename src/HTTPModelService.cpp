@@ -1,9 +1,44 @@
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <string>
 
 #include "HTTPModelService.h"
 
 
+// Most bytes of an error response kept, and quoted in the error message.
+static const size_t max_error_body_size = 64 * 1024;
+static const size_t max_error_quote_size = 500;
+
+
+/*
+Returns the message of the error response body: "error" when a string, or
+"error.message", as OpenAI-compatible servers answer, or the start of the
+body otherwise.
+*/
+static std::string error_response_message(const std::string& body)
+{
+  Json::CharReaderBuilder builder;
+  std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  Json::Value json;
+  std::string errors;
+
+  if (reader->parse(body.data(), body.data() + body.size(), &json, &errors) &&
+    json.isObject())
+  {
+    const Json::Value& error = json["error"];
+    if (error.isString())
+      return error.asString();
+    if (error.isObject() && error["message"].isString())
+      return error["message"].asString();
+  }
+
+  if (body.size() <= max_error_quote_size)
+    return body;
+  return body.substr(0, max_error_quote_size) + "...";
+}
+
+
 size_t HTTPModelService::read_func(void* contents, size_t size, size_t nmemb,
   void* userp)
 {
@@ -19,14 +54,41 @@ size_t HTTPModelService::write_func(void* contents, size_t size, size_t nmemb,
   void* userp)
 {
   size_t total_size = size*nmemb;
-  std::string* response = reinterpret_cast<std::string*>(userp);
-  response->append(reinterpret_cast<char*>(contents), total_size);
+  auto* response = reinterpret_cast<response_sink*>(userp);
+  const char* data = reinterpret_cast<const char*>(contents);
+
+  long http_status = 0;
+  curl_easy_getinfo(response->curl, CURLINFO_RESPONSE_CODE, &http_status);
+
+  if (http_status < 200 || http_status >= 400)
+  {
+    size_t room = max_error_body_size - response->error_body.size();
+    response->error_body.append(data, std::min(total_size, room));
+    return total_size;
+  }
+
+  try
+  {
+    response->parser.feed(data, total_size);
+  }
+  catch (...)
+  {
+    // Aborts the transfer, finish_response() throws the error.
+    response->error = std::current_exception();
+    return 0;
+  }
+
   return total_size;
 }
 
 
 HTTPModelService::HTTPModelService():
-  curl(nullptr)
+  curl(nullptr),
+  base64_supported(true),
+  curl_multi(nullptr),
+  max_requests_in_flight(4),
+  requests_in_flight(0),
+  stopping(false)
 {
   curl_global_init(CURL_GLOBAL_ALL);
   curl = curl_easy_init();
@@ -37,6 +99,14 @@ HTTPModelService::HTTPModelService():
     throw std::runtime_error("curl_easy_init() failed");
   }
 
+  curl_multi = curl_multi_init();
+
+  if (!curl_multi)
+  {
+    clean_up();
+    throw std::runtime_error("curl_multi_init() failed");
+  }
+
   curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_func);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);
 }
@@ -48,139 +118,335 @@ HTTPModelService::~HTTPModelService()
 }
 
 
+bool HTTPModelService::base64_rejected(const response_sink& response,
+  CURLcode res) const
+{
+  if (res != CURLE_OK || response.error)
+    return false;
+
+  // Servers validating their requests answer 400 or 422 to an
+  // "encoding_format" they don't know.
+  long http_status;
+  curl_easy_getinfo(response.curl, CURLINFO_RESPONSE_CODE, &http_status);
+  return http_status == 400 || http_status == 422;
+}
+
+
+void
+HTTPModelService::cache_embeddings(const std::vector<TextUnit>& text_units)
+{
+  if (!cache)
+    return;
+
+  cache->put(cache_model_id(), text_units);
+}
+
+
+const std::string& HTTPModelService::cache_model_id() const
+{
+  // Without a model name, the server decides which model is used.
+  return model_name.empty() ? embeddings_api_url : model_name;
+}
+
+
 void HTTPModelService::clean_up() noexcept
 {
+  if (multi_thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(multi_mutex);
+      stopping = true;
+    }
+    curl_multi_wakeup(curl_multi);
+    multi_thread.join();
+  }
+
+  for (CURL* idle_curl : idle_curl_handles)
+    curl_easy_cleanup(idle_curl);
+  idle_curl_handles.clear();
+
+  if (curl_multi)
+  {
+    curl_multi_cleanup(curl_multi);
+    curl_multi = nullptr;
+  }
+
   if (curl)
   {
       curl_easy_cleanup(curl);
+      curl = nullptr;
   }
 
   curl_global_cleanup();
 }
 
 
-Json::Value HTTPModelService::post_json(const Json::Value& json)
+void HTTPModelService::disable_base64()
 {
-  // Convert the payload to string
-  Json::StreamWriterBuilder builder;
-  std::unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
-  std::stringstream post_sstream;
-  writer->write(json, &post_sstream);
+  if (base64_supported.exchange(false))
+  {
+    std::cerr << "The embeddings API rejected base64 embeddings, requesting "
+      "floats\n";
+  }
+}
 
-  // Set up the curl options
-  curl_slist* headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
 
-  if (!api_auth_key.empty())
+Json::Value
+HTTPModelService::embeddings_request(const std::vector<TextUnit>& text_units)
+{
+  // Prepare the JSON payload
+  Json::Value request_data;
+
+  if (!model_name.empty())
   {
-    headers = curl_slist_append(headers, ("Authorization: Bearer " +
-      api_auth_key).c_str());
+    request_data["model"] = model_name;
   }
 
-  std::string response_body;
+  Json::Value input_arr(Json::arrayValue);
 
-  curl_easy_setopt(curl, CURLOPT_POST, 1L);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_READDATA, &post_sstream);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post_sstream.str().size());
+  for (const TextUnit& unit : text_units)
+  {
+    input_arr.append(Json::Value(unit.text()));
+  }
 
-  // Perform the request
-  CURLcode res = curl_easy_perform(curl);
-   // Clean up
-  curl_slist_free_all(headers);
+  request_data["input"] = input_arr;
+
+  // Servers that ignore it answer with floats, which are parsed as well.
+  if (base64_supported)
+    request_data["encoding_format"] = "base64";
+
+  return request_data;
+}
+
+
+void HTTPModelService::finish_response(response_sink& response, CURLcode res)
+{
+  if (response.error)
+    std::rethrow_exception(response.error);
 
   // Check for errors
   if (res != CURLE_OK) {
-    std::string msg("curl_easy_perform() failed: ");
+    std::string msg("HTTP request failed: ");
     msg += curl_easy_strerror(res);
     throw std::runtime_error(msg);
   }
 
   // Check the HTTP status.
   long http_status;
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+  curl_easy_getinfo(response.curl, CURLINFO_RESPONSE_CODE, &http_status);
 
-  // TODO: Re-design this error handling.
   if (http_status < 200 || http_status >= 400)
   {
     std::string msg("Received HTTP status ");
     msg += std::to_string(http_status);
-    std::cerr << msg << "\n";
-    std::cerr << "Response ***\n" << response_body << "\n";
+    std::string error_msg = error_response_message(response.error_body);
+    if (!error_msg.empty())
+    {
+      msg += ": ";
+      msg += error_msg;
+    }
     throw std::runtime_error(msg);
   }
 
-  // Parse the response JSON
-  Json::CharReaderBuilder reader_builder;
-  Json::Value response_json;
-  std::string errs;
+  response.parser.finish();
+}
 
-  std::istringstream response_stream(response_body);
 
-  if (!Json::parseFromStream(reader_builder, response_stream, &response_json,
-    &errs))
+curl_slist* HTTPModelService::http_headers()
+{
+  curl_slist* headers = NULL;
+  headers = curl_slist_append(headers, "Content-Type: application/json");
+
+  if (!api_auth_key.empty())
   {
-    std::string msg("Failed to parse response from API:\n");
-    throw std::runtime_error(msg + errs);
+    headers = curl_slist_append(headers, ("Authorization: Bearer " +
+      api_auth_key).c_str());
   }
 
-  return response_json;
+  return headers;
 }
 
 
-std::vector<float> HTTPModelService::get_embedding(const char* str)
+void HTTPModelService::post_json(const Json::Value& json,
+  std::vector<TextUnit>& text_units)
 {
-  // Prepare the JSON payload
-  Json::Value request_data;
+  // Convert the payload to string
+  Json::StreamWriterBuilder builder;
+  std::unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+  std::stringstream post_sstream;
+  writer->write(json, &post_sstream);
 
-  if (!model_name.empty())
+  // Set up the curl options
+  curl_slist* headers = http_headers();
+
+  response_sink response(curl, text_units);
+
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_READDATA, &post_sstream);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post_sstream.str().size());
+
+  // Perform the request
+  CURLcode res = curl_easy_perform(curl);
+   // Clean up
+  curl_slist_free_all(headers);
+
+  if (json.isMember("encoding_format") && base64_rejected(response, res))
   {
-    request_data["model"] = model_name;
+    // Other errors are answered with the same status, so base64 is given
+    // up only once the request succeeds without it.
+    Json::Value float_json = json;
+    float_json.removeMember("encoding_format");
+    post_json(float_json, text_units);
+    disable_base64();
+    return;
   }
 
-  request_data["input"] = str;
-
-  Json::Value response_json = post_json(request_data);
+  finish_response(response, res);
+}
 
-  Json::Value embeddings = get_json_member_with_type(response_json, "data",
-    Json::ValueType::arrayValue);
-  Json::Value::ArrayIndex embd_c = embeddings.size();
 
-  if (embd_c != 1)
+void HTTPModelService::post_json_async(Json::Value json,
+  std::vector<TextUnit>& text_units, CompletionFunc on_response)
+{
+  Json::StreamWriterBuilder builder;
+  std::unique_ptr<async_request> request(new async_request(text_units));
+  request->post_body = Json::writeString(builder, json);
+  request->json = std::move(json);
+  request->headers = http_headers();
+  request->on_response = on_response;
+
+  std::unique_lock<std::mutex> lock(multi_mutex);
+  request_done.wait(lock, [this] {
+    return requests_in_flight < max_requests_in_flight;
+  });
+
+  if (!idle_curl_handles.empty())
   {
-    std::string msg("The number of embeddings returned was ");
-    msg += std::to_string(embd_c);
-    msg += " for a single string";
-    throw std::runtime_error(msg);
+    request->response.curl = idle_curl_handles.back();
+    idle_curl_handles.pop_back();
+  }
+  else
+  {
+    request->response.curl = curl_easy_init();
+    if (!request->response.curl)
+    {
+      curl_slist_free_all(request->headers);
+      throw std::runtime_error("curl_easy_init() failed");
+    }
   }
 
-  Json::Value embd_obj = embeddings[0];
-  Json::Value embd_arr = get_json_member_with_type(embd_obj, "embedding",
-    Json::ValueType::arrayValue);
+  CURL* req_curl = request->response.curl;
+  curl_easy_setopt(req_curl, CURLOPT_URL, embeddings_api_url.c_str());
+  curl_easy_setopt(req_curl, CURLOPT_HTTPHEADER, request->headers);
+  curl_easy_setopt(req_curl, CURLOPT_POSTFIELDS, request->post_body.c_str());
+  curl_easy_setopt(req_curl, CURLOPT_POSTFIELDSIZE,
+    static_cast<long>(request->post_body.size()));
+  curl_easy_setopt(req_curl, CURLOPT_WRITEFUNCTION, write_func);
+  curl_easy_setopt(req_curl, CURLOPT_WRITEDATA, &request->response);
+  curl_easy_setopt(req_curl, CURLOPT_PRIVATE, request.get());
 
-  std::vector<float> embd_floats;
-  Json::Value::ArrayIndex embd_size = embd_arr.size();
-  embd_floats.reserve(embd_size);
-  for (Json::Value::ArrayIndex float_idx = 0; float_idx < embd_size;
-    float_idx++)
+  requests_submitted.push_back(request.release());
+  requests_in_flight++;
+
+  if (!multi_thread.joinable())
+    multi_thread = std::thread(&HTTPModelService::run_multi, this);
+
+  lock.unlock();
+  curl_multi_wakeup(curl_multi);
+}
+
+
+void HTTPModelService::run_multi() noexcept
+{
+  for (;;)
   {
-    Json::Value float_obj = embd_arr[float_idx];
-    if (!float_obj.isNumeric())
     {
-      throw std::runtime_error("element of \"embedding\" array is not a "
-        "number");
+      std::lock_guard<std::mutex> lock(multi_mutex);
+
+      if (stopping && requests_in_flight == 0)
+        break;
+
+      for (async_request* request : requests_submitted)
+        curl_multi_add_handle(curl_multi, request->response.curl);
+      requests_submitted.clear();
     }
 
-    embd_floats.push_back(float_obj.asFloat());
-  }
+    int running = 0;
+    curl_multi_perform(curl_multi, &running);
+
+    int msgs_left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(curl_multi, &msgs_left))
+    {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      async_request* request = nullptr;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+      CURL* req_curl = request->response.curl;
+      curl_multi_remove_handle(curl_multi, req_curl);
 
-  return embd_floats;
+      if (request->json.isMember("encoding_format") &&
+        base64_rejected(request->response, msg->data.result))
+      {
+        // Sent again on the same handle, still counted in flight.
+        Json::StreamWriterBuilder builder;
+        request->json.removeMember("encoding_format");
+        request->base64_retry = true;
+        request->post_body = Json::writeString(builder, request->json);
+        request->response.error_body.clear();
+        request->response.parser.reset();
+
+        curl_easy_setopt(req_curl, CURLOPT_POSTFIELDS,
+          request->post_body.c_str());
+        curl_easy_setopt(req_curl, CURLOPT_POSTFIELDSIZE,
+          static_cast<long>(request->post_body.size()));
+        curl_multi_add_handle(curl_multi, req_curl);
+        continue;
+      }
+
+      std::exception_ptr error;
+
+      try
+      {
+        finish_response(request->response, msg->data.result);
+        if (request->base64_retry)
+          disable_base64();
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+
+      request->on_response(error);
+
+      curl_slist_free_all(request->headers);
+      // The handle keeps its connection cache for the next request.
+      curl_easy_reset(req_curl);
+
+      {
+        std::lock_guard<std::mutex> lock(multi_mutex);
+        idle_curl_handles.push_back(req_curl);
+        requests_in_flight--;
+      }
+      request_done.notify_all();
+
+      delete request;
+    }
+
+    curl_multi_poll(curl_multi, nullptr, 0, 1000, nullptr);
+  }
 }
 
 
-void HTTPModelService::get_embeddings_and_set(std::vector<TextUnit>& text_units)
+std::vector<float> HTTPModelService::get_embedding(const char* str)
 {
+  std::vector<float> embd_floats;
+
+  if (cache && cache->get(cache_model_id(), str, embd_floats))
+    return embd_floats;
+
   // Prepare the JSON payload
   Json::Value request_data;
 
@@ -189,48 +455,154 @@ void HTTPModelService::get_embeddings_and_set(std::vector<TextUnit>& text_units)
     request_data["model"] = model_name;
   }
 
-  Json::Value input_arr(Json::arrayValue);
+  request_data["input"] = str;
 
-  for (const TextUnit& unit : text_units)
+  if (base64_supported)
+    request_data["encoding_format"] = "base64";
+
+  std::vector<TextUnit> units(1);
+  post_json(request_data, units);
+
+  if (cache)
   {
-    input_arr.append(Json::Value(unit.text()));
+    units[0].text(str);
+    cache->put(cache_model_id(), units);
   }
 
-  request_data["input"] = input_arr;
+  return units[0].embedding().to_vector();
+}
 
-  Json::Value response_json = post_json(request_data);
 
-  Json::Value embeddings = get_json_member_with_type(response_json, "data",
-    Json::ValueType::arrayValue);
+void HTTPModelService::get_embeddings_and_set(std::vector<TextUnit>& text_units)
+{
+  std::vector<size_t> missing = set_cached_embeddings(text_units);
+
+  if (missing.empty())
+    return;
+
+  if (missing.size() == text_units.size())
+  {
+    post_json(embeddings_request(text_units), text_units);
+    cache_embeddings(text_units);
+    return;
+  }
+
+  // Only the texts without a cached embedding are sent.
+  std::vector<TextUnit> missing_units(missing.size());
+  for (size_t idx = 0; idx < missing.size(); idx++)
+    missing_units[idx].text(text_units[missing[idx]].text());
+
+  post_json(embeddings_request(missing_units), missing_units);
+  cache_embeddings(missing_units);
+
+  for (size_t idx = 0; idx < missing.size(); idx++)
+    text_units[missing[idx]].embedding(missing_units[idx].embedding());
+}
+
+
+void HTTPModelService::get_embeddings_and_set_async(
+  std::vector<TextUnit>& text_units, CompletionFunc on_done)
+{
+  std::vector<size_t> missing = set_cached_embeddings(text_units);
+
+  if (missing.empty())
+  {
+    on_done(nullptr);
+    return;
+  }
 
-  Json::Value::ArrayIndex num_embds = embeddings.size();
-  for (Json::Value::ArrayIndex idx = 0; idx < num_embds; idx++)
+  if (missing.size() == text_units.size())
   {
-    Json::Value obj = embeddings[idx];
-    Json::Value embd_arr = get_json_member_with_type(obj, "embedding",
-      Json::ValueType::arrayValue);
-    Json::Value idx_obj = get_json_member_with_type(obj, "index",
-      Json::ValueType::intValue);
+    post_json_async(embeddings_request(text_units), text_units,
+      [this, &text_units, on_done](std::exception_ptr error)
+      {
+        if (!error)
+        {
+          try
+          {
+            cache_embeddings(text_units);
+          }
+          catch (...)
+          {
+            error = std::current_exception();
+          }
+        }
+
+        on_done(error);
+      });
+    return;
+  }
+
+  // Only the texts without a cached embedding are sent.
+  auto missing_units = std::make_shared<std::vector<TextUnit>>(missing.size());
+  for (size_t idx = 0; idx < missing.size(); idx++)
+    (*missing_units)[idx].text(text_units[missing[idx]].text());
 
-    std::vector<float> embd_floats;
-    Json::Value::ArrayIndex embd_size = embd_arr.size();
-    embd_floats.reserve(embd_size);
-    for (Json::Value::ArrayIndex float_idx = 0; float_idx < embd_size;
-      float_idx++)
+  post_json_async(embeddings_request(*missing_units), *missing_units,
+    [this, &text_units, missing, missing_units, on_done](
+      std::exception_ptr error)
     {
-      Json::Value float_obj = embd_arr[float_idx];
-      if (!float_obj.isNumeric())
+      if (!error)
       {
-        throw std::runtime_error("element of \"embedding\" array is not a "
-          "number");
+        try
+        {
+          cache_embeddings(*missing_units);
+
+          for (size_t idx = 0; idx < missing.size(); idx++)
+          {
+            text_units[missing[idx]].embedding(
+              (*missing_units)[idx].embedding());
+          }
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
       }
 
-      embd_floats.push_back(float_obj.asFloat());
-    }
+      on_done(error);
+    });
+}
+
 
-    int src_idx = idx_obj.asInt();
-    text_units.at(src_idx).embedding(embd_floats);
+std::future<void>
+HTTPModelService::get_embeddings_and_set_async(std::vector<TextUnit>& text_units)
+{
+  auto promise = std::make_shared<std::promise<void>>();
+  get_embeddings_and_set_async(text_units, [promise](std::exception_ptr error) {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value();
+  });
+
+  return promise->get_future();
+}
+
+
+std::vector<size_t>
+HTTPModelService::set_cached_embeddings(std::vector<TextUnit>& text_units)
+{
+  std::vector<size_t> missing;
+  missing.reserve(text_units.size());
+  std::vector<float> embedding;
+
+  for (size_t idx = 0; idx < text_units.size(); idx++)
+  {
+    if (cache && cache->get(cache_model_id(), text_units[idx].text(), embedding))
+      text_units[idx].embedding(std::move(embedding));
+    else
+      missing.push_back(idx);
   }
+
+  return missing;
+}
+
+
+void HTTPModelService::set_cache(
+  const std::shared_ptr<EmbeddingCache>& embeddings_cache)
+{
+  cache = embeddings_cache;
 }
 
 
@@ -244,4 +616,18 @@ void HTTPModelService::set_embeddings_api_url(const std::string& url)
 void HTTPModelService::set_model_name(const std::string& name)
 {
   model_name = name;
+}
+
+
+void HTTPModelService::set_max_requests_in_flight(size_t max_requests)
+{
+  std::lock_guard<std::mutex> lock(multi_mutex);
+  max_requests_in_flight = max_requests ? max_requests : 1;
+}
+
+
+void HTTPModelService::wait_for_requests()
+{
+  std::unique_lock<std::mutex> lock(multi_mutex);
+  request_done.wait(lock, [this] { return requests_in_flight == 0; });
 }
\ No newline at end of file
@@ -1,32 +1,139 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <curl/curl.h>
 #include <json/json.h>
 
 #include "common.h"
+#include "EmbeddingCache.h"
+#include "EmbeddingsParser.h"
 
 
 class HTTPModelService
 {
+public:
+
+  // Called with a null exception_ptr when the request succeeded. Runs on the
+  // thread driving the asynchronous requests, or on the calling thread when
+  // every embedding was cached, and must not throw.
+  typedef std::function<void(std::exception_ptr)> CompletionFunc;
+
+private:
+
+  // Destination of a response body, which is parsed as it is received.
+  struct response_sink
+  {
+    CURL* curl;
+    EmbeddingsParser parser;
+    // Body of a response with an error status, shown in the error message.
+    std::string error_body;
+    // Thrown by the parser, which must not throw through libcurl.
+    std::exception_ptr error;
+
+    response_sink(CURL* curl, std::vector<TextUnit>& text_units):
+      curl(curl),
+      parser(text_units)
+    {
+    }
+  };
+
+  struct async_request
+  {
+    curl_slist* headers;
+    // Kept to be sent again without "encoding_format".
+    Json::Value json;
+    std::string post_body;
+    response_sink response;
+    CompletionFunc on_response;
+    // Set when it's sent again without "encoding_format".
+    bool base64_retry;
+
+    async_request(std::vector<TextUnit>& text_units):
+      headers(nullptr),
+      response(nullptr, text_units),
+      base64_retry(false)
+    {
+    }
+  };
+
   std::string api_auth_key;
+  std::shared_ptr<EmbeddingCache> cache;
   CURL* curl;
   std::string embeddings_api_url;
   std::string model_name;
+  // Whether embeddings are requested in base64, until a request the server
+  // rejected in base64 succeeds without it.
+  std::atomic<bool> base64_supported;
+
+  // State of the asynchronous requests, driven by multi_thread.
+  CURLM* curl_multi;
+  std::thread multi_thread;
+  std::mutex multi_mutex;
+  std::condition_variable request_done;
+  std::deque<async_request*> requests_submitted;
+  std::vector<CURL*> idle_curl_handles;
+  size_t max_requests_in_flight;
+  size_t requests_in_flight;
+  bool stopping;
 
   // Callback function to send POST data
   static size_t read_func(void* contents, size_t size, size_t nmemb,
     void* userp);
 
-  // Callback function to handle the response body
+  // Callback function to parse the response body, a response_sink
   static size_t write_func(void* contents, size_t size, size_t nmemb,
     void* userp);
 
+  // Whether the server answered a request for base64 embeddings with an
+  // error status that may mean it doesn't support it, in which case the
+  // request is sent again without "encoding_format".
+  bool base64_rejected(const response_sink& response, CURLcode res) const;
+
+  // Saves the embeddings of the text units in the cache, if there's one.
+  void cache_embeddings(const std::vector<TextUnit>& text_units);
+
+  // Model ID the cached embeddings are saved under.
+  const std::string& cache_model_id() const;
+
   void clean_up() noexcept;
 
-  Json::Value post_json(const Json::Value& json);
+  // Stops requesting base64 embeddings.
+  void disable_base64();
+
+  Json::Value embeddings_request(const std::vector<TextUnit>& text_units);
+
+  curl_slist* http_headers();
+
+  // Checks the result and HTTP status of a finished transfer and that its
+  // response body was parsed completely.
+  static void finish_response(response_sink& response, CURLcode res);
+
+  // Sets the embeddings of the response on text_units. Without base64
+  // support, the request is sent again for floats.
+  void post_json(const Json::Value& json, std::vector<TextUnit>& text_units);
+
+  // Waits until fewer than max_requests_in_flight requests are running, then
+  // hands the request over to multi_thread. The embeddings of the response
+  // are set on text_units before on_response is called.
+  void post_json_async(Json::Value json, std::vector<TextUnit>& text_units,
+    CompletionFunc on_response);
+
+  void run_multi() noexcept;
+
+  // Sets the embeddings found in the cache and returns the indices of the
+  // text units still without one.
+  std::vector<size_t> set_cached_embeddings(std::vector<TextUnit>& text_units);
 
 public:
 
@@ -42,6 +149,21 @@ public:
 
   void get_embeddings_and_set(std::vector<TextUnit>& text_units);
 
+  // Sends the request concurrently with other asynchronous ones through the
+  // same connection pool. text_units must stay alive until on_done is called.
+  void get_embeddings_and_set_async(std::vector<TextUnit>& text_units,
+    CompletionFunc on_done);
+
+  std::future<void>
+  get_embeddings_and_set_async(std::vector<TextUnit>& text_units);
+
+  void set_max_requests_in_flight(size_t max_requests);
+
+  // Waits until every asynchronous request has completed.
+  void wait_for_requests();
+
+  void set_cache(const std::shared_ptr<EmbeddingCache>& embeddings_cache);
+
   void set_embeddings_api_url(const std::string& url);
 
   void set_model_name(const std::string& name);
@@ -0,0 +1,549 @@
+#include "HnswIndex.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+namespace filesystem = std::filesystem;
+
+static const char file_signature[8] = {'E', 'M', 'B', 'D', 'H', 'N', 'S', '1'};
+
+static const size_t header_size = 64;
+
+// Highest level given to a node. Reaching it with m >= 2 takes more nodes
+// than a node ID can address.
+static const uint32_t max_node_level = 31;
+
+// Mutexes shared by the nodes to guard their links.
+static const size_t n_link_mutexes = 4096;
+
+// Offsets in the record of a node.
+static const size_t level_field = 0;
+static const size_t upper_first_field = 1;
+static const size_t inserted_field = 2;
+static const size_t links_field = 3;
+
+
+static uint32_t draw_level(uint32_t m)
+{
+  thread_local std::mt19937 generator(std::random_device{}());
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  // Levels are exponentially distributed, so each level has about 1/m of
+  // the nodes of the level below.
+  double level = -std::log(1.0 - uniform(generator)) / std::log(m);
+  return std::min<double>(level, max_node_level);
+}
+
+
+HnswIndex::HnswIndex(const filesystem::path& file_path, uint32_t m,
+  uint32_t ef_construction):
+  fd(-1),
+  mapping(nullptr),
+  mapping_size(0),
+  link_mutexes(n_link_mutexes)
+{
+  static_assert(sizeof(file_header) <= header_size, "header too large");
+
+  if (!file_path.parent_path().empty())
+    filesystem::create_directories(file_path.parent_path());
+
+  fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open the HNSW index \"");
+    msg += file_path.string();
+    msg += "\"";
+    throw system_error(msg.c_str());
+  }
+
+  try
+  {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+      throw system_error("fstat() on the HNSW index failed");
+
+    size_t file_size = file_stat.st_size;
+
+    if (file_size == 0)
+    {
+      if (m < 2)
+        throw std::runtime_error("The HNSW parameter m must be at least 2");
+
+      file_size = header_size;
+      if (ftruncate(fd, file_size) != 0)
+        throw system_error("Cannot resize the HNSW index");
+      remap(file_size);
+      std::memcpy(header().signature, file_signature, sizeof(file_signature));
+      header().m = m;
+      header().ef_construction = std::max<uint32_t>(ef_construction, m);
+      header().max_level = -1;
+    }
+    else
+    {
+      if (file_size < header_size)
+        throw std::runtime_error("The HNSW index file is truncated");
+
+      remap(file_size);
+
+      if (std::memcmp(header().signature, file_signature,
+        sizeof(file_signature)) != 0)
+      {
+        std::string msg("\"");
+        msg += file_path.string();
+        msg += "\" is not an HNSW index file.";
+        throw std::runtime_error(msg);
+      }
+
+      size_t expected_size = header_size +
+        header().capacity * node_record_size() * sizeof(uint32_t) +
+        header().upper_capacity * upper_block_size() * sizeof(uint32_t);
+      if (expected_size > file_size)
+        throw std::runtime_error("The HNSW index file is truncated");
+    }
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+HnswIndex::~HnswIndex()
+{
+  clean_up();
+}
+
+
+void HnswIndex::allocate(uint64_t node)
+{
+  if (node >= std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Too many embeddings for the HNSW index");
+
+  if (is_allocated(node))
+    return;
+
+  uint32_t level = draw_level(header().m);
+  uint64_t upper_needed = header().upper_used + level;
+
+  if (node >= header().capacity || upper_needed > header().upper_capacity)
+  {
+    grow(std::max<uint64_t>({node + 1, header().capacity * 2, 1024}),
+      std::max<uint64_t>({upper_needed, header().upper_capacity * 2, 64}));
+  }
+
+  uint32_t* record = node_record(node);
+  record[upper_first_field] = header().upper_used;
+  record[level_field] = level + 1;
+  header().upper_used = upper_needed;
+}
+
+
+void HnswIndex::clean_up() noexcept
+{
+  if (mapping)
+  {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+
+HnswIndex::scored_node HnswIndex::descend(const float* query,
+  scored_node start, uint32_t level, const EmbeddingMatrix& matrix,
+  DistanceFunc distance)
+{
+  scored_node nearest = start;
+  std::vector<uint32_t> neighbors;
+  bool moved = true;
+
+  while (moved)
+  {
+    moved = false;
+
+    {
+      std::lock_guard<std::mutex> lock(link_mutex(nearest.second));
+      const uint32_t* node_links = links(nearest.second, level);
+      neighbors.assign(node_links + 1, node_links + 1 + node_links[0]);
+    }
+
+    for (uint32_t neighbor : neighbors)
+    {
+      float d = distance(query, matrix.row(neighbor), matrix.dimension());
+      if (d < nearest.first)
+      {
+        nearest = scored_node(d, neighbor);
+        moved = true;
+      }
+    }
+  }
+
+  return nearest;
+}
+
+
+void HnswIndex::grow(uint64_t capacity, uint64_t upper_capacity)
+{
+  size_t record_bytes = node_record_size() * sizeof(uint32_t);
+  size_t block_bytes = upper_block_size() * sizeof(uint32_t);
+  size_t old_upper_offset = header_size + header().capacity * record_bytes;
+  size_t old_upper_bytes = header().upper_capacity * block_bytes;
+  size_t new_upper_offset = header_size + capacity * record_bytes;
+  size_t new_size = new_upper_offset + upper_capacity * block_bytes;
+
+  if (ftruncate(fd, new_size) != 0)
+    throw system_error("Cannot resize the HNSW index");
+  remap(new_size);
+
+  // The upper-level blocks follow the node records, so they move up when
+  // there is room for more nodes.
+  if (new_upper_offset != old_upper_offset)
+  {
+    std::memmove(mapping + new_upper_offset, mapping + old_upper_offset,
+      old_upper_bytes);
+    std::memset(mapping + old_upper_offset, 0,
+      std::min(new_upper_offset - old_upper_offset, old_upper_bytes));
+  }
+
+  header().capacity = capacity;
+  header().upper_capacity = upper_capacity;
+}
+
+
+void HnswIndex::insert(uint32_t node, const EmbeddingMatrix& matrix,
+  DistanceFunc distance)
+{
+  uint32_t* record = node_record(node);
+  uint32_t level = record[level_field] - 1;
+  uint32_t m = header().m;
+  const float* query = matrix.row(node);
+  uint32_t dimension = matrix.dimension();
+
+  {
+    std::lock_guard<std::mutex> lock(link_mutex(node));
+    for (uint32_t l = 0; l <= level; l++)
+      links(node, l)[0] = 0;
+  }
+
+  // Kept for the whole insertion by a node that becomes the entry point.
+  std::unique_lock<std::mutex> entry_lock(entry_mutex);
+  int32_t max_level = header().max_level;
+
+  if (max_level < 0)
+  {
+    header().entry_point = node;
+    header().max_level = level;
+    record[inserted_field] = 1;
+    return;
+  }
+
+  uint32_t entry_point = header().entry_point;
+  if (static_cast<int32_t>(level) <= max_level)
+    entry_lock.unlock();
+
+  scored_node nearest(distance(query, matrix.row(entry_point), dimension),
+    entry_point);
+
+  for (int32_t l = max_level; l > static_cast<int32_t>(level); l--)
+    nearest = descend(query, nearest, l, matrix, distance);
+
+  for (int32_t l = std::min<int32_t>(level, max_level); l >= 0; l--)
+  {
+    std::vector<scored_node> candidates = search_level(query, nearest,
+      header().ef_construction, l, matrix, distance,
+      [node](uint32_t candidate) { return candidate != node; });
+
+    if (candidates.empty())
+      continue;
+
+    std::vector<uint32_t> neighbors = select_neighbors(candidates, m, matrix,
+      distance);
+    set_links(node, l, neighbors);
+
+    size_t max_links = l == 0 ? 2 * m : m;
+    for (uint32_t neighbor : neighbors)
+    {
+      std::lock_guard<std::mutex> lock(link_mutex(neighbor));
+      uint32_t* neighbor_links = links(neighbor, l);
+      uint32_t count = neighbor_links[0];
+
+      if (std::find(neighbor_links + 1, neighbor_links + 1 + count, node) !=
+        neighbor_links + 1 + count)
+      {
+        continue;
+      }
+
+      if (count < max_links)
+      {
+        neighbor_links[1 + count] = node;
+        neighbor_links[0] = count + 1;
+        continue;
+      }
+
+      // The neighbor has no room left: its links are chosen again among
+      // the current ones and the new node.
+      const float* neighbor_row = matrix.row(neighbor);
+      std::vector<scored_node> neighbor_candidates;
+      neighbor_candidates.reserve(count + 1);
+      for (uint32_t idx = 1; idx <= count; idx++)
+      {
+        neighbor_candidates.emplace_back(distance(neighbor_row,
+          matrix.row(neighbor_links[idx]), dimension), neighbor_links[idx]);
+      }
+      neighbor_candidates.emplace_back(distance(neighbor_row, query,
+        dimension), node);
+      std::sort(neighbor_candidates.begin(), neighbor_candidates.end());
+
+      std::vector<uint32_t> kept = select_neighbors(neighbor_candidates,
+        max_links, matrix, distance);
+      std::copy(kept.begin(), kept.end(), neighbor_links + 1);
+      neighbor_links[0] = kept.size();
+    }
+
+    nearest = candidates.front();
+  }
+
+  if (static_cast<int32_t>(level) > max_level)
+  {
+    header().entry_point = node;
+    header().max_level = level;
+  }
+
+  record[inserted_field] = 1;
+}
+
+
+bool HnswIndex::is_allocated(uint64_t node) const
+{
+  return node < header().capacity && node_record(node)[level_field] != 0;
+}
+
+
+bool HnswIndex::is_inserted(uint64_t node) const
+{
+  return node < header().capacity && node_record(node)[inserted_field] != 0;
+}
+
+
+uint32_t* HnswIndex::links(uint32_t node, uint32_t level) const
+{
+  uint32_t* record = node_record(node);
+  if (level == 0)
+    return record + links_field;
+
+  size_t block = record[upper_first_field] + level - 1;
+  char* upper_area = mapping + header_size +
+    header().capacity * node_record_size() * sizeof(uint32_t);
+  return reinterpret_cast<uint32_t*>(upper_area) + block * upper_block_size();
+}
+
+
+uint32_t* HnswIndex::node_record(uint32_t node) const
+{
+  return reinterpret_cast<uint32_t*>(mapping + header_size) +
+    static_cast<size_t>(node) * node_record_size();
+}
+
+
+size_t HnswIndex::node_record_size() const
+{
+  return links_field + 1 + 2 * header().m;
+}
+
+
+void HnswIndex::remap(size_t size)
+{
+  void* new_mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+    fd, 0);
+  if (new_mapping == MAP_FAILED)
+    throw system_error("mmap() of the HNSW index failed");
+
+  if (mapping)
+    munmap(mapping, mapping_size);
+
+  mapping = static_cast<char*>(new_mapping);
+  mapping_size = size;
+}
+
+
+std::vector<std::pair<float, uint32_t>> HnswIndex::search(
+  const float* query, size_t k, size_t ef, const EmbeddingMatrix& matrix,
+  DistanceFunc distance, const std::function<bool(uint32_t)>& accept)
+{
+  int32_t max_level;
+  uint32_t entry_point;
+  {
+    std::lock_guard<std::mutex> lock(entry_mutex);
+    max_level = header().max_level;
+    entry_point = header().entry_point;
+  }
+
+  if (max_level < 0)
+    return std::vector<scored_node>();
+
+  scored_node nearest(distance(query, matrix.row(entry_point),
+    matrix.dimension()), entry_point);
+
+  for (int32_t l = max_level; l > 0; l--)
+    nearest = descend(query, nearest, l, matrix, distance);
+
+  std::vector<scored_node> results = search_level(query, nearest,
+    std::max(ef, k), 0, matrix, distance, accept);
+  if (results.size() > k)
+    results.resize(k);
+
+  return results;
+}
+
+
+std::vector<HnswIndex::scored_node> HnswIndex::search_level(
+  const float* query, scored_node entry, size_t ef, uint32_t level,
+  const EmbeddingMatrix& matrix, DistanceFunc distance,
+  const std::function<bool(uint32_t)>& accept)
+{
+  // Visited nodes are marked with the number of the search, so the marks
+  // need no clearing between searches.
+  thread_local std::vector<uint32_t> visited;
+  thread_local uint32_t search_mark = 0;
+
+  if (visited.size() < header().capacity)
+    visited.resize(header().capacity, 0);
+
+  if (++search_mark == 0)
+  {
+    std::fill(visited.begin(), visited.end(), 0);
+    search_mark = 1;
+  }
+
+  // Nearest candidate on top of candidates, farthest result on top of
+  // results.
+  std::priority_queue<scored_node, std::vector<scored_node>,
+    std::greater<scored_node>> candidates;
+  std::priority_queue<scored_node> results;
+
+  visited[entry.second] = search_mark;
+  candidates.push(entry);
+  if (!accept || accept(entry.second))
+    results.push(entry);
+
+  std::vector<uint32_t> neighbors;
+  while (!candidates.empty())
+  {
+    scored_node candidate = candidates.top();
+    if (results.size() >= ef && candidate.first > results.top().first)
+      break;
+    candidates.pop();
+
+    {
+      std::lock_guard<std::mutex> lock(link_mutex(candidate.second));
+      const uint32_t* node_links = links(candidate.second, level);
+      neighbors.assign(node_links + 1, node_links + 1 + node_links[0]);
+    }
+
+    for (uint32_t neighbor : neighbors)
+    {
+      if (visited[neighbor] == search_mark)
+        continue;
+      visited[neighbor] = search_mark;
+
+      float d = distance(query, matrix.row(neighbor), matrix.dimension());
+      if (results.size() < ef || d < results.top().first)
+      {
+        // Rejected nodes still lead the search to the accepted ones.
+        candidates.emplace(d, neighbor);
+        if (!accept || accept(neighbor))
+        {
+          results.emplace(d, neighbor);
+          if (results.size() > ef)
+            results.pop();
+        }
+      }
+    }
+  }
+
+  std::vector<scored_node> nearest(results.size());
+  for (size_t idx = nearest.size(); idx > 0; idx--)
+  {
+    nearest[idx - 1] = results.top();
+    results.pop();
+  }
+
+  return nearest;
+}
+
+
+std::vector<uint32_t> HnswIndex::select_neighbors(
+  const std::vector<scored_node>& candidates, size_t max_neighbors,
+  const EmbeddingMatrix& matrix, DistanceFunc distance)
+{
+  std::vector<uint32_t> selected;
+  selected.reserve(max_neighbors);
+
+  for (const scored_node& candidate : candidates)
+  {
+    if (selected.size() >= max_neighbors)
+      break;
+
+    const float* candidate_row = matrix.row(candidate.second);
+    bool keep = true;
+    for (uint32_t kept : selected)
+    {
+      if (distance(candidate_row, matrix.row(kept), matrix.dimension()) <
+        candidate.first)
+      {
+        keep = false;
+        break;
+      }
+    }
+
+    if (keep)
+      selected.push_back(candidate.second);
+  }
+
+  return selected;
+}
+
+
+void HnswIndex::set_links(uint32_t node, uint32_t level,
+  const std::vector<uint32_t>& neighbors)
+{
+  std::lock_guard<std::mutex> lock(link_mutex(node));
+  uint32_t* node_links = links(node, level);
+  std::copy(neighbors.begin(), neighbors.end(), node_links + 1);
+  node_links[0] = neighbors.size();
+}
+
+
+void HnswIndex::sync()
+{
+  if (msync(mapping, mapping_size, MS_SYNC) != 0)
+    throw system_error("msync() of the HNSW index failed");
+}
+
+
+size_t HnswIndex::upper_block_size() const
+{
+  return 1 + header().m;
+}
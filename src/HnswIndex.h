@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "EmbeddingMatrix.h"
+#include "VectorKernels.h"
+
+
+/*
+Hierarchical navigable small world graph over the rows of an
+EmbeddingMatrix, kept in a single memory-mapped file. Node n of the graph is
+row n of the matrix.
+
+Nodes are allocated one at a time by a single thread, then inserted by any
+number of threads at once, concurrently with searches. The links of each
+node are guarded by one of a fixed set of mutexes.
+*/
+class HnswIndex
+{
+  struct file_header
+  {
+    char signature[8];
+    // Links per node on the upper levels. Level 0 has twice as many.
+    uint32_t m;
+    uint32_t ef_construction;
+    uint64_t capacity;
+    uint64_t upper_capacity;
+    uint64_t upper_used;
+    uint32_t entry_point;
+    // -1 while the graph is empty.
+    int32_t max_level;
+  };
+
+  typedef std::pair<float, uint32_t> scored_node;
+
+  int fd;
+  char* mapping;
+  size_t mapping_size;
+  // Guards the entry point and the maximum level.
+  std::mutex entry_mutex;
+  std::vector<std::mutex> link_mutexes;
+
+  void clean_up() noexcept;
+
+  // Greedy search for the node nearest to query on a level.
+  scored_node descend(const float* query, scored_node start, uint32_t level,
+    const EmbeddingMatrix& matrix, DistanceFunc distance);
+
+  // Grows the file so it can hold capacity nodes and upper_capacity blocks
+  // of upper-level links.
+  void grow(uint64_t capacity, uint64_t upper_capacity);
+
+  file_header& header()
+  {
+    return *reinterpret_cast<file_header*>(mapping);
+  }
+
+  const file_header& header() const
+  {
+    return *reinterpret_cast<const file_header*>(mapping);
+  }
+
+  // Count of links on level, followed by the links.
+  uint32_t* links(uint32_t node, uint32_t level) const;
+
+  std::mutex& link_mutex(uint32_t node)
+  {
+    return link_mutexes[node % link_mutexes.size()];
+  }
+
+  // Per-node fields: level + 1 (0 while not allocated), first upper-level
+  // block and whether the node was inserted.
+  uint32_t* node_record(uint32_t node) const;
+
+  // Level 0 record size and upper-level block size, in uint32_t units.
+  size_t node_record_size() const;
+
+  size_t upper_block_size() const;
+
+  void remap(size_t size);
+
+  std::vector<scored_node> search_level(const float* query, scored_node entry,
+    size_t ef, uint32_t level, const EmbeddingMatrix& matrix,
+    DistanceFunc distance, const std::function<bool(uint32_t)>& accept);
+
+  // Neighbors kept among candidates, nearest first: a candidate is dropped
+  // when it's nearer to a kept neighbor than to the base node.
+  std::vector<uint32_t> select_neighbors(
+    const std::vector<scored_node>& candidates, size_t max_neighbors,
+    const EmbeddingMatrix& matrix, DistanceFunc distance);
+
+  void set_links(uint32_t node, uint32_t level,
+    const std::vector<uint32_t>& neighbors);
+
+public:
+
+  // m and ef_construction apply only when the file is created.
+  HnswIndex(const std::filesystem::path& file_path, uint32_t m,
+    uint32_t ef_construction);
+
+  HnswIndex(const HnswIndex&) = delete;
+
+  HnswIndex& operator=(const HnswIndex&) = delete;
+
+  virtual ~HnswIndex();
+
+  // Gives node a random level and room for its links. Not thread-safe.
+  void allocate(uint64_t node);
+
+  // Links an allocated node into the graph, or relinks one whose insertion
+  // was cut short.
+  void insert(uint32_t node, const EmbeddingMatrix& matrix,
+    DistanceFunc distance);
+
+  bool is_allocated(uint64_t node) const;
+
+  bool is_inserted(uint64_t node) const;
+
+  // Nearest nodes to query for which accept returns true, nearest first,
+  // as (kernel distance, node) pairs. ef is the size of the candidate list
+  // on level 0, which trades speed for recall.
+  std::vector<std::pair<float, uint32_t>> search(const float* query,
+    size_t k, size_t ef, const EmbeddingMatrix& matrix, DistanceFunc distance,
+    const std::function<bool(uint32_t)>& accept);
+
+  // Writes the mapped pages to disk.
+  void sync();
+};
@@ -0,0 +1,187 @@
+#include "HnswVectorDb.h"
+
+#include <exception>
+#include <mutex>
+
+
+namespace filesystem = std::filesystem;
+
+// Nearest rows kept per query out of the efSearch candidates of the graph.
+static const size_t n_results = 20;
+
+
+HnswVectorDb::HnswVectorDb(const filesystem::path& directory, Metric metric,
+  uint32_t m, uint32_t ef_construction, size_t ef_search):
+  LocalVectorDb(directory, metric),
+  default_ef_search(ef_search),
+  index(directory / "index.hnsw", m, ef_construction)
+{
+}
+
+
+std::pair<uint64_t, uint64_t>
+HnswVectorDb::append_records(const std::vector<FileRecord*>& to_save,
+  std::exception_ptr& error)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+
+  uint64_t first_row = matrix.rows();
+
+  for (FileRecord* record : to_save)
+  {
+    try
+    {
+      append_record(*record);
+    }
+    catch (...)
+    {
+      // The records saved before still get linked.
+      error = std::current_exception();
+      break;
+    }
+  }
+
+  uint64_t end_row = matrix.rows();
+  for (uint64_t row = first_row; row < end_row; row++)
+    index.allocate(row);
+
+  return {first_row, end_row};
+}
+
+
+void HnswVectorDb::link_rows(std::pair<uint64_t, uint64_t> rows)
+{
+  // Other threads may be linking their own rows or searching meanwhile.
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  for (uint64_t row = rows.first; row < rows.second; row++)
+    index.insert(row, matrix, distance);
+}
+
+
+std::shared_ptr<HnswVectorDb>
+HnswVectorDb::open_from_settings(const Json::Value& hnsw_settings)
+{
+  Json::Value value = get_json_member_with_type(hnsw_settings, "directory",
+    Json::ValueType::stringValue);
+  filesystem::path directory = value.asString();
+
+  Metric metric = Metric::l2;
+  value = get_json_member_with_type(hnsw_settings, "metric",
+    Json::ValueType::stringValue, false);
+  if (value)
+    metric = parse_metric(value.asString());
+
+  size_t m = get_positive_setting(hnsw_settings, "m", 16);
+  size_t ef_construction = get_positive_setting(hnsw_settings,
+    "efConstruction", 200);
+  size_t ef_search = get_positive_setting(hnsw_settings, "efSearch", 64);
+
+  return std::make_shared<HnswVectorDb>(directory, metric, m,
+    ef_construction, ef_search);
+}
+
+
+void HnswVectorDb::save_file_part(std::vector<TextUnit>& text_units,
+  FileParts& parts)
+{
+  std::pair<uint64_t, uint64_t> rows;
+
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    rows.first = matrix.rows();
+    append_part(text_units, parts);
+    rows.second = matrix.rows();
+    for (uint64_t row = rows.first; row < rows.second; row++)
+      index.allocate(row);
+  }
+
+  link_rows(rows);
+}
+
+
+void HnswVectorDb::save_file_record_with_text_units(FileRecord& record)
+{
+  std::exception_ptr error;
+  link_rows(append_records({&record}, error));
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+
+void
+HnswVectorDb::save_file_records_with_text_units(std::vector<FileRecord>& records)
+{
+  std::vector<FileRecord*> to_save;
+  to_save.reserve(records.size());
+  for (FileRecord& record : records)
+    to_save.push_back(&record);
+
+  std::exception_ptr error;
+  link_rows(append_records(to_save, error));
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+
+std::vector<TextUnitResult>
+HnswVectorDb::search(const std::vector<float>& embedding)
+{
+  return search_with_ef(embedding, default_ef_search);
+}
+
+
+std::vector<TextUnitResult>
+HnswVectorDb::search_with_ef(const std::vector<float>& embedding,
+  size_t ef_search)
+{
+  if (ef_search == 0)
+    ef_search = default_ef_search;
+
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  std::vector<TextUnitResult> results;
+  if (matrix.rows() == 0)
+    return results;
+
+  check_query_dimension(embedding);
+
+  // Rows of removed records stay in the graph to route searches.
+  std::vector<std::pair<float, uint32_t>> nearest = index.search(
+    embedding.data(), n_results, ef_search, matrix, distance,
+    [this](uint32_t row) { return records.is_live(row); });
+
+  results.reserve(nearest.size());
+  for (const std::pair<float, uint32_t>& scored : nearest)
+  {
+    results.push_back(records.result(scored.second,
+      kernel_to_reported_distance(metric, scored.first)));
+  }
+
+  return results;
+}
+
+
+void HnswVectorDb::set_database_up()
+{
+  std::vector<uint64_t> unlinked;
+
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    drop_half_saved();
+
+    for (uint64_t row = 0; row < matrix.rows(); row++)
+    {
+      if (!index.is_inserted(row) && records.is_live(row))
+      {
+        index.allocate(row);
+        unlinked.push_back(row);
+      }
+    }
+  }
+
+  for (uint64_t row : unlinked)
+    link_rows({row, row + 1});
+}
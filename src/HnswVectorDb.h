@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "HnswIndex.h"
+#include "LocalVectorDb.h"
+
+
+/*
+Database kept in a directory by the process itself, like FlatVectorDb, but
+searched through an HNSW graph, so results are approximate and found in far
+fewer distance computations. Safe to share between threads: several threads
+can save at once, and the graph linking of their text units runs
+concurrently with searches.
+*/
+class HnswVectorDb: public LocalVectorDb
+{
+  size_t default_ef_search;
+  // Changed with the mutex held shared, as rows are linked into the graph
+  // while other threads search it.
+  HnswIndex index;
+
+  // Appends the rows and records of to_save, stopping at the first error,
+  // which is stored in error. Returns the first row and the end of the rows
+  // to be linked.
+  std::pair<uint64_t, uint64_t>
+  append_records(const std::vector<FileRecord*>& to_save,
+    std::exception_ptr& error);
+
+  void link_rows(std::pair<uint64_t, uint64_t> rows);
+
+public:
+
+  HnswVectorDb(const std::filesystem::path& directory, Metric metric,
+    uint32_t m, uint32_t ef_construction, size_t ef_search);
+
+  // Opens the database described by the "hnswIndex" settings: "directory",
+  // "metric" ("l2" or "innerProduct"), "m" and "efConstruction", which only
+  // apply when the index is created, and "efSearch".
+  static std::shared_ptr<HnswVectorDb>
+  open_from_settings(const Json::Value& hnsw_settings);
+
+  // The units are linked into the graph as they come, and found once their
+  // record is saved.
+  virtual void save_file_part(std::vector<TextUnit>& text_units,
+    FileParts& parts) override;
+
+  virtual void
+  save_file_record_with_text_units(FileRecord& record) override;
+
+  virtual void
+  save_file_records_with_text_units(std::vector<FileRecord>& records) override;
+
+  virtual std::vector<TextUnitResult>
+  search(const std::vector<float>& embedding) override;
+
+  // The candidate list is on the bottom level of the graph: larger values
+  // find more of the true nearest neighbors, more slowly.
+  virtual std::vector<TextUnitResult>
+  search_with_ef(const std::vector<float>& embedding,
+    size_t ef_search) override;
+
+  // Drops what a crash left half saved and links the rows it left out of
+  // the graph. Can be called more than once.
+  virtual void set_database_up() override;
+};
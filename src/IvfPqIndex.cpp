@@ -0,0 +1,551 @@
+#include "IvfPqIndex.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+namespace filesystem = std::filesystem;
+
+typedef std::pair<float, uint32_t> scored_id;
+
+static const char file_signature[8] = {'E', 'M', 'B', 'D', 'I', 'V', 'F', '1'};
+
+// Codewords per subvector, so a code byte picks one.
+static const size_t n_codewords = 256;
+
+static const size_t max_kmeans_iterations = 25;
+
+// Points assigned by each k-means thread, at least.
+static const size_t min_points_per_thread = 1024;
+
+
+static void write_all(int fd, const std::vector<uint8_t>& buffer)
+{
+  const uint8_t* data = buffer.data();
+  size_t left = buffer.size();
+
+  while (left > 0)
+  {
+    ssize_t written = write(fd, data, left);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw system_error("Cannot write to the IVF-PQ codes file");
+    }
+    data += written;
+    left -= written;
+  }
+}
+
+
+/*
+Lloyd's k-means over n points of dim floats stored one after the other.
+Returns k centroids of dim floats.
+*/
+static std::vector<float> train_kmeans(const float* points, size_t n,
+  size_t dim, size_t k, DistanceFunc l2_distance)
+{
+  std::mt19937 generator(n);
+
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), generator);
+
+  std::vector<float> centroids(k * dim);
+  for (size_t c = 0; c < k; c++)
+  {
+    std::copy(points + order[c] * dim, points + (order[c] + 1) * dim,
+      centroids.begin() + c * dim);
+  }
+
+  std::vector<uint32_t> assignment(n, 0);
+  size_t n_threads = std::min<size_t>(
+    std::max(1u, std::thread::hardware_concurrency()),
+    std::max<size_t>(n / min_points_per_thread, 1));
+
+  for (size_t iteration = 0; iteration < max_kmeans_iterations; iteration++)
+  {
+    std::vector<size_t> changed(n_threads, 0);
+
+    auto assign_part = [&](size_t part) {
+      for (size_t idx = n * part / n_threads; idx < n * (part + 1) / n_threads;
+        idx++)
+      {
+        const float* point = points + idx * dim;
+        uint32_t best = 0;
+        float best_distance = l2_distance(point, centroids.data(), dim);
+        for (size_t c = 1; c < k; c++)
+        {
+          float d = l2_distance(point, centroids.data() + c * dim, dim);
+          if (d < best_distance)
+          {
+            best = c;
+            best_distance = d;
+          }
+        }
+
+        if (assignment[idx] != best || iteration == 0)
+        {
+          assignment[idx] = best;
+          changed[part]++;
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < n_threads; part++)
+      threads.emplace_back(assign_part, part);
+    assign_part(0);
+    for (std::thread& thread : threads)
+      thread.join();
+
+    if (std::accumulate(changed.begin(), changed.end(), size_t(0)) == 0)
+      break;
+
+    std::vector<double> sums(k * dim, 0);
+    std::vector<size_t> counts(k, 0);
+    for (size_t idx = 0; idx < n; idx++)
+    {
+      const float* point = points + idx * dim;
+      double* sum = sums.data() + assignment[idx] * dim;
+      for (size_t d = 0; d < dim; d++)
+        sum[d] += point[d];
+      counts[assignment[idx]]++;
+    }
+
+    for (size_t c = 0; c < k; c++)
+    {
+      float* centroid = centroids.data() + c * dim;
+
+      // An empty cluster restarts from a random point.
+      if (counts[c] == 0)
+      {
+        const float* point = points + generator() % n * dim;
+        std::copy(point, point + dim, centroid);
+        continue;
+      }
+
+      for (size_t d = 0; d < dim; d++)
+        centroid[d] = sums[c * dim + d] / counts[c];
+    }
+  }
+
+  return centroids;
+}
+
+
+IvfPqIndex::IvfPqIndex(const filesystem::path& directory, Metric metric):
+  model_path(directory / "ivfpq.model"),
+  metric(metric),
+  l2_distance(get_distance_func(Metric::l2)),
+  distance(get_distance_func(metric)),
+  adc_distance(get_adc_func()),
+  codes_fd(-1),
+  dimension(0),
+  code_size(0),
+  encoded(0)
+{
+  filesystem::create_directories(directory);
+
+  try
+  {
+    if (filesystem::exists(model_path))
+      load_model();
+
+    filesystem::path codes_path = directory / "ivfpq.codes";
+    load_codes(codes_path);
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+IvfPqIndex::~IvfPqIndex()
+{
+  clean_up();
+}
+
+
+void IvfPqIndex::add(uint32_t id, const float* vector)
+{
+  if (id != encoded)
+    throw std::logic_error("IVF-PQ IDs must be added in order");
+
+  uint32_t list = nearest_centroid(vector);
+
+  std::vector<uint8_t> record(2 * sizeof(uint32_t) + code_size);
+  std::memcpy(record.data(), &id, sizeof(id));
+  std::memcpy(record.data() + sizeof(id), &list, sizeof(list));
+  encode(vector, list, record.data() + 2 * sizeof(uint32_t));
+  write_all(codes_fd, record);
+
+  lists[list].ids.push_back(id);
+  lists[list].codes.insert(lists[list].codes.end(),
+    record.begin() + 2 * sizeof(uint32_t), record.end());
+  encoded++;
+}
+
+
+void IvfPqIndex::clean_up() noexcept
+{
+  if (codes_fd >= 0)
+  {
+    close(codes_fd);
+    codes_fd = -1;
+  }
+}
+
+
+void IvfPqIndex::encode(const float* vector, uint32_t list,
+  uint8_t* code) const
+{
+  size_t sub_size = subvector_size();
+  const float* centroid = centroids.data() + list * dimension;
+
+  std::vector<float> residual(dimension);
+  for (size_t d = 0; d < dimension; d++)
+    residual[d] = vector[d] - centroid[d];
+
+  for (size_t sub = 0; sub < code_size; sub++)
+  {
+    const float* subvector = residual.data() + sub * sub_size;
+    const float* codebook = codebooks.data() + sub * n_codewords * sub_size;
+
+    uint8_t best = 0;
+    float best_distance = l2_distance(subvector, codebook, sub_size);
+    for (size_t codeword = 1; codeword < n_codewords; codeword++)
+    {
+      float d = l2_distance(subvector, codebook + codeword * sub_size,
+        sub_size);
+      if (d < best_distance)
+      {
+        best = codeword;
+        best_distance = d;
+      }
+    }
+
+    code[sub] = best;
+  }
+}
+
+
+void IvfPqIndex::load_codes(const filesystem::path& file_path)
+{
+  uint64_t complete_size = 0;
+
+  if (trained())
+  {
+    std::ifstream file(file_path, std::ios::binary);
+    std::vector<uint8_t> code(code_size);
+    uint32_t id;
+    uint32_t list;
+
+    while (file.read(reinterpret_cast<char*>(&id), sizeof(id)) &&
+      file.read(reinterpret_cast<char*>(&list), sizeof(list)) &&
+      file.read(reinterpret_cast<char*>(code.data()), code_size))
+    {
+      if (id != encoded || list >= lists.size())
+        throw std::runtime_error("The IVF-PQ codes file is corrupt");
+
+      lists[list].ids.push_back(id);
+      lists[list].codes.insert(lists[list].codes.end(), code.begin(),
+        code.end());
+      encoded++;
+      complete_size = file.tellg();
+    }
+  }
+
+  codes_fd = open(file_path.c_str(),
+    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (codes_fd < 0)
+  {
+    std::string msg("Cannot open \"");
+    msg += file_path.string();
+    msg += "\"";
+    throw system_error(msg.c_str());
+  }
+
+  // Drops a code cut short by a crash, or codes left without a model.
+  if (ftruncate(codes_fd, complete_size) != 0)
+    throw system_error("Cannot truncate the IVF-PQ codes file");
+}
+
+
+void IvfPqIndex::load_model()
+{
+  std::ifstream file(model_path, std::ios::binary);
+  char signature[sizeof(file_signature)];
+  uint32_t n_lists;
+
+  if (!file.read(signature, sizeof(signature)) ||
+    std::memcmp(signature, file_signature, sizeof(file_signature)) != 0 ||
+    !file.read(reinterpret_cast<char*>(&dimension), sizeof(dimension)) ||
+    !file.read(reinterpret_cast<char*>(&n_lists), sizeof(n_lists)) ||
+    !file.read(reinterpret_cast<char*>(&code_size), sizeof(code_size)) ||
+    dimension == 0 || n_lists == 0 || code_size == 0 ||
+    dimension % code_size != 0)
+  {
+    std::string msg("\"");
+    msg += model_path.string();
+    msg += "\" is not an IVF-PQ model file.";
+    throw std::runtime_error(msg);
+  }
+
+  std::vector<float> model_centroids(n_lists * dimension);
+  std::vector<float> model_codebooks(n_codewords * dimension);
+  if (!file.read(reinterpret_cast<char*>(model_centroids.data()),
+      model_centroids.size() * sizeof(float)) ||
+    !file.read(reinterpret_cast<char*>(model_codebooks.data()),
+      model_codebooks.size() * sizeof(float)))
+  {
+    throw std::runtime_error("The IVF-PQ model file is truncated");
+  }
+
+  centroids = std::move(model_centroids);
+  codebooks = std::move(model_codebooks);
+  lists.assign(n_lists, inverted_list());
+}
+
+
+uint32_t IvfPqIndex::nearest_centroid(const float* vector,
+  const std::vector<float>& centroids, uint32_t dimension) const
+{
+  // Ranked with the metric of the index, as search() ranks the lists to
+  // probe, so a vector lands in a list its nearest queries probe.
+  uint32_t best = 0;
+  float best_distance = distance(vector, centroids.data(), dimension);
+  uint32_t n_lists = centroids.size() / dimension;
+
+  for (uint32_t list = 1; list < n_lists; list++)
+  {
+    float d = distance(vector, centroids.data() + list * dimension,
+      dimension);
+    if (d < best_distance)
+    {
+      best = list;
+      best_distance = d;
+    }
+  }
+
+  return best;
+}
+
+
+void IvfPqIndex::save_model() const
+{
+  // Written aside and renamed, so a crash never leaves half a model.
+  filesystem::path tmp_path = model_path;
+  tmp_path += ".tmp";
+
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    uint32_t n_lists = lists.size();
+    file.write(file_signature, sizeof(file_signature));
+    file.write(reinterpret_cast<const char*>(&dimension), sizeof(dimension));
+    file.write(reinterpret_cast<const char*>(&n_lists), sizeof(n_lists));
+    file.write(reinterpret_cast<const char*>(&code_size), sizeof(code_size));
+    file.write(reinterpret_cast<const char*>(centroids.data()),
+      centroids.size() * sizeof(float));
+    file.write(reinterpret_cast<const char*>(codebooks.data()),
+      codebooks.size() * sizeof(float));
+
+    if (!file.flush())
+      throw std::runtime_error("Cannot write the IVF-PQ model file");
+  }
+
+  filesystem::rename(tmp_path, model_path);
+}
+
+
+std::vector<std::pair<float, uint32_t>> IvfPqIndex::search(
+  const float* query, size_t probes, size_t n_candidates,
+  const std::function<bool(uint32_t)>& accept) const
+{
+  size_t sub_size = subvector_size();
+
+  std::vector<scored_id> nearest_lists(lists.size());
+  for (uint32_t list = 0; list < lists.size(); list++)
+  {
+    nearest_lists[list] = scored_id(distance(query,
+      centroids.data() + list * dimension, dimension), list);
+  }
+
+  probes = std::min(probes, nearest_lists.size());
+  std::partial_sort(nearest_lists.begin(), nearest_lists.begin() + probes,
+    nearest_lists.end());
+
+  // Distances from each subvector of the query, or of its residual for L2,
+  // to each codeword.
+  std::vector<float> lut(code_size * n_codewords);
+  std::vector<float> residual(dimension);
+
+  auto fill_lut = [&](const float* vector) {
+    for (size_t sub = 0; sub < code_size; sub++)
+    {
+      const float* codebook = codebooks.data() + sub * n_codewords * sub_size;
+      for (size_t codeword = 0; codeword < n_codewords; codeword++)
+      {
+        lut[sub * n_codewords + codeword] = distance(vector + sub * sub_size,
+          codebook + codeword * sub_size, sub_size);
+      }
+    }
+  };
+
+  // The inner product splits over the centroid and the residual, so a
+  // single table serves every list.
+  if (metric == Metric::inner_product)
+    fill_lut(query);
+
+  std::priority_queue<scored_id> candidates;
+
+  for (size_t probe = 0; probe < probes; probe++)
+  {
+    uint32_t list = nearest_lists[probe].second;
+    const float* centroid = centroids.data() + list * dimension;
+    float base = 0;
+
+    if (metric == Metric::inner_product)
+    {
+      base = nearest_lists[probe].first;
+    }
+    else
+    {
+      for (size_t d = 0; d < dimension; d++)
+        residual[d] = query[d] - centroid[d];
+      fill_lut(residual.data());
+    }
+
+    const inverted_list& inv_list = lists[list];
+    for (size_t idx = 0; idx < inv_list.ids.size(); idx++)
+    {
+      uint32_t id = inv_list.ids[idx];
+      if (accept && !accept(id))
+        continue;
+
+      float d = base + adc_distance(lut.data(),
+        inv_list.codes.data() + idx * code_size, code_size);
+      if (candidates.size() < n_candidates)
+      {
+        candidates.emplace(d, id);
+      }
+      else if (d < candidates.top().first)
+      {
+        candidates.pop();
+        candidates.emplace(d, id);
+      }
+    }
+  }
+
+  std::vector<scored_id> results(candidates.size());
+  for (size_t idx = results.size(); idx > 0; idx--)
+  {
+    results[idx - 1] = candidates.top();
+    candidates.pop();
+  }
+
+  return results;
+}
+
+
+void IvfPqIndex::install(model&& trained)
+{
+  dimension = trained.dimension;
+  code_size = trained.code_size;
+  centroids = std::move(trained.centroids);
+  codebooks = std::move(trained.codebooks);
+  lists.assign(centroids.size() / dimension, inverted_list());
+
+  if (ftruncate(codes_fd, 0) != 0)
+    throw system_error("Cannot truncate the IVF-PQ codes file");
+  encoded = 0;
+
+  save_model();
+}
+
+
+void IvfPqIndex::train(const std::vector<const float*>& sample,
+  uint32_t dimension, uint32_t n_lists, uint32_t code_size)
+{
+  std::vector<float> points(sample.size() * dimension);
+  for (size_t idx = 0; idx < sample.size(); idx++)
+  {
+    std::copy(sample[idx], sample[idx] + dimension,
+      points.begin() + idx * dimension);
+  }
+
+  install(train_model(std::move(points), dimension, n_lists, code_size));
+}
+
+
+IvfPqIndex::model IvfPqIndex::train_model(std::vector<float> points,
+  uint32_t dimension, uint32_t n_lists, uint32_t code_size) const
+{
+  if (code_size == 0 || dimension == 0 || dimension % code_size != 0)
+  {
+    throw std::runtime_error("The number of subquantizers must divide the "
+      "embedding dimension");
+  }
+
+  size_t n = points.size() / dimension;
+  if (n < n_codewords)
+  {
+    throw std::runtime_error("IVF-PQ training needs at least " +
+      std::to_string(n_codewords) + " vectors");
+  }
+
+  model trained;
+  trained.dimension = dimension;
+  trained.code_size = code_size;
+
+  n_lists = std::min<size_t>(n_lists, n);
+  trained.centroids = train_kmeans(points.data(), n, dimension, n_lists,
+    l2_distance);
+
+  // The codebooks are trained on the residuals, one subvector at a time.
+  for (size_t idx = 0; idx < n; idx++)
+  {
+    float* point = points.data() + idx * dimension;
+    const float* centroid = trained.centroids.data() +
+      nearest_centroid(point, trained.centroids, dimension) * dimension;
+    for (size_t d = 0; d < dimension; d++)
+      point[d] -= centroid[d];
+  }
+
+  size_t sub_size = dimension / code_size;
+  trained.codebooks.assign(code_size * n_codewords * sub_size, 0);
+  std::vector<float> subvectors(n * sub_size);
+
+  for (size_t sub = 0; sub < code_size; sub++)
+  {
+    for (size_t idx = 0; idx < n; idx++)
+    {
+      const float* subvector = points.data() + idx * dimension + sub * sub_size;
+      std::copy(subvector, subvector + sub_size,
+        subvectors.begin() + idx * sub_size);
+    }
+
+    std::vector<float> codebook = train_kmeans(subvectors.data(), n, sub_size,
+      n_codewords, l2_distance);
+    std::copy(codebook.begin(), codebook.end(),
+      trained.codebooks.begin() + sub * n_codewords * sub_size);
+  }
+
+  return trained;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "VectorKernels.h"
+
+
+/*
+Inverted file index with product quantization. Vectors are assigned to the
+nearest of a set of coarse centroids, by the metric of the index, and the
+residual from that centroid is encoded in one byte per subvector. Only the
+codes are kept in memory; searches rank the codes of the lists nearest to
+the query with lookup tables, which approximates the distances.
+
+The trained quantizers are kept in a model file and the codes appended to
+a codes file, both in a directory. Not thread-safe, except that
+train_model() can run while other threads use the index.
+*/
+class IvfPqIndex
+{
+  struct inverted_list
+  {
+    std::vector<uint32_t> ids;
+    // code_size bytes per ID.
+    std::vector<uint8_t> codes;
+  };
+
+  std::filesystem::path model_path;
+  Metric metric;
+  DistanceFunc l2_distance;
+  DistanceFunc distance;
+  AdcFunc adc_distance;
+  int codes_fd;
+  uint32_t dimension;
+  uint32_t code_size;
+  // Coarse centroids, dimension floats each.
+  std::vector<float> centroids;
+  // 256 codewords of dimension / code_size floats for each subvector.
+  std::vector<float> codebooks;
+  std::vector<inverted_list> lists;
+  uint64_t encoded;
+
+  void clean_up() noexcept;
+
+  // Encodes the residual of vector from centroid list into code.
+  void encode(const float* vector, uint32_t list, uint8_t* code) const;
+
+  void load_codes(const std::filesystem::path& file_path);
+
+  void load_model();
+
+  // List whose centroid is nearest to vector by the metric of the index.
+  uint32_t nearest_centroid(const float* vector) const
+  {
+    return nearest_centroid(vector, centroids, dimension);
+  }
+
+  uint32_t nearest_centroid(const float* vector,
+    const std::vector<float>& centroids, uint32_t dimension) const;
+
+  void save_model() const;
+
+  size_t subvector_size() const
+  {
+    return dimension / code_size;
+  }
+
+public:
+
+  // Quantizers trained apart from an index, to be installed in it.
+  struct model
+  {
+    uint32_t dimension = 0;
+    uint32_t code_size = 0;
+    std::vector<float> centroids;
+    std::vector<float> codebooks;
+  };
+
+  IvfPqIndex(const std::filesystem::path& directory, Metric metric);
+
+  IvfPqIndex(const IvfPqIndex&) = delete;
+
+  IvfPqIndex& operator=(const IvfPqIndex&) = delete;
+
+  virtual ~IvfPqIndex();
+
+  // Encodes a vector and appends it to its list. IDs must be added in
+  // increasing order, from 0.
+  void add(uint32_t id, const float* vector);
+
+  // Number of vectors added, which is also the next ID expected.
+  uint64_t encoded_count() const
+  {
+    return encoded;
+  }
+
+  // Up to n_candidates IDs for which accept returns true, from the probes
+  // lists nearest to query, with their approximate kernel distance, nearest
+  // first.
+  std::vector<std::pair<float, uint32_t>> search(const float* query,
+    size_t probes, size_t n_candidates,
+    const std::function<bool(uint32_t)>& accept) const;
+
+  // Trains the quantizers with k-means over sample, a set of vectors of
+  // dimension floats, and installs them. code_size must divide dimension.
+  void train(const std::vector<const float*>& sample, uint32_t dimension,
+    uint32_t n_lists, uint32_t code_size);
+
+  // Same as train() without changing the index, so other threads can use
+  // it meanwhile. points holds the vectors one after the other.
+  model train_model(std::vector<float> points, uint32_t dimension,
+    uint32_t n_lists, uint32_t code_size) const;
+
+  // Replaces the quantizers with trained ones, dropping the codes added
+  // with the previous ones.
+  void install(model&& trained);
+
+  bool trained() const
+  {
+    return !centroids.empty();
+  }
+};
@@ -0,0 +1,286 @@
+#include "IvfPqVectorDb.h"
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <random>
+
+
+namespace filesystem = std::filesystem;
+
+typedef std::pair<float, uint64_t> scored_row;
+
+// Rows encoded at a time once the index is trained, holding the lock.
+static const size_t encoding_chunk = 4096;
+
+// Rows kept per query once the candidates of the probed lists are re-ranked
+// by their full embeddings; at least this many are re-ranked.
+static const size_t n_results = 20;
+
+
+/*
+Number of subquantizers when the settings don't give one: the largest
+divisor of dimension giving subvectors of at least 8 floats, so each code
+byte stands for 32 bytes of embedding or more.
+*/
+static uint32_t default_subquantizers(uint32_t dimension)
+{
+  for (uint32_t n = dimension / 8; n > 1; n--)
+  {
+    if (dimension % n == 0)
+      return n;
+  }
+
+  return 1;
+}
+
+
+IvfPqVectorDb::IvfPqVectorDb(const filesystem::path& directory,
+  Metric metric, uint32_t n_lists, uint32_t subquantizers,
+  size_t training_size, size_t probes, size_t rerank):
+  LocalVectorDb(directory, metric),
+  n_lists(n_lists),
+  subquantizers(subquantizers),
+  // The codebooks have 256 codewords, each trained from several embeddings.
+  training_size(std::max<size_t>(training_size, 1024)),
+  probes(probes),
+  rerank(std::max(rerank, n_results)),
+  index(directory, metric)
+{
+}
+
+
+void IvfPqVectorDb::encode_rows()
+{
+  if (!index.trained() || catching_up)
+    return;
+
+  for (uint64_t row = index.encoded_count(); row < matrix.rows(); row++)
+    index.add(row, matrix.row(row));
+}
+
+
+std::vector<scored_row> IvfPqVectorDb::exact_search(const float* query,
+  const std::vector<uint64_t>& rows)
+{
+  std::vector<scored_row> nearest;
+  nearest.reserve(rows.size());
+
+  for (uint64_t row : rows)
+  {
+    nearest.emplace_back(distance(query, matrix.row(row), matrix.dimension()),
+      row);
+  }
+
+  size_t n = std::min(nearest.size(), n_results);
+  std::partial_sort(nearest.begin(), nearest.begin() + n, nearest.end());
+  nearest.resize(n);
+
+  return nearest;
+}
+
+
+std::shared_ptr<IvfPqVectorDb>
+IvfPqVectorDb::open_from_settings(const Json::Value& ivf_settings)
+{
+  Json::Value value = get_json_member_with_type(ivf_settings, "directory",
+    Json::ValueType::stringValue);
+  filesystem::path directory = value.asString();
+
+  Metric metric = Metric::l2;
+  value = get_json_member_with_type(ivf_settings, "metric",
+    Json::ValueType::stringValue, false);
+  if (value)
+    metric = parse_metric(value.asString());
+
+  size_t n_lists = get_positive_setting(ivf_settings, "lists", 256);
+
+  size_t subquantizers = get_positive_setting(ivf_settings, "subquantizers",
+    0);
+
+  size_t training_size = get_positive_setting(ivf_settings, "trainingSize",
+    32768);
+  size_t probes = get_positive_setting(ivf_settings, "probes", 16);
+  size_t rerank = get_positive_setting(ivf_settings, "rerank", 200);
+
+  return std::make_shared<IvfPqVectorDb>(directory, metric, n_lists,
+    subquantizers, training_size, probes, rerank);
+}
+
+
+void IvfPqVectorDb::save_file_part(std::vector<TextUnit>& text_units,
+  FileParts& parts)
+{
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    append_part(text_units, parts);
+    encode_rows();
+  }
+
+  train_index();
+}
+
+
+void IvfPqVectorDb::save_file_record_with_text_units(FileRecord& record)
+{
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    append_record(record);
+    encode_rows();
+  }
+
+  train_index();
+}
+
+
+void
+IvfPqVectorDb::save_file_records_with_text_units(std::vector<FileRecord>& records)
+{
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    for (FileRecord& record : records)
+      append_record(record);
+    encode_rows();
+  }
+
+  train_index();
+}
+
+
+std::vector<TextUnitResult>
+IvfPqVectorDb::search(const std::vector<float>& embedding)
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  std::vector<TextUnitResult> results;
+  if (matrix.rows() == 0)
+    return results;
+
+  check_query_dimension(embedding);
+
+  std::vector<uint64_t> rows;
+
+  if (index.trained() && !catching_up)
+  {
+    std::vector<std::pair<float, uint32_t>> candidates = index.search(
+      embedding.data(), probes, rerank,
+      [this](uint32_t row) { return records.is_live(row); });
+
+    rows.reserve(candidates.size());
+    for (const std::pair<float, uint32_t>& candidate : candidates)
+      rows.push_back(candidate.second);
+  }
+  else
+  {
+    for (uint64_t row = 0; row < matrix.rows(); row++)
+    {
+      if (records.is_live(row))
+        rows.push_back(row);
+    }
+  }
+
+  // The candidates are ranked again with their full embeddings.
+  std::vector<scored_row> nearest = exact_search(embedding.data(), rows);
+
+  results.reserve(nearest.size());
+  for (const scored_row& scored : nearest)
+  {
+    results.push_back(records.result(scored.second,
+      kernel_to_reported_distance(metric, scored.first)));
+  }
+
+  return results;
+}
+
+
+void IvfPqVectorDb::set_database_up()
+{
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    drop_half_saved();
+    encode_rows();
+  }
+
+  train_index();
+}
+
+
+void IvfPqVectorDb::train_index()
+{
+  std::unique_lock<std::mutex> training_lock(training_mutex,
+    std::try_to_lock);
+  if (!training_lock.owns_lock())
+    return;
+
+  std::vector<float> points;
+  uint32_t dimension;
+
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    if (index.trained())
+      return;
+
+    std::vector<uint64_t> sample;
+    for (uint64_t row = 0; row < matrix.rows(); row++)
+    {
+      if (records.is_live(row))
+        sample.push_back(row);
+    }
+
+    if (sample.size() < training_size)
+      return;
+
+    std::mt19937 generator(sample.size());
+    std::shuffle(sample.begin(), sample.end(), generator);
+    sample.resize(training_size);
+
+    // Copied, as saves may move the rows once the lock is released.
+    dimension = matrix.dimension();
+    points.resize(sample.size() * dimension);
+    for (size_t idx = 0; idx < sample.size(); idx++)
+    {
+      const float* row = matrix.row(sample[idx]);
+      std::copy(row, row + dimension, points.begin() + idx * dimension);
+    }
+  }
+
+  uint32_t code_size = subquantizers ? subquantizers :
+    default_subquantizers(dimension);
+
+  std::cerr << "Training the IVF-PQ index with " << training_size
+    << " embeddings...\n";
+  IvfPqIndex::model trained = index.train_model(std::move(points),
+    dimension, n_lists, code_size);
+
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    index.install(std::move(trained));
+    catching_up = true;
+  }
+
+  // The rows are encoded a chunk at a time, so saves and searches get the
+  // lock in between.
+  for (;;)
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try
+    {
+      uint64_t end = std::min<uint64_t>(matrix.rows(),
+        index.encoded_count() + encoding_chunk);
+      for (uint64_t row = index.encoded_count(); row < end; row++)
+        index.add(row, matrix.row(row));
+    }
+    catch (...)
+    {
+      catching_up = false;
+      throw;
+    }
+
+    if (index.encoded_count() == matrix.rows())
+    {
+      catching_up = false;
+      break;
+    }
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "IvfPqIndex.h"
+#include "LocalVectorDb.h"
+
+
+/*
+Database kept in a directory by the process itself, for corpora whose
+embeddings don't fit in memory. Only the IVF-PQ codes are held in memory;
+the full embeddings stay in a memory-mapped file, read only to re-rank the
+best candidates of a search exactly.
+
+The index is trained once enough embeddings are saved, without holding the
+lock that saves and searches take. Until it's trained and has encoded the
+embeddings saved meanwhile, searches compare the query with every
+embedding. Safe to share between threads: searches run concurrently, saves
+one at a time.
+*/
+class IvfPqVectorDb: public LocalVectorDb
+{
+  uint32_t n_lists;
+  // 0 to pick one from the dimension.
+  uint32_t subquantizers;
+  size_t training_size;
+  size_t probes;
+  size_t rerank;
+  IvfPqIndex index;
+  // Held by the thread training the index.
+  std::mutex training_mutex;
+  // Set while train_index() encodes the rows saved before the index was
+  // trained, so saves leave theirs to it.
+  bool catching_up = false;
+
+  // Encodes the rows the trained index doesn't have yet. Needs the
+  // exclusive lock.
+  void encode_rows();
+
+  // Kernel distance and row of the nearest live rows, nearest first.
+  std::vector<std::pair<float, uint64_t>> exact_search(const float* query,
+    const std::vector<uint64_t>& rows);
+
+  // Trains the index once there are enough embeddings, unless another
+  // thread is doing it, then encodes the rows. Takes the lock itself, only
+  // to sample the embeddings and to install the trained index.
+  void train_index();
+
+public:
+
+  IvfPqVectorDb(const std::filesystem::path& directory, Metric metric,
+    uint32_t n_lists, uint32_t subquantizers, size_t training_size,
+    size_t probes, size_t rerank);
+
+  // Opens the database described by the "ivfPqIndex" settings: "directory",
+  // "metric" ("l2" or "innerProduct"), "lists", "subquantizers" and
+  // "trainingSize", which apply when the index is trained, and "probes" and
+  // "rerank" for searching.
+  static std::shared_ptr<IvfPqVectorDb>
+  open_from_settings(const Json::Value& ivf_settings);
+
+  virtual void save_file_part(std::vector<TextUnit>& text_units,
+    FileParts& parts) override;
+
+  virtual void
+  save_file_record_with_text_units(FileRecord& record) override;
+
+  virtual void
+  save_file_records_with_text_units(std::vector<FileRecord>& records) override;
+
+  virtual std::vector<TextUnitResult>
+  search(const std::vector<float>& embedding) override;
+
+  // Drops what a crash left half saved and encodes the rows it left out of
+  // the index. Can be called more than once.
+  virtual void set_database_up() override;
+};
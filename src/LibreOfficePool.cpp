@@ -0,0 +1,525 @@
+#include "LibreOfficePool.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <dirent.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cppuhelper/bootstrap.hxx>
+#include <com/sun/star/bridge/UnoUrlResolver.hpp>
+#include <com/sun/star/bridge/XUnoUrlResolver.hpp>
+#include <com/sun/star/connection/NoConnectException.hpp>
+#include <com/sun/star/lang/XMultiComponentFactory.hpp>
+#include <com/sun/star/uno/Exception.hpp>
+#include <osl/file.hxx>
+#include <rtl/ustring.hxx>
+
+#include "common.h"
+
+
+#ifndef LIBREOFFICE_PROGRAM_DIR
+#define LIBREOFFICE_PROGRAM_DIR "/usr/lib/libreoffice/program"
+#endif
+
+
+extern char** environ;
+
+namespace filesystem = std::filesystem;
+
+using com::sun::star::frame::XComponentLoader;
+using com::sun::star::frame::XDesktop;
+using com::sun::star::lang::XMultiComponentFactory;
+using com::sun::star::uno::XComponentContext;
+using com::sun::star::uno::XInterface;
+
+
+// Time given to an office to start, and to terminate when asked to.
+static const std::chrono::seconds start_timeout(60);
+static const std::chrono::seconds terminate_timeout(10);
+
+static const std::chrono::milliseconds poll_interval(100);
+
+// How often the watchdog reads the memory of the offices, which means
+// going through every process in /proc. Often enough to kill one growing
+// fast with a document before it takes the memory of the machine.
+static const std::chrono::seconds memory_check_interval(2);
+
+
+/*
+Resident memory in kB of the processes of a process group, read from /proc.
+*/
+static size_t get_group_rss_kb(pid_t pgid)
+{
+  static const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  size_t rss_kb = 0;
+
+  std::unique_ptr<DIR, int (*)(DIR*)> proc_dir(opendir("/proc"), closedir);
+  if (!proc_dir)
+    return 0;
+
+  while (dirent* entry = readdir(proc_dir.get()))
+  {
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+      continue;
+
+    std::string stat_path("/proc/");
+    stat_path += entry->d_name;
+    stat_path += "/stat";
+
+    std::ifstream stat_file(stat_path);
+    std::string line;
+    if (!std::getline(stat_file, line))
+      continue;
+
+    // The fields after the command, which can have spaces, start with the
+    // state. The process group is the 3rd of them, rss the 22nd.
+    size_t command_end = line.rfind(')');
+    if (command_end == std::string::npos)
+      continue;
+
+    std::istringstream fields(line.substr(command_end + 1));
+    std::string field;
+    long long pgrp = 0;
+    long long rss_pages = 0;
+    for (int idx = 0; idx < 22 && fields >> field; idx++)
+    {
+      if (idx == 2)
+        pgrp = std::atoll(field.c_str());
+      else if (idx == 21)
+        rss_pages = std::atoll(field.c_str());
+    }
+
+    if (pgrp == pgid && rss_pages > 0)
+      rss_kb += rss_pages * page_kb;
+  }
+
+  return rss_kb;
+}
+
+
+/*
+Waits for the process to exit, for at most the timeout. Returns false if it
+didn't.
+*/
+static bool wait_for_exit(pid_t pid, std::chrono::milliseconds timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  for (;;)
+  {
+    pid_t result = waitpid(pid, nullptr, WNOHANG);
+    if (result == pid || (result < 0 && errno == ECHILD))
+      return true;
+
+    if (std::chrono::steady_clock::now() >= deadline)
+      return false;
+
+    std::this_thread::sleep_for(poll_interval);
+  }
+}
+
+
+LibreOfficePool::LibreOfficePool(const settings& pool_settings):
+  _settings(pool_settings),
+  stopping(false)
+{
+  if (_settings.workers == 0)
+    _settings.workers = 1;
+
+  for (size_t idx = 0; idx < _settings.workers; idx++)
+  {
+    workers.push_back(std::make_unique<worker>());
+    workers.back()->idx = idx;
+    idle_workers.push_back(workers.back().get());
+  }
+
+  watchdog_thread = std::thread(&LibreOfficePool::watch, this);
+}
+
+
+LibreOfficePool::~LibreOfficePool()
+{
+  clean_up();
+}
+
+
+LibreOfficePool::lease LibreOfficePool::acquire()
+{
+  worker* w;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cond.wait(lock, [this] { return !idle_workers.empty(); });
+    w = idle_workers.back();
+    idle_workers.pop_back();
+  }
+
+  if (!w->pid)
+  {
+    try
+    {
+      start_worker(*w);
+    }
+    catch (...)
+    {
+      stop_worker(*w, false);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      idle_workers.push_back(w);
+      idle_cond.notify_one();
+      throw;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  w->busy = true;
+  w->timed_out = false;
+  w->over_memory = false;
+  w->busy_since = std::chrono::steady_clock::now();
+  return lease(*this, *w);
+}
+
+
+void LibreOfficePool::clean_up() noexcept
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    watchdog_cond.notify_all();
+  }
+
+  if (watchdog_thread.joinable())
+    watchdog_thread.join();
+
+  for (auto& w : workers)
+    stop_worker(*w, true);
+
+  if (!profiles_dir.empty())
+  {
+    std::error_code error;
+    filesystem::remove_all(profiles_dir, error);
+  }
+}
+
+
+std::shared_ptr<LibreOfficePool>
+LibreOfficePool::open_from_settings(const Json::Value& office_settings)
+{
+  settings pool_settings;
+
+  Json::Value value = get_json_member_with_type(office_settings,
+    "sofficePath", Json::ValueType::stringValue, false);
+  pool_settings.soffice_path = value ? value.asString() :
+    LIBREOFFICE_PROGRAM_DIR "/soffice";
+
+  pool_settings.workers = get_positive_setting(office_settings, "workers", 2);
+  pool_settings.max_documents = get_positive_setting(office_settings,
+    "maxDocuments", 200);
+  pool_settings.max_memory_kb = get_positive_setting(office_settings,
+    "maxMemoryMB", 1024) * 1024;
+  pool_settings.timeout = std::chrono::seconds(
+    get_positive_setting(office_settings, "timeoutSeconds", 120));
+
+  return std::make_shared<LibreOfficePool>(pool_settings);
+}
+
+
+void LibreOfficePool::release(worker& w, bool failed) noexcept
+{
+  bool killed;
+  size_t rss_kb;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    w.busy = false;
+    killed = w.timed_out || w.over_memory;
+    rss_kb = w.rss_kb;
+  }
+
+  w.documents++;
+
+  // An office that crashed is replaced as one that failed.
+  if (w.pid && waitpid(w.pid, nullptr, WNOHANG) == w.pid)
+  {
+    kill(-w.pid, SIGKILL);
+    std::lock_guard<std::mutex> lock(mutex);
+    w.pid = 0;
+    w.rss_kb = 0;
+    rss_kb = 0;
+  }
+
+  if (failed || killed)
+    stop_worker(w, false);
+  else if (w.documents >= _settings.max_documents ||
+    rss_kb >= _settings.max_memory_kb)
+  {
+    // Restarted by the next document that needs it.
+    stop_worker(w, true);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  idle_workers.push_back(&w);
+  idle_cond.notify_one();
+}
+
+
+void LibreOfficePool::set_uno_up()
+{
+  local_context = ::cppu::defaultBootstrap_InitialComponentContext();
+
+  std::string dir_template =
+    (filesystem::temp_directory_path() / "embeddings-db-office-XXXXXX")
+    .string();
+  if (!mkdtemp(dir_template.data()))
+  {
+    std::string msg("Cannot create a directory for LibreOffice profiles: ");
+    msg += std::strerror(errno);
+    throw std::runtime_error(msg);
+  }
+  profiles_dir = dir_template;
+}
+
+
+void LibreOfficePool::start_worker(worker& w)
+{
+  std::call_once(uno_once, &LibreOfficePool::set_uno_up, this);
+
+  w.generation++;
+  w.documents = 0;
+
+  // A new pipe for each process, so a client never reaches an office being
+  // shut down. The profile is kept across restarts, since creating one is
+  // slow.
+  std::string pipe_name("embeddings_db_");
+  pipe_name += std::to_string(getpid());
+  pipe_name += '_';
+  pipe_name += std::to_string(w.idx);
+  pipe_name += '_';
+  pipe_name += std::to_string(w.generation);
+
+  filesystem::path profile_dir = profiles_dir / std::to_string(w.idx);
+
+  // As a file URL, whose special characters are escaped.
+  rtl::OUString profile_url;
+  if (osl::FileBase::getFileURLFromSystemPath(rtl::OUString::fromUtf8(
+    rtl::OString(profile_dir.c_str())), profile_url) !=
+    osl::FileBase::E_None)
+  {
+    std::string msg("Cannot make a URL of the LibreOffice profile \"");
+    msg += profile_dir.string();
+    msg += "\".";
+    throw std::runtime_error(msg);
+  }
+
+  std::string profile_arg("-env:UserInstallation=");
+  profile_arg += rtl::OUStringToOString(profile_url, RTL_TEXTENCODING_UTF8)
+    .getStr();
+  std::string accept_arg("--accept=pipe,name=");
+  accept_arg += pipe_name;
+  accept_arg += ";urp;StarOffice.ComponentContext";
+
+  std::vector<std::string> args = {
+    _settings.soffice_path, "--headless", "--invisible", "--nocrashreport",
+    "--nodefault", "--nofirststartwizard", "--nologo", "--norestore",
+    profile_arg, accept_arg
+  };
+  std::vector<char*> argv;
+  for (std::string& arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  // In a process group of its own, so the office started by the launcher is
+  // killed with it.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+
+  pid_t pid;
+  int result = posix_spawn(&pid, _settings.soffice_path.c_str(), nullptr,
+    &attr, argv.data(), environ);
+  posix_spawnattr_destroy(&attr);
+
+  if (result != 0)
+  {
+    std::string msg("Cannot start \"");
+    msg += _settings.soffice_path;
+    msg += "\": ";
+    msg += std::strerror(result);
+    throw std::runtime_error(msg);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    w.pid = pid;
+  }
+
+  css::uno::Reference<css::bridge::XUnoUrlResolver> resolver =
+    css::bridge::UnoUrlResolver::create(local_context);
+
+  rtl::OUString url = rtl::OUString::createFromAscii(
+    ("uno:pipe,name=" + pipe_name + ";urp;StarOffice.ComponentContext")
+    .c_str());
+
+  auto deadline = std::chrono::steady_clock::now() + start_timeout;
+  css::uno::Reference<XInterface> remote;
+
+  while (!remote.is())
+  {
+    try
+    {
+      remote = resolver->resolve(url);
+    }
+    catch (const css::connection::NoConnectException&)
+    {
+      if (waitpid(pid, nullptr, WNOHANG) == pid)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        w.pid = 0;
+        throw std::runtime_error("LibreOffice exited while starting.");
+      }
+
+      if (std::chrono::steady_clock::now() >= deadline)
+        throw std::runtime_error("LibreOffice did not start in time.");
+
+      std::this_thread::sleep_for(poll_interval);
+    }
+  }
+
+  css::uno::Reference<XComponentContext> remote_context(remote,
+    css::uno::UNO_QUERY_THROW);
+  css::uno::Reference<XMultiComponentFactory> factory =
+    remote_context->getServiceManager();
+
+  w.desktop = css::uno::Reference<XDesktop>(factory->
+    createInstanceWithContext("com.sun.star.frame.Desktop", remote_context),
+    css::uno::UNO_QUERY_THROW);
+  w.component_loader = css::uno::Reference<XComponentLoader>(w.desktop,
+    css::uno::UNO_QUERY_THROW);
+}
+
+
+void LibreOfficePool::stop_worker(worker& w, bool graceful) noexcept
+{
+  if (graceful && w.desktop.is())
+  {
+    try
+    {
+      w.desktop->terminate();
+    }
+    catch (const css::uno::Exception&)
+    {
+    }
+  }
+
+  w.component_loader.clear();
+  w.desktop.clear();
+
+  pid_t pid;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pid = w.pid;
+  }
+
+  if (pid)
+  {
+    if (!graceful || !wait_for_exit(pid, terminate_timeout))
+    {
+      kill(-pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    w.pid = 0;
+    w.rss_kb = 0;
+  }
+}
+
+
+bool LibreOfficePool::lease::over_memory()
+{
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  return w.over_memory;
+}
+
+
+bool LibreOfficePool::lease::timed_out()
+{
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  return w.timed_out;
+}
+
+
+void LibreOfficePool::watch()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  auto memory_checked = std::chrono::steady_clock::now();
+
+  while (!stopping)
+  {
+    watchdog_cond.wait_for(lock, std::chrono::seconds(1));
+
+    auto now = std::chrono::steady_clock::now();
+
+    if (now - memory_checked >= memory_check_interval)
+    {
+      memory_checked = now;
+
+      std::vector<std::pair<worker*, pid_t>> running;
+      for (auto& w : workers)
+      {
+        if (w->pid)
+          running.emplace_back(w.get(), w->pid);
+      }
+
+      // Read without the lock, which acquire() and release() wait for.
+      std::vector<size_t> rss_kbs;
+      lock.unlock();
+      for (const auto& worker_pid : running)
+        rss_kbs.push_back(get_group_rss_kb(worker_pid.second));
+      lock.lock();
+
+      for (size_t idx = 0; idx < running.size(); idx++)
+      {
+        // Not if the process was replaced meanwhile.
+        worker& w = *running[idx].first;
+        if (w.pid != running[idx].second)
+          continue;
+
+        w.rss_kb = rss_kbs[idx];
+
+        // An idle one is left for release() to replace after its next
+        // document.
+        if (w.busy && !w.timed_out && !w.over_memory &&
+          w.rss_kb >= _settings.max_memory_kb)
+        {
+          std::cerr << "LibreOffice used more than "
+            << _settings.max_memory_kb / 1024
+            << " MB on a document, restarting it\n";
+          w.over_memory = true;
+          kill(-w.pid, SIGKILL);
+        }
+      }
+    }
+
+    for (auto& w : workers)
+    {
+      if (w->busy && !w->timed_out && !w->over_memory && w->pid &&
+        now - w->busy_since > _settings.timeout)
+      {
+        std::cerr << "LibreOffice took more than "
+          << _settings.timeout.count() << " s on a document, restarting it\n";
+        w->timed_out = true;
+        kill(-w->pid, SIGKILL);
+      }
+    }
+  }
+}
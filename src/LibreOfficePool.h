@@ -0,0 +1,174 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <json/json.h>
+
+#include <com/sun/star/frame/XComponentLoader.hpp>
+#include <com/sun/star/frame/XDesktop.hpp>
+#include <com/sun/star/uno/Reference.hxx>
+#include <com/sun/star/uno/XComponentContext.hpp>
+
+#include "common.h"
+
+
+/*
+Headless soffice processes that office documents are loaded into, one
+document per process at a time. Each process has its own user profile, so
+they run side by side. A process is started when first needed, and
+replaced once it has loaded a number of documents, when its memory grows
+past a limit, or when a document takes too long. A watchdog kills it in the
+last two cases while it's busy with a document. Safe to share between
+threads.
+*/
+class LibreOfficePool
+{
+public:
+
+  struct settings
+  {
+    std::string soffice_path;
+    size_t workers;
+    size_t max_documents;
+    // Resident memory of a process, with its children, in kB.
+    size_t max_memory_kb;
+    std::chrono::seconds timeout;
+  };
+
+  // Thrown when the watchdog killed the process a document was loaded into
+  // for taking too long.
+  class timeout_error: public FileProcessor::file_error
+  {
+  public:
+
+    using FileProcessor::file_error::file_error;
+  };
+
+private:
+
+  struct worker
+  {
+    size_t idx;
+    // Process group of the soffice launcher and office, 0 when not running.
+    pid_t pid = 0;
+    unsigned generation = 0;
+    css::uno::Reference<css::frame::XDesktop> desktop;
+    css::uno::Reference<css::frame::XComponentLoader> component_loader;
+    size_t documents = 0;
+    // Resident memory of the process group in kB, as the watchdog last
+    // sampled it.
+    size_t rss_kb = 0;
+    bool busy = false;
+    bool timed_out = false;
+    // Killed by the watchdog for using more memory than the limit.
+    bool over_memory = false;
+    std::chrono::steady_clock::time_point busy_since;
+  };
+
+  settings _settings;
+  std::once_flag uno_once;
+  css::uno::Reference<css::uno::XComponentContext> local_context;
+  std::filesystem::path profiles_dir;
+  std::vector<std::unique_ptr<worker>> workers;
+  std::vector<worker*> idle_workers;
+  std::mutex mutex;
+  std::condition_variable idle_cond;
+  std::condition_variable watchdog_cond;
+  bool stopping;
+  std::thread watchdog_thread;
+
+  void clean_up() noexcept;
+
+  // Gives the worker back, replacing its process if it failed or is due.
+  void release(worker& w, bool failed) noexcept;
+
+  // Bootstraps UNO in this process and creates the directory of the user
+  // profiles, the first time a worker starts.
+  void set_uno_up();
+
+  void start_worker(worker& w);
+
+  // Ends the process, asking the office to terminate when graceful.
+  void stop_worker(worker& w, bool graceful) noexcept;
+
+  // Kills the processes busy with a document for longer than the timeout,
+  // and samples the memory of the running ones now and then, killing the
+  // busy ones past the limit.
+  void watch();
+
+public:
+
+  // Process leased to a thread for a document, given back on destruction.
+  class lease
+  {
+    friend class LibreOfficePool;
+
+    LibreOfficePool& pool;
+    worker& w;
+    bool failed;
+
+    lease(LibreOfficePool& pool, worker& w):
+      pool(pool),
+      w(w),
+      failed(false)
+    {
+    }
+
+  public:
+
+    lease(const lease&) = delete;
+
+    lease& operator=(const lease&) = delete;
+
+    ~lease()
+    {
+      pool.release(w, failed);
+    }
+
+    const css::uno::Reference<css::frame::XComponentLoader>&
+    component_loader() const
+    {
+      return w.component_loader;
+    }
+
+    // Has the process replaced when given back, after an error of the
+    // office.
+    void fail()
+    {
+      failed = true;
+    }
+
+    // Whether the watchdog killed the process for taking too long.
+    bool timed_out();
+
+    // Whether the watchdog killed the process for its memory.
+    bool over_memory();
+  };
+
+  explicit LibreOfficePool(const settings& pool_settings);
+
+  LibreOfficePool(const LibreOfficePool&) = delete;
+
+  LibreOfficePool& operator=(const LibreOfficePool&) = delete;
+
+  virtual ~LibreOfficePool();
+
+  // Waits for a process free for a document, starting it if needed.
+  lease acquire();
+
+  // Opens the pool described by the "libreOffice" settings: "sofficePath",
+  // "workers", "maxDocuments", "maxMemoryMB" and "timeoutSeconds".
+  static std::shared_ptr<LibreOfficePool>
+  open_from_settings(const Json::Value& office_settings);
+};
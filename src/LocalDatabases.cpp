@@ -0,0 +1,26 @@
+#include "LocalDatabases.h"
+
+#include "FlatVectorDb.h"
+#include "HnswVectorDb.h"
+#include "IvfPqVectorDb.h"
+
+
+std::shared_ptr<Database> open_local_database(const Json::Value& config_root)
+{
+  Json::Value settings = get_json_member_with_type(config_root, "flatIndex",
+    Json::ValueType::objectValue, false);
+  if (settings)
+    return FlatVectorDb::open_from_settings(settings);
+
+  settings = get_json_member_with_type(config_root, "hnswIndex",
+    Json::ValueType::objectValue, false);
+  if (settings)
+    return HnswVectorDb::open_from_settings(settings);
+
+  settings = get_json_member_with_type(config_root, "ivfPqIndex",
+    Json::ValueType::objectValue, false);
+  if (settings)
+    return IvfPqVectorDb::open_from_settings(settings);
+
+  return nullptr;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <memory>
+
+#include <json/json.h>
+
+#include "common.h"
+
+
+/*
+Opens the in-process database selected by the settings, from the
+"flatIndex", "hnswIndex" or "ivfPqIndex" object, checked in that order.
+Returns an empty pointer if there is none of them.
+*/
+std::shared_ptr<Database> open_local_database(const Json::Value& config_root);
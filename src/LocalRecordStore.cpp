@@ -0,0 +1,526 @@
+#include "LocalRecordStore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace filesystem = std::filesystem;
+
+// Operations appended to files.dat.
+static const uint8_t add_op = 1;
+// Not written anymore, but read from older stores.
+static const uint8_t remove_op = 2;
+static const uint8_t mtime_op = 3;
+// Adds a record like add_op, dropping the earlier ones of its path in the
+// same operation, so a crash leaves either of them and never neither.
+static const uint8_t replace_op = 4;
+// Add or replace a record like the two above, with units added ahead of it
+// in several runs.
+static const uint8_t add_parts_op = 5;
+static const uint8_t replace_parts_op = 6;
+
+
+static void append_value(std::string& buffer, const void* value, size_t size)
+{
+  buffer.append(static_cast<const char*>(value), size);
+}
+
+
+static void write_all(int fd, const std::string& buffer)
+{
+  const char* data = buffer.data();
+  size_t left = buffer.size();
+
+  while (left > 0)
+  {
+    ssize_t written = write(fd, data, left);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw system_error("Cannot write to the record store");
+    }
+    data += written;
+    left -= written;
+  }
+}
+
+
+static bool read_value(std::ifstream& file, void* value, size_t size)
+{
+  file.read(static_cast<char*>(value), size);
+  return static_cast<size_t>(file.gcount()) == size;
+}
+
+
+static int open_for_append(const filesystem::path& file_path)
+{
+  int fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+    0644);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open \"");
+    msg += file_path.string();
+    msg += "\"";
+    throw system_error(msg.c_str());
+  }
+  return fd;
+}
+
+
+LocalRecordStore::LocalRecordStore(const filesystem::path& directory):
+  files_fd(-1),
+  units_fd(-1),
+  units_size(0),
+  next_file_record_id(1)
+{
+  filesystem::create_directories(directory);
+
+  try
+  {
+    filesystem::path units_path = directory / "units.dat";
+    load_units(units_path);
+    units_fd = open_for_append(units_path);
+    // Drops a unit cut short by a crash, so later ones are appended after
+    // the last complete one.
+    if (ftruncate(units_fd, units_size) != 0)
+      throw system_error("Cannot truncate the record store");
+
+    filesystem::path files_path = directory / "files.dat";
+    uint64_t files_size = load_files(files_path);
+    files_fd = open_for_append(files_path);
+    if (ftruncate(files_fd, files_size) != 0)
+      throw system_error("Cannot truncate the record store");
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+LocalRecordStore::~LocalRecordStore()
+{
+  clean_up();
+}
+
+
+uint64_t LocalRecordStore::add(FileRecord& record)
+{
+  const std::vector<TextUnit>& record_units = record.text_units();
+  uint64_t first_unit = append_units(record_units, next_file_record_id);
+
+  // The record is written after its units, so a crash in between leaves
+  // only units that belong to no record.
+  write_record(record, {{first_unit, record_units.size()}});
+
+  std::vector<TextUnit> units_with_ids = record_units;
+  for (size_t idx = 0; idx < units_with_ids.size(); idx++)
+    units_with_ids[idx].id(first_unit + idx);
+  record.text_units(std::move(units_with_ids));
+
+  return first_unit;
+}
+
+
+void LocalRecordStore::add_parts(FileRecord& record,
+  const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+  for (const std::pair<uint64_t, uint64_t>& range : ranges)
+  {
+    if (range.first + range.second > units.size())
+      throw std::runtime_error("Units of a record missing from the store");
+  }
+
+  write_record(record, ranges);
+}
+
+
+uint64_t LocalRecordStore::add_units(const std::vector<TextUnit>& text_units)
+{
+  return append_units(text_units, 0);
+}
+
+
+uint64_t LocalRecordStore::append_units(
+  const std::vector<TextUnit>& text_units, unsigned long file_record_id)
+{
+  uint64_t first_unit = units.size();
+
+  std::string buffer;
+  std::vector<unit_entry> new_units;
+  new_units.reserve(text_units.size());
+  uint64_t offset = units_size;
+
+  for (const TextUnit& unit : text_units)
+  {
+    uint64_t id = file_record_id;
+    uint32_t text_size = unit.text().size();
+    append_value(buffer, &id, sizeof(id));
+    append_value(buffer, &text_size, sizeof(text_size));
+    buffer += unit.text();
+
+    offset += sizeof(id) + sizeof(text_size);
+    new_units.push_back(unit_entry{file_record_id, offset, text_size});
+    offset += text_size;
+  }
+
+  write_all(units_fd, buffer);
+  units_size = offset;
+  units.insert(units.end(), new_units.begin(), new_units.end());
+  units_live.resize(units.size(), false);
+
+  return first_unit;
+}
+
+
+void LocalRecordStore::clean_up() noexcept
+{
+  if (files_fd >= 0)
+  {
+    close(files_fd);
+    files_fd = -1;
+  }
+
+  if (units_fd >= 0)
+  {
+    close(units_fd);
+    units_fd = -1;
+  }
+}
+
+
+std::vector<FileRecord> LocalRecordStore::get_file_records() const
+{
+  std::vector<FileRecord> records;
+  records.reserve(file_records.size());
+  for (const auto& id_record : file_records)
+    records.push_back(id_record.second);
+  return records;
+}
+
+
+void LocalRecordStore::forget(const std::string& file_path)
+{
+  auto it = ids_by_path.find(file_path);
+  if (it == ids_by_path.end())
+    return;
+
+  for (unsigned long file_record_id : it->second)
+  {
+    set_live(file_record_id, false);
+    unit_ranges.erase(file_record_id);
+    file_records.erase(file_record_id);
+  }
+
+  ids_by_path.erase(it);
+}
+
+
+uint64_t LocalRecordStore::load_files(const filesystem::path& file_path)
+{
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file)
+    return 0;
+
+  uint64_t complete_size = 0;
+  uint8_t op;
+  while (read_value(file, &op, sizeof(op)))
+  {
+    uint64_t id;
+    if (!read_value(file, &id, sizeof(id)))
+      break;
+
+    if (op == remove_op)
+    {
+      auto it = file_records.find(id);
+      if (it != file_records.end())
+      {
+        set_live(id, false);
+        std::vector<unsigned long>& path_ids =
+          ids_by_path[it->second.file_path()];
+        path_ids.erase(std::remove(path_ids.begin(), path_ids.end(), id),
+          path_ids.end());
+        if (path_ids.empty())
+          ids_by_path.erase(it->second.file_path());
+        unit_ranges.erase(id);
+        file_records.erase(it);
+      }
+      complete_size = file.tellg();
+      continue;
+    }
+
+    if (op == mtime_op)
+    {
+      int64_t mtime;
+      if (!read_value(file, &mtime, sizeof(mtime)))
+        break;
+
+      auto it = file_records.find(id);
+      if (it != file_records.end())
+        it->second.mtime(mtime);
+      complete_size = file.tellg();
+      continue;
+    }
+
+    bool has_parts = op == add_parts_op || op == replace_parts_op;
+    if (op != add_op && op != replace_op && !has_parts)
+      throw std::runtime_error("The record store is corrupt");
+
+    // A single run of units, or their number followed by each run.
+    uint64_t n_ranges = 1;
+    if (has_parts && !read_value(file, &n_ranges, sizeof(n_ranges)))
+      break;
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    bool ranges_read = true;
+    bool units_found = true;
+    for (uint64_t idx = 0; idx < n_ranges; idx++)
+    {
+      uint64_t first_unit;
+      uint64_t n_units;
+      if (!read_value(file, &first_unit, sizeof(first_unit)) ||
+        !read_value(file, &n_units, sizeof(n_units)))
+      {
+        ranges_read = false;
+        break;
+      }
+      if (first_unit + n_units > units.size())
+        units_found = false;
+      ranges.emplace_back(first_unit, n_units);
+    }
+    if (!ranges_read)
+      break;
+
+    uint64_t file_size;
+    int64_t mtime;
+    uint64_t content_hash;
+    uint32_t path_size;
+    if (!read_value(file, &file_size, sizeof(file_size)) ||
+      !read_value(file, &mtime, sizeof(mtime)) ||
+      !read_value(file, &content_hash, sizeof(content_hash)) ||
+      !read_value(file, &path_size, sizeof(path_size)))
+    {
+      break;
+    }
+
+    std::string path(path_size, '\0');
+    if (!read_value(file, &path[0], path_size))
+      break;
+
+    complete_size = file.tellg();
+
+    // A record whose units did not make it to disk is skipped.
+    if (!units_found)
+      continue;
+
+    if (op == replace_op || op == replace_parts_op)
+      forget(path);
+
+    FileRecord record;
+    record.id(id);
+    record.file_path(path);
+    record.file_size(file_size);
+    record.mtime(mtime);
+    record.content_hash(content_hash);
+    file_records[id] = record;
+    ids_by_path[path].push_back(id);
+    unit_ranges[id] = std::move(ranges);
+    own_units(id);
+    set_live(id, true);
+
+    if (id >= next_file_record_id)
+      next_file_record_id = id + 1;
+  }
+
+  return complete_size;
+}
+
+
+void LocalRecordStore::load_units(const filesystem::path& file_path)
+{
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file)
+    return;
+
+  uint64_t file_size = filesystem::file_size(file_path);
+  uint64_t offset = 0;
+  while (true)
+  {
+    uint64_t id;
+    uint32_t text_size;
+    if (!read_value(file, &id, sizeof(id)) ||
+      !read_value(file, &text_size, sizeof(text_size)))
+    {
+      break;
+    }
+
+    offset += sizeof(id) + sizeof(text_size);
+    if (offset + text_size > file_size ||
+      !file.seekg(text_size, std::ios::cur))
+    {
+      break;
+    }
+
+    units.push_back(unit_entry{static_cast<unsigned long>(id), offset,
+      text_size});
+    offset += text_size;
+  }
+
+  units_live.resize(units.size(), false);
+  units_size = offset;
+}
+
+
+void LocalRecordStore::own_units(unsigned long file_record_id)
+{
+  for (const std::pair<uint64_t, uint64_t>& range :
+    unit_ranges[file_record_id])
+  {
+    for (uint64_t idx = 0; idx < range.second; idx++)
+      units[range.first + idx].file_record_id = file_record_id;
+  }
+}
+
+
+TextUnitResult LocalRecordStore::result(uint64_t unit_id, float distance) const
+{
+  const unit_entry& entry = units[unit_id];
+
+  std::string text(entry.text_size, '\0');
+  size_t read_size = 0;
+  while (read_size < entry.text_size)
+  {
+    ssize_t n = pread(units_fd, &text[read_size], entry.text_size - read_size,
+      entry.text_offset + read_size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw system_error("Cannot read a text unit from the record store");
+    read_size += n;
+  }
+
+  TextUnitResult unit_res;
+  unit_res.unit.id(unit_id);
+  unit_res.unit.text(text);
+  unit_res.distance = distance;
+
+  auto it = file_records.find(entry.file_record_id);
+  if (it != file_records.end())
+    unit_res.unit.file_record(std::make_shared<FileRecord>(it->second));
+
+  return unit_res;
+}
+
+
+void LocalRecordStore::set_live(unsigned long file_record_id, bool live)
+{
+  for (const std::pair<uint64_t, uint64_t>& range :
+    unit_ranges[file_record_id])
+  {
+    for (uint64_t idx = 0; idx < range.second; idx++)
+      units_live[range.first + idx] = live;
+  }
+}
+
+
+void LocalRecordStore::truncate_units(uint64_t n)
+{
+  if (n >= units.size())
+    return;
+
+  uint64_t new_size = units[n].text_offset - sizeof(uint64_t) -
+    sizeof(uint32_t);
+  if (ftruncate(units_fd, new_size) != 0)
+    throw system_error("Cannot truncate the record store");
+
+  units.resize(n);
+  units_live.resize(n);
+  units_size = new_size;
+}
+
+
+void LocalRecordStore::update_mtime(const std::string& file_path,
+  long long mtime)
+{
+  auto it = ids_by_path.find(file_path);
+  if (it == ids_by_path.end())
+    return;
+
+  std::string buffer;
+  for (unsigned long file_record_id : it->second)
+  {
+    uint64_t id = file_record_id;
+    int64_t new_mtime = mtime;
+    append_value(buffer, &mtime_op, sizeof(mtime_op));
+    append_value(buffer, &id, sizeof(id));
+    append_value(buffer, &new_mtime, sizeof(new_mtime));
+  }
+  write_all(files_fd, buffer);
+
+  for (unsigned long file_record_id : it->second)
+    file_records[file_record_id].mtime(mtime);
+}
+
+
+void LocalRecordStore::write_record(FileRecord& record,
+  std::vector<std::pair<uint64_t, uint64_t>> ranges)
+{
+  unsigned long file_record_id = next_file_record_id;
+
+  // Records of a single run of units are written as by older versions.
+  std::string buffer;
+  uint64_t id = file_record_id;
+  uint64_t file_size = record.file_size();
+  int64_t mtime = record.mtime();
+  uint64_t content_hash = record.content_hash();
+  uint32_t path_size = record.file_path().size();
+  bool has_parts = ranges.size() != 1;
+  uint8_t op;
+  if (has_parts)
+    op = record.replaces_previous() ? replace_parts_op : add_parts_op;
+  else
+    op = record.replaces_previous() ? replace_op : add_op;
+  append_value(buffer, &op, sizeof(op));
+  append_value(buffer, &id, sizeof(id));
+  if (has_parts)
+  {
+    uint64_t n_ranges = ranges.size();
+    append_value(buffer, &n_ranges, sizeof(n_ranges));
+  }
+  for (const std::pair<uint64_t, uint64_t>& range : ranges)
+  {
+    append_value(buffer, &range.first, sizeof(range.first));
+    append_value(buffer, &range.second, sizeof(range.second));
+  }
+  append_value(buffer, &file_size, sizeof(file_size));
+  append_value(buffer, &mtime, sizeof(mtime));
+  append_value(buffer, &content_hash, sizeof(content_hash));
+  append_value(buffer, &path_size, sizeof(path_size));
+  buffer += record.file_path();
+  write_all(files_fd, buffer);
+
+  next_file_record_id++;
+  record.id(file_record_id);
+
+  if (record.replaces_previous())
+    forget(record.file_path());
+
+  FileRecord saved;
+  saved.id(file_record_id);
+  saved.file_path(record.file_path());
+  saved.file_size(record.file_size());
+  saved.mtime(record.mtime());
+  saved.content_hash(record.content_hash());
+  file_records[file_record_id] = saved;
+  ids_by_path[record.file_path()].push_back(file_record_id);
+  unit_ranges[file_record_id] = std::move(ranges);
+  own_units(file_record_id);
+  set_live(file_record_id, true);
+}
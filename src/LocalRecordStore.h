@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+
+/*
+File records and the text of their units, kept in append-only files of a
+directory for the in-process Database backends, which store the embeddings
+themselves. Unit IDs are consecutive from 0 in the order units are added,
+so a backend can use them as row numbers. Not thread-safe.
+*/
+class LocalRecordStore
+{
+  struct unit_entry
+  {
+    unsigned long file_record_id;
+    uint64_t text_offset;
+    uint32_t text_size;
+  };
+
+  int files_fd;
+  int units_fd;
+  std::unordered_map<unsigned long, FileRecord> file_records;
+  std::unordered_map<std::string, std::vector<unsigned long>> ids_by_path;
+  // First unit and number of units of each run of units of a file record,
+  // a single one unless its units were added ahead of it.
+  std::unordered_map<unsigned long, std::vector<std::pair<uint64_t, uint64_t>>>
+    unit_ranges;
+  std::vector<unit_entry> units;
+  std::vector<bool> units_live;
+  uint64_t units_size;
+  unsigned long next_file_record_id;
+
+  // Writes the text of the units, which belong to file_record_id, or to no
+  // record yet when it's 0. Returns the ID of the first one.
+  uint64_t append_units(const std::vector<TextUnit>& text_units,
+    unsigned long file_record_id);
+
+  void clean_up() noexcept;
+
+  // Drops the records of file_path from memory, once an operation replacing
+  // them is on disk.
+  void forget(const std::string& file_path);
+
+  // Sets the record of its units, which were written without it when added
+  // ahead of it.
+  void own_units(unsigned long file_record_id);
+
+  // Returns the size of the complete operations read.
+  uint64_t load_files(const std::filesystem::path& file_path);
+
+  void load_units(const std::filesystem::path& file_path);
+
+  void set_live(unsigned long file_record_id, bool live);
+
+  // Writes the operation adding the record, then keeps it in memory.
+  void write_record(FileRecord& record,
+    std::vector<std::pair<uint64_t, uint64_t>> ranges);
+
+public:
+
+  explicit LocalRecordStore(const std::filesystem::path& directory);
+
+  LocalRecordStore(const LocalRecordStore&) = delete;
+
+  LocalRecordStore& operator=(const LocalRecordStore&) = delete;
+
+  virtual ~LocalRecordStore();
+
+  // Saves the record and the text of its units, setting the ID of the record
+  // and of each unit. Returns the ID of the first unit. When the record
+  // replaces previous ones, they are dropped in the same write.
+  uint64_t add(FileRecord& record);
+
+  // Saves the record of the units added by add_units(), given as the first
+  // ID and the number of units of each call, in the same way as add().
+  void add_parts(FileRecord& record,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+  // Saves the text of units ahead of their record, which they are not live
+  // without. Returns the ID of the first one.
+  uint64_t add_units(const std::vector<TextUnit>& text_units);
+
+  std::vector<FileRecord> get_file_records() const;
+
+  bool is_live(uint64_t unit_id) const
+  {
+    return units_live[unit_id];
+  }
+
+  // Search result for a unit, with its text read from disk.
+  TextUnitResult result(uint64_t unit_id, float distance) const;
+
+  // Drops the units after the first n ones, which must belong to no record,
+  // like those written before a crash.
+  void truncate_units(uint64_t n);
+
+  // Sets the modification time of the records saved for file_path.
+  void update_mtime(const std::string& file_path, long long mtime);
+
+  uint64_t unit_count() const
+  {
+    return units.size();
+  }
+};
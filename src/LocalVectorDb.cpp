@@ -0,0 +1,126 @@
+#include "LocalVectorDb.h"
+
+#include <mutex>
+#include <stdexcept>
+
+
+namespace filesystem = std::filesystem;
+
+
+LocalVectorDb::LocalVectorDb(const filesystem::path& directory,
+  Metric metric):
+  metric(metric),
+  distance(get_distance_func(metric)),
+  matrix(directory / "embeddings.mat"),
+  records(directory)
+{
+}
+
+
+void LocalVectorDb::append_part(std::vector<TextUnit>& text_units,
+  FileParts& parts)
+{
+  // In the same order as in append_record().
+  try
+  {
+    for (const TextUnit& unit : text_units)
+    {
+      if (unit.embedding().empty())
+        throw std::runtime_error("Text unit without an embedding");
+
+      matrix.append(unit.embedding().data(), unit.embedding().size());
+    }
+
+    uint64_t first_unit = records.add_units(text_units);
+    parts.unit_ranges.emplace_back(first_unit, text_units.size());
+  }
+  catch (...)
+  {
+    matrix.truncate(records.unit_count());
+    throw;
+  }
+}
+
+
+void LocalVectorDb::append_record(FileRecord& record)
+{
+  // The rows are appended before the units are saved, so a unit always has
+  // its row: a crash in between leaves only rows that set_database_up()
+  // drops, and the file keeps its previous records, which the store only
+  // drops in the write adding the new one.
+  try
+  {
+    for (const TextUnit& unit : record.text_units())
+    {
+      if (unit.embedding().empty())
+        throw std::runtime_error("Text unit without an embedding");
+
+      matrix.append(unit.embedding().data(), unit.embedding().size());
+    }
+
+    records.add(record);
+  }
+  catch (...)
+  {
+    matrix.truncate(records.unit_count());
+    throw;
+  }
+}
+
+
+void
+LocalVectorDb::check_query_dimension(const std::vector<float>& embedding) const
+{
+  if (embedding.size() != matrix.dimension())
+  {
+    std::string msg("Query embedding of dimension ");
+    msg += std::to_string(embedding.size());
+    msg += " for a database of dimension ";
+    msg += std::to_string(matrix.dimension());
+    throw std::runtime_error(msg);
+  }
+}
+
+
+void LocalVectorDb::drop_file_parts(const FileParts& /*parts*/)
+{
+}
+
+
+void LocalVectorDb::drop_half_saved()
+{
+  if (matrix.rows() > records.unit_count())
+    matrix.truncate(records.unit_count());
+  else if (records.unit_count() > matrix.rows())
+    records.truncate_units(matrix.rows());
+}
+
+
+std::vector<FileRecord> LocalVectorDb::get_file_records()
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return records.get_file_records();
+}
+
+
+void LocalVectorDb::save_file_record_with_parts(FileRecord& record,
+  const FileParts& parts)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  records.add_parts(record, parts.unit_ranges);
+}
+
+
+void LocalVectorDb::set_database_up()
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  drop_half_saved();
+}
+
+
+void LocalVectorDb::update_file_mtime(const std::string& file_path,
+  long long mtime)
+{
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  records.update_mtime(file_path, mtime);
+}
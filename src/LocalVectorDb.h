@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "EmbeddingMatrix.h"
+#include "LocalRecordStore.h"
+#include "VectorKernels.h"
+
+
+/*
+Base of the databases kept in a directory by the process itself: the
+embeddings are the rows of a matrix, and row i is the embedding of the unit
+of ID i in the record store. Saving appends the rows first, so a crash can
+only leave rows without units, which set_database_up() drops.
+*/
+class LocalVectorDb: public Database
+{
+protected:
+
+  Metric metric;
+  DistanceFunc distance;
+  // Held exclusively to change the matrix or the records.
+  std::shared_mutex mutex;
+  EmbeddingMatrix matrix;
+  LocalRecordStore records;
+
+  // Appends the rows of the units then saves them ahead of their record,
+  // leaving the matrix as it was on an error. Needs the exclusive lock.
+  void append_part(std::vector<TextUnit>& text_units, FileParts& parts);
+
+  // Appends the rows of the record then saves it, leaving the matrix as it
+  // was on an error. Needs the exclusive lock.
+  void append_record(FileRecord& record);
+
+  // Throws if the query can't be compared with the rows.
+  void check_query_dimension(const std::vector<float>& embedding) const;
+
+  // Makes the matrix and the records agree on the number of units, after a
+  // crash. Needs the exclusive lock.
+  void drop_half_saved();
+
+public:
+
+  LocalVectorDb(const std::filesystem::path& directory, Metric metric);
+
+  // The units saved ahead of a record are never live without it, so they
+  // are only left behind, like those of replaced records.
+  virtual void drop_file_parts(const FileParts& parts) override;
+
+  virtual std::vector<FileRecord> get_file_records() override;
+
+  virtual void save_file_record_with_parts(FileRecord& record,
+    const FileParts& parts) override;
+
+  // Drops what a crash left half saved. Can be called more than once.
+  virtual void set_database_up() override;
+
+  // Sets the modification time of the records saved for the file path, when
+  // only it changed.
+  virtual void update_file_mtime(const std::string& file_path,
+    long long mtime) override;
+};
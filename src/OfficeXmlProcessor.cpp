@@ -0,0 +1,657 @@
+#include "OfficeXmlProcessor.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <strings.h>
+
+
+typedef OfficeXmlProcessor::element_kind element_kind;
+
+struct known_element
+{
+  const char* name;
+  element_kind kind;
+};
+
+static const known_element odf_office_elements[] = {
+  {"text", element_kind::body},
+  {"annotation", element_kind::skipped}
+};
+
+static const known_element odf_text_elements[] = {
+  {"p", element_kind::paragraph},
+  {"h", element_kind::heading},
+  {"s", element_kind::spaces},
+  {"tab", element_kind::tab},
+  {"line-break", element_kind::line_break},
+  {"note", element_kind::skipped},
+  {"tracked-changes", element_kind::skipped}
+};
+
+static const known_element wordprocessingml_elements[] = {
+  {"body", element_kind::body},
+  {"p", element_kind::paragraph},
+  {"pPr", element_kind::paragraph_properties},
+  {"pStyle", element_kind::paragraph_style},
+  {"outlineLvl", element_kind::outline_level},
+  {"r", element_kind::run},
+  {"t", element_kind::text},
+  {"tab", element_kind::tab},
+  {"br", element_kind::line_break},
+  {"cr", element_kind::line_break},
+  {"noBreakHyphen", element_kind::hyphen},
+  {"tbl", element_kind::skipped},
+  {"txbxContent", element_kind::skipped}
+};
+
+static const known_element markup_compatibility_elements[] = {
+  {"Fallback", element_kind::skipped}
+};
+
+static const char odf_office_uri[] =
+  "urn:oasis:names:tc:opendocument:xmlns:office:1.0";
+static const char odf_text_uri[] =
+  "urn:oasis:names:tc:opendocument:xmlns:text:1.0";
+static const char odf_table_uri[] =
+  "urn:oasis:names:tc:opendocument:xmlns:table:1.0";
+static const char odf_drawing_uri[] =
+  "urn:oasis:names:tc:opendocument:xmlns:drawing:1.0";
+// Transitional and strict variants of Office Open XML.
+static const char wordprocessingml_uri[] =
+  "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
+static const char strict_wordprocessingml_uri[] =
+  "http://purl.oclc.org/ooxml/wordprocessingml/main";
+static const char markup_compatibility_uri[] =
+  "http://schemas.openxmlformats.org/markup-compatibility/2006";
+
+// Spaces a single text:s stands for at most, against absurd counts.
+static constexpr long max_spaces = 1024;
+
+// Steps followed through the styles a DOCX style is based on.
+static constexpr int max_style_depth = 16;
+
+// Size of the text of the units held while a document is parsed, past
+// which they are emitted. Bounds the memory of a document whose entry
+// inflates to a huge size.
+static constexpr size_t max_held_size = 4 * 1024 * 1024;
+
+
+template<size_t N>
+static element_kind find_element_kind(const known_element (&elements)[N],
+  const xmlChar* local_name)
+{
+  const char* name = reinterpret_cast<const char*>(local_name);
+  for (const known_element& element : elements)
+  {
+    if (std::strcmp(name, element.name) == 0)
+      return element.kind;
+  }
+
+  return element_kind::other;
+}
+
+
+/*
+Value of the attribute with the local name, in the namespace of uri, from
+the attributes given by the SAX2 parser: local name, prefix, URI, and start
+and end of the value for each.
+*/
+static bool get_attribute(const xmlChar** attributes, int n_attributes,
+  const xmlChar* uri, const char* local_name, std::string& value)
+{
+  for (int idx = 0; idx < n_attributes; idx++)
+  {
+    const xmlChar** attribute = attributes + idx * 5;
+    if (std::strcmp(reinterpret_cast<const char*>(attribute[0]),
+      local_name) != 0)
+      continue;
+
+    if (uri && attribute[2] && !xmlStrEqual(uri, attribute[2]))
+      continue;
+
+    value.assign(reinterpret_cast<const char*>(attribute[3]),
+      attribute[4] - attribute[3]);
+    return true;
+  }
+
+  return false;
+}
+
+
+static bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+OfficeXmlProcessor::
+OfficeXmlProcessor(LibreOfficePool& office_pool,
+  const TextChunker::limits& chunk_limits, TextUnitFunc on_text_unit_func):
+  office_pool(office_pool),
+  chunk_limits(chunk_limits),
+  _on_text_unit_func(std::move(on_text_unit_func)),
+  parsed_size(0),
+  emitting(false),
+  chunker(chunk_limits, [this](TextUnit&& unit) {
+    on_parsed_unit(std::move(unit));
+  }),
+  body_sax_handler({}),
+  styles_sax_handler({}),
+  last_uri(nullptr),
+  last_namespace(xml_namespace::other),
+  format(doc_format::odt),
+  curr_style(nullptr)
+{
+  reset_state();
+
+  body_sax_handler.initialized = XML_SAX2_MAGIC;
+  body_sax_handler.startElementNs = on_start_element_func;
+  body_sax_handler.endElementNs = on_end_element_func;
+  body_sax_handler.characters = on_characters_func;
+  // Blanks in w:t elements are text.
+  body_sax_handler.ignorableWhitespace = on_characters_func;
+  body_sax_handler.cdataBlock = on_characters_func;
+
+  styles_sax_handler.initialized = XML_SAX2_MAGIC;
+  styles_sax_handler.startElementNs = on_start_style_func;
+  styles_sax_handler.endElementNs = on_end_style_func;
+}
+
+
+void OfficeXmlProcessor::emit_parsed_units()
+{
+  emitting = true;
+  for (TextUnit& unit : parsed_units)
+    _on_text_unit_func(std::move(unit));
+  parsed_units.clear();
+  parsed_size = 0;
+}
+
+
+void OfficeXmlProcessor::end_paragraph()
+{
+  if (format == doc_format::docx)
+  {
+    // Set on the paragraph, else through its style.
+    is_heading = outline_level == 0 ||
+      (outline_level < 0 && heading_styles.count(style_id) != 0);
+  }
+
+  if (is_heading)
+    chunker.end_unit();
+
+  if (!(is_all_spaces(paragraph_text.c_str()) && paragraph_text.size() > 1))
+    chunker.append(paragraph_text);
+
+  if (!chunker.empty())
+    chunker.append("\n", 1);
+
+  paragraph_text.clear();
+}
+
+
+bool OfficeXmlProcessor::extract_text(const char* file_path)
+{
+  parsed_units.clear();
+  parsed_size = 0;
+  emitting = false;
+  chunker.clear();
+
+  try
+  {
+    ZipArchive archive(file_path);
+
+    if (archive.has_entry("content.xml"))
+    {
+      format = doc_format::odt;
+      parse_entry(archive, "content.xml", body_sax_handler, file_path);
+    }
+    else if (archive.has_entry("word/document.xml"))
+    {
+      format = doc_format::docx;
+      read_docx_styles(archive, file_path);
+      parse_entry(archive, "word/document.xml", body_sax_handler, file_path);
+    }
+    else
+    {
+      std::cerr << "Neither content.xml nor word/document.xml in \""
+        << file_path << "\".\n";
+      return false;
+    }
+  }
+  catch (const ZipArchive::format_error& error)
+  {
+    chunker.clear();
+    if (emitting)
+      throw file_error(error.what());
+
+    std::cerr << error.what() << "\n";
+    parsed_units.clear();
+    return false;
+  }
+  catch (const parse_error& error)
+  {
+    chunker.clear();
+    if (emitting)
+      throw file_error(error.what());
+
+    std::cerr << error.what() << "\n";
+    parsed_units.clear();
+    return false;
+  }
+
+  chunker.end_unit();
+  return true;
+}
+
+
+OfficeXmlProcessor::xml_namespace
+OfficeXmlProcessor::get_namespace(const xmlChar* uri)
+{
+  if (uri == last_uri)
+    return last_namespace;
+
+  last_uri = uri;
+  last_namespace = xml_namespace::other;
+  if (!uri)
+    return last_namespace;
+
+  const char* uri_str = reinterpret_cast<const char*>(uri);
+  if (std::strcmp(uri_str, odf_text_uri) == 0)
+    last_namespace = xml_namespace::odf_text;
+  else if (std::strcmp(uri_str, odf_office_uri) == 0)
+    last_namespace = xml_namespace::odf_office;
+  else if (std::strcmp(uri_str, odf_table_uri) == 0 ||
+    std::strcmp(uri_str, odf_drawing_uri) == 0)
+    last_namespace = xml_namespace::odf_skipped;
+  else if (std::strcmp(uri_str, wordprocessingml_uri) == 0 ||
+    std::strcmp(uri_str, strict_wordprocessingml_uri) == 0)
+    last_namespace = xml_namespace::wordprocessingml;
+  else if (std::strcmp(uri_str, markup_compatibility_uri) == 0)
+    last_namespace = xml_namespace::markup_compatibility;
+
+  return last_namespace;
+}
+
+
+void OfficeXmlProcessor::on_characters_func(void* ctx, const xmlChar* text,
+  int len)
+{
+  OfficeXmlProcessor* self = static_cast<OfficeXmlProcessor*>(ctx);
+  const char* _text = reinterpret_cast<const char*>(text);
+
+  if (self->skip_depth || !self->paragraph_depth)
+    return;
+
+  if (self->format == doc_format::docx)
+  {
+    if (self->in_text)
+      self->paragraph_text.append(_text, len);
+    return;
+  }
+
+  for (int idx = 0; idx < len; idx++)
+  {
+    if (!is_blank(_text[idx]))
+    {
+      self->paragraph_text += _text[idx];
+      self->last_was_blank = false;
+    }
+    else if (!self->last_was_blank)
+    {
+      self->paragraph_text += ' ';
+      self->last_was_blank = true;
+    }
+  }
+}
+
+
+void OfficeXmlProcessor::on_end_element_func(void* ctx,
+  const xmlChar* local_name, const xmlChar* /* prefix */, const xmlChar* uri)
+{
+  OfficeXmlProcessor* self = static_cast<OfficeXmlProcessor*>(ctx);
+
+  if (self->skip_depth)
+  {
+    self->skip_depth--;
+    return;
+  }
+
+  xml_namespace ns = self->get_namespace(uri);
+  element_kind kind = element_kind::other;
+  if (ns == xml_namespace::odf_text)
+    kind = find_element_kind(odf_text_elements, local_name);
+  else if (ns == xml_namespace::odf_office)
+    kind = find_element_kind(odf_office_elements, local_name);
+  else if (ns == xml_namespace::wordprocessingml)
+    kind = find_element_kind(wordprocessingml_elements, local_name);
+
+  switch (kind)
+  {
+  case element_kind::body:
+    self->in_body = false;
+    break;
+  case element_kind::paragraph:
+  case element_kind::heading:
+    if (self->paragraph_depth && --self->paragraph_depth == 0)
+      self->end_paragraph();
+    break;
+  case element_kind::paragraph_properties:
+    self->in_paragraph_properties = false;
+    break;
+  case element_kind::run:
+    self->in_run = false;
+    self->in_text = false;
+    break;
+  case element_kind::text:
+    self->in_text = false;
+    break;
+  default:
+    break;
+  }
+}
+
+
+void OfficeXmlProcessor::on_end_style_func(void* ctx,
+  const xmlChar* local_name, const xmlChar* /* prefix */, const xmlChar* uri)
+{
+  OfficeXmlProcessor* self = static_cast<OfficeXmlProcessor*>(ctx);
+
+  if (self->get_namespace(uri) == xml_namespace::wordprocessingml &&
+    xmlStrEqual(local_name, BAD_CAST "style"))
+    self->curr_style = nullptr;
+}
+
+
+void OfficeXmlProcessor::on_parsed_unit(TextUnit&& unit)
+{
+  if (emitting)
+  {
+    _on_text_unit_func(std::move(unit));
+    return;
+  }
+
+  parsed_size += unit.text().size();
+  parsed_units.push_back(std::move(unit));
+  if (parsed_size > max_held_size)
+    emit_parsed_units();
+}
+
+
+void OfficeXmlProcessor::on_start_element_func(void* ctx,
+  const xmlChar* local_name, const xmlChar* /* prefix */, const xmlChar* uri,
+  int /* n_namespaces */, const xmlChar** /* namespaces */, int n_attributes,
+  int /* n_defaulted */, const xmlChar** attributes)
+{
+  OfficeXmlProcessor* self = static_cast<OfficeXmlProcessor*>(ctx);
+
+  if (self->skip_depth)
+  {
+    self->skip_depth++;
+    return;
+  }
+
+  element_kind kind = element_kind::other;
+  switch (self->get_namespace(uri))
+  {
+  case xml_namespace::odf_text:
+    kind = find_element_kind(odf_text_elements, local_name);
+    break;
+  case xml_namespace::odf_office:
+    kind = find_element_kind(odf_office_elements, local_name);
+    break;
+  case xml_namespace::odf_skipped:
+    kind = element_kind::skipped;
+    break;
+  case xml_namespace::wordprocessingml:
+    kind = find_element_kind(wordprocessingml_elements, local_name);
+    break;
+  case xml_namespace::markup_compatibility:
+    kind = find_element_kind(markup_compatibility_elements, local_name);
+    break;
+  default:
+    break;
+  }
+
+  std::string value;
+  bool is_odt = self->format == doc_format::odt;
+
+  switch (kind)
+  {
+  case element_kind::body:
+    self->in_body = true;
+    break;
+  case element_kind::skipped:
+    if (self->in_body)
+      self->skip_depth = 1;
+    break;
+  case element_kind::paragraph:
+  case element_kind::heading:
+    if (!self->in_body || self->paragraph_depth++ != 0)
+      break;
+
+    self->is_heading = false;
+    self->outline_level = -1;
+    self->style_id.clear();
+    // Blanks at the start of an ODT paragraph are dropped.
+    self->last_was_blank = true;
+
+    if (kind == element_kind::heading)
+    {
+      // Headings are of level 1 unless told otherwise.
+      self->is_heading = !get_attribute(attributes, n_attributes, uri,
+        "outline-level", value) || value == "1";
+    }
+    break;
+  case element_kind::paragraph_properties:
+    self->in_paragraph_properties = self->paragraph_depth != 0;
+    break;
+  case element_kind::paragraph_style:
+    if (self->in_paragraph_properties &&
+      get_attribute(attributes, n_attributes, uri, "val", value))
+      self->style_id = value;
+    break;
+  case element_kind::outline_level:
+    if (self->in_paragraph_properties &&
+      get_attribute(attributes, n_attributes, uri, "val", value))
+      self->outline_level = std::atoi(value.c_str());
+    break;
+  case element_kind::run:
+    self->in_run = self->paragraph_depth != 0;
+    break;
+  case element_kind::text:
+    self->in_text = self->in_run;
+    break;
+  case element_kind::spaces:
+    if (self->paragraph_depth)
+    {
+      long count = 1;
+      if (get_attribute(attributes, n_attributes, uri, "c", value))
+        count = std::clamp(std::atol(value.c_str()), 1L, max_spaces);
+      self->paragraph_text.append(count, ' ');
+      self->last_was_blank = true;
+    }
+    break;
+  case element_kind::tab:
+    // A w:tab out of a run is a tab stop.
+    if (self->paragraph_depth && (is_odt || self->in_run))
+    {
+      self->paragraph_text += '\t';
+      self->last_was_blank = true;
+    }
+    break;
+  case element_kind::line_break:
+    if (self->paragraph_depth && (is_odt || self->in_run))
+    {
+      // Page and column breaks aren't part of the text.
+      if (!is_odt &&
+        get_attribute(attributes, n_attributes, uri, "type", value) &&
+        value != "textWrapping")
+        break;
+
+      self->paragraph_text += '\n';
+      self->last_was_blank = true;
+    }
+    break;
+  case element_kind::hyphen:
+    if (self->in_run)
+      self->paragraph_text += '-';
+    break;
+  default:
+    break;
+  }
+}
+
+
+void OfficeXmlProcessor::on_start_style_func(void* ctx,
+  const xmlChar* local_name, const xmlChar* /* prefix */, const xmlChar* uri,
+  int /* n_namespaces */, const xmlChar** /* namespaces */, int n_attributes,
+  int /* n_defaulted */, const xmlChar** attributes)
+{
+  OfficeXmlProcessor* self = static_cast<OfficeXmlProcessor*>(ctx);
+
+  if (self->get_namespace(uri) != xml_namespace::wordprocessingml)
+    return;
+
+  std::string value;
+  if (xmlStrEqual(local_name, BAD_CAST "style"))
+  {
+    if (get_attribute(attributes, n_attributes, uri, "styleId", value))
+      self->curr_style = &self->styles[value];
+    return;
+  }
+
+  if (!self->curr_style ||
+    !get_attribute(attributes, n_attributes, uri, "val", value))
+    return;
+
+  if (xmlStrEqual(local_name, BAD_CAST "basedOn"))
+    self->curr_style->based_on = value;
+  else if (xmlStrEqual(local_name, BAD_CAST "name"))
+  {
+    // Built-in heading style, whose outline level Word leaves implied.
+    if (strcasecmp(value.c_str(), "heading 1") == 0 &&
+      self->curr_style->outline_level < 0)
+      self->curr_style->outline_level = 0;
+  }
+  else if (xmlStrEqual(local_name, BAD_CAST "outlineLvl"))
+    self->curr_style->outline_level = std::atoi(value.c_str());
+}
+
+
+void OfficeXmlProcessor::parse_entry(const ZipArchive& archive,
+  const char* entry_name, xmlSAXHandler& sax_handler, const char* file_path)
+{
+  reset_state();
+
+  std::unique_ptr<xmlParserCtxt, void (*)(xmlParserCtxtPtr)> ctxt(
+    xmlCreatePushParserCtxt(&sax_handler, this, nullptr, 0, file_path),
+    xmlFreeParserCtxt);
+  if (!ctxt)
+    throw std::runtime_error("xmlCreatePushParserCtxt() failed");
+
+  // Errors are reported through the exception, and nothing is fetched
+  // from the network.
+  xmlCtxtUseOptions(ctxt.get(),
+    XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING |
+    XML_PARSE_HUGE);
+
+  archive.read_entry(entry_name, [&](const char* data, size_t size) {
+    if (ctxt->wellFormed)
+      xmlParseChunk(ctxt.get(), data, size, 0);
+  });
+  if (ctxt->wellFormed)
+    xmlParseChunk(ctxt.get(), nullptr, 0, 1);
+
+  if (!ctxt->wellFormed)
+  {
+    std::string msg("Cannot parse ");
+    msg += entry_name;
+    msg += " of \"";
+    msg += file_path;
+    msg += "\"";
+    xmlErrorPtr error = xmlCtxtGetLastError(ctxt.get());
+    if (error && error->message)
+    {
+      msg += ": ";
+      msg += error->message;
+      // The messages of libxml2 end with a new line.
+      while (!msg.empty() && msg.back() == '\n')
+        msg.pop_back();
+    }
+    else
+      msg += ".";
+    throw parse_error(msg);
+  }
+}
+
+
+void OfficeXmlProcessor::process_file(const char* file_path)
+{
+  if (extract_text(file_path))
+  {
+    emit_parsed_units();
+    return;
+  }
+
+  std::cerr << "Extracting the text of \"" << file_path
+    << "\" with LibreOffice.\n";
+  if (!fallback_processor)
+  {
+    fallback_processor = std::make_unique<OpenDocProcessor>(office_pool,
+      chunk_limits, _on_text_unit_func);
+  }
+  fallback_processor->process_file(file_path);
+}
+
+
+void OfficeXmlProcessor::read_docx_styles(const ZipArchive& archive,
+  const char* file_path)
+{
+  styles.clear();
+  heading_styles.clear();
+  if (!archive.has_entry("word/styles.xml"))
+    return;
+
+  parse_entry(archive, "word/styles.xml", styles_sax_handler, file_path);
+
+  for (const auto& [id, style] : styles)
+  {
+    const paragraph_style* base = &style;
+    for (int depth = 0; base && base->outline_level < 0 &&
+      depth < max_style_depth; depth++)
+    {
+      auto iter = styles.find(base->based_on);
+      base = iter != styles.end() ? &iter->second : nullptr;
+    }
+
+    if (base && base->outline_level == 0)
+      heading_styles.insert(id);
+  }
+
+  styles.clear();
+}
+
+
+void OfficeXmlProcessor::reset_state()
+{
+  // Interned strings of the previous parser may be gone.
+  last_uri = nullptr;
+  last_namespace = xml_namespace::other;
+  in_body = false;
+  skip_depth = 0;
+  paragraph_depth = 0;
+  in_paragraph_properties = false;
+  in_run = false;
+  in_text = false;
+  is_heading = false;
+  outline_level = -1;
+  style_id.clear();
+  paragraph_text.clear();
+  last_was_blank = true;
+  curr_style = nullptr;
+}
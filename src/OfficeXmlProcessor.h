@@ -0,0 +1,191 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <libxml/parser.h>
+
+#include "LibreOfficePool.h"
+#include "OpenDocProcessor.h"
+#include "TextChunker.h"
+#include "ZipArchive.h"
+
+
+/*
+Extracts the text of ODT and DOCX documents straight from the XML of their
+body, streamed out of the zip container into the SAX parser of libxml2.
+Like OpenDocProcessor, it gives the text of the paragraphs outside tables,
+frames and notes, with a unit starting at each heading of outline level 1.
+Documents it can't read are handed to an OpenDocProcessor, so the office is
+only started for them, unless they fail past the text it holds back.
+*/
+class OfficeXmlProcessor : public FileProcessor
+{
+public:
+
+  // What an element does to the extracted text.
+  enum class element_kind : uint8_t
+  {
+    other,
+    // office:text, w:body.
+    body,
+    // text:p, w:p.
+    paragraph,
+    // text:h, whose outline level is an attribute.
+    heading,
+    // w:pPr, holding the style and outline level of a DOCX paragraph.
+    paragraph_properties,
+    // w:pStyle.
+    paragraph_style,
+    // w:outlineLvl, from 0 for level 1.
+    outline_level,
+    // w:r.
+    run,
+    // w:t, the only element whose text is extracted in DOCX.
+    text,
+    // text:s, with the number of spaces as an attribute.
+    spaces,
+    // text:tab, w:tab in a run.
+    tab,
+    // text:line-break, w:br and w:cr.
+    line_break,
+    // w:noBreakHyphen.
+    hyphen,
+    // Element whose content isn't extracted, tables and frames among them.
+    skipped
+  };
+
+private:
+
+  enum class xml_namespace : uint8_t
+  {
+    other,
+    odf_office,
+    odf_text,
+    // Namespaces of ODF tables and drawings, whose content is skipped.
+    odf_skipped,
+    wordprocessingml,
+    // Alternative content for consumers not handling the preferred one.
+    markup_compatibility
+  };
+
+  // Thrown when the XML of a document isn't well-formed.
+  class parse_error: public std::runtime_error
+  {
+  public:
+
+    using std::runtime_error::runtime_error;
+  };
+
+  enum class doc_format : uint8_t
+  {
+    odt,
+    docx
+  };
+
+  // DOCX paragraph style, as far as outline levels go.
+  struct paragraph_style
+  {
+    std::string based_on;
+    // From 0 for level 1, -1 when not set.
+    int outline_level = -1;
+  };
+
+  LibreOfficePool& office_pool;
+  TextChunker::limits chunk_limits;
+  TextUnitFunc _on_text_unit_func;
+  std::unique_ptr<OpenDocProcessor> fallback_processor;
+  // First units of the document being parsed, held until it's all parsed
+  // or they grow past max_held_size, so a document handed to the fallback
+  // emits nothing twice.
+  std::vector<TextUnit> parsed_units;
+  // Size of the text of parsed_units.
+  size_t parsed_size;
+  // Whether the units are given to _on_text_unit_func as they are cut, so
+  // a document that fails from then on can't be handed to the fallback.
+  bool emitting;
+  TextChunker chunker;
+  xmlSAXHandler body_sax_handler;
+  xmlSAXHandler styles_sax_handler;
+
+  // Namespace URI last looked up, interned by the parser.
+  const xmlChar* last_uri;
+  xml_namespace last_namespace;
+
+  doc_format format;
+  bool in_body;
+  // Depth of the elements entered in a skipped one, 0 outside of them.
+  unsigned skip_depth;
+  // Depth of the paragraphs entered, which only nest in skipped elements.
+  unsigned paragraph_depth;
+  bool in_paragraph_properties;
+  bool in_run;
+  bool in_text;
+  bool is_heading;
+  int outline_level;
+  std::string style_id;
+  std::string paragraph_text;
+  // In ODT, blanks are collapsed into a single space.
+  bool last_was_blank;
+
+  // DOCX styles by ID, and those of outline level 1.
+  std::unordered_map<std::string, paragraph_style> styles;
+  paragraph_style* curr_style;
+  std::unordered_set<std::string> heading_styles;
+
+  // Gives the units held to _on_text_unit_func, and the next ones as they
+  // are cut.
+  void emit_parsed_units();
+
+  // Emits the text of the paragraph, after ending the unit at a heading.
+  void end_paragraph();
+
+  // Returns false, after telling why, when the document isn't readable
+  // without the office. Throws FileProcessor::file_error when it isn't
+  // once some of its units were emitted.
+  bool extract_text(const char* file_path);
+
+  xml_namespace get_namespace(const xmlChar* uri);
+
+  // Sets heading_styles from word/styles.xml, when present.
+  void read_docx_styles(const ZipArchive& archive, const char* file_path);
+
+  void parse_entry(const ZipArchive& archive, const char* entry_name,
+    xmlSAXHandler& sax_handler, const char* file_path);
+
+  void on_parsed_unit(TextUnit&& unit);
+
+  void reset_state();
+
+  static void on_characters_func(void* ctx, const xmlChar* text, int len);
+
+  static void on_end_element_func(void* ctx, const xmlChar* local_name,
+    const xmlChar* prefix, const xmlChar* uri);
+
+  static void on_end_style_func(void* ctx, const xmlChar* local_name,
+    const xmlChar* prefix, const xmlChar* uri);
+
+  static void on_start_element_func(void* ctx, const xmlChar* local_name,
+    const xmlChar* prefix, const xmlChar* uri, int n_namespaces,
+    const xmlChar** namespaces, int n_attributes, int n_defaulted,
+    const xmlChar** attributes);
+
+  static void on_start_style_func(void* ctx, const xmlChar* local_name,
+    const xmlChar* prefix, const xmlChar* uri, int n_namespaces,
+    const xmlChar** namespaces, int n_attributes, int n_defaulted,
+    const xmlChar** attributes);
+
+public:
+
+  OfficeXmlProcessor(LibreOfficePool& office_pool,
+    const TextChunker::limits& chunk_limits, TextUnitFunc on_text_unit_func);
+
+  virtual void process_file(const char* file_path) override;
+};
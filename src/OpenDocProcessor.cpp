@@ -2,8 +2,8 @@
 
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
-#include <cppuhelper/bootstrap.hxx>
 #include <com/sun/star/uno/Any.hxx>
 #include <com/sun/star/container/XEnumerationAccess.hpp>
 #include <com/sun/star/beans/PropertyValue.hpp>
@@ -13,11 +13,13 @@
 #include <com/sun/star/text/XTextRange.hpp>
 #include <com/sun/star/text/XTextContent.hpp>
 #include <com/sun/star/text/XTextCursor.hpp>
+#include <com/sun/star/util/XCloseable.hpp>
 #include <com/sun/star/lang/XComponent.hpp>
 #include <com/sun/star/lang/XServiceInfo.hpp>
 #include <com/sun/star/awt/ActionEvent.hpp>
 #include <com/sun/star/awt/MouseEvent.hpp>
 #include <com/sun/star/container/XIndexAccess.hpp>
+#include <com/sun/star/uno/Exception.hpp>
 #include <osl/file.hxx>
 #include <rtl/process.h>
 
@@ -25,59 +27,53 @@
 using com::sun::star::beans::XPropertySet;
 using com::sun::star::container::XEnumeration;
 using com::sun::star::container::XEnumerationAccess;
-using com::sun::star::frame::XComponentLoader;
-using com::sun::star::frame::XDesktop;
 using com::sun::star::lang::XComponent;
-using com::sun::star::lang::XMultiComponentFactory;
 using com::sun::star::lang::XServiceInfo;
 using com::sun::star::text::XText;
 using com::sun::star::text::XTextCursor;
 using com::sun::star::text::XTextDocument;
 using com::sun::star::text::XTextRange;
+using com::sun::star::util::XCloseable;
 
 
-OpenDocProcessor::
-OpenDocProcessor(std::function<void(const TextUnit&)> on_text_unit_func):
-  _on_text_unit_func(on_text_unit_func)
+/*
+Closes the document so the office frees it, which it doesn't do when the
+last reference to it goes away.
+*/
+static void close_document(const css::uno::Reference<XComponent>& document)
+  noexcept
 {
-  // Initialize LibreOffice environment
-  xComponentContext = ::cppu::bootstrap();
-  xMultiComponentFactory = xComponentContext->getServiceManager();
-  if (!xMultiComponentFactory.is())
-  {
-    throw std::runtime_error("Could not create the XMultiServiceFactory.");
-  }
+  if (!document.is())
+    return;
 
-  xDesktop = css::uno::Reference<XDesktop>(xMultiComponentFactory->
-    createInstanceWithContext("com.sun.star.frame.Desktop", xComponentContext),
-    css::uno::UNO_QUERY);
-  if (!xDesktop.is())
+  try
   {
-    throw std::runtime_error("Could not create the XDesktop.");
+    css::uno::Reference<XCloseable> xCloseable(document, css::uno::UNO_QUERY);
+    if (xCloseable.is())
+      xCloseable->close(true);
+    else
+      document->dispose();
   }
-
-  xComponentLoader = css::uno::Reference<XComponentLoader>(xDesktop, css::uno::UNO_QUERY);
-  if (!xComponentLoader.is())
+  catch (const css::uno::Exception&)
   {
-    throw std::runtime_error("Could not create the XComponentLoader.");
+    // The document is then closed with the process.
   }
 }
 
 
-void OpenDocProcessor::process_file(const char* file_path)
+OpenDocProcessor::
+OpenDocProcessor(LibreOfficePool& office_pool,
+  const TextChunker::limits& chunk_limits, TextUnitFunc on_text_unit_func):
+  office_pool(office_pool),
+  chunker(chunk_limits, std::move(on_text_unit_func))
 {
-  // Opening the document
-  rtl::OUString wdir;
-  osl_getProcessWorkingDir(&wdir.pData);
-  rtl::OUString url;
-  osl::FileBase::getFileURLFromSystemPath(rtl::OUString::fromUtf8(rtl::OString(file_path)), url);
-  rtl::OUString absUrl;
-  osl::FileBase::getAbsoluteFileURL(wdir, url, absUrl);
-  css::uno::Sequence<css::beans::PropertyValue> loadProps(1);
-  loadProps[0].Name = "Hidden";
-  loadProps[0].Value <<= true;
-  css::uno::Reference<XComponent> xLoadedDoc = xComponentLoader->loadComponentFromURL(absUrl, "_blank", 0, loadProps);
-  css::uno::Reference<XTextDocument> xTextDoc(xLoadedDoc, css::uno::UNO_QUERY_THROW);
+}
+
+
+void OpenDocProcessor::
+extract_text(const css::uno::Reference<XComponent>& document)
+{
+  css::uno::Reference<XTextDocument> xTextDoc(document, css::uno::UNO_QUERY_THROW);
 
   // Get the text object
   css::uno::Reference<XText> xDocText = xTextDoc->getText();
@@ -97,15 +93,7 @@ void OpenDocProcessor::process_file(const char* file_path)
     xParProps->getPropertyValue("OutlineLevel") >>= outlineLevel;
 
     if (outlineLevel == 1)
-    {
-      if (!curr_text.empty())
-      {
-        TextUnit unit;
-        unit.text(curr_text);
-        _on_text_unit_func(unit);
-        curr_text.clear();
-      }
-    }
+      chunker.end_unit();
 
     while (xTexts->hasMoreElements())
     {
@@ -116,19 +104,77 @@ void OpenDocProcessor::process_file(const char* file_path)
 
       if (!(is_all_spaces(u8text.getStr()) && u8text.getLength() > 1))
       {
-        curr_text += u8text.getStr();
+        chunker.append(u8text.getStr(), u8text.getLength());
       }
     }
 
-    if (!curr_text.empty())
-      curr_text += "\n";
+    if (!chunker.empty())
+      chunker.append("\n", 1);
+  }
+
+  chunker.end_unit();
+}
+
+
+void OpenDocProcessor::process_file(const char* file_path)
+{
+  // Text left by a document that failed.
+  chunker.clear();
+
+  LibreOfficePool::lease office = office_pool.acquire();
+
+  // Opening the document
+  rtl::OUString wdir;
+  osl_getProcessWorkingDir(&wdir.pData);
+  rtl::OUString url;
+  osl::FileBase::getFileURLFromSystemPath(rtl::OUString::fromUtf8(rtl::OString(file_path)), url);
+  rtl::OUString absUrl;
+  osl::FileBase::getAbsoluteFileURL(wdir, url, absUrl);
+  css::uno::Sequence<css::beans::PropertyValue> loadProps(1);
+  loadProps[0].Name = "Hidden";
+  loadProps[0].Value <<= true;
+
+  css::uno::Reference<XComponent> xLoadedDoc;
+  try
+  {
+    xLoadedDoc = office.component_loader()->loadComponentFromURL(absUrl, "_blank", 0, loadProps);
+    extract_text(xLoadedDoc);
   }
+  catch (const css::uno::Exception& e)
+  {
+    // The handler below doesn't see what this one throws.
+    chunker.clear();
+    close_document(xLoadedDoc);
+
+    if (office.timed_out())
+    {
+      std::string msg("Timed out extracting the text of \"");
+      msg += file_path;
+      msg += "\".";
+      throw LibreOfficePool::timeout_error(msg);
+    }
 
-  if (!curr_text.empty())
+    std::string msg("Cannot extract the text of \"");
+    msg += file_path;
+    msg += "\": ";
+
+    if (office.over_memory())
+    {
+      msg += "LibreOffice used too much memory.";
+      throw file_error(msg);
+    }
+
+    // The office may be left in any state, so it's replaced.
+    office.fail();
+
+    msg += rtl::OUStringToOString(e.Message, RTL_TEXTENCODING_UTF8).getStr();
+    throw file_error(msg);
+  }
+  catch (...)
   {
-    TextUnit unit;
-    unit.text(curr_text);
-    _on_text_unit_func(unit);
-    curr_text.clear();
+    close_document(xLoadedDoc);
+    throw;
   }
+
+  close_document(xLoadedDoc);
 }
@@ -4,26 +4,30 @@
 
 #include <functional>
 
-#include <com/sun/star/frame/XComponentLoader.hpp>
-#include <com/sun/star/frame/XDesktop.hpp>
-#include <com/sun/star/lang/XMultiComponentFactory.hpp>
+#include <com/sun/star/lang/XComponent.hpp>
 #include <com/sun/star/uno/Reference.hxx>
-#include <com/sun/star/uno/XComponentContext.hpp>
 
+#include "LibreOfficePool.h"
+#include "TextChunker.h"
 
+
+/*
+Extracts the text of office documents loaded into a process of the
+LibreOffice pool, which is given back once the document is closed.
+*/
 class OpenDocProcessor : public FileProcessor
 {
-  std::string curr_text;
-  std::function<void(const TextUnit&)> _on_text_unit_func;
+  LibreOfficePool& office_pool;
+  TextChunker chunker;
 
-  css::uno::Reference<css::uno::XComponentContext> xComponentContext;
-  css::uno::Reference<css::frame::XComponentLoader> xComponentLoader;
-  css::uno::Reference<css::frame::XDesktop> xDesktop;
-  css::uno::Reference<css::lang::XMultiComponentFactory> xMultiComponentFactory;
+  // Emits the text of the paragraphs of the document, split at the
+  // headings of outline level 1.
+  void extract_text(const css::uno::Reference<css::lang::XComponent>& document);
 
 public:
 
-  OpenDocProcessor(std::function<void(const TextUnit&)> on_text_unit_func);
+  OpenDocProcessor(LibreOfficePool& office_pool,
+    const TextChunker::limits& chunk_limits, TextUnitFunc on_text_unit_func);
 
   virtual void process_file(const char* file_path) override;
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "PostgreSqlDb.h"
 #include "common.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <memory>
@@ -9,198 +10,271 @@
 
 #include <arpa/inet.h>
 
+#include "VectorKernels.h"
+
 
 typedef std::unique_ptr<PGresult, decltype(&PQclear)> PGresult_unique_ptr;
 
 
-static std::vector<uint8_t> to_pgvector_binary(const float* embedding, uint16_t n)
-{
-  std::vector<uint8_t> buffer;
-  buffer.resize(4 + n * 4);
+// OIDs of built-in types, from pg_type.
+static const Oid int8_oid = 20;
+static const Oid int4_oid = 23;
+static const Oid text_oid = 25;
+static const Oid bit_oid = 1560;
 
-  uint16_t n_be = htons(n);
-  std::memcpy(buffer.data(), &n_be, 2);
+// Names of the statements prepared by prepare_statements() on the connection.
+static const char* const delete_file_records_stmt = "delete_file_records";
+static const char* const delete_text_units_stmt = "delete_text_units";
+static const char* const insert_file_record_stmt = "insert_file_record";
+static const char* const insert_text_unit_stmt = "insert_text_unit";
+static const char* const insert_text_unit_currval_stmt =
+  "insert_text_unit_currval";
+static const char* const search_stmt = "search";
 
-  for (size_t i = 0; i < n; ++i)
-  {
-    uint32_t f_be = htonf(embedding[i]);
-    std::memcpy(buffer.data() + 4 + i * 4, &f_be, 4);
-  }
 
-  return buffer;
+// Signature that starts the PostgreSQL binary COPY format.
+static const uint8_t copy_binary_signature[] = {
+  'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0xff, '\r', '\n', 0
+};
+
+// Size at which the COPY buffer is handed over to libpq.
+static const size_t copy_flush_size = 1 << 18;
+
+// Largest dimension of the pgvector vector type.
+static const size_t max_vector_dimension = 16000;
+
+// Table of the text units saved by versions with a single model.
+static const char* const legacy_units_table = "textunits768";
+
+// Key of the advisory lock taken while changing the models and their tables.
+static const char* const lock_models_sql =
+  "SELECT pg_advisory_xact_lock(hashtext('EmbeddingModels'))";
+
+
+static void append_be16(std::vector<uint8_t>& buffer, uint16_t value)
+{
+  uint16_t value_be = htons(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value_be);
+  buffer.insert(buffer.end(), bytes, bytes + 2);
 }
 
 
-static std::vector<uint8_t> to_pgvector_binary(const std::vector<float>& embedding)
+static void append_be32(std::vector<uint8_t>& buffer, uint32_t value)
 {
-  return to_pgvector_binary(embedding.data(), embedding.size());
+  uint32_t value_be = htonl(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value_be);
+  buffer.insert(buffer.end(), bytes, bytes + 4);
 }
 
 
-PostgreSqlDb::PostgreSqlDb(const char* dbname, const char* user, const char* password, const char* host, const char* port): pgconn(nullptr)
+/*
+Values, in text format, of the parameters of the FileRecords INSERT.
+*/
+struct file_record_params
 {
-  std::vector<const char*> params_keys = {
-    "dbname", "user", "password", "host", "port", nullptr
-  };
+  std::string file_size;
+  std::string mtime;
+  std::string content_hash;
+  const char* values[4];
 
-  std::vector<const char*> params = {
-    dbname, user, password, host, port
-  };
+  explicit file_record_params(const FileRecord& record):
+    file_size(std::to_string(record.file_size())),
+    mtime(std::to_string(record.mtime())),
+    // Stored in a BIGINT column, so it's saved as a signed value.
+    content_hash(std::to_string(static_cast<int64_t>(record.content_hash())))
+  {
+    values[0] = record.file_path().c_str();
+    values[1] = file_size.c_str();
+    values[2] = mtime.c_str();
+    values[3] = content_hash.c_str();
+  }
 
-  pgconn = PQconnectdbParams(params_keys.data(), params.data(), 0);
+  file_record_params(const file_record_params&) = delete;
 
-  if (PQstatus(pgconn) != CONNECTION_OK)
+  file_record_params& operator=(const file_record_params&) = delete;
+};
+
+
+/*
+Column that keeps the embeddings for a storage type of the settings, and how
+it's indexed and compared. The compact columns are kept along with the full
+embeddings, which re-rank what a scan of them finds.
+*/
+struct storage_column
+{
+  const char* storage_type;
+  const char* name;
+  const char* sql_type;
+  const char* index_ops;
+  const char* distance_op;
+  // Expression giving the column's type from embd, without the dimension.
+  const char* conversion;
+  // Largest dimension pgvector's HNSW and IVFFlat indexes take for the type.
+  size_t max_index_dimension;
+};
+
+static const storage_column storage_columns[] = {
+  {"vector", "embd", "VECTOR", "vector_l2_ops", "<->", "embd::vector", 2000},
+  {"halfvec", "embd_half", "HALFVEC", "halfvec_l2_ops", "<->",
+    "embd::halfvec", 4000},
+  {"bit", "embd_bits", "BIT", "bit_hamming_ops", "<~>",
+    "binary_quantize(embd)::bit", 64000}
+};
+
+
+static const storage_column& get_storage_column(const std::string& storage_type)
+{
+  for (const storage_column& column : storage_columns)
   {
-    std::string msg(PQerrorMessage(pgconn));
-    clean_up();
-    throw std::runtime_error(msg);
+    if (storage_type == column.storage_type)
+      return column;
   }
+
+  throw std::runtime_error("Unknown storage type \"" + storage_type +
+    "\", expected \"vector\", \"halfvec\" or \"bit\"");
 }
 
 
-PostgreSqlDb::~PostgreSqlDb()
+/*
+Expression converting the full embedding named embd to the type of the
+column, for embeddings of dimension floats.
+*/
+static std::string compact_conversion(const storage_column& column,
+  const std::string& embd, size_t dimension)
 {
-  clean_up();
+  std::string conversion(column.conversion);
+  conversion.replace(conversion.find("embd"), 4, embd);
+  return conversion + "(" + std::to_string(dimension) + ")";
 }
 
 
-void PostgreSqlDb::clean_up() noexcept
+// "$first, $first+1, ..." for n parameters.
+static std::string param_list(size_t first, size_t n)
 {
-  if (pgconn)
+  std::string list;
+  for (size_t idx = first; idx < first + n; idx++)
   {
-    PQfinish(pgconn);
-    pgconn = nullptr;
+    if (!list.empty())
+      list += ", ";
+    list += "$" + std::to_string(idx);
   }
+  return list;
 }
 
 
-void PostgreSqlDb::exec_sql(const char* sql)
+/*
+Pointers, lengths and formats of the parameters of a statement, as libpq
+takes them. The values added must outlive it.
+*/
+struct statement_params
 {
-  PGresult_unique_ptr res(PQexec(pgconn, sql), PQclear);
+  std::vector<const char*> values;
+  std::vector<int> lengths;
+  std::vector<int> formats;
 
-  ExecStatusType res_code = PQresultStatus(res.get());
+  void add_binary(const std::vector<uint8_t>& value)
+  {
+    values.push_back(reinterpret_cast<const char*>(value.data()));
+    lengths.push_back(value.size());
+    formats.push_back(1);
+  }
 
-  if (res_code == PGRES_NONFATAL_ERROR)
+  void add_text(const std::string& value)
   {
-    std::cerr << PQerrorMessage(pgconn) << "\n";
+    values.push_back(value.c_str());
+    lengths.push_back(value.size());
+    formats.push_back(0);
   }
-  else if (!(res_code == PGRES_COMMAND_OK || res_code == PGRES_TUPLES_OK))
+
+  int size() const
   {
-    throw std::runtime_error(PQerrorMessage(pgconn));
+    return values.size();
   }
-}
+};
 
 
-void PostgreSqlDb::save_file_record_with_text_units(FileRecord& record)
+static void check_pgvector_dimension(size_t n)
 {
-  const char* param_values[3];
-  int param_lengths[3];
-  int param_formats[3];
+  if (n == 0 || n > max_vector_dimension)
+  {
+    throw std::runtime_error("Embedding of dimension " + std::to_string(n) +
+      ", pgvector takes 1 to " + std::to_string(max_vector_dimension));
+  }
+}
 
-  param_values[0] = record.file_path().c_str();
 
-  exec_sql("BEGIN");
+static std::vector<uint8_t> to_pgvector_binary(const float* embedding, size_t n)
+{
+  check_pgvector_dimension(n);
 
-  PGresult_unique_ptr res(PQexecParams(
-    pgconn,
-    "INSERT INTO FileRecords(file_path) VALUES ($1) RETURNING id",
-    1,
-    nullptr,            // infer types
-    param_values,
-    nullptr,
-    nullptr,
-    0                   // text result
-  ), PQclear);
+  std::vector<uint8_t> buffer;
+  buffer.resize(4 + n * 4);
 
-  ExecStatusType res_code = PQresultStatus(res.get());
+  // Dimension, then a field pgvector leaves unused.
+  uint16_t n_be = htons(static_cast<uint16_t>(n));
+  std::memcpy(buffer.data(), &n_be, 2);
 
-  if (res_code == PGRES_NONFATAL_ERROR)
-  {
-    std::cerr << PQerrorMessage(pgconn) << "\n";
-  }
-  else if (res_code != PGRES_TUPLES_OK)
+  for (size_t i = 0; i < n; ++i)
   {
-    throw std::runtime_error(PQerrorMessage(pgconn));
+    uint32_t f_be = htonf(embedding[i]);
+    std::memcpy(buffer.data() + 4 + i * 4, &f_be, 4);
   }
 
-  // Have to copy the ID string there, since it goes away when res for the
-  // FileRecord INSERT is cleared.
-  std::string fr_id_str(PQgetvalue(res.get(), 0, 0));
-  record.id(strtoul(fr_id_str.c_str(), nullptr, 10));
+  return buffer;
+}
 
-  // This needs to be set only once, since it's the file record ID for all the
-  // text units being saved.
-  param_values[2] = fr_id_str.c_str();
-  param_lengths[2] = fr_id_str.size();
-  param_formats[2] = 0;
 
-  for (const TextUnit& text_unit : record.text_units())
-  {
-    std::vector<uint8_t> binary_vec = to_pgvector_binary(text_unit.embedding());
+/*
+The embedding in half precision, in the format accepted by halfvec_recv: the
+same header as a vector, then 2 bytes per value.
+*/
+static std::vector<uint8_t> to_pghalfvec_binary(const float* embedding,
+  size_t n)
+{
+  static const HalfEncodeFunc encode_half = get_half_encode_func();
 
-    // text column
-    param_values[0]  = text_unit.text().c_str();
-    param_lengths[0] = text_unit.text().size();
-    param_formats[0] = 0; // text
+  check_pgvector_dimension(n);
 
-    // vector column (binary)
-    param_values[1]  = reinterpret_cast<const char*>(binary_vec.data());
-    param_lengths[1] = binary_vec.size();
-    param_formats[1] = 1; // binary
+  std::vector<uint16_t> halves(n);
+  encode_half(embedding, n, halves.data());
 
-    res.reset(PQexecParams(pgconn,
-      "INSERT INTO TextUnits768(text, embd, file_record_id) "
-      "VALUES ($1, $2::vector, $3)",
-      3, nullptr, param_values, param_lengths, param_formats, 0));
+  std::vector<uint8_t> buffer(4 + n * 2);
 
-    ExecStatusType res_code = PQresultStatus(res.get());
+  uint16_t n_be = htons(static_cast<uint16_t>(n));
+  std::memcpy(buffer.data(), &n_be, 2);
 
-    if (res_code == PGRES_NONFATAL_ERROR)
-    {
-      std::cerr << PQerrorMessage(pgconn) << "\n";
-    }
-    else if (res_code != PGRES_COMMAND_OK)
-    {
-      throw std::runtime_error(PQerrorMessage(pgconn));
-    }
-    else
-    {
-      std::cerr << "Inserted binary embedding successfully\n";
-    }
+  for (size_t i = 0; i < n; ++i)
+  {
+    uint16_t half_be = htons(halves[i]);
+    std::memcpy(buffer.data() + 4 + i * 2, &half_be, 2);
   }
 
-  exec_sql("COMMIT");
+  return buffer;
 }
 
 
-std::vector<TextUnitResult>
-PostgreSqlDb::search(const std::vector<float>& embedding)
+/*
+The signs of the embedding as binary_quantize() gives them, in the format
+accepted by bit_recv: the number of bits, then the bits packed in bytes.
+*/
+static std::vector<uint8_t> to_pgbit_binary(const float* embedding, size_t n)
 {
-  std::vector<uint8_t> binary_vec = to_pgvector_binary(embedding);
+  static const SignBitsFunc encode_sign_bits = get_sign_bits_func();
 
-  const char* param_value  = reinterpret_cast<const char*>(binary_vec.data());
-  int param_length = binary_vec.size();
-  int param_format = 1; // binary
+  check_pgvector_dimension(n);
 
-  PGresult_unique_ptr res(PQexecParams(
-    pgconn,
-    "SELECT TextUnits768.id, TextUnits768.text, FileRecords.id, FileRecords.file_path, "
-    "TextUnits768.embd <-> $1::vector AS distance FROM FileRecords "
-    "INNER JOIN TextUnits768 ON TextUnits768.file_record_id=FileRecords.id ORDER BY distance LIMIT 20;",
-    1, nullptr, &param_value, &param_length, &param_format, 0), PQclear);
+  std::vector<uint8_t> buffer(4 + (n + 7) / 8);
 
-  ExecStatusType res_code = PQresultStatus(res.get());
+  uint32_t n_be = htonl(n);
+  std::memcpy(buffer.data(), &n_be, 4);
+  encode_sign_bits(embedding, n, buffer.data() + 4);
 
-  if (res_code == PGRES_NONFATAL_ERROR)
-  {
-    std::cerr << PQerrorMessage(pgconn) << "\n";
-  }
-  else if (res_code != PGRES_TUPLES_OK)
-  {
-    throw std::runtime_error(PQerrorMessage(pgconn));
-  }
+  return buffer;
+}
 
-  PGresult* r = res.get();
+
+static std::vector<TextUnitResult> results_from_pgresult(const PGresult* r)
+{
   int n_results = PQntuples(r);
   std::vector<std::shared_ptr<FileRecord>> frecords;
   std::vector<TextUnitResult> results;
@@ -250,17 +324,1482 @@ PostgreSqlDb::search(const std::vector<float>& embedding)
 }
 
 
-void PostgreSqlDb::set_database_up()
+PostgreSqlDb::PostgreSqlDb(const char* dbname, const char* user, const char* password, const char* host, const char* port):
+  pgconn(nullptr),
+  pipeline_mode(false),
+  model_row_id(0),
+  storage_type("vector"),
+  rerank(200),
+  has_half_column(false),
+  has_bits_column(false),
+  index_m(16),
+  index_ef_construction(64),
+  index_lists(100),
+  search_ef_search(0),
+  search_probes(0),
+  session_ef_search(0),
+  session_probes(0)
 {
-  exec_sql("CREATE TABLE IF NOT EXISTS FileRecords("
-    "id serial PRIMARY KEY,"
-    "file_path TEXT"
-  ")");
+  std::vector<const char*> params_keys = {
+    "dbname", "user", "password", "host", "port", nullptr
+  };
 
-  exec_sql("CREATE TABLE IF NOT EXISTS TextUnits768 ("
-    "id bigserial PRIMARY KEY, "
-    "text TEXT, "
-    "embd VECTOR(768), "
-    "file_record_id INTEGER REFERENCES FileRecords(id)"
-  ")");
+  std::vector<const char*> params = {
+    dbname, user, password, host, port
+  };
+
+  pgconn = PQconnectdbParams(params_keys.data(), params.data(), 0);
+
+  if (PQstatus(pgconn) != CONNECTION_OK)
+  {
+    std::string msg(PQerrorMessage(pgconn));
+    clean_up();
+    throw std::runtime_error(msg);
+  }
+}
+
+
+PostgreSqlDb::~PostgreSqlDb()
+{
+  clean_up();
+}
+
+
+void PostgreSqlDb::adopt_legacy_table()
+{
+  locked_models_transaction([this]() {
+    std::string sql("SELECT to_regclass('");
+    sql += legacy_units_table;
+    sql += "') IS NOT NULL AND NOT EXISTS "
+      "(SELECT 1 FROM EmbeddingModels WHERE units_table = '";
+    sql += legacy_units_table;
+    sql += "')";
+
+    PGresult_unique_ptr res(PQexec(pgconn, sql.c_str()), PQclear);
+    check_result(res.get(), PGRES_TUPLES_OK);
+
+    if (std::strcmp(PQgetvalue(res.get(), 0, 0), "t") != 0)
+      return;
+
+    std::cerr << "Registering the table " << legacy_units_table
+      << " as the table of model \"" << model.model_id() << "\"...\n";
+
+    sql = "INSERT INTO EmbeddingModels(model_id, dimension, units_table) "
+      "SELECT CASE WHEN EXISTS "
+      "(SELECT 1 FROM EmbeddingModels WHERE model_id = $1) "
+      "THEN $2 ELSE $1 END, 768, $2";
+
+    const char* param_values[2] = {
+      model.model_id().c_str(), legacy_units_table
+    };
+
+    res.reset(PQexecParams(pgconn, sql.c_str(), 2, nullptr, param_values,
+      nullptr, nullptr, 0));
+    check_result(res.get(), PGRES_COMMAND_OK);
+
+    res.reset(PQexecParams(pgconn,
+      "UPDATE FileRecords SET embedding_model = "
+      "(SELECT id FROM EmbeddingModels WHERE units_table = $1) "
+      "WHERE embedding_model IS NULL",
+      1, nullptr, &param_values[1], nullptr, nullptr, 0));
+    check_result(res.get(), PGRES_COMMAND_OK);
+  });
+}
+
+
+void PostgreSqlDb::check_dimension(size_t dimension) const
+{
+  if (dimension != model.dimension())
+  {
+    std::string msg("Embedding of dimension ");
+    msg += std::to_string(dimension);
+    msg += " for model \"";
+    msg += model.model_id();
+    msg += "\", whose table has dimension ";
+    msg += std::to_string(model.dimension());
+    throw std::runtime_error(msg);
+  }
+}
+
+
+void PostgreSqlDb::check_index_dimension(size_t dimension) const
+{
+  if (vector_index_type != "hnsw" && vector_index_type != "ivfflat")
+    return;
+
+  const storage_column& column = get_storage_column(storage_type);
+  if (dimension <= column.max_index_dimension)
+    return;
+
+  std::string msg("Embeddings of dimension ");
+  msg += std::to_string(dimension);
+  msg += " for model \"";
+  msg += model.model_id();
+  msg += "\" are too large for an ";
+  msg += vector_index_type;
+  msg += " index of the ";
+  msg += storage_type;
+  msg += " storage type, which takes up to ";
+  msg += std::to_string(column.max_index_dimension);
+  msg += ". Use the halfvec or bit storage type, or no vector index";
+  throw std::runtime_error(msg);
+}
+
+
+void PostgreSqlDb::check_result(const PGresult* res, ExecStatusType expected)
+{
+  ExecStatusType res_code = PQresultStatus(res);
+
+  if (res_code == PGRES_NONFATAL_ERROR)
+  {
+    std::cerr << PQerrorMessage(pgconn) << "\n";
+  }
+  else if (res_code != expected)
+  {
+    throw std::runtime_error(PQerrorMessage(pgconn));
+  }
+}
+
+
+void PostgreSqlDb::clean_up() noexcept
+{
+  if (pgconn)
+  {
+    PQfinish(pgconn);
+    pgconn = nullptr;
+  }
+}
+
+
+bool
+PostgreSqlDb::copy_text_units(const std::vector<const FileRecord*>& records)
+{
+  std::string sql("COPY ");
+  sql += units_table;
+  sql += "(text, ";
+  sql += embedding_columns();
+  sql += ", file_record_id) FROM STDIN (FORMAT binary)";
+
+  PGresult_unique_ptr res(PQexec(pgconn, sql.c_str()), PQclear);
+
+  if (PQresultStatus(res.get()) != PGRES_COPY_IN)
+  {
+    std::cerr << PQerrorMessage(pgconn) << "\n";
+    return false;
+  }
+
+  // Header: signature, flags field and header extension length.
+  std::vector<uint8_t> buffer(copy_binary_signature,
+    copy_binary_signature + sizeof(copy_binary_signature));
+  append_be32(buffer, 0);
+  append_be32(buffer, 0);
+
+  bool sent = true;
+
+  for (const FileRecord* record : records)
+  {
+    for (const TextUnit& text_unit : record->text_units())
+    {
+      const std::string& text = text_unit.text();
+      std::vector<std::vector<uint8_t>> embedding_vals =
+        embedding_values(text_unit.embedding());
+
+      // Number of fields in the tuple.
+      append_be16(buffer, 2 + embedding_vals.size());
+
+      // text column
+      append_be32(buffer, text.size());
+      buffer.insert(buffer.end(), text.begin(), text.end());
+
+      // embedding columns, in the formats accepted by their recv functions
+      for (const std::vector<uint8_t>& value : embedding_vals)
+      {
+        append_be32(buffer, value.size());
+        buffer.insert(buffer.end(), value.begin(), value.end());
+      }
+
+      // file_record_id column (INTEGER)
+      append_be32(buffer, 4);
+      append_be32(buffer, record->id());
+
+      if (buffer.size() >= copy_flush_size)
+      {
+        sent = PQputCopyData(pgconn, reinterpret_cast<const char*>(buffer.data()),
+          buffer.size()) == 1;
+        buffer.clear();
+
+        if (!sent)
+          break;
+      }
+    }
+
+    if (!sent)
+      break;
+  }
+
+  if (sent)
+  {
+    // File trailer.
+    append_be16(buffer, 0xffff);
+    sent = PQputCopyData(pgconn, reinterpret_cast<const char*>(buffer.data()),
+      buffer.size()) == 1;
+  }
+
+  if (PQputCopyEnd(pgconn, sent ? nullptr : "client failed to send data") != 1)
+    sent = false;
+
+  bool copied = sent;
+
+  // Drain every result so the connection is ready for the next command.
+  while (PGresult* copy_res = PQgetResult(pgconn))
+  {
+    if (PQresultStatus(copy_res) != PGRES_COMMAND_OK)
+      copied = false;
+    PQclear(copy_res);
+  }
+
+  if (!copied)
+    std::cerr << PQerrorMessage(pgconn) << "\n";
+
+  return copied;
+}
+
+
+void PostgreSqlDb::delete_previous_records(const FileRecord& record)
+{
+  const char* param_value = record.file_path().c_str();
+
+  PGresult_unique_ptr res(PQexecPrepared(pgconn, delete_text_units_stmt,
+    1, &param_value, nullptr, nullptr, 0), PQclear);
+  check_result(res.get(), PGRES_COMMAND_OK);
+
+  res.reset(PQexecPrepared(pgconn, delete_file_records_stmt,
+    1, &param_value, nullptr, nullptr, 0));
+  check_result(res.get(), PGRES_COMMAND_OK);
+}
+
+
+void PostgreSqlDb::drop_file_parts(const FileParts& parts)
+{
+  if (!parts.staging_record_id)
+    return;
+
+  std::string id_str = std::to_string(parts.staging_record_id);
+  std::string sql("DELETE FROM " + units_table + " WHERE file_record_id = " +
+    id_str);
+
+  exec_sql("BEGIN");
+
+  try
+  {
+    exec_sql(sql.c_str());
+    sql = "DELETE FROM FileRecords WHERE id = " + id_str;
+    exec_sql(sql.c_str());
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+}
+
+
+std::string PostgreSqlDb::embedding_columns() const
+{
+  std::string columns("embd");
+  if (has_half_column)
+    columns += ", embd_half";
+  if (has_bits_column)
+    columns += ", embd_bits";
+  return columns;
+}
+
+
+std::vector<std::vector<uint8_t>>
+PostgreSqlDb::embedding_values(const Embedding& embedding) const
+{
+  std::vector<std::vector<uint8_t>> values;
+  values.push_back(to_pgvector_binary(embedding.data(), embedding.size()));
+  if (has_half_column)
+    values.push_back(to_pghalfvec_binary(embedding.data(), embedding.size()));
+  if (has_bits_column)
+    values.push_back(to_pgbit_binary(embedding.data(), embedding.size()));
+  return values;
+}
+
+
+void PostgreSqlDb::exec_sql(const char* sql)
+{
+  PGresult_unique_ptr res(PQexec(pgconn, sql), PQclear);
+
+  ExecStatusType res_code = PQresultStatus(res.get());
+
+  if (res_code == PGRES_NONFATAL_ERROR)
+  {
+    std::cerr << PQerrorMessage(pgconn) << "\n";
+  }
+  else if (!(res_code == PGRES_COMMAND_OK || res_code == PGRES_TUPLES_OK))
+  {
+    throw std::runtime_error(PQerrorMessage(pgconn));
+  }
+}
+
+
+void PostgreSqlDb::collect_pipeline_results(
+  const std::vector<std::string>& statements,
+  const std::function<void(size_t, const PGresult*)>& on_result)
+{
+  if (PQpipelineSync(pgconn) != 1)
+    throw std::runtime_error(PQerrorMessage(pgconn));
+
+  std::string error;
+  size_t idx = 0;
+  bool synced = false;
+
+  // Results are read up to the sync point even after an error, since the
+  // connection can only leave pipeline mode once they all are.
+  while (!synced)
+  {
+    PGresult_unique_ptr res(PQgetResult(pgconn), PQclear);
+
+    if (!res)
+    {
+      // Each statement's results end with a null pointer, which is all that
+      // comes once the connection is lost.
+      if (PQstatus(pgconn) == CONNECTION_BAD)
+      {
+        if (error.empty())
+          error = PQerrorMessage(pgconn);
+        break;
+      }
+      continue;
+    }
+
+    ExecStatusType res_code = PQresultStatus(res.get());
+
+    if (res_code == PGRES_PIPELINE_SYNC)
+    {
+      synced = true;
+    }
+    else if (res_code == PGRES_NONFATAL_ERROR)
+    {
+      std::cerr << PQresultErrorMessage(res.get()) << "\n";
+    }
+    else if (idx >= statements.size())
+    {
+      if (error.empty())
+        error = "Unexpected result in pipeline mode";
+    }
+    else if (res_code == PGRES_COMMAND_OK || res_code == PGRES_TUPLES_OK)
+    {
+      try
+      {
+        if (error.empty())
+          on_result(idx, res.get());
+      }
+      catch (const std::exception& e)
+      {
+        error = e.what();
+      }
+      idx++;
+    }
+    else
+    {
+      // Statements after the failed one are reported as aborted.
+      if (res_code != PGRES_PIPELINE_ABORTED && error.empty())
+      {
+        error = "Statement #" + std::to_string(idx + 1) + " (" +
+          statements[idx] + ") failed: " + PQresultErrorMessage(res.get());
+      }
+      idx++;
+    }
+  }
+
+  if (PQexitPipelineMode(pgconn) != 1 && error.empty())
+    error = PQerrorMessage(pgconn);
+
+  if (!error.empty())
+    throw std::runtime_error(error);
+}
+
+
+void PostgreSqlDb::save_file_record_with_text_units(FileRecord& record)
+{
+  if (!ready_to_save({&record}))
+    return;
+
+  if (pipeline_mode)
+  {
+    pipeline_save({&record});
+    return;
+  }
+
+  exec_sql("BEGIN");
+
+  try
+  {
+    if (record.replaces_previous())
+      delete_previous_records(record);
+
+    insert_file_record(record);
+    save_text_units({&record});
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+}
+
+
+void PostgreSqlDb::save_file_part(std::vector<TextUnit>& text_units,
+  FileParts& parts)
+{
+  FileRecord staging;
+  staging.text_units(std::move(text_units));
+
+  if (!ready_to_save({&staging}))
+    return;
+
+  exec_sql("BEGIN");
+
+  try
+  {
+    staging.id(parts.staging_record_id ? parts.staging_record_id :
+      insert_staging_record());
+    save_text_units({&staging});
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+
+  parts.staging_record_id = staging.id();
+}
+
+
+void PostgreSqlDb::save_file_record_with_parts(FileRecord& record,
+  const FileParts& parts)
+{
+  // No part had units to save.
+  if (!parts.staging_record_id)
+  {
+    save_file_record_with_text_units(record);
+    return;
+  }
+
+  file_record_params params(record);
+  std::string id_str = std::to_string(parts.staging_record_id);
+  const char* param_values[5] = {params.values[0], params.values[1],
+    params.values[2], params.values[3], id_str.c_str()};
+
+  exec_sql("BEGIN");
+
+  try
+  {
+    if (record.replaces_previous())
+      delete_previous_records(record);
+
+    PGresult_unique_ptr res(PQexecParams(pgconn,
+      "UPDATE FileRecords SET file_path = $1, file_size = $2, mtime = $3, "
+      "content_hash = $4 WHERE id = $5",
+      5, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+    check_result(res.get(), PGRES_COMMAND_OK);
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+
+  record.id(parts.staging_record_id);
+}
+
+
+void
+PostgreSqlDb::save_file_records_with_text_units(std::vector<FileRecord>& records)
+{
+  std::vector<const FileRecord*> record_ptrs;
+  record_ptrs.reserve(records.size());
+  for (const FileRecord& record : records)
+    record_ptrs.push_back(&record);
+
+  if (!ready_to_save(record_ptrs))
+    return;
+
+  if (pipeline_mode)
+  {
+    std::vector<FileRecord*> pipeline_ptrs;
+    pipeline_ptrs.reserve(records.size());
+    for (FileRecord& record : records)
+      pipeline_ptrs.push_back(&record);
+
+    pipeline_save(pipeline_ptrs);
+    return;
+  }
+
+  exec_sql("BEGIN");
+
+  try
+  {
+    for (FileRecord& record : records)
+    {
+      if (record.replaces_previous())
+        delete_previous_records(record);
+
+      insert_file_record(record);
+    }
+
+    save_text_units(record_ptrs);
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+}
+
+
+std::vector<FileRecord> PostgreSqlDb::get_file_records()
+{
+  if (!model_row_id && !load_model())
+    return {};
+
+  // Staging records have no path.
+  std::string sql("SELECT id, file_path, file_size, mtime, content_hash "
+    "FROM FileRecords WHERE file_path IS NOT NULL AND embedding_model = ");
+  sql += std::to_string(model_row_id);
+
+  PGresult_unique_ptr res(PQexec(pgconn, sql.c_str()), PQclear);
+
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  PGresult* r = res.get();
+  int n_records = PQntuples(r);
+  std::vector<FileRecord> records(n_records);
+
+  for (int idx = 0; idx < n_records; idx++)
+  {
+    FileRecord& record = records[idx];
+    record.id(strtoul(PQgetvalue(r, idx, 0), nullptr, 10));
+    record.file_path(PQgetvalue(r, idx, 1));
+
+    // Records saved before these columns existed have them NULL, and are
+    // left with zeros that match no file.
+    if (!PQgetisnull(r, idx, 2))
+      record.file_size(strtoull(PQgetvalue(r, idx, 2), nullptr, 10));
+    if (!PQgetisnull(r, idx, 3))
+      record.mtime(strtoll(PQgetvalue(r, idx, 3), nullptr, 10));
+    if (!PQgetisnull(r, idx, 4))
+      record.content_hash(strtoll(PQgetvalue(r, idx, 4), nullptr, 10));
+  }
+
+  return records;
+}
+
+
+void PostgreSqlDb::insert_file_record(FileRecord& record)
+{
+  file_record_params params(record);
+
+  PGresult_unique_ptr res(PQexecPrepared(
+    pgconn,
+    insert_file_record_stmt,
+    4,
+    params.values,
+    nullptr,
+    nullptr,
+    0                   // text result
+  ), PQclear);
+
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  record.id(strtoul(PQgetvalue(res.get(), 0, 0), nullptr, 10));
+}
+
+
+unsigned long PostgreSqlDb::insert_staging_record()
+{
+  std::string sql("INSERT INTO FileRecords(embedding_model) VALUES (");
+  sql += std::to_string(model_row_id);
+  sql += ") RETURNING id";
+
+  PGresult_unique_ptr res(PQexec(pgconn, sql.c_str()), PQclear);
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  return strtoul(PQgetvalue(res.get(), 0, 0), nullptr, 10);
+}
+
+
+void PostgreSqlDb::insert_text_units(const FileRecord& record)
+{
+  // The file record ID is the same for all the text units being saved.
+  std::string fr_id_str = std::to_string(record.id());
+
+  for (const TextUnit& text_unit : record.text_units())
+  {
+    std::vector<std::vector<uint8_t>> embedding_vals =
+      embedding_values(text_unit.embedding());
+
+    statement_params params;
+    params.add_text(text_unit.text());
+    for (const std::vector<uint8_t>& value : embedding_vals)
+      params.add_binary(value);
+    params.add_text(fr_id_str);
+
+    PGresult_unique_ptr res(PQexecPrepared(pgconn, insert_text_unit_stmt,
+      params.size(), params.values.data(), params.lengths.data(),
+      params.formats.data(), 0), PQclear);
+
+    check_result(res.get(), PGRES_COMMAND_OK);
+  }
+}
+
+
+bool PostgreSqlDb::load_model()
+{
+  const char* param_value = model.model_id().c_str();
+
+  PGresult_unique_ptr res(PQexecParams(pgconn,
+    "SELECT id, dimension, units_table FROM EmbeddingModels "
+    "WHERE model_id = $1",
+    1, nullptr, &param_value, nullptr, nullptr, 0), PQclear);
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  if (PQntuples(res.get()) == 0)
+    return false;
+
+  model_row_id = strtoul(PQgetvalue(res.get(), 0, 0), nullptr, 10);
+  model.dimension(strtoul(PQgetvalue(res.get(), 0, 1), nullptr, 10));
+
+  // Models registered by this version have a table named after their ID.
+  if (PQgetisnull(res.get(), 0, 2))
+    units_table = "textunits_" + std::to_string(model_row_id);
+  else
+    units_table = PQgetvalue(res.get(), 0, 2);
+
+  set_up_units_table();
+  return true;
+}
+
+
+void PostgreSqlDb::locked_models_transaction(const std::function<void()>& fn)
+{
+  exec_sql("BEGIN");
+
+  try
+  {
+    exec_sql(lock_models_sql);
+    fn();
+  }
+  catch (...)
+  {
+    exec_sql("ROLLBACK");
+    throw;
+  }
+
+  exec_sql("COMMIT");
+}
+
+
+void PostgreSqlDb::manage_vector_index()
+{
+  if (vector_index_type.empty())
+    return;
+
+  std::string wanted_name = vector_index_name();
+  bool exists = false;
+
+  for (const std::string& name : managed_vector_indexes())
+  {
+    if (name == wanted_name)
+    {
+      exists = true;
+      continue;
+    }
+
+    std::string sql("DROP INDEX IF EXISTS ");
+    sql += name;
+    exec_sql(sql.c_str());
+  }
+
+  if (wanted_name.empty() || exists)
+    return;
+
+  check_index_dimension(model.dimension());
+
+  std::string sql("CREATE INDEX IF NOT EXISTS ");
+  sql += wanted_name;
+  sql += " ON ";
+  sql += units_table;
+  sql += " USING ";
+
+  const storage_column& column = get_storage_column(storage_type);
+
+  if (vector_index_type == "hnsw")
+  {
+    sql += "hnsw (";
+    sql += column.name;
+    sql += " ";
+    sql += column.index_ops;
+    sql += ") WITH (m = ";
+    sql += std::to_string(index_m);
+    sql += ", ef_construction = ";
+    sql += std::to_string(index_ef_construction);
+    sql += ")";
+  }
+  else
+  {
+    sql += "ivfflat (";
+    sql += column.name;
+    sql += " ";
+    sql += column.index_ops;
+    sql += ") WITH (lists = ";
+    sql += std::to_string(index_lists);
+    sql += ")";
+  }
+
+  std::cerr << "Creating the vector index " << wanted_name << "...\n";
+  exec_sql(sql.c_str());
+}
+
+
+std::vector<std::string> PostgreSqlDb::managed_vector_indexes()
+{
+  // Underscores are wildcards in LIKE patterns.
+  std::string pattern;
+  for (char c : units_table + "_embd_")
+  {
+    if (c == '_')
+      pattern += '\\';
+    pattern += c;
+  }
+  pattern += '%';
+
+  const char* param_values[2] = {units_table.c_str(), pattern.c_str()};
+
+  PGresult_unique_ptr res(PQexecParams(pgconn,
+    "SELECT indexname FROM pg_indexes WHERE tablename = $1 "
+    "AND indexname LIKE $2",
+    2, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  std::vector<std::string> names;
+  int n_names = PQntuples(res.get());
+  for (int idx = 0; idx < n_names; idx++)
+    names.push_back(PQgetvalue(res.get(), idx, 0));
+
+  return names;
+}
+
+
+void PostgreSqlDb::pipeline_save(const std::vector<FileRecord*>& records)
+{
+  if (PQenterPipelineMode(pgconn) != 1)
+    throw std::runtime_error(PQerrorMessage(pgconn));
+
+  // No BEGIN/COMMIT is sent: everything up to the sync point runs as one
+  // implicit transaction, which the server rolls back if a statement fails.
+  std::vector<std::string> statements;
+  // Index of the FileRecords INSERT of each record in statements.
+  std::vector<size_t> record_statements;
+  bool queued = true;
+
+  for (FileRecord* record : records)
+  {
+    const char* path_value = record->file_path().c_str();
+
+    if (record->replaces_previous())
+    {
+      if (!PQsendQueryPrepared(pgconn, delete_text_units_stmt,
+        1, &path_value, nullptr, nullptr, 0))
+      {
+        queued = false;
+        break;
+      }
+
+      statements.push_back("DELETE of the previous text units of \"" +
+        record->file_path() + "\"");
+
+      if (!PQsendQueryPrepared(pgconn, delete_file_records_stmt,
+        1, &path_value, nullptr, nullptr, 0))
+      {
+        queued = false;
+        break;
+      }
+
+      statements.push_back("DELETE of the previous records of \"" +
+        record->file_path() + "\"");
+    }
+
+    file_record_params params(*record);
+
+    if (!PQsendQueryPrepared(pgconn, insert_file_record_stmt,
+      4, params.values, nullptr, nullptr, 0))
+    {
+      queued = false;
+      break;
+    }
+
+    record_statements.push_back(statements.size());
+    statements.push_back("INSERT into FileRecords of \"" +
+      record->file_path() + "\"");
+
+    size_t unit_idx = 0;
+
+    for (const TextUnit& text_unit : record->text_units())
+    {
+      std::vector<std::vector<uint8_t>> embedding_vals =
+        embedding_values(text_unit.embedding());
+
+      statement_params params;
+      params.add_text(text_unit.text());
+      for (const std::vector<uint8_t>& value : embedding_vals)
+        params.add_binary(value);
+
+      if (!PQsendQueryPrepared(pgconn, insert_text_unit_currval_stmt,
+        params.size(), params.values.data(), params.lengths.data(),
+        params.formats.data(), 0))
+      {
+        queued = false;
+        break;
+      }
+
+      statements.push_back("INSERT of text unit #" +
+        std::to_string(++unit_idx) + " of \"" + record->file_path() + "\"");
+    }
+
+    if (!queued)
+      break;
+  }
+
+  std::string send_error;
+  if (!queued)
+    send_error = PQerrorMessage(pgconn);
+
+  std::vector<unsigned long> ids(statements.size());
+  collect_pipeline_results(statements, [&](size_t idx, const PGresult* res) {
+    if (PQresultStatus(res) == PGRES_TUPLES_OK)
+      ids[idx] = strtoul(PQgetvalue(res, 0, 0), nullptr, 10);
+  });
+
+  if (!queued)
+    throw std::runtime_error(send_error);
+
+  for (size_t idx = 0; idx < record_statements.size(); idx++)
+    records[idx]->id(ids[record_statements[idx]]);
+}
+
+
+void PostgreSqlDb::prepare(const char* name, const char* sql,
+  const std::vector<Oid>& param_types)
+{
+  PGresult_unique_ptr res(PQprepare(pgconn, name, sql, param_types.size(),
+    param_types.data()), PQclear);
+
+  check_result(res.get(), PGRES_COMMAND_OK);
+}
+
+
+void PostgreSqlDb::prepare_statements()
+{
+  // The OIDs of the pgvector types depend on when the extension was created.
+  // halfvec only exists from pgvector 0.7.
+  PGresult_unique_ptr res(PQexec(pgconn,
+    "SELECT 'vector'::regtype::oid, to_regtype('halfvec')::oid"), PQclear);
+  check_result(res.get(), PGRES_TUPLES_OK);
+  Oid vector_oid = strtoul(PQgetvalue(res.get(), 0, 0), nullptr, 10);
+  Oid halfvec_oid = strtoul(PQgetvalue(res.get(), 0, 1), nullptr, 10);
+
+  // Types of the embedding columns, in the order of embedding_columns().
+  std::vector<Oid> embedding_types = {vector_oid};
+  if (has_half_column)
+    embedding_types.push_back(halfvec_oid);
+  if (has_bits_column)
+    embedding_types.push_back(bit_oid);
+
+  size_t n_embeddings = embedding_types.size();
+
+  // The model's ID is fixed for the connection, so it's part of the SQL.
+  std::string model_cond("embedding_model = ");
+  model_cond += std::to_string(model_row_id);
+
+  std::string sql("INSERT INTO FileRecords"
+    "(file_path, file_size, mtime, content_hash, embedding_model) "
+    "VALUES ($1, $2, $3, $4, ");
+  sql += std::to_string(model_row_id);
+  sql += ") RETURNING id";
+  prepare(insert_file_record_stmt, sql.c_str(),
+    {text_oid, int8_oid, int8_oid, int8_oid});
+
+  sql = "DELETE FROM " + units_table + " WHERE file_record_id IN "
+    "(SELECT id FROM FileRecords WHERE file_path = $1 AND " + model_cond + ")";
+  prepare(delete_text_units_stmt, sql.c_str(), {text_oid});
+
+  sql = "DELETE FROM FileRecords WHERE file_path = $1 AND " + model_cond;
+  prepare(delete_file_records_stmt, sql.c_str(), {text_oid});
+
+  std::vector<Oid> param_types = {text_oid};
+  param_types.insert(param_types.end(), embedding_types.begin(),
+    embedding_types.end());
+
+  std::string insert_sql("INSERT INTO " + units_table + "(text, " +
+    embedding_columns() + ", file_record_id) VALUES ($1, " +
+    param_list(2, n_embeddings) + ", ");
+
+  // The ID of the file record is the last value taken from the FileRecords
+  // sequence in this session, used in pipeline mode where it's not known yet.
+  sql = insert_sql + "currval(pg_get_serial_sequence('FileRecords', 'id')))";
+  prepare(insert_text_unit_currval_stmt, sql.c_str(), param_types);
+
+  sql = insert_sql + "$" + std::to_string(n_embeddings + 2) + ")";
+  param_types.push_back(int4_oid);
+  prepare(insert_text_unit_stmt, sql.c_str(), param_types);
+
+  if (storage_type == "vector")
+  {
+    sql = "SELECT " + units_table + ".id, " + units_table + ".text, "
+      "FileRecords.id, FileRecords.file_path, " + units_table +
+      ".embd <-> $1 AS distance FROM FileRecords INNER JOIN " + units_table +
+      " ON " + units_table + ".file_record_id=FileRecords.id "
+      "WHERE FileRecords.file_path IS NOT NULL ORDER BY distance LIMIT 20";
+    prepare(search_stmt, sql.c_str(), {vector_oid});
+    return;
+  }
+
+  // The nearest rows by the compact column, which its index can find, are
+  // ranked again by their full embeddings.
+  const storage_column& column = get_storage_column(storage_type);
+
+  sql = "SELECT candidates.id, candidates.text, FileRecords.id, "
+    "FileRecords.file_path, candidates.embd <-> $1 AS distance FROM "
+    "(SELECT id, text, embd, file_record_id FROM " + units_table +
+    " ORDER BY " + column.name + " " + column.distance_op + " $2 LIMIT " +
+    std::to_string(rerank) + ") AS candidates INNER JOIN FileRecords "
+    "ON candidates.file_record_id=FileRecords.id "
+    "WHERE FileRecords.file_path IS NOT NULL ORDER BY distance LIMIT 20";
+  prepare(search_stmt, sql.c_str(),
+    {vector_oid, storage_type == "halfvec" ? halfvec_oid : bit_oid});
+}
+
+
+std::vector<std::vector<uint8_t>>
+PostgreSqlDb::query_values(const std::vector<float>& embedding) const
+{
+  std::vector<std::vector<uint8_t>> values;
+  values.push_back(to_pgvector_binary(embedding.data(), embedding.size()));
+  if (storage_type == "halfvec")
+    values.push_back(to_pghalfvec_binary(embedding.data(), embedding.size()));
+  else if (storage_type == "bit")
+    values.push_back(to_pgbit_binary(embedding.data(), embedding.size()));
+  return values;
+}
+
+
+bool PostgreSqlDb::ready_to_save(const std::vector<const FileRecord*>& records)
+{
+  for (const FileRecord* record : records)
+  {
+    for (const TextUnit& text_unit : record->text_units())
+    {
+      if (!model_row_id)
+        register_model(text_unit.embedding().size());
+
+      check_dimension(text_unit.embedding().size());
+    }
+  }
+
+  // Records without text units, before the model has any, are left to be
+  // saved again by a later run.
+  return model_row_id != 0;
+}
+
+
+bool PostgreSqlDb::reconnect_if_lost()
+{
+  if (PQstatus(pgconn) != CONNECTION_BAD)
+    return false;
+
+  std::cerr << "The connection to PostgreSQL was lost, reconnecting...\n";
+  PQreset(pgconn);
+  if (PQstatus(pgconn) != CONNECTION_OK)
+    throw std::runtime_error(PQerrorMessage(pgconn));
+
+  session_ef_search = 0;
+  session_probes = 0;
+  if (model_row_id)
+    prepare_statements();
+
+  return true;
+}
+
+
+void PostgreSqlDb::register_model(size_t dimension)
+{
+  if (dimension == 0 || dimension > max_vector_dimension)
+  {
+    throw std::runtime_error("Embedding of dimension " +
+      std::to_string(dimension) + " for model \"" + model.model_id() +
+      "\", pgvector takes 1 to " + std::to_string(max_vector_dimension));
+  }
+
+  // Before the table exists, rather than when its index can't be created.
+  check_index_dimension(dimension);
+
+  std::string dimension_str = std::to_string(dimension);
+  const char* param_values[2] = {
+    model.model_id().c_str(), dimension_str.c_str()
+  };
+
+  // Another connection may register the model first, with the dimension
+  // its embeddings have, which check_dimension() holds these ones to.
+  locked_models_transaction([&]() {
+    PGresult_unique_ptr res(PQexecParams(pgconn,
+      "INSERT INTO EmbeddingModels(model_id, dimension) VALUES ($1, $2) "
+      "ON CONFLICT (model_id) DO NOTHING",
+      2, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+    check_result(res.get(), PGRES_COMMAND_OK);
+  });
+
+  if (!load_model())
+    throw std::runtime_error("Model \"" + model.model_id() + "\" not found "
+      "after registering it");
+}
+
+
+void
+PostgreSqlDb::save_text_units(const std::vector<const FileRecord*>& records)
+{
+  // A failed COPY aborts the current transaction, so it runs inside a
+  // savepoint that can be rolled back before falling back to plain INSERTs.
+  exec_sql("SAVEPOINT copy_text_units");
+
+  if (copy_text_units(records))
+  {
+    exec_sql("RELEASE SAVEPOINT copy_text_units");
+    return;
+  }
+
+  std::cerr << "COPY of text units failed, inserting them row by row...\n";
+  exec_sql("ROLLBACK TO SAVEPOINT copy_text_units");
+
+  for (const FileRecord* record : records)
+    insert_text_units(*record);
+}
+
+
+void PostgreSqlDb::rebuild_vector_index()
+{
+  if (!model_row_id && !load_model())
+    throw std::runtime_error("No text units saved for model \"" +
+      model.model_id() + "\"");
+
+  std::vector<std::string> names = managed_vector_indexes();
+  if (names.empty())
+    throw std::runtime_error("There is no vector index to rebuild");
+
+  for (const std::string& name : names)
+  {
+    std::cerr << "Rebuilding the vector index " << name << "...\n";
+    std::string sql("REINDEX INDEX CONCURRENTLY ");
+    sql += name;
+    exec_sql(sql.c_str());
+  }
+}
+
+
+std::vector<TextUnitResult>
+PostgreSqlDb::search(const std::vector<float>& embedding)
+{
+  return search_with_ef(embedding, 0);
+}
+
+
+std::vector<std::vector<TextUnitResult>>
+PostgreSqlDb::search_batch(const std::vector<std::vector<float>>& embeddings)
+{
+  if (!pipeline_mode)
+    return Database::search_batch(embeddings);
+
+  reconnect_if_lost();
+
+  if (!model_row_id && !load_model())
+    return std::vector<std::vector<TextUnitResult>>(embeddings.size());
+
+  for (const std::vector<float>& embedding : embeddings)
+    check_dimension(embedding.size());
+
+  set_search_parameters(0);
+
+  if (PQenterPipelineMode(pgconn) != 1)
+    throw std::runtime_error(PQerrorMessage(pgconn));
+
+  std::vector<std::string> statements;
+  bool queued = true;
+
+  for (const std::vector<float>& embedding : embeddings)
+  {
+    std::vector<std::vector<uint8_t>> query_vals = query_values(embedding);
+
+    statement_params params;
+    for (const std::vector<uint8_t>& value : query_vals)
+      params.add_binary(value);
+
+    if (!PQsendQueryPrepared(pgconn, search_stmt,
+      params.size(), params.values.data(), params.lengths.data(),
+      params.formats.data(), 0))
+    {
+      queued = false;
+      break;
+    }
+
+    statements.push_back("search query #" + std::to_string(statements.size() + 1));
+  }
+
+  std::string send_error;
+  if (!queued)
+    send_error = PQerrorMessage(pgconn);
+
+  std::vector<std::vector<TextUnitResult>> results(statements.size());
+  collect_pipeline_results(statements, [&](size_t idx, const PGresult* res) {
+    results[idx] = results_from_pgresult(res);
+  });
+
+  if (!queued)
+    throw std::runtime_error(send_error);
+
+  return results;
+}
+
+
+std::vector<TextUnitResult>
+PostgreSqlDb::search_once(const std::vector<float>& embedding,
+  size_t ef_search)
+{
+  if (!model_row_id && !load_model())
+    return {};
+
+  check_dimension(embedding.size());
+  set_search_parameters(ef_search);
+  std::vector<std::vector<uint8_t>> query_vals = query_values(embedding);
+
+  statement_params params;
+  for (const std::vector<uint8_t>& value : query_vals)
+    params.add_binary(value);
+
+  PGresult_unique_ptr res(PQexecPrepared(pgconn, search_stmt,
+    params.size(), params.values.data(), params.lengths.data(),
+    params.formats.data(), 0), PQclear);
+
+  ExecStatusType res_code = PQresultStatus(res.get());
+
+  if (res_code == PGRES_NONFATAL_ERROR)
+  {
+    std::cerr << PQerrorMessage(pgconn) << "\n";
+  }
+  else if (res_code != PGRES_TUPLES_OK)
+  {
+    throw std::runtime_error(PQerrorMessage(pgconn));
+  }
+
+  return results_from_pgresult(res.get());
+}
+
+
+std::vector<TextUnitResult>
+PostgreSqlDb::search_with_ef(const std::vector<float>& embedding,
+  size_t ef_search)
+{
+  reconnect_if_lost();
+
+  try
+  {
+    return search_once(embedding, ef_search);
+  }
+  catch (const std::runtime_error&)
+  {
+    // A search only reads, so it's run again when the server went away
+    // since the last statement, as when it restarts.
+    if (!reconnect_if_lost())
+      throw;
+  }
+
+  return search_once(embedding, ef_search);
+}
+
+
+void PostgreSqlDb::set_database_up()
+{
+  exec_sql("CREATE TABLE IF NOT EXISTS FileRecords("
+    "id serial PRIMARY KEY,"
+    "file_path TEXT,"
+    "file_size BIGINT,"
+    "mtime BIGINT,"
+    "content_hash BIGINT"
+  ")");
+
+  // Tables created by older versions.
+  exec_sql("ALTER TABLE FileRecords "
+    "ADD COLUMN IF NOT EXISTS file_size BIGINT, "
+    "ADD COLUMN IF NOT EXISTS mtime BIGINT, "
+    "ADD COLUMN IF NOT EXISTS content_hash BIGINT");
+
+  exec_sql("CREATE INDEX IF NOT EXISTS FileRecords_file_path_idx "
+    "ON FileRecords(file_path)");
+
+  // A NULL units_table means the table named after the ID.
+  exec_sql("CREATE TABLE IF NOT EXISTS EmbeddingModels("
+    "id serial PRIMARY KEY,"
+    "model_id TEXT UNIQUE NOT NULL,"
+    "dimension INTEGER NOT NULL,"
+    "units_table TEXT"
+  ")");
+
+  exec_sql("ALTER TABLE FileRecords ADD COLUMN IF NOT EXISTS "
+    "embedding_model INTEGER REFERENCES EmbeddingModels(id)");
+
+  adopt_legacy_table();
+
+  if (!model_row_id)
+    load_model();
+}
+
+
+void PostgreSqlDb::set_model(const ModelInfo& model_info)
+{
+  model = model_info;
+}
+
+
+void PostgreSqlDb::set_pipeline_mode(bool enabled)
+{
+  pipeline_mode = enabled;
+}
+
+
+void PostgreSqlDb::set_search_parameters(size_t ef_search)
+{
+  if (ef_search == 0)
+    ef_search = search_ef_search;
+
+  // An HNSW scan returns up to ef_search rows, which must cover the
+  // candidates re-ranked after a scan of a compact column. 1000 is the most
+  // pgvector accepts.
+  if (storage_type != "vector")
+    ef_search = std::max(ef_search, std::min<size_t>(rerank, 1000));
+
+  // Set for the session rather than with SET LOCAL, which would need a
+  // transaction around each search, so consecutive searches with the same
+  // values send nothing.
+  if (ef_search && ef_search != session_ef_search)
+  {
+    std::string sql("SET hnsw.ef_search = ");
+    sql += std::to_string(ef_search);
+    exec_sql(sql.c_str());
+    session_ef_search = ef_search;
+  }
+
+  if (search_probes && search_probes != session_probes)
+  {
+    std::string sql("SET ivfflat.probes = ");
+    sql += std::to_string(search_probes);
+    exec_sql(sql.c_str());
+    session_probes = search_probes;
+  }
+}
+
+
+void PostgreSqlDb::set_storage(const Json::Value& storage_settings)
+{
+  Json::Value value = get_json_member_with_type(storage_settings, "type",
+    Json::ValueType::stringValue, false);
+
+  if (value)
+  {
+    storage_type = value.asString();
+    get_storage_column(storage_type);
+  }
+
+  // At least as many candidates as results.
+  rerank = std::max<size_t>(get_positive_setting(storage_settings, "rerank",
+    200), 20);
+}
+
+
+void PostgreSqlDb::set_up_units_table()
+{
+  std::string dimension_str = std::to_string(model.dimension());
+
+  locked_models_transaction([&]() {
+    std::string sql("CREATE TABLE IF NOT EXISTS ");
+    sql += units_table;
+    sql += " (id bigserial PRIMARY KEY, text TEXT, embd VECTOR(";
+    sql += dimension_str;
+    sql += "), file_record_id INTEGER REFERENCES FileRecords(id))";
+    exec_sql(sql.c_str());
+
+    sql = "CREATE INDEX IF NOT EXISTS " + units_table +
+      "_file_record_id_idx ON " + units_table + "(file_record_id)";
+    exec_sql(sql.c_str());
+
+    has_half_column = set_up_compact_column("halfvec");
+    has_bits_column = set_up_compact_column("bit");
+  });
+
+  manage_vector_index();
+  prepare_statements();
+}
+
+
+bool PostgreSqlDb::set_up_compact_column(const std::string& column_type)
+{
+  const storage_column& column = get_storage_column(column_type);
+
+  const char* param_values[2] = {units_table.c_str(), column.name};
+  PGresult_unique_ptr res(PQexecParams(pgconn,
+    "SELECT 1 FROM pg_attribute WHERE attrelid = $1::regclass "
+    "AND attname = $2 AND NOT attisdropped",
+    2, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  if (PQntuples(res.get()) > 0)
+  {
+    set_up_compact_trigger(column_type);
+    return true;
+  }
+
+  if (storage_type != column_type)
+    return false;
+
+  std::cerr << "Adding the column " << column.name << " to " << units_table
+    << "...\n";
+
+  std::string sql = "ALTER TABLE " + units_table + " ADD COLUMN " +
+    column.name + " " + column.sql_type + "(" +
+    std::to_string(model.dimension()) + ")";
+  exec_sql(sql.c_str());
+
+  set_up_compact_trigger(column_type);
+
+  sql = "UPDATE " + units_table + " SET " + column.name + " = " +
+    compact_conversion(column, "embd", model.dimension());
+  exec_sql(sql.c_str());
+
+  return true;
+}
+
+
+void PostgreSqlDb::set_up_compact_trigger(const std::string& column_type)
+{
+  const storage_column& column = get_storage_column(column_type);
+
+  // In lower case, as unquoted names appear in pg_trigger.
+  std::string trigger_name = units_table + "_fill_" + column.name;
+
+  const char* param_values[2] = {units_table.c_str(), trigger_name.c_str()};
+  PGresult_unique_ptr res(PQexecParams(pgconn,
+    "SELECT 1 FROM pg_trigger WHERE tgrelid = $1::regclass AND tgname = $2",
+    2, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+  check_result(res.get(), PGRES_TUPLES_OK);
+
+  if (PQntuples(res.get()) > 0)
+    return;
+
+  // Named after the table, as the dimension of the conversion is the one of
+  // its model.
+  std::string sql = "CREATE OR REPLACE FUNCTION " + trigger_name +
+    "() RETURNS trigger AS $$ BEGIN IF NEW." + column.name + " IS NULL "
+    "THEN NEW." + column.name + " := " +
+    compact_conversion(column, "NEW.embd", model.dimension()) +
+    "; END IF; RETURN NEW; END $$ LANGUAGE plpgsql";
+  exec_sql(sql.c_str());
+
+  sql = "CREATE TRIGGER " + trigger_name + " BEFORE INSERT ON " +
+    units_table + " FOR EACH ROW EXECUTE FUNCTION " + trigger_name + "()";
+  exec_sql(sql.c_str());
+}
+
+
+void PostgreSqlDb::set_vector_index(const Json::Value& index_settings)
+{
+  Json::Value value = get_json_member_with_type(index_settings, "type",
+    Json::ValueType::stringValue, false);
+
+  if (value)
+  {
+    vector_index_type = value.asString();
+    if (vector_index_type != "none" && vector_index_type != "hnsw" &&
+      vector_index_type != "ivfflat")
+    {
+      throw std::runtime_error("Unknown vector index type \"" +
+        vector_index_type + "\", expected \"none\", \"hnsw\" or "
+        "\"ivfflat\"");
+    }
+  }
+
+  index_m = get_positive_setting(index_settings, "m", 16);
+  index_ef_construction = get_positive_setting(index_settings,
+    "efConstruction", 64);
+  index_lists = get_positive_setting(index_settings, "lists", 100);
+  search_ef_search = get_positive_setting(index_settings, "efSearch", 0);
+  search_probes = get_positive_setting(index_settings, "probes", 0);
+}
+
+
+void PostgreSqlDb::update_file_mtime(const std::string& file_path,
+  long long mtime)
+{
+  if (!model_row_id && !load_model())
+    return;
+
+  std::string mtime_str = std::to_string(mtime);
+  std::string model_str = std::to_string(model_row_id);
+  const char* param_values[3] = {
+    file_path.c_str(), mtime_str.c_str(), model_str.c_str()
+  };
+
+  PGresult_unique_ptr res(PQexecParams(pgconn,
+    "UPDATE FileRecords SET mtime = $2 "
+    "WHERE file_path = $1 AND embedding_model = $3",
+    3, nullptr, param_values, nullptr, nullptr, 0), PQclear);
+  check_result(res.get(), PGRES_COMMAND_OK);
+}
+
+
+std::string PostgreSqlDb::vector_index_name() const
+{
+  std::string name;
+
+  // Unquoted names are folded to lower case, as they appear in pg_indexes.
+  // Indexes of compact columns are named after their storage type.
+  std::string prefix = units_table + "_embd_";
+  if (storage_type != "vector")
+    prefix += storage_type + "_";
+
+  if (vector_index_type == "hnsw")
+  {
+    name = prefix + "hnsw_m";
+    name += std::to_string(index_m);
+    name += "_efc";
+    name += std::to_string(index_ef_construction);
+  }
+  else if (vector_index_type == "ivfflat")
+  {
+    name = prefix + "ivfflat_lists";
+    name += std::to_string(index_lists);
+  }
+
+  return name;
 }
\ No newline at end of file
@@ -1,29 +1,234 @@
 #pragma once
 
 #include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
 #include <libpq-fe.h>
 
 
+/*
+Database kept in PostgreSQL with pgvector. The text units of each embedding
+model are kept in a table of their own, registered in EmbeddingModels with
+the dimension of the model, and the file records in FileRecords refer to the
+model they were saved for. A connection reads and saves the records of the
+model set with set_model() only.
+*/
 class PostgreSqlDb: public Database
 {
   PGconn* pgconn;
+  bool pipeline_mode;
+  ModelInfo model;
+  // ID of the model in EmbeddingModels, 0 until it's registered.
+  unsigned long model_row_id;
+  // Table of the model's text units, in lower case as in pg_indexes.
+  std::string units_table;
+  // Column searched first: "vector" for the full embeddings, "halfvec" or
+  // "bit" for a compact copy, whose nearest rerank rows are re-ranked by
+  // their full embeddings.
+  std::string storage_type;
+  size_t rerank;
+  // Compact columns the table has, which every save fills.
+  bool has_half_column;
+  bool has_bits_column;
+  // Type of the vector index kept by set_database_up(): empty to leave the
+  // existing indexes alone, "none", "hnsw" or "ivfflat".
+  std::string vector_index_type;
+  size_t index_m;
+  size_t index_ef_construction;
+  size_t index_lists;
+  // Set on the connection before searching when not 0. The efSearch of a
+  // query replaces search_ef_search.
+  size_t search_ef_search;
+  size_t search_probes;
+  // Values set on the connection, 0 for the server's defaults.
+  size_t session_ef_search;
+  size_t session_probes;
+
+  // Registers the TextUnits768 table of older versions as the table of the
+  // model, or of a model named after it when the model has another table,
+  // and attaches the file records without a model to it.
+  void adopt_legacy_table();
+
+  // Throws unless the dimension is the one of the model's table.
+  void check_dimension(size_t dimension) const;
+
+  // Throws if the settings ask for an HNSW or IVFFlat index that can't hold
+  // embeddings of the dimension in the column of the storage type.
+  void check_index_dimension(size_t dimension) const;
+
+  void check_result(const PGresult* res, ExecStatusType expected);
 
   void clean_up() noexcept;
 
+  // Sends a sync point, reads the result of every statement queued in
+  // pipeline mode, passing it to on_result, and leaves pipeline mode. Throws
+  // naming the first statement in statements that failed.
+  void collect_pipeline_results(const std::vector<std::string>& statements,
+    const std::function<void(size_t, const PGresult*)>& on_result);
+
+  bool copy_text_units(const std::vector<const FileRecord*>& records);
+
+  // Deletes the records saved before for the file path of record, along
+  // with their text units.
+  void delete_previous_records(const FileRecord& record);
+
+  // Columns the embeddings are saved to, the full one first.
+  std::string embedding_columns() const;
+
+  // Values of the embedding for the columns of embedding_columns(), in
+  // binary format.
+  std::vector<std::vector<uint8_t>>
+  embedding_values(const Embedding& embedding) const;
+
   void exec_sql(const char* sql);
 
+  void insert_file_record(FileRecord& record);
+
+  // Inserts a file record without a path, which hides its text units from
+  // searches until it gets one. Returns its ID.
+  unsigned long insert_staging_record();
+
+  void insert_text_units(const FileRecord& record);
+
+  // Looks the model up in EmbeddingModels and, when it's there, creates its
+  // table if needed and prepares the statements. Returns false otherwise.
+  bool load_model();
+
+  // Runs fn in a transaction holding the lock that serializes changes to
+  // EmbeddingModels and the tables of the models between connections.
+  void locked_models_transaction(const std::function<void()>& fn);
+
+  // Creates the vector index of the settings and drops the ones built with
+  // another type or other parameters.
+  void manage_vector_index();
+
+  // Names of the vector indexes on the embeddings, which begin with a
+  // common prefix.
+  std::vector<std::string> managed_vector_indexes();
+
+  void pipeline_save(const std::vector<FileRecord*>& records);
+
+  void prepare(const char* name, const char* sql,
+    const std::vector<Oid>& param_types);
+
+  // Prepares the statements used for saving and searching, once per
+  // connection.
+  void prepare_statements();
+
+  // Values of the search statement's parameters for a query, in binary
+  // format.
+  std::vector<std::vector<uint8_t>>
+  query_values(const std::vector<float>& embedding) const;
+
+  // Registers the model with the dimension of the first embedding in
+  // records if it has no table yet, and checks the dimension of every
+  // embedding. Returns false when there is no table to save records to.
+  bool ready_to_save(const std::vector<const FileRecord*>& records);
+
+  // Connects again when the connection to the server was lost, preparing
+  // the statements again, as they went with it. Returns whether it did.
+  bool reconnect_if_lost();
+
+  void register_model(size_t dimension);
+
+  void save_text_units(const std::vector<const FileRecord*>& records);
+
+  std::vector<TextUnitResult>
+  search_once(const std::vector<float>& embedding, size_t ef_search);
+
+  // Sets hnsw.ef_search and ivfflat.probes on the connection for the next
+  // searches, when they change. ef_search is the one of the query, or 0 for
+  // the one of the settings.
+  void set_search_parameters(size_t ef_search);
+
+  // Returns whether the table has the compact column of column_type,
+  // adding it and filling it from the full embeddings when it's the storage
+  // type of the settings.
+  bool set_up_compact_column(const std::string& column_type);
+
+  // Has the compact column of column_type filled from the full embedding of
+  // the rows inserted without it, by connections that prepared their
+  // statements before the column was added, in this process or others.
+  void set_up_compact_trigger(const std::string& column_type);
+
+  // Creates the table of the model's text units if needed, keeps its vector
+  // index and prepares the statements.
+  void set_up_units_table();
+
+  // Name for the vector index of the settings, which includes its type and
+  // build parameters, so changing them means a new index. Empty for none.
+  std::string vector_index_name() const;
+
 public:
 
   PostgreSqlDb(const char* dbname, const char* user, const char* password, const char* host, const char* port);
 
   virtual ~PostgreSqlDb();
 
+  virtual void drop_file_parts(const FileParts& parts) override;
+
+  virtual std::vector<FileRecord> get_file_records() override;
+
+  // Each part is saved in a transaction of its own under a staging record,
+  // which the record of the file replaces, and not in pipeline mode. A crash
+  // before then leaves the staging record and its units hidden.
+  virtual void save_file_part(std::vector<TextUnit>& text_units,
+    FileParts& parts) override;
+
+  virtual void save_file_record_with_parts(FileRecord& record,
+    const FileParts& parts) override;
+
   virtual void
   save_file_record_with_text_units(FileRecord& record) override;
 
+  virtual void
+  save_file_records_with_text_units(std::vector<FileRecord>& records) override;
+
+  // Rebuilds the vector indexes without blocking writes, to be run after
+  // large loads. IVFFlat lists in particular are only chosen well from the
+  // rows present when the index is built.
+  virtual void rebuild_vector_index() override;
+
   virtual std::vector<TextUnitResult>
   search(const std::vector<float>& embedding) override;
 
+  virtual std::vector<TextUnitResult>
+  search_with_ef(const std::vector<float>& embedding,
+    size_t ef_search) override;
+
+  virtual std::vector<std::vector<TextUnitResult>>
+  search_batch(const std::vector<std::vector<float>>& embeddings) override;
+
+  // Creates the tables if needed and prepares the statements on the
+  // connection. Must be called before saving or searching. The table of a
+  // model saved for the first time is created with its first records.
   virtual void set_database_up() override;
 
+  // Model whose text units are saved and searched. Must be set before
+  // set_database_up(); the dimension is taken from the model's table, or
+  // from its first embedding.
+  void set_model(const ModelInfo& model_info);
+
+  // In pipeline mode, the statements for saving file records and the queries
+  // of a batch search are sent to the server without waiting for each result.
+  void set_pipeline_mode(bool enabled);
+
+  // Reads the "storage" settings: "type" ("vector", "halfvec" or "bit"),
+  // and "rerank", the number of candidates from a compact column re-ranked
+  // by their full embeddings.
+  void set_storage(const Json::Value& storage_settings);
+
+  // Reads the "vectorIndex" settings: "type" ("none", "hnsw" or
+  // "ivfflat"), the build parameters "m", "efConstruction" and "lists", and
+  // "efSearch" and "probes" for searching.
+  void set_vector_index(const Json::Value& index_settings);
+
+  // Sets the modification time of the model's records for the file path,
+  // when only it changed.
+  virtual void update_file_mtime(const std::string& file_path,
+    long long mtime) override;
 };
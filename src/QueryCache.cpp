@@ -0,0 +1,363 @@
+#include "QueryCache.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+namespace filesystem = std::filesystem;
+
+// Start of the file, followed by the entries, least recently used first.
+static const char file_signature[8] = {'E', 'M', 'B', 'D', 'Q', 'R', 'Y', '1'};
+
+// Memory taken by an entry besides its key and embedding: the list node, the
+// index node and the allocations' headers, roughly.
+static const size_t entry_overhead = 128;
+
+
+/*
+Holds flock() on the lock file next to the cache file while in scope, so
+the processes saving the cache merge their entries one after the other.
+*/
+class save_lock
+{
+  int fd;
+
+public:
+
+  explicit save_lock(const filesystem::path& file_path)
+  {
+    filesystem::path lock_path = file_path;
+    lock_path += ".lock";
+
+    fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw system_error("Cannot open the lock file of the query cache");
+
+    while (flock(fd, LOCK_EX) != 0)
+    {
+      if (errno != EINTR)
+      {
+        close(fd);
+        throw system_error("flock() on the query cache failed");
+      }
+    }
+  }
+
+  save_lock(const save_lock&) = delete;
+
+  save_lock& operator=(const save_lock&) = delete;
+
+  ~save_lock()
+  {
+    // Which unlocks it.
+    close(fd);
+  }
+};
+
+
+QueryCache::QueryCache(const std::filesystem::path& file_path,
+  size_t max_bytes):
+  file_path(file_path),
+  max_bytes(max_bytes),
+  used_bytes(0),
+  changes(0),
+  saved_changes(0),
+  _hits(0),
+  _misses(0)
+{
+  if (!file_path.empty())
+    load();
+}
+
+
+size_t QueryCache::entry_bytes(const entry& e)
+{
+  return e.key.size() + e.embedding.size() * sizeof(float) + entry_overhead;
+}
+
+
+void QueryCache::evict()
+{
+  while (used_bytes > max_bytes && !entries.empty())
+  {
+    used_bytes -= entry_bytes(entries.back());
+    index.erase(entries.back().key);
+    entries.pop_back();
+  }
+}
+
+
+bool QueryCache::get(const std::string& model_id, const std::string& query,
+  std::vector<float>& embedding)
+{
+  std::string key = make_key(model_id, query);
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto found = index.find(key);
+  if (found == index.end())
+  {
+    _misses++;
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, found->second);
+  embedding = found->second->embedding;
+  _hits++;
+  return true;
+}
+
+
+void QueryCache::insert(std::string&& key, std::vector<float>&& embedding)
+{
+  auto found = index.find(key);
+  if (found != index.end())
+  {
+    used_bytes -= entry_bytes(*found->second);
+    entries.erase(found->second);
+    index.erase(found);
+  }
+
+  entries.push_front(entry{std::move(key), std::move(embedding)});
+  index[entries.front().key] = entries.begin();
+  used_bytes += entry_bytes(entries.front());
+
+  evict();
+}
+
+
+void QueryCache::load()
+{
+  std::vector<entry> file_entries;
+  if (!read_entries(file_entries))
+  {
+    std::cerr << "The query cache \"" << file_path.string() << "\" is "
+      "corrupt, it's discarded.\n";
+    return;
+  }
+
+  for (entry& e : file_entries)
+    insert(std::move(e.key), std::move(e.embedding));
+}
+
+
+std::string QueryCache::make_key(const std::string& model_id,
+  const std::string& query)
+{
+  // The terminating null character separates the model ID from the query.
+  std::string key(model_id.c_str(), model_id.size() + 1);
+  key += normalize(query);
+  return key;
+}
+
+
+bool QueryCache::read_entries(std::vector<entry>& file_entries) const
+{
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file)
+    return true;
+
+  char signature[sizeof(file_signature)];
+  if (!file.read(signature, sizeof(signature)) ||
+    std::memcmp(signature, file_signature, sizeof(file_signature)) != 0)
+  {
+    std::string msg("\"");
+    msg += file_path.string();
+    msg += "\" is not a query cache file.";
+    throw std::runtime_error(msg);
+  }
+
+  std::error_code error;
+  uint64_t file_size = filesystem::file_size(file_path, error);
+  if (error)
+    return true;
+
+  // Dimension of the embeddings of each model ID, which every entry of the
+  // model must have.
+  std::unordered_map<std::string, uint32_t> dimensions;
+
+  // A file cut short keeps its complete entries. The sizes are checked
+  // before anything is allocated for them.
+  uint32_t sizes[2];
+  while (file.read(reinterpret_cast<char*>(sizes), sizeof(sizes)))
+  {
+    uint64_t left = file_size - file.tellg();
+    if (sizes[0] + uint64_t(sizes[1]) * sizeof(float) > left)
+      break;
+
+    entry e{std::string(sizes[0], '\0'), std::vector<float>(sizes[1])};
+
+    if (!file.read(e.key.data(), e.key.size()) ||
+      !file.read(reinterpret_cast<char*>(e.embedding.data()),
+        e.embedding.size() * sizeof(float)))
+    {
+      break;
+    }
+
+    size_t model_end = e.key.find('\0');
+    uint32_t& dimension = dimensions[e.key.substr(0, model_end)];
+    if (!dimension)
+      dimension = sizes[1];
+
+    if (model_end == std::string::npos || sizes[1] == 0 ||
+      sizes[1] != dimension)
+    {
+      file_entries.clear();
+      return false;
+    }
+
+    file_entries.push_back(std::move(e));
+  }
+
+  return true;
+}
+
+
+std::string QueryCache::normalize(const std::string& query)
+{
+  std::string normalized;
+  normalized.reserve(query.size());
+  bool in_space = false;
+
+  for (char c : query)
+  {
+    if (std::isspace(static_cast<unsigned char>(c)))
+    {
+      in_space = true;
+      continue;
+    }
+
+    if (in_space && !normalized.empty())
+      normalized += ' ';
+
+    normalized += c;
+    in_space = false;
+  }
+
+  return normalized;
+}
+
+
+std::shared_ptr<QueryCache>
+QueryCache::open_from_settings(const Json::Value& cache_settings)
+{
+  size_t max_bytes = 16 << 20;
+
+  Json::Value value = get_json_member_with_type(cache_settings, "maxBytes",
+    Json::ValueType::intValue, false);
+
+  if (value)
+  {
+    if (value.asLargestInt() < 0)
+      throw std::runtime_error("Member with the key \"maxBytes\" must not be "
+        "negative");
+
+    max_bytes = value.asLargestUInt();
+    if (max_bytes == 0)
+      return nullptr;
+  }
+
+  filesystem::path file_path = get_default_cache_dir();
+  file_path.append("queries.cache");
+
+  value = get_json_member_with_type(cache_settings, "file",
+    Json::ValueType::stringValue, false);
+  if (value)
+    file_path = value.asString();
+
+  return std::make_shared<QueryCache>(file_path, max_bytes);
+}
+
+
+void QueryCache::put(const std::string& model_id, const std::string& query,
+  const Embedding& embedding)
+{
+  std::string key = make_key(model_id, query);
+  std::vector<float> floats = embedding.to_vector();
+  std::lock_guard<std::mutex> lock(mutex);
+  insert(std::move(key), std::move(floats));
+  changes++;
+}
+
+
+void QueryCache::save()
+{
+  if (file_path.empty() || !unsaved())
+    return;
+
+  if (!file_path.parent_path().empty())
+    filesystem::create_directories(file_path.parent_path());
+
+  // Held until the file is replaced, so the entries another process saves
+  // meanwhile are read here or merge these.
+  save_lock lock_file(file_path);
+
+  std::vector<entry> file_entries;
+  if (!read_entries(file_entries))
+    file_entries.clear();
+
+  // Written aside and renamed, so a crash never leaves half a file.
+  filesystem::path tmp_path = file_path;
+  tmp_path += "." + std::to_string(getpid()) + ".tmp";
+
+  // The entries of the file that this process doesn't have come after its
+  // own, as used less recently, and are the first evicted. The entries are
+  // then copied, so searches aren't held up while the file is written.
+  std::vector<entry> saved_entries;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = file_entries.rbegin(); it != file_entries.rend(); ++it)
+    {
+      if (index.count(it->key))
+        continue;
+
+      entries.push_back(std::move(*it));
+      index[entries.back().key] = std::prev(entries.end());
+      used_bytes += entry_bytes(entries.back());
+    }
+    evict();
+
+    saved_entries.assign(entries.rbegin(), entries.rend());
+    saved_changes = changes;
+  }
+
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(file_signature, sizeof(file_signature));
+
+    for (auto it = saved_entries.begin(); it != saved_entries.end(); ++it)
+    {
+      uint32_t sizes[2] = {
+        static_cast<uint32_t>(it->key.size()),
+        static_cast<uint32_t>(it->embedding.size())
+      };
+      file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+      file.write(it->key.data(), it->key.size());
+      file.write(reinterpret_cast<const char*>(it->embedding.data()),
+        it->embedding.size() * sizeof(float));
+    }
+
+    if (!file.flush())
+    {
+      std::string msg("Cannot write the query cache \"");
+      msg += tmp_path.string();
+      msg += "\"";
+      throw std::runtime_error(msg);
+    }
+  }
+
+  filesystem::rename(tmp_path, file_path);
+}
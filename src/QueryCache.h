@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <json/json.h>
+
+#include "common.h"
+
+
+/*
+Embeddings of search queries kept in memory, keyed by model ID and
+normalized query text, and evicted least recently used first once they take
+more than a number of bytes. The entries are saved to a file by save() and
+loaded back when the cache is opened, so they outlive the process. save()
+merges the entries other processes saved meanwhile, so none are lost to
+processes saving in turn. Safe to share between threads.
+*/
+class QueryCache
+{
+  struct entry
+  {
+    std::string key;
+    std::vector<float> embedding;
+  };
+
+  std::filesystem::path file_path;
+  size_t max_bytes;
+  size_t used_bytes;
+  // Most recently used first.
+  std::list<entry> entries;
+  std::unordered_map<std::string, std::list<entry>::iterator> index;
+  std::mutex mutex;
+  // Entries put so far, and when the last save() began.
+  size_t changes;
+  size_t saved_changes;
+  std::atomic<size_t> _hits;
+  std::atomic<size_t> _misses;
+
+  // Bytes an entry counts for, with an estimate of the memory around it.
+  static size_t entry_bytes(const entry& e);
+
+  void evict();
+
+  void insert(std::string&& key, std::vector<float>&& embedding);
+
+  static std::string make_key(const std::string& model_id,
+    const std::string& query);
+
+  void load();
+
+  // Reads the entries of the file, least recently used first. Returns false
+  // if it's corrupt.
+  bool read_entries(std::vector<entry>& file_entries) const;
+
+public:
+
+  // Loads the entries saved in file_path, unless it's empty.
+  QueryCache(const std::filesystem::path& file_path, size_t max_bytes);
+
+  QueryCache(const QueryCache&) = delete;
+
+  QueryCache& operator=(const QueryCache&) = delete;
+
+  // Returns false, counting a miss, when there's no embedding for the query.
+  bool get(const std::string& model_id, const std::string& query,
+    std::vector<float>& embedding);
+
+  size_t hits() const
+  {
+    return _hits;
+  }
+
+  size_t misses() const
+  {
+    return _misses;
+  }
+
+  // The query with the whitespace at its ends removed and the runs of
+  // whitespace inside it replaced by a space, so queries typed differently
+  // share an entry.
+  static std::string normalize(const std::string& query);
+
+  // Opens the cache described by the "queryCache" settings: "maxBytes" and
+  // "file", the default one if it's not set. Returns an empty pointer if
+  // "maxBytes" is 0, and keeps the entries in memory only if "file" is an
+  // empty string.
+  static std::shared_ptr<QueryCache>
+  open_from_settings(const Json::Value& cache_settings);
+
+  void put(const std::string& model_id, const std::string& query,
+    const Embedding& embedding);
+
+  // Writes the entries to the file, along with the ones saved there by
+  // other processes that still fit, when entries were put since the last
+  // save.
+  void save();
+
+  // Whether entries were put since the last save() began.
+  bool unsaved()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return changes != saved_changes;
+  }
+};
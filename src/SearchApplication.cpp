@@ -1,12 +1,264 @@
 #include "SearchApplication.h"
 
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "BoundedQueue.h"
+#include "LocalDatabases.h"
+#include "QueryCache.h"
+
+
+// Largest request or response frame accepted from the socket.
+static const uint32_t max_frame_size = 1 << 24;
+
+// How often the daemon checks if it should stop, should a stop signal come
+// before it waits.
+static const int stop_check_ms = 500;
+
+// How long the daemon waits for the rest of a request once its first bytes
+// came, so a client that stops halfway only holds a thread that long.
+static const int request_timeout_ms = 10000;
+
+// Requests waiting for a thread, per database connection, above which
+// clients are turned away.
+static const size_t pending_requests_per_connection = 8;
+
+// How often the daemon saves the query cache when it has new entries, so
+// they survive it being killed.
+static const std::chrono::minutes cache_save_interval(5);
+
+static volatile sig_atomic_t stop_signal_received = 0;
+
+
+static void on_stop_signal(int)
+{
+  stop_signal_received = 1;
+}
+
+
+/*
+Frames of the daemon protocol: a 32-bit big-endian length, then that many
+bytes of JSON. A client sends {"query": text} and the daemon answers
+{"results": [...]}, or {"error": message} when the search failed.
+*/
+static bool read_all(int fd, char* data, size_t size,
+  std::chrono::steady_clock::time_point deadline)
+{
+  while (size > 0)
+  {
+    if (deadline != std::chrono::steady_clock::time_point::max())
+    {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+      pollfd poll_fd = {fd, POLLIN, 0};
+      int ready = poll(&poll_fd, 1, left > 0 ? left : 0);
+      if (ready < 0 && errno == EINTR)
+        continue;
+      if (ready <= 0)
+        return false;
+    }
+
+    ssize_t n_read = read(fd, data, size);
+    if (n_read < 0 && errno == EINTR)
+      continue;
+    if (n_read <= 0)
+      return false;
+
+    data += n_read;
+    size -= n_read;
+  }
+
+  return true;
+}
+
+
+static bool write_all(int fd, const char* data, size_t size)
+{
+  while (size > 0)
+  {
+    // Not write(), which raises SIGPIPE when the peer has gone.
+    ssize_t n_written = send(fd, data, size, MSG_NOSIGNAL);
+    if (n_written < 0 && errno == EINTR)
+      continue;
+    if (n_written <= 0)
+      return false;
+
+    data += n_written;
+    size -= n_written;
+  }
+
+  return true;
+}
+
+
+// Reads a frame in at most timeout_ms, or with no limit when it's negative.
+static bool read_frame(int fd, Json::Value& json, int timeout_ms)
+{
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (timeout_ms >= 0)
+  {
+    deadline = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+  }
+
+  uint32_t size_be;
+  if (!read_all(fd, reinterpret_cast<char*>(&size_be), 4, deadline))
+    return false;
+
+  uint32_t size = ntohl(size_be);
+  if (size > max_frame_size)
+    return false;
+
+  std::string text(size, '\0');
+  if (!read_all(fd, text.data(), size, deadline))
+    return false;
+
+  Json::CharReaderBuilder reader_builder;
+  std::istringstream text_stream(text);
+  std::string errors;
+  return Json::parseFromStream(reader_builder, text_stream, &json, &errors);
+}
+
+
+static std::string make_frame(const Json::Value& json)
+{
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  std::string text = Json::writeString(builder, json);
+
+  uint32_t size_be = htonl(text.size());
+  return std::string(reinterpret_cast<const char*>(&size_be), 4) + text;
+}
+
+
+static bool write_frame(int fd, const Json::Value& json)
+{
+  std::string frame = make_frame(json);
+  return write_all(fd, frame.data(), frame.size());
+}
+
+
+static sockaddr_un socket_address(const std::string& path)
+{
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Socket path too long: " + path);
+
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+
+// Connected socket to path, or -1.
+static int connect_to_socket(const std::string& path)
+{
+  sockaddr_un address = socket_address(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    throw std::runtime_error(std::string("socket() failed: ") +
+      std::strerror(errno));
+
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&address),
+    sizeof(address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+static Json::Value results_to_json(const std::vector<TextUnitResult>& results)
+{
+  Json::Value json(Json::arrayValue);
+
+  for (const TextUnitResult& res : results)
+  {
+    Json::Value result;
+    result["textUnitId"] = Json::UInt64(res.unit.id());
+    result["distance"] = res.distance;
+    result["filePath"] = res.unit.file_record()->file_path();
+    result["text"] = res.unit.text();
+    json.append(result);
+  }
+
+  return json;
+}
+
+
+static void print_results(const Json::Value& results)
+{
+  Json::ArrayIndex n_results = results.size();
+  for (Json::ArrayIndex idx = 0; idx < n_results; idx++)
+  {
+    const Json::Value& res = results[idx];
+    std::cerr << "*** Result #" << idx + 1 << " ***\n\n";
+
+    std::cerr << "Text Unit ID: " << res["textUnitId"].asUInt64() << "\n";
+    std::cerr << "Distance: " << res["distance"].asFloat() << "\n\n";
+    std::cerr << "File path: " << res["filePath"].asString() << "\n\n";
+    std::cerr << "Text\n==============================\n" <<
+      res["text"].asString() << "\n\n";
+  }
+}
+
+
+// Whether str is a whole number greater than 0, set to value.
+static bool parse_positive(const char* str, size_t& value)
+{
+  const char* end = str + std::strlen(str);
+  auto [ptr, ec] = std::from_chars(str, end, value);
+  return ec == std::errc() && ptr == end && value > 0;
+}
+
+
+// Reads up to max_items non-empty lines of input as text units.
+static std::vector<TextUnit> read_query_batch(std::istream& input,
+  size_t max_items)
+{
+  std::vector<TextUnit> queries;
+  std::string line;
+
+  while (queries.size() < max_items && std::getline(input, line))
+  {
+    if (line.empty())
+      continue;
+
+    queries.emplace_back();
+    queries.back().text(line);
+  }
+
+  return queries;
+}
+
 
 SearchApplication::SearchApplication():
-  database()
+  batch_max_items(1),
+  ef_search(0)
 {
 }
 
@@ -21,29 +273,75 @@ int SearchApplication::run(int argc, char** argv)
 {
   config_root = get_settings_from_default_json_file();
 
-  std::string embd_api_url;
-  std::string model_name;
+  if (argc >= 2 && std::strcmp(argv[1], "--ef-search") == 0)
+  {
+    if (argc < 3 || !parse_positive(argv[2], ef_search))
+      throw std::runtime_error("--ef-search takes a number greater than 0");
 
-  Json::Value embd_serv = get_json_member_with_type(config_root,
-    "embeddingsHttp", Json::ValueType::objectValue, false);
+    // The mode and query follow, as if the option wasn't there.
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
 
-  if (embd_serv)
+  if (argc >= 2 && std::strcmp(argv[1], "--serve") == 0)
   {
-    Json::Value url_obj = get_json_member_with_type(embd_serv, "embeddingsUrl",
-      Json::ValueType::stringValue, false);
-    if (url_obj)
-      embd_api_url = url_obj.asString();
+    set_model_service_up();
+    return serve();
+  }
 
-    Json::Value model_id_obj = get_json_member_with_type(embd_serv, "idModelToSave",
-      Json::ValueType::stringValue, false);
-    model_name = model_id_obj.asString();
+  if (argc >= 2 && std::strcmp(argv[1], "--batch") == 0)
+  {
+    set_model_service_up();
+
+    if (argc < 3 || std::strcmp(argv[2], "-") == 0)
+      return run_batch(std::cin);
+
+    std::ifstream input(argv[2]);
+    if (!input)
+      throw std::runtime_error(std::string("Couldn't open ") + argv[2]);
+
+    return run_batch(input);
   }
 
-  if (embd_api_url.empty())
-    embd_api_url = "http://localhost:8080/v1/embeddings";
+  if (argc >= 2 && std::strcmp(argv[1], "--client") == 0)
+  {
+    std::string query = read_query(argc, argv, 2);
+    if (query.empty())
+      return 0;
+
+    return run_client(query);
+  }
+
+  set_model_service_up();
+
+  std::string query = read_query(argc, argv, 1);
+  if (query.empty())
+    return 0;
+
+  return run_query(query);
+}
+
+
+void SearchApplication::clean_up() noexcept
+{
+}
 
-  model_service.set_embeddings_api_url(embd_api_url);
-  model_service.set_model_name(model_name);
+
+std::shared_ptr<Database> SearchApplication::connect_database()
+{
+  // An in-process database is opened once and shared by the threads.
+  if (!local_database)
+  {
+    local_database = open_local_database(config_root);
+    if (local_database)
+      local_database->set_database_up();
+  }
+
+  if (local_database)
+    return local_database;
+
+  std::shared_ptr<Database> database;
 
   Json::Value pgsql_settings = get_json_member_with_type(config_root,
     "postgresql", Json::ValueType::objectValue, false);
@@ -55,6 +353,7 @@ int SearchApplication::run(int argc, char** argv)
     std::string password;
     std::string host;
     std::string port;
+    bool pipeline_mode = false;
 
     Json::Value value = get_json_member_with_type(pgsql_settings, "dbname",
       Json::ValueType::stringValue, false);
@@ -76,68 +375,655 @@ int SearchApplication::run(int argc, char** argv)
       Json::ValueType::stringValue, false);
     if (value) port = value.asString();
 
-    database.reset(new PostgreSqlDb(dbname.empty() ? nullptr : dbname.c_str(),
+    value = get_json_member_with_type(pgsql_settings, "pipelineMode",
+      Json::ValueType::booleanValue, false);
+    if (value) pipeline_mode = value.asBool();
+
+    PostgreSqlDb* pg_database = new PostgreSqlDb(
+      dbname.empty() ? nullptr : dbname.c_str(),
       user.empty() ? nullptr : user.c_str(),
       password.empty() ? nullptr : password.c_str(),
       host.empty() ? nullptr : host.c_str(),
-      port.empty() ? nullptr : port.c_str()));
+      port.empty() ? nullptr : port.c_str());
+    database.reset(pg_database);
+    pg_database->set_pipeline_mode(pipeline_mode);
+    pg_database->set_model(model_info);
+
+    Json::Value index_settings = get_json_member_with_type(pgsql_settings,
+      "vectorIndex", Json::ValueType::objectValue, false);
+    if (index_settings)
+      pg_database->set_vector_index(index_settings);
+
+    Json::Value storage_settings = get_json_member_with_type(pgsql_settings,
+      "storage", Json::ValueType::objectValue, false);
+    if (storage_settings)
+      pg_database->set_storage(storage_settings);
   }
   else
   {
     std::cerr << "No database settings found in the settings file. "
       "Connecting to a local PostgreSQL database with the default values...\n";
-    database.reset(new PostgreSqlDb(nullptr, nullptr, nullptr, nullptr,
-      nullptr));
+    PostgreSqlDb* pg_database = new PostgreSqlDb(nullptr, nullptr, nullptr,
+      nullptr, nullptr);
+    database.reset(pg_database);
+    pg_database->set_model(model_info);
   }
 
-  if (database)
+  database->set_database_up();
+  return database;
+}
+
+
+void SearchApplication::finish_embedding(query_batch& batch)
+{
+  if (!batch.embedded.valid())
+    return;
+
+  batch.embedded.get();
+
+  for (size_t idx = 0; idx < batch.requested.size(); idx++)
   {
-    database->set_database_up();
+    TextUnit& query = batch.queries[batch.requested_indexes[idx]];
+    query.embedding(batch.requested[idx].embedding());
+
+    if (query_cache)
+      query_cache->put(model_info.model_id(), query.text(), query.embedding());
   }
-  else
+}
+
+
+std::vector<float>
+SearchApplication::get_query_embedding(const std::string& query)
+{
+  std::vector<float> embedding;
+  if (query_cache && query_cache->get(model_info.model_id(), query, embedding))
+    return embedding;
+
+  std::vector<TextUnit> text_units(1);
+  text_units[0].text(query);
+
+  model_service->get_embeddings_and_set_async(text_units).get();
+
+  if (query_cache)
+    query_cache->put(model_info.model_id(), query, text_units[0].embedding());
+
+  return text_units[0].embedding().to_vector();
+}
+
+
+std::string SearchApplication::read_query(int argc, char** argv, int query_arg)
+{
+  if (argc > query_arg)
+    return argv[query_arg];
+
+  std::string query;
+  std::cerr << "Search query: ";
+  std::getline(std::cin, query);
+
+  if (query.empty())
+    std::cerr << "Empty query string, exiting...\n";
+
+  return query;
+}
+
+
+void SearchApplication::report_caches()
+{
+  // Hits as a percentage of lookups.
+  auto hit_rate = [](size_t hits, size_t misses) {
+    return hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+  };
+
+  if (query_cache)
   {
-    throw std::runtime_error("database is empty");
+    std::cerr << "Query cache: " << query_cache->hits() << " hits, "
+      << query_cache->misses() << " misses ("
+      << hit_rate(query_cache->hits(), query_cache->misses()) << "% hits)\n";
   }
 
-  std::string query_str_stdin;
-  const char* query_str = nullptr;
-  if (argc >= 2)
+  if (embeddings_cache)
   {
-    query_str = argv[1];
+    std::cerr << "Embeddings cache: " << embeddings_cache->hits() << " hits, "
+      << embeddings_cache->misses() << " misses ("
+      << hit_rate(embeddings_cache->hits(), embeddings_cache->misses())
+      << "% hits)\n";
   }
-  else
+}
+
+
+int SearchApplication::run_batch(std::istream& input)
+{
+  std::shared_ptr<Database> database = connect_database();
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+
+  // Each batch is embedded while the one before is searched. The requests
+  // write to the text units, so the two batches stay where they are.
+  query_batch batches[2];
+  size_t current = 0;
+  size_t n_queries = 0;
+  size_t n_failed = 0;
+
+  batches[current].queries = read_query_batch(input, batch_max_items);
+  start_embedding(batches[current]);
+
+  while (!batches[current].queries.empty())
   {
-    std::cerr << "Search query: ";
-    std::getline(std::cin, query_str_stdin);
-    query_str = query_str_stdin.c_str();
+    size_t next = 1 - current;
+    batches[next].queries = read_query_batch(input, batch_max_items);
+    start_embedding(batches[next]);
 
-    if (query_str_stdin.empty())
+    try
     {
-      std::cerr << "Empty query string, exiting...\n";
-      return 0;
+      const std::vector<TextUnit>& queries = batches[current].queries;
+
+      std::string embedding_error;
+      try
+      {
+        finish_embedding(batches[current]);
+      }
+      catch (const std::exception& e)
+      {
+        embedding_error = e.what();
+      }
+
+      // Searched one at a time when the batch search fails, so only the
+      // queries that fail get an error.
+      std::vector<std::vector<TextUnitResult>> results;
+      if (embedding_error.empty() && !ef_search)
+      {
+        std::vector<std::vector<float>> embeddings;
+        embeddings.reserve(queries.size());
+        for (const TextUnit& query : queries)
+          embeddings.push_back(query.embedding().to_vector());
+
+        try
+        {
+          results = database->search_batch(embeddings);
+        }
+        catch (const std::exception&)
+        {
+          // Searched one at a time below.
+        }
+      }
+
+      for (size_t idx = 0; idx < queries.size(); idx++)
+      {
+        Json::Value line;
+        line["query"] = queries[idx].text();
+
+        if (!embedding_error.empty())
+        {
+          line["error"] = embedding_error;
+        }
+        else if (idx < results.size())
+        {
+          line["results"] = results_to_json(results[idx]);
+        }
+        else
+        {
+          try
+          {
+            line["results"] = results_to_json(database->search_with_ef(
+              queries[idx].embedding().to_vector(), ef_search));
+          }
+          catch (const std::exception& e)
+          {
+            line["error"] = e.what();
+          }
+        }
+
+        if (line.isMember("error"))
+          n_failed++;
+
+        std::cout << Json::writeString(builder, line) << '\n';
+      }
+    }
+    catch (...)
+    {
+      // The next batch's request must not outlive its text units.
+      if (batches[next].embedded.valid())
+        batches[next].embedded.wait();
+      throw;
     }
+
+    n_queries += batches[current].queries.size();
+    current = next;
+  }
+
+  std::cout.flush();
+
+  std::cerr << "Searched " << n_queries << " queries";
+  if (n_failed)
+    std::cerr << ", " << n_failed << " of which failed";
+  std::cerr << "\n";
+  report_caches();
+
+  if (query_cache)
+    query_cache->save();
+
+  return n_failed ? 1 : 0;
+}
+
+
+int SearchApplication::run_client(const std::string& query)
+{
+  std::string path = socket_path();
+
+  int fd = connect_to_socket(path);
+  if (fd < 0)
+  {
+    std::cerr << "Couldn't connect to the search daemon at " << path <<
+      ": " << std::strerror(errno) << "\n";
+    return 1;
   }
 
-  std::vector<float> embd = model_service.get_embedding(query_str);
-  std::vector<TextUnitResult> results = database->search(embd);
+  Json::Value request;
+  request["query"] = query;
+  if (ef_search)
+    request["efSearch"] = Json::UInt64(ef_search);
+
+  Json::Value response;
+  bool answered = write_frame(fd, request) &&
+    read_frame(fd, response, -1);
+  close(fd);
 
-  size_t n_results = results.size();
-  for (size_t idx = 0; idx < n_results; idx++)
+  if (!answered)
   {
-    const TextUnitResult& res = results[idx];
-    std::cerr << "*** Result #" << idx + 1 << " ***\n\n";
+    std::cerr << "The search daemon closed the connection.\n";
+    return 1;
+  }
 
-    std::cerr << "Text Unit ID: " << res.unit.id() << "\n";
-    std::cerr << "Distance: " << res.distance << "\n\n";
-    std::cerr << "File path: " << res.unit.file_record()->file_path() << "\n\n";
-    std::cerr << "Text\n==============================\n" <<
-      res.unit.text() << "\n\n";
+  if (response.isMember("error"))
+  {
+    std::cerr << "Search failed: " << response["error"].asString() << "\n";
+    return 1;
   }
 
+  print_results(response["results"]);
   return 0;
 }
 
 
-void SearchApplication::clean_up() noexcept
+int SearchApplication::run_query(const std::string& query)
+{
+  std::shared_ptr<Database> database = connect_database();
+
+  std::vector<float> embd = get_query_embedding(query);
+  print_results(results_to_json(database->search_with_ef(embd, ef_search)));
+
+  // Once the results are out, rather than before the search.
+  report_caches();
+
+  if (query_cache)
+    query_cache->save();
+
+  return 0;
+}
+
+
+int SearchApplication::serve()
+{
+  Json::Value daemon_settings = get_json_member_with_type(config_root,
+    "searchDaemon", Json::ValueType::objectValue, false);
+  size_t n_connections = get_positive_setting(daemon_settings, "connections",
+    4);
+
+  // The connections are opened and set up one after the other, so the
+  // tables are never created concurrently.
+  std::vector<std::shared_ptr<Database>> databases;
+  for (size_t idx = 0; idx < n_connections; idx++)
+    databases.push_back(connect_database());
+
+  std::string path = socket_path();
+  sockaddr_un address = socket_address(path);
+
+  // A socket left by a daemon that didn't stop cleanly accepts no
+  // connection and is replaced.
+  int running_fd = connect_to_socket(path);
+  if (running_fd >= 0)
+  {
+    close(running_fd);
+    std::cerr << "A search daemon is already running at " << path << "\n";
+    return 1;
+  }
+  unlink(path.c_str());
+
+  // Non-blocking, so accept() doesn't wait for a client that went away
+  // after poll() reported it.
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+    0);
+  if (listen_fd < 0)
+    throw std::runtime_error(std::string("socket() failed: ") +
+      std::strerror(errno));
+
+  // Only the user running the daemon can connect.
+  mode_t old_umask = umask(0077);
+  int bound = bind(listen_fd, reinterpret_cast<const sockaddr*>(&address),
+    sizeof(address));
+  umask(old_umask);
+
+  if (bound != 0 || listen(listen_fd, SOMAXCONN) != 0)
+  {
+    std::string msg("Couldn't listen at " + path + ": " +
+      std::strerror(errno));
+    close(listen_fd);
+    throw std::runtime_error(msg);
+  }
+
+  // Threads hand back the clients they answered through this pipe, for the
+  // next request to be waited for along with the new clients.
+  int answered_pipe[2];
+  if (pipe2(answered_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+  {
+    std::string msg(std::string("pipe() failed: ") + std::strerror(errno));
+    close(listen_fd);
+    throw std::runtime_error(msg);
+  }
+
+  // The threads are started with the stop signals blocked, so they are
+  // delivered to this one and interrupt poll().
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+  // Clients whose request has started to arrive, each answered by the next
+  // free thread.
+  BoundedQueue<int> requests(n_connections * pending_requests_per_connection);
+  std::vector<std::thread> threads;
+
+  // The query cache is saved by a thread of its own, so no client waits
+  // for the file to be written.
+  std::mutex saver_mutex;
+  std::condition_variable saver_wakeup;
+  bool saver_stopping = false;
+  std::thread saver;
+
+  if (query_cache)
+  {
+    saver = std::thread([this, &saver_mutex, &saver_wakeup,
+      &saver_stopping]() {
+      std::unique_lock<std::mutex> lock(saver_mutex);
+      while (!saver_wakeup.wait_for(lock, cache_save_interval,
+        [&saver_stopping]() { return saver_stopping; }))
+      {
+        try
+        {
+          query_cache->save();
+        }
+        catch (const std::exception& e)
+        {
+          std::cerr << e.what() << "\n";
+        }
+      }
+    });
+  }
+
+  for (std::shared_ptr<Database>& database : databases)
+  {
+    threads.emplace_back([this, &requests, &answered_pipe, database]() {
+      int client_fd;
+      while (requests.pop(client_fd))
+      {
+        // A write this small to a pipe is whole or fails, only when the
+        // pipe is full, in which case the client is let go.
+        if (!serve_request(client_fd, *database) ||
+          write(answered_pipe[1], &client_fd, sizeof(client_fd)) !=
+          sizeof(client_fd))
+        {
+          close(client_fd);
+        }
+      }
+    });
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = on_stop_signal;
+  // No SA_RESTART, so poll() returns on a signal.
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+
+  std::cerr << "Serving searches at " << path << " with " << n_connections
+    << " connections\n";
+
+  // The listening socket, the pipe, then the clients between two requests.
+  std::vector<pollfd> poll_fds = {
+    {listen_fd, POLLIN, 0}, {answered_pipe[0], POLLIN, 0}
+  };
+  Json::Value busy_response;
+  busy_response["error"] = "The search daemon is busy";
+  std::string busy_frame = make_frame(busy_response);
+
+  while (!stop_signal_received)
+  {
+    int ready = poll(poll_fds.data(), poll_fds.size(), stop_check_ms);
+
+    if (ready < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      std::cerr << "poll() failed: " << std::strerror(errno) << "\n";
+      break;
+    }
+
+    // A client that sent something, or hung up, goes to the threads, which
+    // close it when no request can be read. It's turned away when too many
+    // requests are waiting already.
+    for (size_t idx = poll_fds.size(); idx-- > 2;)
+    {
+      if (!poll_fds[idx].revents)
+        continue;
+
+      int client_fd = poll_fds[idx].fd;
+      poll_fds[idx] = poll_fds.back();
+      poll_fds.pop_back();
+
+      // The answer is only sent if the socket takes it at once, so this
+      // thread never waits for a client that doesn't read.
+      if (!requests.try_push(client_fd))
+      {
+        send(client_fd, busy_frame.data(), busy_frame.size(),
+          MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(client_fd);
+      }
+    }
+
+    if (poll_fds[1].revents)
+    {
+      int client_fds[64];
+      ssize_t n_read;
+      while ((n_read = read(answered_pipe[0], client_fds,
+        sizeof(client_fds))) > 0)
+      {
+        for (ssize_t idx = 0; idx < n_read / static_cast<ssize_t>(sizeof(int)); idx++)
+          poll_fds.push_back({client_fds[idx], POLLIN, 0});
+      }
+    }
+
+    if (poll_fds[0].revents)
+    {
+      int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+      if (client_fd >= 0)
+      {
+        poll_fds.push_back({client_fd, POLLIN, 0});
+      }
+      else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN &&
+        errno != EWOULDBLOCK)
+      {
+        std::cerr << "accept() failed: " << std::strerror(errno) << "\n";
+        break;
+      }
+    }
+  }
+
+  std::cerr << "Stopping the search daemon...\n";
+
+  // The requests that no thread took are dropped, and the threads finish
+  // the ones they are answering.
+  int client_fd;
+  while (requests.try_pop(client_fd))
+    close(client_fd);
+  requests.close();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  if (saver.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(saver_mutex);
+      saver_stopping = true;
+    }
+    saver_wakeup.notify_one();
+    saver.join();
+  }
+
+  for (size_t idx = 2; idx < poll_fds.size(); idx++)
+    close(poll_fds[idx].fd);
+
+  int client_fds[64];
+  ssize_t n_read;
+  while ((n_read = read(answered_pipe[0], client_fds, sizeof(client_fds))) > 0)
+  {
+    for (ssize_t idx = 0; idx < n_read / static_cast<ssize_t>(sizeof(int)); idx++)
+      close(client_fds[idx]);
+  }
+
+  close(answered_pipe[0]);
+  close(answered_pipe[1]);
+  close(listen_fd);
+  unlink(path.c_str());
+
+  report_caches();
+  if (query_cache)
+    query_cache->save();
+
+  return 0;
+}
+
+
+bool SearchApplication::serve_request(int client_fd, Database& database)
+{
+  Json::Value request;
+  if (!read_frame(client_fd, request, request_timeout_ms))
+    return false;
+
+  Json::Value response;
+
+  try
+  {
+    if (!request.isObject())
+      throw std::runtime_error("The request is not a JSON object");
+
+    Json::Value query = get_json_member_with_type(request, "query",
+      Json::ValueType::stringValue);
+
+    size_t query_ef_search = get_positive_setting(request, "efSearch",
+      ef_search);
+
+    std::vector<float> embd = get_query_embedding(query.asString());
+    response["results"] = results_to_json(database.search_with_ef(embd,
+      query_ef_search));
+  }
+  catch (const std::exception& e)
+  {
+    response["error"] = e.what();
+  }
+
+  return write_frame(client_fd, response);
+}
+
+
+void SearchApplication::set_model_service_up()
+{
+  std::string embd_api_url;
+  std::string model_name;
+
+  Json::Value embd_serv = get_json_member_with_type(config_root,
+    "embeddingsHttp", Json::ValueType::objectValue, false);
+
+  if (embd_serv)
+  {
+    Json::Value url_obj = get_json_member_with_type(embd_serv, "embeddingsUrl",
+      Json::ValueType::stringValue, false);
+    if (url_obj)
+      embd_api_url = url_obj.asString();
+
+    Json::Value model_id_obj = get_json_member_with_type(embd_serv, "idModelToSave",
+      Json::ValueType::stringValue, false);
+    model_name = model_id_obj.asString();
+  }
+
+  if (embd_api_url.empty())
+    embd_api_url = "http://localhost:8080/v1/embeddings";
+
+  batch_max_items = get_positive_setting(embd_serv, "batchMaxItems", 64);
+
+  embeddings_cache = EmbeddingCache::open_from_settings(embd_serv);
+
+  Json::Value query_cache_settings = get_json_member_with_type(config_root,
+    "queryCache", Json::ValueType::objectValue, false);
+  query_cache = QueryCache::open_from_settings(query_cache_settings);
+
+  model_service = std::make_unique<HTTPModelService>();
+  model_service->set_embeddings_api_url(embd_api_url);
+  model_service->set_model_name(model_name);
+  model_service->set_cache(embeddings_cache);
+
+  // Named as in the embeddings cache: without a model name, the server
+  // decides which model is used.
+  model_info.model_id(model_name.empty() ? embd_api_url : model_name);
+}
+
+
+void SearchApplication::start_embedding(query_batch& batch)
 {
-}
\ No newline at end of file
+  batch.requested.clear();
+  batch.requested_indexes.clear();
+  batch.embedded = std::future<void>();
+
+  std::vector<float> embedding;
+  for (size_t idx = 0; idx < batch.queries.size(); idx++)
+  {
+    TextUnit& query = batch.queries[idx];
+
+    if (query_cache &&
+      query_cache->get(model_info.model_id(), query.text(), embedding))
+    {
+      query.embedding(embedding);
+      continue;
+    }
+
+    batch.requested.push_back(query);
+    batch.requested_indexes.push_back(idx);
+  }
+
+  if (!batch.requested.empty())
+  {
+    batch.embedded = model_service->get_embeddings_and_set_async(
+      batch.requested);
+  }
+}
+
+
+std::string SearchApplication::socket_path() const
+{
+  Json::Value daemon_settings = get_json_member_with_type(config_root,
+    "searchDaemon", Json::ValueType::objectValue, false);
+
+  Json::Value value = get_json_member_with_type(daemon_settings,
+    "socketPath", Json::ValueType::stringValue, false);
+  if (value)
+    return value.asString();
+
+  const char* dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && dir[0] != 0)
+    return std::string(dir) + "/embeddings-db-search.sock";
+
+  return "/tmp/embeddings-db-search-" + std::to_string(getuid()) + ".sock";
+}
@@ -1,22 +1,101 @@
 #pragma once
 
+#include <future>
+#include <istream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <json/json.h>
 
 #include "common.h"
+#include "EmbeddingCache.h"
 #include "HTTPModelService.h"
 #include "PostgreSqlDb.h"
 
 
+class QueryCache;
+
+
 class SearchApplication
 {
+  // Queries of batch mode embedded together.
+  struct query_batch
+  {
+    std::vector<TextUnit> queries;
+    // Queries missing from the query cache, sent to the model service, and
+    // their index in queries.
+    std::vector<TextUnit> requested;
+    std::vector<size_t> requested_indexes;
+    std::future<void> embedded;
+  };
+
   Json::Value config_root;
-  std::unique_ptr<Database> database;
-  HTTPModelService model_service;
+  ModelInfo model_info;
+  // Queries per embedding request in batch mode.
+  size_t batch_max_items;
+  std::shared_ptr<EmbeddingCache> embeddings_cache;
+  std::shared_ptr<QueryCache> query_cache;
+  // Created only by the modes that embed queries, so the client mode doesn't
+  // initialize libcurl.
+  std::unique_ptr<HTTPModelService> model_service;
+  // Opened once and shared by every connection when the settings describe an
+  // in-process database.
+  std::shared_ptr<Database> local_database;
+  // Size of the candidate list of HNSW searches, from the
+  // --ef-search option, 0 for the one of the settings.
+  size_t ef_search;
 
   void clean_up() noexcept;
 
+  // Opens a database connection as the settings describe it and sets it up.
+  std::shared_ptr<Database> connect_database();
+
+  // Waits for the embeddings requested by start_embedding() and sets them on
+  // the queries of the batch.
+  void finish_embedding(query_batch& batch);
+
+  // Embeds a query through the query cache, or the asynchronous requests of
+  // the model service, which several threads can share.
+  std::vector<float> get_query_embedding(const std::string& query);
+
+  // Reads a query from stdin when argv has none. Returns an empty string
+  // when there's none.
+  static std::string read_query(int argc, char** argv, int query_arg);
+
+  // Prints the hits and misses of the caches.
+  void report_caches();
+
+  // Searches the queries of input, one per line, and writes the results to
+  // stdout as JSON Lines. A query that can't be embedded or searched gets
+  // an "error" member instead of "results", and the others go on; the
+  // exit status is then 1.
+  int run_batch(std::istream& input);
+
+  // Sends the query to the daemon and prints the results it answers.
+  int run_client(const std::string& query);
+
+  // Searches in-process and prints the results.
+  int run_query(const std::string& query);
+
+  // Runs the daemon until SIGINT or SIGTERM.
+  int serve();
+
+  // Reads a request of a client connected to the daemon and answers it.
+  // Returns false when the client is to be closed: it disconnected, didn't
+  // send a whole request in time, or can't be answered.
+  bool serve_request(int client_fd, Database& database);
+
+  void set_model_service_up();
+
+  // Sets the embeddings of the queries of batch found in the query cache and
+  // requests the others.
+  void start_embedding(query_batch& batch);
+
+  // Path of the daemon's socket: "socketPath" of the "searchDaemon" settings,
+  // or a file in $XDG_RUNTIME_DIR or /tmp.
+  std::string socket_path() const;
+
 public:
 
   SearchApplication();
@@ -27,5 +106,9 @@ public:
 
   virtual ~SearchApplication();
 
+  // With --serve as first argument, runs the search daemon. With --client,
+  // sends the query to it. With --batch, searches the queries of a file, or
+  // of stdin. Otherwise, searches in-process. Any of them can be preceded
+  // by --ef-search and the candidate list size of HNSW searches.
   int run(int argc, char** argv);
-};
\ No newline at end of file
+};
@@ -0,0 +1,159 @@
+#include "TextChunker.h"
+
+#include <algorithm>
+
+
+// Continuation bytes of a UTF-8 character at most.
+static constexpr size_t max_utf8_continuations = 3;
+
+
+static bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+static bool is_utf8_continuation(char c)
+{
+  return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+
+TextChunker::TextChunker(const limits& chunk_limits,
+  FileProcessor::TextUnitFunc on_text_unit_func):
+  _limits(chunk_limits),
+  _on_text_unit_func(std::move(on_text_unit_func)),
+  overlap_size(0)
+{
+  // Each unit cut at the limit then brings at least half a limit of new
+  // text, and a document makes at most twice as many units as without
+  // overlap.
+  if (_limits.max_size)
+    _limits.overlap = std::min(_limits.overlap, _limits.max_size / 2);
+}
+
+
+void TextChunker::append(const char* str, size_t len)
+{
+  if (!_limits.max_size)
+  {
+    text.append(str, len);
+    return;
+  }
+
+  // Appended a limit at a time, so a long string doesn't make text grow
+  // past twice the limit.
+  while (len > 0)
+  {
+    size_t part = std::min(len, _limits.max_size);
+    text.append(str, part);
+    str += part;
+    len -= part;
+
+    while (text.size() > _limits.max_size)
+      cut(find_cut());
+  }
+}
+
+
+void TextChunker::clear()
+{
+  text.clear();
+  overlap_size = 0;
+}
+
+
+void TextChunker::cut(size_t size)
+{
+  TextUnit unit;
+  unit.text(text.substr(0, size));
+
+  size_t next_start = size;
+  if (_limits.overlap)
+  {
+    next_start = size - std::min(_limits.overlap, size);
+
+    // The overlap starts with a word when there's a blank to start after.
+    size_t blank = next_start;
+    while (blank < size && !is_blank(text[blank]))
+      blank++;
+    if (blank < size)
+      next_start = blank + 1;
+    else
+    {
+      while (next_start < size && is_utf8_continuation(text[next_start]))
+        next_start++;
+    }
+  }
+
+  text.erase(0, next_start);
+  overlap_size = size - next_start;
+
+  _on_text_unit_func(std::move(unit));
+}
+
+
+void TextChunker::end_unit()
+{
+  if (!empty())
+  {
+    TextUnit unit;
+    unit.text(std::move(text));
+    _on_text_unit_func(std::move(unit));
+  }
+
+  clear();
+}
+
+
+size_t TextChunker::find_cut() const
+{
+  size_t max_size = _limits.max_size;
+  // Cuts are searched in the second half of the new text, so units don't
+  // get much shorter than the limit, and at least a byte is always cut.
+  size_t min_cut = overlap_size + (max_size - overlap_size + 1) / 2;
+
+  // Cut after the end of a paragraph, else after the end of a sentence,
+  // else after a blank.
+  size_t sentence_cut = 0;
+  size_t word_cut = 0;
+
+  for (size_t pos = max_size; pos > min_cut; pos--)
+  {
+    char c = text[pos - 1];
+
+    if (c == '\n')
+      return pos;
+
+    if (!sentence_cut && (c == ' ' || c == '\t') && pos >= 2)
+    {
+      char prev = text[pos - 2];
+      if (prev == '.' || prev == '!' || prev == '?')
+        sentence_cut = pos;
+    }
+
+    if (!word_cut && is_blank(c))
+      word_cut = pos;
+  }
+
+  if (sentence_cut)
+    return sentence_cut;
+
+  if (word_cut)
+    return word_cut;
+
+  // No blank at all, so the cut only avoids splitting a UTF-8 character,
+  // whose continuation bytes are at most 3. More of them are invalid UTF-8,
+  // cut at the limit like the rest so each unit still brings half a limit
+  // of new text.
+  size_t pos = max_size;
+  while (pos > min_cut && pos + max_utf8_continuations > max_size &&
+    is_utf8_continuation(text[pos]))
+  {
+    pos--;
+  }
+
+  if (is_utf8_continuation(text[pos]))
+    return max_size;
+  return pos;
+}
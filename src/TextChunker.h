@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "common.h"
+
+
+/*
+Gathers the text of a document and emits it as text units as soon as they
+are complete, so no unit, and no buffer, grows with the size of the
+document. A unit ends where the document says so, at a heading for
+instance, or when it would exceed the size limit. In that case it's cut at
+the last paragraph, sentence or word boundary before the limit, and the
+next unit starts with the last bytes of it when an overlap is set.
+*/
+class TextChunker
+{
+public:
+
+  struct limits
+  {
+    // Largest unit in bytes, 0 for no limit.
+    size_t max_size = 0;
+    // Bytes of a unit cut at the limit repeated at the start of the next one,
+    // at most half of max_size.
+    size_t overlap = 0;
+  };
+
+private:
+
+  limits _limits;
+  FileProcessor::TextUnitFunc _on_text_unit_func;
+  std::string text;
+  // Bytes at the start of text repeated from the previous unit.
+  size_t overlap_size;
+
+  // Emits the first size bytes of text, keeping the end of them as overlap.
+  void cut(size_t size);
+
+  // Where text is best cut to keep at most max_size bytes.
+  size_t find_cut() const;
+
+public:
+
+  TextChunker(const limits& chunk_limits,
+    FileProcessor::TextUnitFunc on_text_unit_func);
+
+  void append(const char* str, size_t len);
+
+  void append(const std::string& str)
+  {
+    append(str.data(), str.size());
+  }
+
+  // Discards the text not emitted, to start another document.
+  void clear();
+
+  // Whether there's no text since the last unit, the overlap aside.
+  bool empty() const
+  {
+    return text.size() == overlap_size;
+  }
+
+  // Emits the text gathered as a unit, if any.
+  void end_unit();
+};
@@ -0,0 +1,672 @@
+#include "VectorKernels.h"
+
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+float adc_distance_scalar(const float* lut, const uint8_t* code, size_t m)
+{
+  float sum = 0;
+  for (size_t idx = 0; idx < m; idx++)
+    sum += lut[idx * 256 + code[idx]];
+  return sum;
+}
+
+
+/* Values of the base64 characters, -1 for the other bytes. */
+static const std::array<int8_t, 256>& base64_values()
+{
+  static const std::array<int8_t, 256> values = [] {
+    const char* alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::array<int8_t, 256> values;
+    values.fill(-1);
+    for (int idx = 0; idx < 64; idx++)
+      values[static_cast<unsigned char>(alphabet[idx])] = idx;
+    return values;
+  }();
+
+  return values;
+}
+
+
+bool decode_base64_scalar(const char* in, size_t n, uint8_t* out)
+{
+  const std::array<int8_t, 256>& values = base64_values();
+  auto value = [&values](char c) -> int {
+    return values[static_cast<unsigned char>(c)];
+  };
+
+  size_t idx = 0;
+  for (; idx + 4 <= n; idx += 4)
+  {
+    int a = value(in[idx]);
+    int b = value(in[idx + 1]);
+    int c = value(in[idx + 2]);
+    int d = value(in[idx + 3]);
+    if ((a | b | c | d) < 0)
+      return false;
+
+    uint32_t bits = a << 18 | b << 12 | c << 6 | d;
+    *out++ = bits >> 16;
+    *out++ = bits >> 8;
+    *out++ = bits;
+  }
+
+  // The last 2 or 3 characters of unpadded base64 make 1 or 2 bytes.
+  size_t rest = n - idx;
+  if (rest == 0)
+    return true;
+  if (rest == 1)
+    return false;
+
+  int a = value(in[idx]);
+  int b = value(in[idx + 1]);
+  int c = rest == 3 ? value(in[idx + 2]) : 0;
+  if ((a | b | c) < 0)
+    return false;
+
+  uint32_t bits = a << 18 | b << 12 | c << 6;
+  *out++ = bits >> 16;
+  if (rest == 3)
+    *out = bits >> 8;
+  return true;
+}
+
+
+static uint16_t float_to_half(float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, 4);
+
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+
+  // Infinity, or a NaN kept quiet.
+  if (abs >= 0x7f800000)
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+
+  // 65520 and above round to infinity.
+  if (abs >= 0x477ff000)
+    return sign | 0x7c00;
+
+  uint32_t half;
+  uint32_t rest;
+  uint32_t halfway;
+
+  if (abs < 0x38800000)
+  {
+    // Below 2^-14, a subnormal half: the mantissa with its implicit bit in
+    // units of 2^-24. Up to 2^-25, which rounds to even, it's 0.
+    if (abs <= 0x33000000)
+      return sign;
+
+    uint32_t shift = 126 - (abs >> 23);
+    uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+    half = mantissa >> shift;
+    rest = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  }
+  else
+  {
+    // The exponent is rebiased from 127 to 15 and the mantissa cut to 10
+    // bits. A carry from rounding moves on to the exponent.
+    half = (abs >> 13) - ((127 - 15) << 10);
+    rest = abs & 0x1fff;
+    halfway = 0x1000;
+  }
+
+  if (rest > halfway || (rest == halfway && (half & 1)))
+    half++;
+
+  return sign | half;
+}
+
+
+static uint8_t reverse_bits(uint8_t byte)
+{
+  byte = (byte & 0xf0) >> 4 | (byte & 0x0f) << 4;
+  byte = (byte & 0xcc) >> 2 | (byte & 0x33) << 2;
+  return (byte & 0xaa) >> 1 | (byte & 0x55) << 1;
+}
+
+
+void encode_half_scalar(const float* in, size_t n, uint16_t* out)
+{
+  for (size_t idx = 0; idx < n; idx++)
+    out[idx] = float_to_half(in[idx]);
+}
+
+
+void encode_sign_bits_scalar(const float* in, size_t n, uint8_t* out)
+{
+  for (size_t idx = 0; idx < n; idx += 8)
+  {
+    uint8_t byte = 0;
+    for (size_t bit = 0; bit < 8 && idx + bit < n; bit++)
+    {
+      if (in[idx + bit] > 0)
+        byte |= 0x80 >> bit;
+    }
+    out[idx / 8] = byte;
+  }
+}
+
+
+float inner_product_distance_scalar(const float* a, const float* b, size_t n)
+{
+  float sum = 0;
+  for (size_t idx = 0; idx < n; idx++)
+    sum += a[idx] * b[idx];
+  return -sum;
+}
+
+
+float l2_squared_scalar(const float* a, const float* b, size_t n)
+{
+  float sum = 0;
+  for (size_t idx = 0; idx < n; idx++)
+  {
+    float diff = a[idx] - b[idx];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v)
+{
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+    _mm256_extractf128_ps(v, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
+  return _mm_cvtss_f32(sum);
+}
+
+
+__attribute__((target("avx2,fma")))
+static float adc_distance_avx2(const float* lut, const uint8_t* code, size_t m)
+{
+  // Entry j of the table starts 256 floats after entry j - 1.
+  const __m256i table_offsets = _mm256_setr_epi32(0, 256, 512, 768, 1024,
+    1280, 1536, 1792);
+  __m256 sum = _mm256_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 8 <= m; idx += 8)
+  {
+    __m128i code_bytes = _mm_loadl_epi64(
+      reinterpret_cast<const __m128i*>(code + idx));
+    __m256i indexes = _mm256_add_epi32(_mm256_cvtepu8_epi32(code_bytes),
+      table_offsets);
+    sum = _mm256_add_ps(sum,
+      _mm256_i32gather_ps(lut + idx * 256, indexes, 4));
+  }
+
+  float total = hsum_avx2(sum);
+  for (; idx < m; idx++)
+    total += lut[idx * 256 + code[idx]];
+
+  return total;
+}
+
+
+// Wojciech Muła's decoder: the characters are checked and translated to
+// their values with nibble lookups, then the 6-bit values are packed with
+// multiply-adds and shuffles.
+__attribute__((target("avx2,fma")))
+static bool decode_base64_avx2(const char* in, size_t n, uint8_t* out)
+{
+  const __m256i lut_lo = _mm256_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  const __m256i pack_bytes = _mm256_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+  size_t idx = 0;
+
+  // Each block of 32 characters stores 32 bytes, of which 24 are decoded,
+  // so the loop stops while at least 8 more bytes are left to decode.
+  for (; idx + 44 <= n; idx += 32)
+  {
+    __m256i str = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(in + idx));
+
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      return false;
+
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll,
+      _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, pack_bytes);
+    merged = _mm256_permutevar8x32_epi32(merged, pack_lanes);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), merged);
+    out += 24;
+  }
+
+  return decode_base64_scalar(in + idx, n - idx, out);
+}
+
+
+__attribute__((target("avx2,fma,f16c")))
+static void encode_half_avx2(const float* in, size_t n, uint16_t* out)
+{
+  size_t idx = 0;
+
+  for (; idx + 8 <= n; idx += 8)
+  {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + idx),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + idx), half);
+  }
+
+  encode_half_scalar(in + idx, n - idx, out + idx);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void encode_sign_bits_avx2(const float* in, size_t n, uint8_t* out)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  size_t idx = 0;
+
+  // Lane i of the compare lands in bit i of the mask, the reverse of the
+  // order in the output bytes.
+  for (; idx + 8 <= n; idx += 8)
+  {
+    __m256 positive = _mm256_cmp_ps(_mm256_loadu_ps(in + idx), zero,
+      _CMP_GT_OQ);
+    out[idx / 8] = reverse_bits(_mm256_movemask_ps(positive));
+  }
+
+  encode_sign_bits_scalar(in + idx, n - idx, out + idx / 8);
+}
+
+
+__attribute__((target("avx2,fma")))
+static float inner_product_distance_avx2(const float* a, const float* b,
+  size_t n)
+{
+  // Two accumulators hide the latency of the FMA instructions.
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 16 <= n; idx += 16)
+  {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + idx), _mm256_loadu_ps(b + idx),
+      sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + idx + 8),
+      _mm256_loadu_ps(b + idx + 8), sum1);
+  }
+
+  for (; idx + 8 <= n; idx += 8)
+  {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + idx), _mm256_loadu_ps(b + idx),
+      sum0);
+  }
+
+  float sum = hsum_avx2(_mm256_add_ps(sum0, sum1));
+  for (; idx < n; idx++)
+    sum += a[idx] * b[idx];
+
+  return -sum;
+}
+
+
+__attribute__((target("avx2,fma")))
+static float l2_squared_avx2(const float* a, const float* b, size_t n)
+{
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 16 <= n; idx += 16)
+  {
+    __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(a + idx),
+      _mm256_loadu_ps(b + idx));
+    __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(a + idx + 8),
+      _mm256_loadu_ps(b + idx + 8));
+    sum0 = _mm256_fmadd_ps(diff0, diff0, sum0);
+    sum1 = _mm256_fmadd_ps(diff1, diff1, sum1);
+  }
+
+  for (; idx + 8 <= n; idx += 8)
+  {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + idx),
+      _mm256_loadu_ps(b + idx));
+    sum0 = _mm256_fmadd_ps(diff, diff, sum0);
+  }
+
+  float sum = hsum_avx2(_mm256_add_ps(sum0, sum1));
+  for (; idx < n; idx++)
+  {
+    float diff = a[idx] - b[idx];
+    sum += diff * diff;
+  }
+
+  return sum;
+}
+
+
+__attribute__((target("avx512f")))
+static float hsum_avx512(__m512 v)
+{
+  // Not _mm512_reduce_add_ps(), which makes GCC 12 warn about an
+  // uninitialized variable in its headers.
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, v);
+
+  float sum = 0;
+  for (float lane : lanes)
+    sum += lane;
+  return sum;
+}
+
+
+__attribute__((target("avx512f")))
+static float adc_distance_avx512(const float* lut, const uint8_t* code,
+  size_t m)
+{
+  const __m512i table_offsets = _mm512_mullo_epi32(
+    _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+    _mm512_set1_epi32(256));
+  __m512 sum = _mm512_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 16 <= m; idx += 16)
+  {
+    __m128i code_bytes = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(code + idx));
+    // The masked forms, because the others make GCC 12 warn about
+    // uninitialized variables in its headers.
+    __m512i indexes = _mm512_add_epi32(
+      _mm512_maskz_cvtepu8_epi32(0xffff, code_bytes), table_offsets);
+    sum = _mm512_add_ps(sum, _mm512_mask_i32gather_ps(_mm512_setzero_ps(),
+      0xffff, indexes, lut + idx * 256, 4));
+  }
+
+  float total = hsum_avx512(sum);
+  for (; idx < m; idx++)
+    total += lut[idx * 256 + code[idx]];
+
+  return total;
+}
+
+
+__attribute__((target("avx512f")))
+static void encode_half_avx512(const float* in, size_t n, uint16_t* out)
+{
+  size_t idx = 0;
+
+  for (; idx + 16 <= n; idx += 16)
+  {
+    __m256i half = _mm512_cvtps_ph(_mm512_loadu_ps(in + idx),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + idx), half);
+  }
+
+  encode_half_scalar(in + idx, n - idx, out + idx);
+}
+
+
+__attribute__((target("avx512f")))
+static void encode_sign_bits_avx512(const float* in, size_t n, uint8_t* out)
+{
+  const __m512 zero = _mm512_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 16 <= n; idx += 16)
+  {
+    __mmask16 positive = _mm512_cmp_ps_mask(_mm512_loadu_ps(in + idx), zero,
+      _CMP_GT_OQ);
+    out[idx / 8] = reverse_bits(positive & 0xff);
+    out[idx / 8 + 1] = reverse_bits(positive >> 8);
+  }
+
+  encode_sign_bits_scalar(in + idx, n - idx, out + idx / 8);
+}
+
+
+__attribute__((target("avx512f")))
+static float inner_product_distance_avx512(const float* a, const float* b,
+  size_t n)
+{
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 32 <= n; idx += 32)
+  {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + idx), _mm512_loadu_ps(b + idx),
+      sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + idx + 16),
+      _mm512_loadu_ps(b + idx + 16), sum1);
+  }
+
+  // The remaining elements are loaded with a mask, zeroing the others.
+  for (; idx < n; idx += 16)
+  {
+    __mmask16 mask = n - idx >= 16 ? 0xffff : (1u << (n - idx)) - 1;
+    sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + idx),
+      _mm512_maskz_loadu_ps(mask, b + idx), sum0);
+  }
+
+  return -hsum_avx512(_mm512_add_ps(sum0, sum1));
+}
+
+
+__attribute__((target("avx512f")))
+static float l2_squared_avx512(const float* a, const float* b, size_t n)
+{
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  size_t idx = 0;
+
+  for (; idx + 32 <= n; idx += 32)
+  {
+    __m512 diff0 = _mm512_sub_ps(_mm512_loadu_ps(a + idx),
+      _mm512_loadu_ps(b + idx));
+    __m512 diff1 = _mm512_sub_ps(_mm512_loadu_ps(a + idx + 16),
+      _mm512_loadu_ps(b + idx + 16));
+    sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+    sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+  }
+
+  for (; idx < n; idx += 16)
+  {
+    __mmask16 mask = n - idx >= 16 ? 0xffff : (1u << (n - idx)) - 1;
+    __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + idx),
+      _mm512_maskz_loadu_ps(mask, b + idx));
+    sum0 = _mm512_fmadd_ps(diff, diff, sum0);
+  }
+
+  return hsum_avx512(_mm512_add_ps(sum0, sum1));
+}
+
+#endif
+
+
+enum class kernel_isa
+{
+  scalar,
+  avx2,
+  avx512
+};
+
+
+static kernel_isa detect_isa()
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return kernel_isa::avx512;
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return kernel_isa::avx2;
+#endif
+
+  return kernel_isa::scalar;
+}
+
+
+static kernel_isa get_isa()
+{
+  static const kernel_isa isa = detect_isa();
+  return isa;
+}
+
+
+DistanceFunc get_distance_func(Metric metric)
+{
+  switch (get_isa())
+  {
+#ifdef HAVE_X86_KERNELS
+  case kernel_isa::avx512:
+    return metric == Metric::l2 ? l2_squared_avx512 :
+      inner_product_distance_avx512;
+  case kernel_isa::avx2:
+    return metric == Metric::l2 ? l2_squared_avx2 :
+      inner_product_distance_avx2;
+#endif
+  default:
+    return metric == Metric::l2 ? l2_squared_scalar :
+      inner_product_distance_scalar;
+  }
+}
+
+
+AdcFunc get_adc_func()
+{
+  switch (get_isa())
+  {
+#ifdef HAVE_X86_KERNELS
+  case kernel_isa::avx512:
+    return adc_distance_avx512;
+  case kernel_isa::avx2:
+    return adc_distance_avx2;
+#endif
+  default:
+    return adc_distance_scalar;
+  }
+}
+
+
+Base64DecodeFunc get_base64_decode_func()
+{
+  switch (get_isa())
+  {
+#ifdef HAVE_X86_KERNELS
+  // AVX-512F has no byte shuffles, the AVX2 decoder is used.
+  case kernel_isa::avx512:
+  case kernel_isa::avx2:
+    return decode_base64_avx2;
+#endif
+  default:
+    return decode_base64_scalar;
+  }
+}
+
+
+HalfEncodeFunc get_half_encode_func()
+{
+  switch (get_isa())
+  {
+#ifdef HAVE_X86_KERNELS
+  case kernel_isa::avx512:
+    return encode_half_avx512;
+  case kernel_isa::avx2:
+    // Conversions to half precision come with F16C, not with AVX2.
+    if (__builtin_cpu_supports("f16c"))
+      return encode_half_avx2;
+    return encode_half_scalar;
+#endif
+  default:
+    return encode_half_scalar;
+  }
+}
+
+
+SignBitsFunc get_sign_bits_func()
+{
+  switch (get_isa())
+  {
+#ifdef HAVE_X86_KERNELS
+  case kernel_isa::avx512:
+    return encode_sign_bits_avx512;
+  case kernel_isa::avx2:
+    return encode_sign_bits_avx2;
+#endif
+  default:
+    return encode_sign_bits_scalar;
+  }
+}
+
+
+const char* get_distance_isa()
+{
+  switch (get_isa())
+  {
+  case kernel_isa::avx512:
+    return "AVX-512";
+  case kernel_isa::avx2:
+    return "AVX2";
+  default:
+    return "scalar";
+  }
+}
+
+
+float kernel_to_reported_distance(Metric metric, float kernel_distance)
+{
+  if (metric == Metric::l2)
+    return std::sqrt(kernel_distance);
+
+  return kernel_distance;
+}
+
+
+Metric parse_metric(const std::string& name)
+{
+  if (name == "l2")
+    return Metric::l2;
+
+  if (name == "innerProduct")
+    return Metric::inner_product;
+
+  throw std::runtime_error("Unknown metric \"" + name + "\", expected \"l2\" "
+    "or \"innerProduct\"");
+}
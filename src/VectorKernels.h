@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+enum class Metric
+{
+  l2,
+  inner_product
+};
+
+
+// Distance between two vectors of n floats. Smaller means closer: the squared
+// L2 distance, or the negative inner product.
+typedef float (*DistanceFunc)(const float* a, const float* b, size_t n);
+
+
+/*
+Returns the kernel for metric that uses the widest instruction set the CPU
+supports, picked once at run time.
+*/
+DistanceFunc get_distance_func(Metric metric);
+
+// Name of the instruction set used by the kernels of get_distance_func().
+const char* get_distance_isa();
+
+// Sum of the entries of a product quantization lookup table picked by a
+// code: lut[j * 256 + code[j]] for each of the m bytes of the code.
+typedef float (*AdcFunc)(const float* lut, const uint8_t* code, size_t m);
+
+// Returns the ADC kernel for the widest instruction set the CPU supports,
+// using gathers from the table.
+AdcFunc get_adc_func();
+
+// Converts n floats to IEEE half precision, rounding to nearest even.
+typedef void (*HalfEncodeFunc)(const float* in, size_t n, uint16_t* out);
+
+// Returns the half precision encoder for the widest instruction set the CPU
+// supports.
+HalfEncodeFunc get_half_encode_func();
+
+// Packs the signs of n floats into (n + 7) / 8 bytes: a bit set for each
+// value above 0, the first value in the highest bit of the first byte, as
+// pgvector's binary_quantize() does.
+typedef void (*SignBitsFunc)(const float* in, size_t n, uint8_t* out);
+
+// Returns the sign bit encoder for the widest instruction set the CPU
+// supports.
+SignBitsFunc get_sign_bits_func();
+
+// Decodes n characters of base64 without padding into n * 3 / 4 bytes.
+// Returns false if a character is not in the base64 alphabet or n % 4 is 1.
+typedef bool (*Base64DecodeFunc)(const char* in, size_t n, uint8_t* out);
+
+// Returns the base64 decoder for the widest instruction set the CPU
+// supports.
+Base64DecodeFunc get_base64_decode_func();
+
+// Converts a value returned by a kernel into the distance reported in search
+// results, which matches pgvector's <-> and <#> operators.
+float kernel_to_reported_distance(Metric metric, float kernel_distance);
+
+// Parses "l2" or "innerProduct", as used in the settings.
+Metric parse_metric(const std::string& name);
+
+float adc_distance_scalar(const float* lut, const uint8_t* code, size_t m);
+
+bool decode_base64_scalar(const char* in, size_t n, uint8_t* out);
+
+void encode_half_scalar(const float* in, size_t n, uint16_t* out);
+
+void encode_sign_bits_scalar(const float* in, size_t n, uint8_t* out);
+
+float inner_product_distance_scalar(const float* a, const float* b, size_t n);
+
+float l2_squared_scalar(const float* a, const float* b, size_t n);
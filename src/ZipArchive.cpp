@@ -0,0 +1,367 @@
+#include "ZipArchive.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+
+static constexpr uint32_t end_of_central_dir_signature = 0x06054b50;
+static constexpr uint32_t central_dir_header_signature = 0x02014b50;
+static constexpr uint32_t local_header_signature = 0x04034b50;
+
+static constexpr size_t end_of_central_dir_size = 22;
+static constexpr size_t central_dir_header_size = 46;
+static constexpr size_t local_header_size = 30;
+static constexpr size_t max_comment_size = 0xFFFF;
+
+static constexpr uint16_t method_stored = 0;
+static constexpr uint16_t method_deflated = 8;
+
+static constexpr uint16_t flag_encrypted = 0x0001;
+
+// Bytes given to on_data at a time.
+static constexpr size_t data_chunk_size = 64 * 1024;
+
+
+static uint16_t read_u16(const unsigned char* ptr)
+{
+  return ptr[0] | (ptr[1] << 8);
+}
+
+
+static uint32_t read_u32(const unsigned char* ptr)
+{
+  return static_cast<uint32_t>(ptr[0]) | (static_cast<uint32_t>(ptr[1]) << 8) |
+    (static_cast<uint32_t>(ptr[2]) << 16) |
+    (static_cast<uint32_t>(ptr[3]) << 24);
+}
+
+
+ZipArchive::ZipArchive(const char* file_path):
+  _file_path(file_path),
+  data(nullptr),
+  size(0)
+{
+  int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    std::string msg("Cannot open the file \"");
+    msg += file_path;
+    msg += "\": ";
+    msg += std::strerror(errno);
+    throw std::runtime_error(msg);
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+  {
+    int stat_errno = errno;
+    close(fd);
+
+    std::string msg("Cannot get the status of file \"");
+    msg += file_path;
+    msg += "\": ";
+    msg += std::strerror(stat_errno);
+    throw std::runtime_error(msg);
+  }
+
+  size = file_stat.st_size;
+  if (size < end_of_central_dir_size)
+  {
+    close(fd);
+
+    std::string msg("\"");
+    msg += file_path;
+    msg += "\" is too short to be a zip file.";
+    throw format_error(msg);
+  }
+
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    int mmap_errno = errno;
+    close(fd);
+
+    std::string msg("Cannot map the file \"");
+    msg += file_path;
+    msg += "\": ";
+    msg += std::strerror(mmap_errno);
+    throw std::runtime_error(msg);
+  }
+
+  // The mapping stays valid once the file is closed.
+  close(fd);
+  data = static_cast<const unsigned char*>(mapping);
+
+  try
+  {
+    read_central_directory();
+  }
+  catch (...)
+  {
+    clean_up();
+    throw;
+  }
+}
+
+
+ZipArchive::~ZipArchive()
+{
+  clean_up();
+}
+
+
+void ZipArchive::clean_up() noexcept
+{
+  if (data)
+  {
+    munmap(const_cast<unsigned char*>(data), size);
+    data = nullptr;
+  }
+}
+
+
+const unsigned char* ZipArchive::get_entry_data(const std::string& name,
+  const entry& e) const
+{
+  const unsigned char* header = data + e.local_header_offset;
+  if (e.local_header_offset > size - local_header_size ||
+    read_u32(header) != local_header_signature)
+  {
+    std::string msg("Bad local header for \"");
+    msg += name;
+    msg += "\" in \"";
+    msg += _file_path;
+    msg += "\".";
+    throw format_error(msg);
+  }
+
+  // The name and extra field may differ from the central directory ones.
+  size_t data_offset = e.local_header_offset + local_header_size +
+    read_u16(header + 26) + read_u16(header + 28);
+  if (data_offset > size || e.compressed_size > size - data_offset)
+  {
+    std::string msg("Entry \"");
+    msg += name;
+    msg += "\" goes past the end of \"";
+    msg += _file_path;
+    msg += "\".";
+    throw format_error(msg);
+  }
+
+  return data + data_offset;
+}
+
+
+void ZipArchive::inflate_entry(const std::string& name, const entry& e,
+  const unsigned char* src, const DataFunc& on_data) const
+{
+  z_stream stream = {};
+  // Negative window bits for raw deflate data, with no zlib header.
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    throw std::runtime_error("inflateInit2() failed");
+
+  std::unique_ptr<z_stream, int (*)(z_streamp)> stream_guard(&stream,
+    inflateEnd);
+
+  std::unique_ptr<char[]> out(new char[data_chunk_size]);
+  size_t in_left = e.compressed_size;
+  size_t out_total = 0;
+  uLong crc = crc32(0, Z_NULL, 0);
+  int ret;
+
+  stream.next_in = const_cast<Bytef*>(src);
+  do
+  {
+    if (stream.avail_in == 0)
+    {
+      stream.avail_in = std::min<size_t>(in_left, 1U << 30);
+      in_left -= stream.avail_in;
+    }
+
+    stream.next_out = reinterpret_cast<Bytef*>(out.get());
+    stream.avail_out = data_chunk_size;
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END)
+    {
+      std::string msg("Cannot inflate \"");
+      msg += name;
+      msg += "\" in \"";
+      msg += _file_path;
+      msg += "\": ";
+      msg += (stream.msg ? stream.msg : "truncated data");
+      throw format_error(msg);
+    }
+
+    size_t out_size = data_chunk_size - stream.avail_out;
+    out_total += out_size;
+    // Stops a corrupted entry from growing past its size.
+    if (out_total > e.size)
+      break;
+
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(out.get()), out_size);
+    if (out_size > 0)
+      on_data(out.get(), out_size);
+  }
+  while (ret != Z_STREAM_END);
+
+  if (out_total != e.size || crc != e.crc)
+  {
+    std::string msg("Entry \"");
+    msg += name;
+    msg += "\" of \"";
+    msg += _file_path;
+    msg += "\" is corrupted.";
+    throw format_error(msg);
+  }
+}
+
+
+void ZipArchive::read_central_directory()
+{
+  // The end of central directory record is followed by a comment of up to
+  // 64 KiB, so it's searched backwards from the end.
+  size_t min_offset = size - end_of_central_dir_size -
+    std::min(size - end_of_central_dir_size, max_comment_size);
+  size_t end_offset = size - end_of_central_dir_size + 1;
+  do
+  {
+    end_offset--;
+    if (read_u32(data + end_offset) == end_of_central_dir_signature)
+      break;
+  }
+  while (end_offset > min_offset);
+
+  const unsigned char* end_record = data + end_offset;
+  if (read_u32(end_record) != end_of_central_dir_signature)
+  {
+    std::string msg("\"");
+    msg += _file_path;
+    msg += "\" isn't a zip file.";
+    throw format_error(msg);
+  }
+
+  size_t n_entries = read_u16(end_record + 10);
+  size_t dir_size = read_u32(end_record + 12);
+  size_t dir_offset = read_u32(end_record + 16);
+  if (n_entries == 0xFFFF || dir_offset == 0xFFFFFFFF)
+  {
+    std::string msg("\"");
+    msg += _file_path;
+    msg += "\" is a zip64 file.";
+    throw format_error(msg);
+  }
+
+  if (dir_offset > end_offset || dir_size > end_offset - dir_offset)
+  {
+    std::string msg("Bad central directory in \"");
+    msg += _file_path;
+    msg += "\".";
+    throw format_error(msg);
+  }
+
+  const unsigned char* header = data + dir_offset;
+  const unsigned char* dir_end = header + dir_size;
+  for (size_t idx = 0; idx < n_entries; idx++)
+  {
+    if (static_cast<size_t>(dir_end - header) < central_dir_header_size ||
+      read_u32(header) != central_dir_header_signature)
+    {
+      std::string msg("Bad central directory in \"");
+      msg += _file_path;
+      msg += "\".";
+      throw format_error(msg);
+    }
+
+    uint16_t flags = read_u16(header + 8);
+    size_t name_len = read_u16(header + 28);
+    size_t header_len = central_dir_header_size + name_len +
+      read_u16(header + 30) + read_u16(header + 32);
+    if (static_cast<size_t>(dir_end - header) < header_len)
+    {
+      std::string msg("Bad central directory in \"");
+      msg += _file_path;
+      msg += "\".";
+      throw format_error(msg);
+    }
+
+    entry e;
+    e.method = read_u16(header + 10);
+    e.crc = read_u32(header + 16);
+    e.compressed_size = read_u32(header + 20);
+    e.size = read_u32(header + 24);
+    e.local_header_offset = read_u32(header + 42);
+
+    // Encrypted entries are left out, as if missing.
+    if (!(flags & flag_encrypted))
+    {
+      entries.emplace(std::string(
+        reinterpret_cast<const char*>(header + central_dir_header_size),
+        name_len), e);
+    }
+
+    header += header_len;
+  }
+}
+
+
+void ZipArchive::read_entry(const std::string& name,
+  const DataFunc& on_data) const
+{
+  auto iter = entries.find(name);
+  if (iter == entries.end())
+  {
+    std::string msg("No entry \"");
+    msg += name;
+    msg += "\" in \"";
+    msg += _file_path;
+    msg += "\".";
+    throw format_error(msg);
+  }
+
+  const entry& e = iter->second;
+  const unsigned char* src = get_entry_data(name, e);
+
+  if (e.method == method_deflated)
+  {
+    inflate_entry(name, e, src, on_data);
+    return;
+  }
+
+  if (e.method != method_stored)
+  {
+    std::string msg("Entry \"");
+    msg += name;
+    msg += "\" of \"";
+    msg += _file_path;
+    msg += "\" has unsupported compression method ";
+    msg += std::to_string(e.method);
+    msg += ".";
+    throw format_error(msg);
+  }
+
+  if (e.compressed_size != e.size ||
+    crc32(0, src, e.size) != e.crc)
+  {
+    std::string msg("Entry \"");
+    msg += name;
+    msg += "\" of \"";
+    msg += _file_path;
+    msg += "\" is corrupted.";
+    throw format_error(msg);
+  }
+
+  for (size_t offset = 0; offset < e.size; offset += data_chunk_size)
+  {
+    on_data(reinterpret_cast<const char*>(src + offset),
+      std::min(data_chunk_size, e.size - offset));
+  }
+}
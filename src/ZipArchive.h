@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+
+/*
+Read-only zip file, memory-mapped, with the entries listed by its central
+directory. Handles what office documents are made of: entries stored or
+deflated, with no encryption and no zip64 extension.
+*/
+class ZipArchive
+{
+public:
+
+  // Called with each chunk of the uncompressed bytes of an entry.
+  typedef std::function<void(const char* data, size_t size)> DataFunc;
+
+  // Thrown when the file isn't a zip file, or uses features not handled.
+  class format_error: public std::runtime_error
+  {
+  public:
+
+    using std::runtime_error::runtime_error;
+  };
+
+private:
+
+  struct entry
+  {
+    uint16_t method;
+    uint32_t crc;
+    size_t compressed_size;
+    size_t size;
+    size_t local_header_offset;
+  };
+
+  std::string _file_path;
+  const unsigned char* data;
+  size_t size;
+  std::unordered_map<std::string, entry> entries;
+
+  void clean_up() noexcept;
+
+  void read_central_directory();
+
+  // Where the compressed bytes of the entry start in data.
+  const unsigned char* get_entry_data(const std::string& name,
+    const entry& e) const;
+
+  void inflate_entry(const std::string& name, const entry& e,
+    const unsigned char* src, const DataFunc& on_data) const;
+
+public:
+
+  explicit ZipArchive(const char* file_path);
+
+  ZipArchive(const ZipArchive&) = delete;
+
+  ZipArchive& operator=(const ZipArchive&) = delete;
+
+  virtual ~ZipArchive();
+
+  bool has_entry(const std::string& name) const
+  {
+    return entries.count(name) != 0;
+  }
+
+  // Streams the uncompressed bytes of the entry to on_data, checking them
+  // against their size and CRC once all read.
+  void read_entry(const std::string& name, const DataFunc& on_data) const;
+};
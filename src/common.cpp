@@ -1,10 +1,14 @@
 #include "common.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cctype>
+#include <cstring>
 #include <fstream>
 #include <ios>
 #include <iostream>
+#include <new>
 #include <stdexcept>
 
 #include <arpa/inet.h>
@@ -47,6 +51,25 @@ Json::Value ask_for_postgresql_settings()
 }
 
 
+std::filesystem::path get_default_cache_dir()
+{
+  const char* dir = getenv("XDG_CACHE_HOME");
+  filesystem::path p;
+  if (dir && dir[0] != 0)
+  {
+    p.assign(dir);
+  }
+  else if ((dir = getenv("HOME")) && dir[0] != 0)
+  {
+    p.assign(dir);
+    p.append(".cache");
+  }
+
+  p.append("embeddings-db");
+  return p;
+}
+
+
 std::filesystem::path get_default_settings_json_file()
 {
   const char* dir = getenv("XDG_CONFIG_HOME");
@@ -129,6 +152,27 @@ Json::Value get_json_member_with_type(const Json::Value& object,
 }
 
 
+size_t get_positive_setting(const Json::Value& settings,
+  const char* key, size_t default_value)
+{
+  Json::Value value = get_json_member_with_type(settings, key,
+    Json::ValueType::intValue, false);
+
+  if (!value)
+    return default_value;
+
+  if (value.asLargestInt() < 1)
+  {
+    std::string msg("Member with the key \"");
+    msg += key;
+    msg += "\" must be greater than 0";
+    throw std::runtime_error(msg);
+  }
+
+  return value.asLargestUInt();
+}
+
+
 Json::Value get_settings_from_default_json_file()
 {
   filesystem::path file_path = get_default_settings_json_file();
@@ -218,6 +262,50 @@ bool get_yes_or_no_response(const char* msg)
 }
 
 
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t hash = seed;
+
+  for (size_t idx = 0; idx < size; idx++)
+  {
+    hash ^= bytes[idx];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+
+uint64_t hash_file_content(const char* file_path)
+{
+  std::ifstream file(file_path, std::ifstream::binary);
+  if (!file.is_open())
+  {
+    std::string msg("Cannot open file \"");
+    msg += file_path;
+    msg += "\".";
+    throw std::ios_base::failure(msg);
+  }
+
+  uint64_t hash = hash_bytes(nullptr, 0);
+  char buffer[1 << 16];
+
+  while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+    hash = hash_bytes(buffer, file.gcount(), hash);
+
+  if (file.bad())
+  {
+    std::string msg("Cannot read file \"");
+    msg += file_path;
+    msg += "\".";
+    throw std::ios_base::failure(msg);
+  }
+
+  return hash;
+}
+
+
 uint32_t htonf(float f)
 {
     uint32_t i;
@@ -236,4 +324,36 @@ bool is_all_spaces(const char* str)
   }
 
   return true;
-}
\ No newline at end of file
+}
+
+
+std::runtime_error system_error(const char* what)
+{
+  std::string msg(what);
+  msg += ": ";
+  msg += strerror(errno);
+  return std::runtime_error(msg);
+}
+
+
+Embedding::Embedding(std::vector<float>&& embedding)
+{
+  auto owner = std::make_shared<std::vector<float>>(std::move(embedding));
+  _size = owner->size();
+  _data = std::shared_ptr<const float>(owner, owner->data());
+}
+
+
+EmbeddingBatch::EmbeddingBatch(size_t rows, size_t dimension):
+  _rows(rows),
+  _dimension(dimension),
+  _row_stride((dimension + 15) & ~static_cast<size_t>(15))
+{
+  // aligned_alloc() takes a multiple of the alignment, which a row is.
+  size_t size = std::max<size_t>(rows * _row_stride, 16) * sizeof(float);
+  void* data = std::aligned_alloc(64, size);
+  if (!data)
+    throw std::bad_alloc();
+
+  _data = std::shared_ptr<float>(static_cast<float*>(data), std::free);
+}
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <json/json.h>
@@ -9,11 +13,17 @@
 
 Json::Value ask_for_postgresql_settings();
 
+std::filesystem::path get_default_cache_dir();
+
 std::filesystem::path get_default_config_json_file();
 
 Json::Value get_json_member_with_type(const Json::Value& object,
   const char* key, Json::ValueType required_type, bool required=true);
 
+// Value of an optional integer member that must be greater than 0.
+size_t get_positive_setting(const Json::Value& settings, const char* key,
+  size_t default_value);
+
 Json::Value get_settings_from_default_json_file();
 
 Json::Value
@@ -21,17 +31,38 @@ get_settings_from_json_file(const std::filesystem::path& file_path);
 
 bool get_yes_or_no_response(const char* msg);
 
+// 64-bit FNV-1a hash, which can be chained through seed.
+uint64_t hash_bytes(const void* data, size_t size,
+  uint64_t seed=0xcbf29ce484222325ULL);
+
+uint64_t hash_file_content(const char* file_path);
+
 uint32_t htonf(float f);
 
 bool is_all_spaces(const char* str);
 
+// Error whose message is what, then the description of errno.
+std::runtime_error system_error(const char* what);
+
 
 class ModelInfo
 {
   std::string _model_id;
+  // Size of the model's embeddings, 0 until one is known.
+  uint32_t _dimension = 0;
 
 public:
 
+  uint32_t dimension() const
+  {
+    return _dimension;
+  }
+
+  void dimension(uint32_t dimension)
+  {
+    _dimension = dimension;
+  }
+
   const std::string& model_id() const
   {
     return _model_id;
@@ -44,6 +75,113 @@ public:
 };
 
 
+/*
+Floats of an embedding, which never change once set, shared by the copies of
+the Embedding. They are owned by a vector of their own or by the allocation
+of an EmbeddingBatch.
+*/
+class Embedding
+{
+  std::shared_ptr<const float> _data;
+  size_t _size = 0;
+
+public:
+
+  Embedding() = default;
+
+  Embedding(std::shared_ptr<const float> data, size_t size):
+    _data(std::move(data)),
+    _size(size)
+  {
+  }
+
+  explicit Embedding(std::vector<float>&& embedding);
+
+  const float* begin() const
+  {
+    return _data.get();
+  }
+
+  const float* data() const
+  {
+    return _data.get();
+  }
+
+  bool empty() const
+  {
+    return _size == 0;
+  }
+
+  const float* end() const
+  {
+    return _data.get() + _size;
+  }
+
+  float operator[](size_t idx) const
+  {
+    return _data.get()[idx];
+  }
+
+  size_t size() const
+  {
+    return _size;
+  }
+
+  std::vector<float> to_vector() const
+  {
+    return std::vector<float>(begin(), end());
+  }
+};
+
+
+/*
+Embeddings of a batch of text units as the rows of one allocation, each row
+starting on a 64-byte boundary. The Embedding of a row shares the
+allocation, which is freed with the last of them.
+*/
+class EmbeddingBatch
+{
+  std::shared_ptr<float> _data;
+  size_t _rows = 0;
+  size_t _dimension = 0;
+  // Floats from the start of a row to the start of the next one.
+  size_t _row_stride = 0;
+
+public:
+
+  EmbeddingBatch() = default;
+
+  EmbeddingBatch(size_t rows, size_t dimension);
+
+  size_t dimension() const
+  {
+    return _dimension;
+  }
+
+  Embedding embedding(size_t idx) const
+  {
+    return Embedding(std::shared_ptr<const float>(_data,
+      _data.get() + idx * _row_stride), _dimension);
+  }
+
+  // Whether there's no allocation, as for a batch constructed by default.
+  bool empty() const
+  {
+    return !_data;
+  }
+
+  float* row(size_t idx)
+  {
+    return _data.get() + idx * _row_stride;
+  }
+
+  size_t rows() const
+  {
+    return _rows;
+  }
+};
+
+
 class FileRecord;
 
 
@@ -52,7 +190,7 @@ class TextUnit
   unsigned long long _id;
   std::string _text;
   std::string _anchor;
-  std::vector<float> _embedding;
+  Embedding _embedding;
   std::shared_ptr<FileRecord> _file_record;
 
 public:
@@ -77,6 +215,11 @@ public:
     _text = text;
   }
 
+  void text(std::string&& text)
+  {
+    _text = std::move(text);
+  }
+
   const std::string& anchor() const
   {
     return _anchor;
@@ -87,16 +230,37 @@ public:
     _anchor = anchor;
   }
 
-  const std::vector<float>& embedding() const
+  void anchor(std::string&& anchor)
+  {
+    _anchor = std::move(anchor);
+  }
+
+  const Embedding& embedding() const
   {
     return _embedding;
   }
 
-  void embedding(const std::vector<float>& embedding)
+  // Shares the floats of embedding.
+  void embedding(const Embedding& embedding)
   {
     _embedding = embedding;
   }
 
+  void embedding(Embedding&& embedding)
+  {
+    _embedding = std::move(embedding);
+  }
+
+  void embedding(const std::vector<float>& embedding)
+  {
+    _embedding = Embedding(std::vector<float>(embedding));
+  }
+
+  void embedding(std::vector<float>&& embedding)
+  {
+    _embedding = Embedding(std::move(embedding));
+  }
+
   void file_record(const std::shared_ptr<FileRecord>& record)
   {
     _file_record = record;
@@ -113,6 +277,10 @@ class FileRecord
 {
   unsigned long _id;
   std::string _file_path;
+  unsigned long long _file_size = 0;
+  long long _mtime = 0;
+  uint64_t _content_hash = 0;
+  bool _replaces_previous = false;
   ModelInfo _model_info;
   std::vector<TextUnit> _text_units;
 
@@ -138,6 +306,53 @@ public:
     _file_path = file_path;
   }
 
+  void file_path(std::string&& file_path)
+  {
+    _file_path = std::move(file_path);
+  }
+
+  unsigned long long file_size() const
+  {
+    return _file_size;
+  }
+
+  void file_size(unsigned long long file_size)
+  {
+    _file_size = file_size;
+  }
+
+  // Modification time in nanoseconds since the epoch.
+  long long mtime() const
+  {
+    return _mtime;
+  }
+
+  void mtime(long long mtime)
+  {
+    _mtime = mtime;
+  }
+
+  uint64_t content_hash() const
+  {
+    return _content_hash;
+  }
+
+  void content_hash(uint64_t content_hash)
+  {
+    _content_hash = content_hash;
+  }
+
+  // Whether records saved before for the same file path must be replaced.
+  bool replaces_previous() const
+  {
+    return _replaces_previous;
+  }
+
+  void replaces_previous(bool replaces_previous)
+  {
+    _replaces_previous = replaces_previous;
+  }
+
   const ModelInfo& model_info() const
   {
     return _model_info;
@@ -157,6 +372,11 @@ public:
   {
     _text_units = text_units;
   }
+
+  void text_units(std::vector<TextUnit>&& text_units)
+  {
+    _text_units = std::move(text_units);
+  }
 };
 
 
@@ -167,18 +387,85 @@ struct TextUnitResult
 };
 
 
+// Where the units of a file saved a part at a time went, until its record is
+// saved with them.
+struct FileParts
+{
+  // Record that keeps the units out of searches meanwhile, for the
+  // databases that have one.
+  unsigned long staging_record_id = 0;
+  // First ID and number of the units of each part, for the others.
+  std::vector<std::pair<uint64_t, uint64_t>> unit_ranges;
+};
+
+
 class Database
 {
 public:
 
   virtual ~Database() = default;
 
+  // Returns the saved file records without their text units.
+  virtual std::vector<FileRecord> get_file_records() = 0;
+
   virtual void save_file_record_with_text_units(FileRecord& record) = 0;
 
+  virtual void
+  save_file_records_with_text_units(std::vector<FileRecord>& records)
+  {
+    for (FileRecord& record : records)
+      save_file_record_with_text_units(record);
+  }
+
+  // Saves units of a file ahead of its record, for files whose units are
+  // embedded a few at a time, noting where they went in parts. They stay out
+  // of searches until save_file_record_with_parts() saves the record with
+  // them, replacing the previous records of its path as
+  // save_file_record_with_text_units() does.
+  virtual void save_file_part(std::vector<TextUnit>& text_units,
+    FileParts& parts) = 0;
+
+  virtual void save_file_record_with_parts(FileRecord& record,
+    const FileParts& parts) = 0;
+
+  // Drops the units saved ahead of a record that won't be saved.
+  virtual void drop_file_parts(const FileParts& parts) = 0;
+
+  // Rebuilds the vector index of the database, for the ones whose index
+  // degrades with large loads. The others throw.
+  virtual void rebuild_vector_index()
+  {
+    throw std::runtime_error("The database has no vector index to rebuild");
+  }
+
   virtual std::vector<TextUnitResult>
   search(const std::vector<float>& embedding) = 0;
 
+  // Searches with a candidate list of ef_search entries, for the databases
+  // searched through an HNSW graph, or with their default when it's 0. The
+  // others ignore it.
+  virtual std::vector<TextUnitResult>
+  search_with_ef(const std::vector<float>& embedding, size_t /*ef_search*/)
+  {
+    return search(embedding);
+  }
+
+  virtual std::vector<std::vector<TextUnitResult>>
+  search_batch(const std::vector<std::vector<float>>& embeddings)
+  {
+    std::vector<std::vector<TextUnitResult>> results;
+    results.reserve(embeddings.size());
+    for (const std::vector<float>& embedding : embeddings)
+      results.push_back(search(embedding));
+    return results;
+  }
+
   virtual void set_database_up() = 0;
+
+  // Sets the modification time of the records saved for the file path, for
+  // a file whose content didn't change.
+  virtual void update_file_mtime(const std::string& file_path,
+    long long mtime) = 0;
 };
 
 
@@ -186,7 +473,19 @@ class FileProcessor
 {
 public:
 
+  // Thrown when a file can't be extracted, after some of its units may
+  // have been passed, which are to be dropped with the file.
+  class file_error: public std::runtime_error
+  {
+  public:
+
+    using std::runtime_error::runtime_error;
+  };
+
   virtual ~FileProcessor() = default;
 
+  // Called with each text unit extracted, which the callee can take.
+  typedef std::function<void(TextUnit&&)> TextUnitFunc;
+
   virtual void process_file(const char* file_path) = 0;
 };
\ No newline at end of file
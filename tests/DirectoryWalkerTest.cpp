@@ -0,0 +1,202 @@
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fnmatch.h>
+
+#include "check.h"
+#include "DirectoryWalker.h"
+
+
+namespace filesystem = std::filesystem;
+
+
+static void write_file(const filesystem::path& file_path)
+{
+  std::ofstream file(file_path);
+  file << file_path.filename().string() << "\n";
+  CHECK(file.flush());
+}
+
+
+/*
+Tree of nested directories with HTML and text files, a directory excluded
+by name and one by relative path, and symbolic links to a file, to a
+directory and to nothing.
+*/
+static void make_tree(const filesystem::path& root)
+{
+  for (size_t top = 0; top < 6; top++)
+  {
+    filesystem::path top_dir = root / ("dir" + std::to_string(top));
+    for (size_t sub = 0; sub < 5; sub++)
+    {
+      filesystem::path sub_dir = top_dir / ("sub" + std::to_string(sub)) /
+        "deeper";
+      filesystem::create_directories(sub_dir);
+      for (size_t idx = 0; idx < 8; idx++)
+      {
+        write_file(sub_dir / ("page" + std::to_string(idx) + ".html"));
+        write_file(sub_dir.parent_path() /
+          ("note" + std::to_string(idx) + ".txt"));
+      }
+    }
+    write_file(top_dir / "index.html");
+  }
+
+  filesystem::create_directories(root / "node_modules" / "package");
+  write_file(root / "node_modules" / "package" / "readme.html");
+  filesystem::create_directories(root / "dir1" / "node_modules");
+  write_file(root / "dir1" / "node_modules" / "nested.html");
+  filesystem::create_directories(root / "dir2" / "private");
+  write_file(root / "dir2" / "private" / "secret.html");
+  filesystem::create_directories(root / "dir3" / "private");
+  write_file(root / "dir3" / "private" / "kept.html");
+  write_file(root / "top.html");
+
+  filesystem::create_symlink(root / "top.html", root / "dir4" / "link.html");
+  filesystem::create_directory_symlink(root / "dir5", root / "dir4" /
+    "dirlink");
+  filesystem::create_symlink(root / "missing.html", root / "dir4" /
+    "broken.html");
+}
+
+
+static bool matches_any(const std::vector<std::string>& patterns,
+  const std::string& name, const std::string& relative_path)
+{
+  for (const std::string& pattern : patterns)
+  {
+    const std::string& subject = pattern.find('/') == std::string::npos ?
+      name : relative_path;
+    if (fnmatch(pattern.c_str(), subject.c_str(), FNM_PATHNAME) == 0)
+      return true;
+  }
+  return false;
+}
+
+
+/*
+Files the walk should report, found by a single-threaded walk of
+std::filesystem following the rules of DirectoryWalker.
+*/
+static std::set<std::string> expected_files(const filesystem::path& root,
+  const std::vector<std::string>& include_patterns,
+  const std::vector<std::string>& exclude_patterns)
+{
+  std::set<std::string> files;
+  for (auto it = filesystem::recursive_directory_iterator(root);
+    it != filesystem::recursive_directory_iterator(); ++it)
+  {
+    std::string name = it->path().filename().string();
+    std::string relative_path =
+      filesystem::relative(it->path(), root).string();
+
+    if (matches_any(exclude_patterns, name, relative_path))
+    {
+      if (it->is_directory() && !it->is_symlink())
+        it.disable_recursion_pending();
+      continue;
+    }
+
+    if (it->is_regular_file() && (include_patterns.empty() ||
+      matches_any(include_patterns, name, relative_path)))
+    {
+      files.insert(it->path().string());
+    }
+  }
+  return files;
+}
+
+
+static void test_walk(const filesystem::path& root, size_t n_threads,
+  const std::vector<std::string>& include_patterns,
+  const std::vector<std::string>& exclude_patterns)
+{
+  DirectoryWalker walker(n_threads);
+  for (const std::string& pattern : include_patterns)
+    walker.add_include_pattern(pattern);
+  for (const std::string& pattern : exclude_patterns)
+    walker.add_exclude_pattern(pattern);
+
+  std::set<std::string> expected = expected_files(root, include_patterns,
+    exclude_patterns);
+  CHECK(!expected.empty());
+
+  // Walked twice, as a walker can be.
+  for (size_t round = 0; round < 2; round++)
+  {
+    std::mutex mutex;
+    std::set<std::string> files;
+    bool duplicate = false;
+    walker.walk(root, [&](filesystem::path&& file_path) {
+      std::lock_guard<std::mutex> lock(mutex);
+      duplicate |= !files.insert(file_path.string()).second;
+      return true;
+    });
+
+    CHECK(!duplicate);
+    CHECK(files == expected);
+  }
+}
+
+
+static void test_stop_and_errors(const filesystem::path& root)
+{
+  DirectoryWalker walker(4);
+
+  std::atomic<size_t> reported(0);
+  walker.walk(root, [&](filesystem::path&&) {
+    reported++;
+    return false;
+  });
+  CHECK(reported >= 1 && reported <= 4);
+
+  bool rethrown = false;
+  try
+  {
+    walker.walk(root, [](filesystem::path&&) -> bool {
+      throw std::runtime_error("callback error");
+    });
+  }
+  catch (const std::runtime_error& error)
+  {
+    rethrown = std::string(error.what()) == "callback error";
+  }
+  CHECK(rethrown);
+
+  bool missing_fails = false;
+  try
+  {
+    walker.walk(root / "missing", [](filesystem::path&&) { return true; });
+  }
+  catch (const std::runtime_error&)
+  {
+    missing_fails = true;
+  }
+  CHECK(missing_fails);
+}
+
+
+int main()
+{
+  TestDirectory directory("DirectoryWalkerTest");
+  make_tree(directory.path());
+
+  for (size_t n_threads : {1, 2, 8})
+  {
+    test_walk(directory.path(), n_threads, {}, {});
+    test_walk(directory.path(), n_threads, {"*.html"},
+      {"node_modules", "dir2/private"});
+    test_walk(directory.path(), n_threads, {"*.txt", "dir0/*/deeper/*"},
+      {"sub3"});
+  }
+
+  test_stop_and_errors(directory.path());
+  return EXIT_SUCCESS;
+}
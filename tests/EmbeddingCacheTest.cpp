@@ -0,0 +1,155 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "common.h"
+#include "EmbeddingCache.h"
+
+
+namespace filesystem = std::filesystem;
+
+
+static TextUnit make_unit(const std::string& text,
+  std::vector<float> embedding)
+{
+  TextUnit unit;
+  unit.text(text);
+  unit.embedding(std::move(embedding));
+  return unit;
+}
+
+
+static void test_put_get(const filesystem::path& file_path)
+{
+  {
+    EmbeddingCache cache(file_path);
+    std::vector<TextUnit> units;
+    units.push_back(make_unit("first", {1, 2, 3}));
+    units.push_back(make_unit("second", {4, 5}));
+    // Skipped, as are the texts already saved.
+    units.push_back(TextUnit());
+    units.push_back(make_unit("first", {7, 8, 9}));
+    cache.put("model", units);
+    cache.put("model", units);
+
+    std::vector<float> embedding;
+    CHECK(cache.get("model", "first", embedding));
+    CHECK(embedding == std::vector<float>({1, 2, 3}));
+    CHECK(cache.get("model", "second", embedding));
+    CHECK(embedding == std::vector<float>({4, 5}));
+    CHECK(!cache.get("other", "first", embedding));
+    CHECK(!cache.get("model", "third", embedding));
+    CHECK(cache.hits() == 2 && cache.misses() == 2);
+  }
+
+  // A second cache sees the records of the first, saved once, and adds to
+  // them.
+  size_t file_size = filesystem::file_size(file_path);
+  EmbeddingCache cache(file_path);
+  EmbeddingCache other(file_path);
+  cache.put("model", {make_unit("first", {1, 2, 3})});
+  CHECK(filesystem::file_size(file_path) == file_size);
+
+  other.put("model", {make_unit("third", {6})});
+  cache.put("model", {make_unit("fourth", {0.5f})});
+
+  // Records appended by others are indexed on the next append.
+  std::vector<float> embedding;
+  CHECK(cache.get("model", "third", embedding));
+  CHECK(embedding == std::vector<float>({6}));
+  CHECK(!other.get("model", "fourth", embedding));
+  other.put("model", {make_unit("fifth", {7})});
+  CHECK(other.get("model", "fourth", embedding));
+  CHECK(embedding == std::vector<float>({0.5f}));
+}
+
+
+/*
+A record whose hash is the one of another key is never returned for it, as
+happens when two texts collide.
+*/
+static void test_collision(const filesystem::path& file_path)
+{
+  const char signature[8] = {'E', 'M', 'B', 'D', 'C', 'A', 'C', '2'};
+  std::string key("model");
+  key += '\0';
+  uint64_t hash = hash_bytes(key.data(), key.size());
+  hash = hash_bytes("wanted", 6, hash);
+  key += "stored";
+
+  struct
+  {
+    uint64_t key_hash;
+    uint32_t key_size;
+    uint32_t dimension;
+  } header = {hash, static_cast<uint32_t>(key.size()), 1};
+  float value = 1;
+
+  {
+    std::ofstream file(file_path, std::ios::binary);
+    file.write(signature, sizeof(signature));
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file << key;
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    // A record cut short, dropped when the cache is opened.
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    CHECK(file.flush());
+  }
+
+  EmbeddingCache cache(file_path);
+  std::vector<float> embedding;
+  CHECK(!cache.get("model", "wanted", embedding));
+
+  cache.put("model", {make_unit("wanted", {2})});
+  CHECK(cache.get("model", "wanted", embedding));
+  CHECK(embedding == std::vector<float>({2}));
+
+  EmbeddingCache reopened(file_path);
+  CHECK(reopened.get("model", "wanted", embedding));
+  CHECK(embedding == std::vector<float>({2}));
+}
+
+
+/*
+Appends grow the mapping past the end of the file, and what's appended
+there later is read.
+*/
+static void test_growth(const filesystem::path& file_path)
+{
+  EmbeddingCache cache(file_path);
+  for (size_t batch = 0; batch < 50; batch++)
+  {
+    std::vector<TextUnit> units;
+    for (size_t idx = 0; idx < 20; idx++)
+    {
+      std::string text = std::to_string(batch) + "." + std::to_string(idx);
+      units.push_back(make_unit(text, std::vector<float>(64, batch + idx)));
+    }
+    cache.put("model", units);
+  }
+
+  EmbeddingCache reopened(file_path);
+  std::vector<float> embedding;
+  for (size_t batch = 0; batch < 50; batch++)
+  {
+    std::string text = std::to_string(batch) + ".19";
+    CHECK(cache.get("model", text, embedding));
+    CHECK(embedding == std::vector<float>(64, batch + 19));
+    CHECK(reopened.get("model", text, embedding));
+    CHECK(embedding == std::vector<float>(64, batch + 19));
+  }
+}
+
+
+int main()
+{
+  TestDirectory directory("EmbeddingCacheTest");
+  test_put_get(directory.path() / "put.cache");
+  test_collision(directory.path() / "collision.cache");
+  test_growth(directory.path() / "growth.cache");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "common.h"
+#include "EmbeddingsParser.h"
+
+
+static const size_t dimension = 24;
+
+
+// Numbers written as JSON allows them, parsed as std::strtof() does.
+static const char* const number_tokens[] = {
+  "0", "-0", "-0.0", "1", "-1", "0.5", "1e-3", "1E+2", "-2.5e-7",
+  "3.4028235e38", "-3.4028235e38", "1.17549435e-38", "1.4e-45", "123456789",
+  "0.30000000000000004", "0.1000000000000000055511151231257827",
+  "7.038531e-26", "1.00000005960464477539062500001", "-0.00012207031"
+};
+
+
+/*
+Text of the numbers of the embeddings, mixing the number tokens above with
+random floats written with all their digits or only a few.
+*/
+static std::vector<std::vector<std::string>> make_numbers(std::mt19937& rng,
+  size_t n_embeddings)
+{
+  std::normal_distribution<float> value(0, 0.05f);
+  const size_t n_tokens = sizeof(number_tokens) / sizeof(number_tokens[0]);
+
+  std::vector<std::vector<std::string>> numbers(n_embeddings);
+  for (std::vector<std::string>& embedding : numbers)
+  {
+    for (size_t idx = 0; idx < dimension; idx++)
+    {
+      char text[32];
+      switch (rng() % 4)
+      {
+      case 0:
+        embedding.push_back(number_tokens[rng() % n_tokens]);
+        continue;
+      case 1:
+        std::snprintf(text, sizeof(text), "%.3g", value(rng));
+        break;
+      default:
+        std::snprintf(text, sizeof(text), "%.9g", value(rng));
+      }
+      embedding.push_back(text);
+    }
+  }
+  return numbers;
+}
+
+
+/*
+Response of the embeddings API with the numbers, its items in reverse order,
+with members that are skipped and the "index" before or after the
+"embedding".
+*/
+static std::string make_response(
+  const std::vector<std::vector<std::string>>& numbers)
+{
+  std::string json("{\"object\": \"list\", \"data\": [\n");
+
+  for (size_t idx = numbers.size(); idx > 0; idx--)
+  {
+    size_t index = idx - 1;
+    std::string embedding("[");
+    for (size_t dim = 0; dim < numbers[index].size(); dim++)
+    {
+      if (dim > 0)
+        embedding += dim % 3 == 0 ? ",\n  " : ",";
+      embedding += numbers[index][dim];
+    }
+    embedding += "]";
+
+    json += "  {\"object\": \"embedding\", ";
+    if (index % 2 == 0)
+    {
+      json += "\"index\": " + std::to_string(index) + ", \"embedding\": " +
+        embedding;
+    }
+    else
+    {
+      json += "\"embedding\" :" + embedding + " , \"extra\": [1, [true, "
+        "false, null], {\"a\": \"\\\"]}\"}], \"index\":" +
+        std::to_string(index);
+    }
+    json += idx > 1 ? "},\n" : "}\n";
+  }
+
+  json += "], \"model\": \"name \\\"quoted\\\" \\u00e9\\\\\", "
+    "\"usage\": {\"prompt_tokens\": 12, \"total_tokens\": 12}}";
+  return json;
+}
+
+
+/*
+Feeds json to the parser in chunks of chunk_size bytes, so numbers, strings
+and keys are cut anywhere.
+*/
+static void parse(EmbeddingsParser& parser, const std::string& json,
+  size_t chunk_size)
+{
+  for (size_t offset = 0; offset < json.size(); offset += chunk_size)
+  {
+    parser.feed(json.data() + offset,
+      std::min(chunk_size, json.size() - offset));
+  }
+  parser.finish();
+}
+
+
+static void check_embeddings(const std::vector<TextUnit>& text_units,
+  const std::vector<std::vector<std::string>>& numbers)
+{
+  CHECK(text_units.size() == numbers.size());
+  for (size_t idx = 0; idx < text_units.size(); idx++)
+  {
+    const Embedding& embedding = text_units[idx].embedding();
+    CHECK(embedding.size() == dimension);
+    // Rows of the batch start on 64-byte boundaries.
+    CHECK(reinterpret_cast<uintptr_t>(embedding.data()) % 64 == 0);
+
+    for (size_t dim = 0; dim < dimension; dim++)
+    {
+      float expected = std::strtof(numbers[idx][dim].c_str(), nullptr);
+      CHECK(std::memcmp(embedding.data() + dim, &expected, sizeof(float)) ==
+        0);
+    }
+  }
+}
+
+
+static void test_numbers()
+{
+  std::mt19937 rng(42);
+
+  for (size_t n_units : {1, 2, 7})
+  {
+    std::vector<std::vector<std::string>> numbers = make_numbers(rng,
+      n_units);
+    std::string json = make_response(numbers);
+
+    for (size_t chunk_size : {json.size(), size_t(1), size_t(2), size_t(3),
+      size_t(7), size_t(16), size_t(61)})
+    {
+      std::vector<TextUnit> text_units(n_units);
+      EmbeddingsParser parser(text_units);
+      parse(parser, json, chunk_size);
+      check_embeddings(text_units, numbers);
+    }
+  }
+}
+
+
+static void test_reset()
+{
+  std::mt19937 rng(7);
+  std::vector<TextUnit> text_units(3);
+  EmbeddingsParser parser(text_units);
+
+  // A response cut short, then retried.
+  std::string json = make_response(make_numbers(rng, 3));
+  parser.feed(json.data(), json.size() / 2);
+  parser.reset();
+
+  std::vector<std::vector<std::string>> numbers = make_numbers(rng, 3);
+  parse(parser, make_response(numbers), 5);
+  check_embeddings(text_units, numbers);
+}
+
+
+/*
+Response with the embeddings in base64, each padded or not, with "\/" for
+some of the slashes, as some servers write them.
+*/
+static std::string make_base64_response(
+  const std::vector<std::vector<float>>& embeddings)
+{
+  std::string json("{\"data\": [");
+
+  for (size_t idx = 0; idx < embeddings.size(); idx++)
+  {
+    std::string base64 = encode_base64(embeddings[idx].data(),
+      embeddings[idx].size() * sizeof(float), idx % 2 == 0);
+    std::string escaped;
+    for (size_t pos = 0; pos < base64.size(); pos++)
+    {
+      escaped += base64[pos] == '/' && pos % 3 != 0 ? "\\/" :
+        std::string(1, base64[pos]);
+    }
+
+    if (idx > 0)
+      json += ", ";
+    // The first item has its index after the embedding, so it's decoded
+    // before the batch is allocated.
+    if (idx == 0)
+    {
+      json += "{\"embedding\": \"" + escaped + "\", \"index\": 0}";
+    }
+    else
+    {
+      json += "{\"index\": " + std::to_string(idx) + ", \"embedding\": \"" +
+        escaped + "\"}";
+    }
+  }
+
+  json += "]}";
+  return json;
+}
+
+
+static void test_base64()
+{
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> bits;
+
+  // Odd dimensions leave 1 or 2 bytes in the last group of characters.
+  for (size_t base64_dimension : {1, 5, 24, 100, 257})
+  {
+    std::vector<std::vector<float>> embeddings(4,
+      std::vector<float>(base64_dimension));
+    for (std::vector<float>& embedding : embeddings)
+    {
+      for (float& value : embedding)
+      {
+        uint32_t value_bits = bits(rng);
+        std::memcpy(&value, &value_bits, sizeof(value));
+      }
+    }
+    std::string json = make_base64_response(embeddings);
+
+    for (size_t chunk_size : {json.size(), size_t(1), size_t(3), size_t(50),
+      size_t(333)})
+    {
+      std::vector<TextUnit> text_units(embeddings.size());
+      EmbeddingsParser parser(text_units);
+      parse(parser, json, chunk_size);
+
+      for (size_t idx = 0; idx < embeddings.size(); idx++)
+      {
+        const Embedding& embedding = text_units[idx].embedding();
+        CHECK(embedding.size() == base64_dimension);
+        CHECK(std::memcmp(embedding.data(), embeddings[idx].data(),
+          base64_dimension * sizeof(float)) == 0);
+      }
+    }
+  }
+}
+
+
+static bool parse_fails(const std::string& json, size_t n_units)
+{
+  std::vector<TextUnit> text_units(n_units);
+  EmbeddingsParser parser(text_units);
+  try
+  {
+    parse(parser, json, 3);
+  }
+  catch (const std::runtime_error&)
+  {
+    return true;
+  }
+  return false;
+}
+
+
+static void test_errors()
+{
+  CHECK(!parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}]}",
+    1));
+  CHECK(parse_fails("[]", 1));
+  CHECK(parse_fails("{\"object\": \"list\"}", 1));
+  CHECK(parse_fails("{\"data\": {}}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}]}",
+    2));
+  CHECK(parse_fails("{\"data\": [{\"index\": 1, \"embedding\": [1, 2]}]}",
+    1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}, "
+    "{\"index\": 0, \"embedding\": [3, 4]}]}", 2));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}, "
+    "{\"index\": 1, \"embedding\": [3, 4, 5]}]}", 2));
+  CHECK(parse_fails("{\"data\": [{\"embedding\": [1, 2], \"index\": 1}, "
+    "{\"embedding\": [3], \"index\": 0}]}", 2));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"embedding\": [1, 2]}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, \"2\"]}]}",
+    1));
+  CHECK(parse_fails("{\"data\": [{\"index\": \"0\", \"embedding\": [1]}]}",
+    1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0 \"embedding\": [1, 2]}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}]}x",
+    1));
+
+  // Literals are skipped when whole, cut between chunks or not.
+  CHECK(!parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": true, \"b\": false, \"c\": null}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": tru}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": nul1}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": falsey}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": nothing}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": [1, 2], "
+    "\"a\": True}]}", 1));
+
+  // Base64 of a float, then base64 of 3 bytes, with a character outside the
+  // alphabet, with padding inside and with an escape other than "\/".
+  CHECK(!parse_fails("{\"data\": [{\"index\": 0, \"embedding\": "
+    "\"AACAPw\"}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": "
+    "\"AACA\"}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": "
+    "\"AAC*Pw\"}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": "
+    "\"AA==AACAPw\"}]}", 1));
+  CHECK(parse_fails("{\"data\": [{\"index\": 0, \"embedding\": "
+    "\"AAC\\nPw\"}]}", 1));
+}
+
+
+int main()
+{
+  test_numbers();
+  test_reset();
+  test_base64();
+  test_errors();
+  return EXIT_SUCCESS;
+}
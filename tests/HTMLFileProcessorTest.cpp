@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <libxml/parser.h>
+
+#include "check.h"
+#include "common.h"
+#include "HTMLFileProcessor.h"
+#include "TextChunker.h"
+
+
+static const char html_page[] =
+  "<!DOCTYPE html>\n"
+  "<html>\n"
+  "<head>\n"
+  "  <title>Page title</title>\n"
+  "  <style>p { color: red; }</style>\n"
+  "  <script>var skipped = \"<p>not text</p>\";</script>\n"
+  "</head>\n"
+  "<body>\n"
+  "  <h1>First heading</h1>\n"
+  "  <p>First <b>bold</b> paragraph</p>\n"
+  "  <P>Upper case<BR>after break</P>\n"
+  "  <ul><li>One</li><li>Two</li></ul>\n"
+  "  <table><tr><td>A1</td><td>B1</td></tr><tr><td>A2</td><td>B2</td></tr>"
+  "</table>\n"
+  "  <pre>  indented\n    code</pre>\n"
+  "  <div>Caf&eacute; &amp; &lt;tags&gt;</div>\n"
+  "  <h1>Second heading</h1>\n"
+  "  <h2>Section</h2>\n"
+  "  <p>Last</p>\n"
+  "</body>\n"
+  "</html>\n";
+
+
+static void write_file(const std::string& file_path, const std::string& data)
+{
+  std::ofstream file(file_path, std::ios::binary);
+  file << data;
+  CHECK(file.flush());
+}
+
+
+static std::vector<std::string> extract(HTMLFileProcessor& processor,
+  std::vector<std::string>& texts, const std::string& file_path)
+{
+  texts.clear();
+  processor.process_file(file_path.c_str());
+  return texts;
+}
+
+
+static void test_page(const TestDirectory& directory)
+{
+  std::string file_path = directory.path() / "page.html";
+  write_file(file_path, html_page);
+
+  std::vector<std::string> texts;
+  HTMLFileProcessor processor(TextChunker::limits(),
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+
+  // Processed twice, as a processor is reused for each file.
+  for (size_t round = 0; round < 2; round++)
+  {
+    std::vector<std::string> units = extract(processor, texts, file_path);
+    CHECK(units.size() == 3);
+    CHECK(units[0] == "Page title");
+    CHECK(units[1] ==
+      "First heading\n"
+      "First bold paragraph\n"
+      "Upper case\n"
+      "after break\n"
+      "One\n"
+      "Two\n"
+      "  A1  B1\n"
+      "  A2  B2  indented\n"
+      "    code\n"
+      // Spaces alone between entities come as text of their own, dropped.
+      "Caf\xc3\xa9&<tags>");
+    CHECK(units[2] == "Second heading\nSection\nLast");
+  }
+}
+
+
+/*
+Page of n_sections sections, each with a heading and paragraphs, larger
+than the chunks given to the parser so that tags, entities and multi-byte
+characters are cut between chunks.
+*/
+static std::string make_long_page(size_t n_sections,
+  std::vector<std::string>& expected)
+{
+  std::string html("<html><head><meta charset=\"utf-8\"></head><body>\n");
+  expected.clear();
+
+  for (size_t section = 0; section < n_sections; section++)
+  {
+    std::string number = std::to_string(section);
+    html += "<h1>Heading " + number + "</h1>\n";
+    std::string unit("Heading " + number);
+
+    for (size_t idx = 0; idx < 20; idx++)
+    {
+      std::string paragraph = "Paragraph " + number + "." +
+        std::to_string(idx);
+      html += "<p class=\"text\">" + paragraph +
+        " &amp; caf\xc3\xa9</p>\n";
+      unit += "\n" + paragraph + " & caf\xc3\xa9";
+    }
+    expected.push_back(unit);
+  }
+
+  html += "</body></html>\n";
+  return html;
+}
+
+
+static void test_long_page(const TestDirectory& directory)
+{
+  std::vector<std::string> expected;
+  std::string html = make_long_page(3000, expected);
+  CHECK(html.size() > 1024 * 1024);
+
+  std::string file_path = directory.path() / "long.html";
+  write_file(file_path, html);
+
+  std::vector<std::string> texts;
+  HTMLFileProcessor processor(TextChunker::limits(),
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+  CHECK(extract(processor, texts, file_path) == expected);
+
+  // Cut at the size limit, no unit is larger and every line is kept, in
+  // order.
+  TextChunker::limits limits;
+  limits.max_size = 200;
+  HTMLFileProcessor limited(limits,
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+  std::vector<std::string> units = extract(limited, texts, file_path);
+  CHECK(units.size() > expected.size());
+  std::string text;
+  for (const std::string& unit_text : units)
+  {
+    CHECK(!unit_text.empty() && unit_text.size() <= limits.max_size);
+    text += unit_text;
+  }
+  size_t pos = 0;
+  for (const std::string& unit_text : expected)
+  {
+    for (size_t start = 0; start < unit_text.size();)
+    {
+      size_t end = std::min(unit_text.find('\n', start), unit_text.size());
+      pos = text.find(unit_text.substr(start, end - start), pos);
+      CHECK(pos != std::string::npos);
+      start = end + 1;
+    }
+  }
+}
+
+
+static void test_files(const TestDirectory& directory)
+{
+  std::vector<std::string> texts;
+  HTMLFileProcessor processor(TextChunker::limits(),
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+
+  std::string file_path = directory.path() / "empty.html";
+  write_file(file_path, "");
+  CHECK(extract(processor, texts, file_path).empty());
+
+  bool missing_fails = false;
+  try
+  {
+    extract(processor, texts, directory.path() / "missing.html");
+  }
+  catch (const std::runtime_error&)
+  {
+    missing_fails = true;
+  }
+  CHECK(missing_fails);
+}
+
+
+int main()
+{
+  xmlInitParser();
+
+  TestDirectory directory("HTMLFileProcessorTest");
+  test_page(directory);
+  test_long_page(directory);
+  test_files(directory);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "EmbeddingMatrix.h"
+#include "HnswIndex.h"
+#include "VectorKernels.h"
+
+
+static const uint32_t dimension = 16;
+static const size_t n_rows = 3000;
+static const size_t n_queries = 100;
+static const size_t k = 10;
+static const size_t ef_search = 100;
+
+
+static std::vector<float> random_vector(std::mt19937& rng)
+{
+  std::normal_distribution<float> value;
+  std::vector<float> vector(dimension);
+  for (float& x : vector)
+    x = value(rng);
+  return vector;
+}
+
+
+/*
+The k rows nearest to query for which accept returns true, found by scanning
+them all with the scalar kernel.
+*/
+static std::vector<uint32_t> exact_nearest(const float* query,
+  const EmbeddingMatrix& matrix, DistanceFunc distance,
+  bool (*accept)(uint32_t))
+{
+  std::vector<std::pair<float, uint32_t>> scored;
+  for (uint32_t row = 0; row < matrix.rows(); row++)
+  {
+    if (accept(row))
+      scored.emplace_back(distance(query, matrix.row(row), dimension), row);
+  }
+
+  std::partial_sort(scored.begin(), scored.begin() + k, scored.end());
+  std::vector<uint32_t> nearest;
+  for (size_t idx = 0; idx < k; idx++)
+    nearest.push_back(scored[idx].second);
+  return nearest;
+}
+
+
+static bool accept_all(uint32_t)
+{
+  return true;
+}
+
+
+static bool accept_odd(uint32_t row)
+{
+  return row % 2 == 1;
+}
+
+
+/*
+Fraction of the exact k nearest rows that the index finds, checking that the
+results pass the filter and come nearest first with their kernel distance.
+*/
+static double recall(HnswIndex& index, const EmbeddingMatrix& matrix,
+  Metric metric, const std::vector<std::vector<float>>& queries,
+  bool (*accept)(uint32_t))
+{
+  DistanceFunc distance = get_distance_func(metric);
+  DistanceFunc scalar_distance = metric == Metric::l2 ?
+    l2_squared_scalar : inner_product_distance_scalar;
+
+  size_t found = 0;
+  for (const std::vector<float>& query : queries)
+  {
+    std::vector<std::pair<float, uint32_t>> results = index.search(
+      query.data(), k, ef_search, matrix, distance, accept);
+    CHECK(results.size() == k);
+
+    for (size_t idx = 0; idx < results.size(); idx++)
+    {
+      CHECK(accept(results[idx].second));
+      CHECK(idx == 0 || results[idx - 1].first <= results[idx].first);
+      float expected = scalar_distance(query.data(),
+        matrix.row(results[idx].second), dimension);
+      CHECK(std::abs(results[idx].first - expected) <=
+        1e-4f * std::max(1.0f, std::abs(expected)));
+    }
+
+    std::vector<uint32_t> nearest = exact_nearest(query.data(), matrix,
+      scalar_distance, accept);
+    for (const std::pair<float, uint32_t>& result : results)
+    {
+      if (std::find(nearest.begin(), nearest.end(), result.second) !=
+        nearest.end())
+      {
+        found++;
+      }
+    }
+  }
+
+  return static_cast<double>(found) / (queries.size() * k);
+}
+
+
+static void test_metric(Metric metric, const char* name)
+{
+  TestDirectory directory(name);
+  std::mt19937 rng(42);
+
+  std::vector<std::vector<float>> queries;
+  for (size_t idx = 0; idx < n_queries; idx++)
+    queries.push_back(random_vector(rng));
+
+  EmbeddingMatrix matrix(directory.path() / "embeddings.mat");
+  for (size_t row = 0; row < n_rows; row++)
+    matrix.append(random_vector(rng).data(), dimension);
+
+  {
+    HnswIndex index(directory.path() / "index.hnsw", 16, 100);
+    CHECK(index.search(queries[0].data(), k, ef_search, matrix,
+      get_distance_func(metric), accept_all).empty());
+
+    for (uint64_t row = 0; row < n_rows; row++)
+      index.allocate(row);
+
+    // Rows are linked by several threads at once, as HnswVectorDb does.
+    DistanceFunc distance = get_distance_func(metric);
+    std::vector<std::thread> threads;
+    for (size_t thread_idx = 0; thread_idx < 4; thread_idx++)
+    {
+      threads.emplace_back([&, thread_idx]() {
+        for (uint64_t row = thread_idx; row < n_rows; row += 4)
+          index.insert(row, matrix, distance);
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+
+    for (uint64_t row = 0; row < n_rows; row++)
+      CHECK(index.is_inserted(row));
+
+    CHECK(recall(index, matrix, metric, queries, accept_all) >= 0.95);
+    CHECK(recall(index, matrix, metric, queries, accept_odd) >= 0.9);
+  }
+
+  // The graph is read back from its file.
+  HnswIndex index(directory.path() / "index.hnsw", 16, 100);
+  for (uint64_t row = 0; row < n_rows; row++)
+    CHECK(index.is_inserted(row));
+  CHECK(recall(index, matrix, metric, queries, accept_all) >= 0.95);
+}
+
+
+int main()
+{
+  test_metric(Metric::l2, "HnswIndexTest-l2");
+  test_metric(Metric::inner_product, "HnswIndexTest-ip");
+  return EXIT_SUCCESS;
+}
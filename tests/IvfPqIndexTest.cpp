@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "IvfPqIndex.h"
+#include "VectorKernels.h"
+
+
+static const uint32_t dimension = 16;
+static const uint32_t n_lists = 16;
+static const uint32_t code_size = 4;
+static const size_t n_clusters = 16;
+static const size_t n_rows = 2000;
+static const size_t n_queries = 100;
+static const size_t k = 10;
+static const size_t n_candidates = 100;
+static const size_t probes = 4;
+
+
+/*
+Vectors around random centers, so that the lists of the index match
+clusters of the data, as they do with embeddings.
+*/
+static std::vector<std::vector<float>> clustered_vectors(std::mt19937& rng,
+  const std::vector<std::vector<float>>& centers, size_t n)
+{
+  std::normal_distribution<float> noise(0, 0.3f);
+  std::uniform_int_distribution<size_t> center_idx(0, centers.size() - 1);
+
+  std::vector<std::vector<float>> vectors;
+  for (size_t idx = 0; idx < n; idx++)
+  {
+    std::vector<float> vector = centers[center_idx(rng)];
+    for (float& x : vector)
+      x += noise(rng);
+    vectors.push_back(vector);
+  }
+  return vectors;
+}
+
+
+/*
+The k vectors nearest to query for which accept returns true, found by
+scanning them all with the scalar kernel.
+*/
+static std::vector<uint32_t> exact_nearest(const float* query,
+  const std::vector<std::vector<float>>& rows, DistanceFunc distance,
+  const std::function<bool(uint32_t)>& accept)
+{
+  std::vector<std::pair<float, uint32_t>> scored;
+  for (uint32_t row = 0; row < rows.size(); row++)
+  {
+    if (accept(row))
+      scored.emplace_back(distance(query, rows[row].data(), dimension), row);
+  }
+
+  std::partial_sort(scored.begin(), scored.begin() + k, scored.end());
+  std::vector<uint32_t> nearest;
+  for (size_t idx = 0; idx < k; idx++)
+    nearest.push_back(scored[idx].second);
+  return nearest;
+}
+
+
+/*
+Fraction of the exact k nearest vectors found among the candidates of the
+probed lists, checking that the candidates pass the filter and come nearest
+first.
+*/
+static double recall(const IvfPqIndex& index, Metric metric,
+  const std::vector<std::vector<float>>& rows,
+  const std::vector<std::vector<float>>& queries,
+  const std::function<bool(uint32_t)>& accept)
+{
+  DistanceFunc scalar_distance = metric == Metric::l2 ?
+    l2_squared_scalar : inner_product_distance_scalar;
+
+  size_t found = 0;
+  for (const std::vector<float>& query : queries)
+  {
+    std::vector<std::pair<float, uint32_t>> candidates = index.search(
+      query.data(), probes, n_candidates, accept);
+    CHECK(candidates.size() == n_candidates);
+
+    for (size_t idx = 0; idx < candidates.size(); idx++)
+    {
+      CHECK(accept(candidates[idx].second));
+      CHECK(idx == 0 || candidates[idx - 1].first <= candidates[idx].first);
+    }
+
+    for (uint32_t row : exact_nearest(query.data(), rows, scalar_distance,
+      accept))
+    {
+      for (const std::pair<float, uint32_t>& candidate : candidates)
+      {
+        if (candidate.second == row)
+        {
+          found++;
+          break;
+        }
+      }
+    }
+  }
+
+  return static_cast<double>(found) / (queries.size() * k);
+}
+
+
+static void test_metric(Metric metric, const char* name)
+{
+  TestDirectory directory(name);
+  std::mt19937 rng(42);
+
+  std::normal_distribution<float> value;
+  std::vector<std::vector<float>> centers(n_clusters,
+    std::vector<float>(dimension));
+  for (std::vector<float>& center : centers)
+  {
+    for (float& x : center)
+      x = value(rng);
+  }
+
+  std::vector<std::vector<float>> rows = clustered_vectors(rng, centers,
+    n_rows);
+  std::vector<std::vector<float>> queries = clustered_vectors(rng, centers,
+    n_queries);
+  auto accept_all = [](uint32_t) { return true; };
+  auto accept_odd = [](uint32_t id) { return id % 2 == 1; };
+
+  std::vector<std::pair<float, uint32_t>> first_candidates;
+  {
+    IvfPqIndex index(directory.path(), metric);
+    CHECK(!index.trained());
+
+    std::vector<const float*> sample;
+    for (size_t row = 0; row < n_rows / 2; row++)
+      sample.push_back(rows[row].data());
+    index.train(sample, dimension, n_lists, code_size);
+    CHECK(index.trained());
+
+    for (uint32_t row = 0; row < n_rows; row++)
+      index.add(row, rows[row].data());
+    CHECK(index.encoded_count() == n_rows);
+
+    bool out_of_order = false;
+    try
+    {
+      index.add(0, rows[0].data());
+    }
+    catch (const std::logic_error&)
+    {
+      out_of_order = true;
+    }
+    CHECK(out_of_order);
+
+    // Probing every list reaches every vector once.
+    std::vector<std::pair<float, uint32_t>> all = index.search(
+      queries[0].data(), n_lists, n_rows, accept_all);
+    CHECK(all.size() == n_rows);
+    std::vector<bool> seen(n_rows, false);
+    for (const std::pair<float, uint32_t>& candidate : all)
+    {
+      CHECK(!seen[candidate.second]);
+      seen[candidate.second] = true;
+    }
+
+    // The exact nearest vectors are among the candidates of a few lists.
+    CHECK(recall(index, metric, rows, queries, accept_all) >= 0.9);
+    CHECK(recall(index, metric, rows, queries, accept_odd) >= 0.9);
+
+    first_candidates = index.search(queries[0].data(), probes, n_candidates,
+      accept_all);
+
+    // A model trained aside leaves the index as it is until it's installed,
+    // which drops the codes.
+    std::vector<float> points;
+    for (size_t row = 0; row < n_rows / 2; row++)
+      points.insert(points.end(), rows[row].begin(), rows[row].end());
+    IvfPqIndex::model trained = index.train_model(std::move(points),
+      dimension, n_lists, code_size);
+    CHECK(index.encoded_count() == n_rows);
+    CHECK(index.search(queries[0].data(), probes, n_candidates, accept_all) ==
+      first_candidates);
+
+    index.install(std::move(trained));
+    CHECK(index.trained() && index.encoded_count() == 0);
+    for (uint32_t row = 0; row < n_rows; row++)
+      index.add(row, rows[row].data());
+    CHECK(index.search(queries[0].data(), probes, n_candidates, accept_all) ==
+      first_candidates);
+  }
+
+  // The model and the codes are read back from their files.
+  IvfPqIndex index(directory.path(), metric);
+  CHECK(index.trained());
+  CHECK(index.encoded_count() == n_rows);
+  CHECK(index.search(queries[0].data(), probes, n_candidates, accept_all) ==
+    first_candidates);
+}
+
+
+int main()
+{
+  test_metric(Metric::l2, "IvfPqIndexTest-l2");
+  test_metric(Metric::inner_product, "IvfPqIndexTest-ip");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "common.h"
+#include "LibreOfficePool.h"
+#include "OpenDocProcessor.h"
+#include "TextChunker.h"
+
+
+namespace filesystem = std::filesystem;
+
+static const char soffice_path[] = LIBREOFFICE_PROGRAM_DIR "/soffice";
+
+// Large enough for an office loading a small document.
+static const size_t max_memory_kb = 4 * 1024 * 1024;
+
+
+static void write_file(const std::string& file_path, const std::string& data)
+{
+  std::ofstream file(file_path, std::ios::binary);
+  file << data;
+  CHECK(file.flush());
+}
+
+
+/*
+A launcher that exits at once fails each lease asked for, which leaves the
+pool usable.
+*/
+static void test_exiting_office(const TestDirectory& directory)
+{
+  std::string script_path = directory.path() / "exiting-soffice";
+  write_file(script_path, "#!/bin/sh\nexit 1\n");
+  CHECK(chmod(script_path.c_str(), 0755) == 0);
+
+  LibreOfficePool::settings pool_settings{script_path, 1, 10, max_memory_kb,
+    std::chrono::seconds(60)};
+  LibreOfficePool office_pool(pool_settings);
+
+  for (size_t round = 0; round < 2; round++)
+  {
+    bool start_fails = false;
+    try
+    {
+      LibreOfficePool::lease office = office_pool.acquire();
+    }
+    catch (const std::runtime_error&)
+    {
+      start_fails = true;
+    }
+    CHECK(start_fails);
+  }
+}
+
+
+/*
+Documents loaded into a process replaced after every 2 of them, with its
+profile under a path that must be escaped in a URL. A document the office
+can't load is skipped, and the next one loaded.
+*/
+static void test_documents(const TestDirectory& directory,
+  const filesystem::path& temp_dir)
+{
+  std::string file_path = directory.path() / "document.txt";
+  write_file(file_path, "Title\nSecond paragraph");
+
+  LibreOfficePool::settings pool_settings{soffice_path, 1, 2, max_memory_kb,
+    std::chrono::seconds(60)};
+  LibreOfficePool office_pool(pool_settings);
+
+  std::vector<std::string> texts;
+  OpenDocProcessor processor(office_pool, TextChunker::limits(),
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+
+  for (size_t round = 0; round < 3; round++)
+  {
+    texts.clear();
+    processor.process_file(file_path.c_str());
+    CHECK(texts == std::vector<std::string>({"Title\nSecond paragraph\n"}));
+  }
+
+  // The profile is where it was asked for, among the temporary files of the
+  // office.
+  size_t n_profiles = 0;
+  for (const filesystem::directory_entry& entry :
+    filesystem::directory_iterator(temp_dir))
+  {
+    if (entry.path().filename().string().rfind("embeddings-db-office-", 0)
+      != 0)
+      continue;
+
+    CHECK(filesystem::is_directory(entry.path() / "0" / "user"));
+    n_profiles++;
+  }
+  CHECK(n_profiles == 1);
+
+  std::string missing_path = directory.path() / "missing.odt";
+  bool missing_fails = false;
+  try
+  {
+    processor.process_file(missing_path.c_str());
+  }
+  catch (const FileProcessor::file_error&)
+  {
+    missing_fails = true;
+  }
+  CHECK(missing_fails);
+
+  texts.clear();
+  processor.process_file(file_path.c_str());
+  CHECK(texts.size() == 1);
+}
+
+
+/*
+A process busy for longer than the timeout, or using more memory than the
+limit, is killed by the watchdog, and replaced for the next lease.
+*/
+static void test_watchdog()
+{
+  LibreOfficePool::settings pool_settings{soffice_path, 1, 10, max_memory_kb,
+    std::chrono::seconds(1)};
+
+  {
+    LibreOfficePool office_pool(pool_settings);
+    {
+      LibreOfficePool::lease office = office_pool.acquire();
+      std::this_thread::sleep_for(std::chrono::seconds(3));
+      CHECK(office.timed_out() && !office.over_memory());
+    }
+
+    LibreOfficePool::lease office = office_pool.acquire();
+    CHECK(!office.timed_out() && office.component_loader().is());
+  }
+
+  pool_settings.max_memory_kb = 1;
+  pool_settings.timeout = std::chrono::seconds(60);
+  LibreOfficePool office_pool(pool_settings);
+  LibreOfficePool::lease office = office_pool.acquire();
+  for (size_t idx = 0; idx < 100 && !office.over_memory(); idx++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK(office.over_memory() && !office.timed_out());
+}
+
+
+int main()
+{
+  // UNO is bootstrapped from the office installation.
+  if (access(soffice_path, X_OK) != 0)
+  {
+    std::cerr << "No " << soffice_path << ", the pool isn't tested.\n";
+    return EXIT_SUCCESS;
+  }
+
+  TestDirectory directory("LibreOfficePoolTest");
+
+  // The directory of the profiles is made there.
+  filesystem::path temp_dir = directory.path() / "temp dir #1%";
+  filesystem::create_directory(temp_dir);
+  CHECK(setenv("TMPDIR", temp_dir.c_str(), 1) == 0);
+
+  test_exiting_office(directory);
+  test_documents(directory, temp_dir);
+  test_watchdog();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "common.h"
+#include "LocalRecordStore.h"
+
+
+namespace filesystem = std::filesystem;
+
+
+static FileRecord make_record(const std::string& file_path,
+  const std::vector<std::string>& texts, bool replaces_previous)
+{
+  std::vector<TextUnit> units(texts.size());
+  for (size_t idx = 0; idx < texts.size(); idx++)
+    units[idx].text(texts[idx]);
+
+  FileRecord record;
+  record.file_path(file_path);
+  record.file_size(100 * texts.size());
+  record.mtime(texts.size());
+  record.replaces_previous(replaces_previous);
+  record.text_units(std::move(units));
+  return record;
+}
+
+
+static std::string read_file(const filesystem::path& file_path)
+{
+  std::ifstream file(file_path, std::ios::binary);
+  std::ostringstream data;
+  data << file.rdbuf();
+  return data.str();
+}
+
+
+static void write_file(const filesystem::path& file_path,
+  const std::string& data)
+{
+  std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+  file << data;
+  CHECK(file.flush());
+}
+
+
+// Texts of the live units of the store, in the order of their IDs.
+static std::vector<std::string> live_texts(const LocalRecordStore& store)
+{
+  std::vector<std::string> texts;
+  for (uint64_t unit_id = 0; unit_id < store.unit_count(); unit_id++)
+  {
+    if (store.is_live(unit_id))
+      texts.push_back(store.result(unit_id, 0).unit.text());
+  }
+  return texts;
+}
+
+
+static void test_replace(const filesystem::path& directory)
+{
+  {
+    LocalRecordStore store(directory);
+    FileRecord first = make_record("/docs/a.html", {"a1", "a2"}, false);
+    CHECK(store.add(first) == 0);
+    FileRecord other = make_record("/docs/b.html", {"b1"}, false);
+    CHECK(store.add(other) == 2);
+    FileRecord second = make_record("/docs/a.html", {"a3"}, true);
+    CHECK(store.add(second) == 3);
+    CHECK(second.text_units()[0].id() == 3);
+
+    CHECK(live_texts(store) == std::vector<std::string>({"b1", "a3"}));
+    CHECK(store.get_file_records().size() == 2);
+  }
+
+  // The same once loaded from disk.
+  LocalRecordStore store(directory);
+  CHECK(store.unit_count() == 4);
+  CHECK(live_texts(store) == std::vector<std::string>({"b1", "a3"}));
+
+  std::vector<FileRecord> records = store.get_file_records();
+  CHECK(records.size() == 2);
+  for (const FileRecord& record : records)
+  {
+    CHECK(record.file_path() == "/docs/b.html" ||
+      (record.file_path() == "/docs/a.html" && record.mtime() == 1));
+  }
+
+  TextUnitResult result = store.result(3, 0.5f);
+  CHECK(result.distance == 0.5f);
+  CHECK(result.unit.file_record()->file_path() == "/docs/a.html");
+}
+
+
+/*
+A replacement cut short by a crash, at every byte of its operation, leaves
+the record it replaces.
+*/
+static void test_cut_replace(const filesystem::path& directory)
+{
+  filesystem::path files_path = directory / "files.dat";
+  size_t before_size;
+
+  {
+    LocalRecordStore store(directory);
+    FileRecord first = make_record("/docs/a.html", {"a1", "a2"}, false);
+    store.add(first);
+    before_size = filesystem::file_size(files_path);
+
+    FileRecord second = make_record("/docs/a.html", {"a3"}, true);
+    store.add(second);
+  }
+
+  std::string files_data = read_file(files_path);
+  for (size_t size = before_size; size < files_data.size(); size++)
+  {
+    // Opening the store drops the cut operation, so the file is written
+    // again each time.
+    write_file(files_path, files_data.substr(0, size));
+
+    LocalRecordStore store(directory);
+    CHECK(live_texts(store) == std::vector<std::string>({"a1", "a2"}));
+    std::vector<FileRecord> records = store.get_file_records();
+    CHECK(records.size() == 1 && records[0].mtime() == 2);
+  }
+
+  // Units without a record are dropped, and the file saved again.
+  LocalRecordStore store(directory);
+  store.truncate_units(2);
+  FileRecord second = make_record("/docs/a.html", {"a4"}, true);
+  CHECK(store.add(second) == 2);
+  CHECK(live_texts(store) == std::vector<std::string>({"a4"}));
+}
+
+
+static std::vector<TextUnit> make_units(const std::vector<std::string>& texts)
+{
+  std::vector<TextUnit> units(texts.size());
+  for (size_t idx = 0; idx < texts.size(); idx++)
+    units[idx].text(texts[idx]);
+  return units;
+}
+
+
+/*
+Units added ahead of their record, between the units of another one, are
+live only once the record is saved, and replaced with it.
+*/
+static void test_parts(const filesystem::path& directory)
+{
+  {
+    LocalRecordStore store(directory);
+    CHECK(store.add_units(make_units({"p1", "p2"})) == 0);
+    FileRecord other = make_record("/docs/b.html", {"b1"}, false);
+    CHECK(store.add(other) == 2);
+    CHECK(store.add_units(make_units({"p3"})) == 3);
+    CHECK(live_texts(store) == std::vector<std::string>({"b1"}));
+
+    FileRecord record = make_record("/docs/a.html", {}, false);
+    store.add_parts(record, {{0, 2}, {3, 1}});
+    CHECK(live_texts(store) ==
+      std::vector<std::string>({"p1", "p2", "b1", "p3"}));
+    CHECK(store.result(3, 0).unit.file_record()->file_path() ==
+      "/docs/a.html");
+
+    // Units that never get a record, like those of a failed file.
+    store.add_units(make_units({"lost"}));
+  }
+
+  {
+    LocalRecordStore store(directory);
+    CHECK(live_texts(store) ==
+      std::vector<std::string>({"p1", "p2", "b1", "p3"}));
+    CHECK(store.result(1, 0).unit.file_record()->file_path() ==
+      "/docs/a.html");
+
+    uint64_t first_unit = store.add_units(make_units({"p4"}));
+    FileRecord record = make_record("/docs/a.html", {}, true);
+    store.add_parts(record, {{first_unit, 1}});
+    CHECK(live_texts(store) == std::vector<std::string>({"b1", "p4"}));
+  }
+
+  // Saved in the format of a single run of units.
+  LocalRecordStore store(directory);
+  CHECK(live_texts(store) == std::vector<std::string>({"b1", "p4"}));
+  CHECK(store.get_file_records().size() == 2);
+  CHECK(store.result(5, 0).unit.file_record()->file_path() == "/docs/a.html");
+}
+
+
+static void test_update_mtime(const filesystem::path& directory)
+{
+  {
+    LocalRecordStore store(directory);
+    FileRecord record = make_record("/docs/c.html", {"c1"}, false);
+    store.add(record);
+    store.update_mtime("/docs/c.html", 42);
+    store.update_mtime("/docs/missing.html", 43);
+  }
+
+  LocalRecordStore store(directory);
+  std::vector<FileRecord> records = store.get_file_records();
+  CHECK(records.size() == 1 && records[0].mtime() == 42);
+}
+
+
+int main()
+{
+  TestDirectory directory("LocalRecordStoreTest");
+  test_replace(directory.path() / "replace");
+  test_cut_replace(directory.path() / "cut");
+  test_parts(directory.path() / "parts");
+  test_update_mtime(directory.path() / "mtime");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <libxml/parser.h>
+
+#include "check.h"
+#include "common.h"
+#include "LibreOfficePool.h"
+#include "OfficeXmlProcessor.h"
+#include "TextChunker.h"
+#include "ZipWriter.h"
+
+
+static const char odt_content[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<office:document-content"
+  " xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\""
+  " xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\""
+  " xmlns:table=\"urn:oasis:names:tc:opendocument:xmlns:table:1.0\""
+  " xmlns:draw=\"urn:oasis:names:tc:opendocument:xmlns:drawing:1.0\">\n"
+  "<office:automatic-styles><text:p>Not in the body</text:p>"
+  "</office:automatic-styles>\n"
+  "<office:body>\n"
+  "<office:text>\n"
+  "  <text:h text:outline-level=\"1\">Title</text:h>\n"
+  "  <text:p>  First \n  paragraph<text:s text:c=\"3\"/>spaced<text:tab/>"
+  "tabbed<text:line-break/>broken</text:p>\n"
+  "  <table:table><table:table-row><table:table-cell>"
+  "<text:p>In a table</text:p></table:table-cell></table:table-row>"
+  "</table:table>\n"
+  "  <text:p>Note<text:note><text:note-body><text:p>In a note</text:p>"
+  "</text:note-body></text:note> after<draw:frame><draw:text-box>"
+  "<text:p>In a frame</text:p></draw:text-box></draw:frame></text:p>\n"
+  "  <text:p><office:annotation><text:p>Comment</text:p>"
+  "</office:annotation>Caf\xc3\xa9 &amp; &lt;tags&gt;</text:p>\n"
+  "  <text:h text:outline-level=\"2\">Section</text:h>\n"
+  "  <text:p>Second</text:p>\n"
+  "  <text:p/>\n"
+  "  <text:h>Other title</text:h>\n"
+  "  <text:p><text:span>Third</text:span></text:p>\n"
+  "</office:text>\n"
+  "</office:body>\n"
+  "</office:document-content>\n";
+
+static const char docx_styles[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+  "<w:styles xmlns:w="
+  "\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\">\n"
+  "<w:style w:type=\"paragraph\" w:styleId=\"Heading1\">"
+  "<w:name w:val=\"heading 1\"/></w:style>\n"
+  "<w:style w:type=\"paragraph\" w:styleId=\"Chapter\">"
+  "<w:name w:val=\"Chapter\"/><w:basedOn w:val=\"Heading1\"/></w:style>\n"
+  "<w:style w:type=\"paragraph\" w:styleId=\"Heading2\">"
+  "<w:name w:val=\"heading 2\"/><w:basedOn w:val=\"Heading1\"/>"
+  "<w:pPr><w:outlineLvl w:val=\"1\"/></w:pPr></w:style>\n"
+  "</w:styles>\n";
+
+static const char docx_document[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+  "<w:document"
+  " xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\""
+  " xmlns:mc="
+  "\"http://schemas.openxmlformats.org/markup-compatibility/2006\">\n"
+  "<w:body>\n"
+  "<w:p><w:pPr><w:pStyle w:val=\"Heading1\"/></w:pPr>"
+  "<w:r><w:t>Title</w:t></w:r></w:p>\n"
+  "<w:p><w:pPr><w:tabs><w:tab w:val=\"left\" w:pos=\"720\"/></w:tabs>"
+  "</w:pPr><w:r><w:t xml:space=\"preserve\">  First </w:t></w:r>"
+  "<w:r><w:t>run</w:t><w:tab/><w:t>tabbed</w:t><w:br/><w:t>broken</w:t>"
+  "<w:br w:type=\"page\"/><w:t>same</w:t><w:noBreakHyphen/><w:t>line</w:t>"
+  "</w:r><w:r><w:instrText>PAGE</w:instrText></w:r></w:p>\n"
+  "<w:tbl><w:tr><w:tc><w:p><w:r><w:t>In a table</w:t></w:r></w:p></w:tc>"
+  "</w:tr></w:tbl>\n"
+  "<w:p><w:r><mc:AlternateContent><mc:Choice Requires=\"wps\">"
+  "<w:t>Chosen</w:t></mc:Choice><mc:Fallback><w:t>Fallback</w:t>"
+  "</mc:Fallback></mc:AlternateContent></w:r></w:p>\n"
+  "<w:p><w:r><w:txbxContent><w:p><w:r><w:t>In a text box</w:t></w:r></w:p>"
+  "</w:txbxContent><w:t>After the box</w:t></w:r></w:p>\n"
+  "<w:p><w:pPr><w:pStyle w:val=\"Heading2\"/></w:pPr>"
+  "<w:r><w:t>Section</w:t></w:r></w:p>\n"
+  "<w:p><w:pPr><w:pStyle w:val=\"Chapter\"/></w:pPr>"
+  "<w:r><w:t>Chapter</w:t></w:r></w:p>\n"
+  "<w:p><w:r><w:t>Body</w:t></w:r></w:p>\n"
+  "<w:p><w:pPr><w:outlineLvl w:val=\"0\"/></w:pPr>"
+  "<w:r><w:t>Direct</w:t></w:r></w:p>\n"
+  "<w:p><w:pPr><w:pStyle w:val=\"Heading1\"/><w:outlineLvl w:val=\"2\"/>"
+  "</w:pPr><w:r><w:t>Not a title</w:t></w:r></w:p>\n"
+  "<w:sectPr/>\n"
+  "</w:body>\n"
+  "</w:document>\n";
+
+
+/*
+Texts of the units the processor gives for the file, which it reads without
+the office.
+*/
+static std::vector<std::string> extract(const std::string& file_path,
+  const TextChunker::limits& limits = TextChunker::limits())
+{
+  LibreOfficePool::settings pool_settings{"soffice", 1, 0, 0,
+    std::chrono::seconds(60)};
+  LibreOfficePool office_pool(pool_settings);
+
+  std::vector<std::string> texts;
+  OfficeXmlProcessor processor(office_pool, limits,
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+  processor.process_file(file_path.c_str());
+  return texts;
+}
+
+
+// content.xml of an ODT document whose body is text.
+static std::string make_odt_content(const std::string& text)
+{
+  return std::string(
+    "<office:document-content"
+    " xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\""
+    " xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\">"
+    "<office:body><office:text>") + text +
+    "</office:text></office:body></office:document-content>";
+}
+
+
+static void test_odt(const TestDirectory& directory)
+{
+  std::string file_path = directory.path() / "document.odt";
+  ZipWriter writer;
+  writer.add("mimetype", "application/vnd.oasis.opendocument.text", false);
+  writer.add("content.xml", odt_content, true);
+  writer.write(file_path);
+
+  std::vector<std::string> texts = extract(file_path);
+  CHECK(texts.size() == 2);
+  CHECK(texts[0] ==
+    "Title\n"
+    "First paragraph   spaced\ttabbed\nbroken\n"
+    "Note after\n"
+    "Caf\xc3\xa9 & <tags>\n"
+    "Section\n"
+    "Second\n"
+    "\n");
+  CHECK(texts[1] == "Other title\nThird\n");
+}
+
+
+static void test_docx(const TestDirectory& directory)
+{
+  std::string file_path = directory.path() / "document.docx";
+  ZipWriter writer;
+  writer.add("[Content_Types].xml", "<Types/>", true);
+  writer.add("word/styles.xml", docx_styles, true);
+  writer.add("word/document.xml", docx_document, true);
+  writer.write(file_path);
+
+  std::vector<std::string> texts = extract(file_path);
+  CHECK(texts.size() == 3);
+  CHECK(texts[0] ==
+    "Title\n"
+    "  First run\ttabbed\nbrokensame-line\n"
+    "Chosen\n"
+    "After the box\n"
+    "Section\n");
+  CHECK(texts[1] == "Chapter\nBody\n");
+  CHECK(texts[2] == "Direct\nNot a title\n");
+}
+
+
+static void test_limits(const TestDirectory& directory)
+{
+  std::string text;
+  for (size_t idx = 0; idx < 200; idx++)
+    text += "<text:p>Paragraph number " + std::to_string(idx) + "</text:p>";
+
+  std::string file_path = directory.path() / "long.odt";
+  ZipWriter writer;
+  writer.add("content.xml", make_odt_content(text), true);
+  writer.write(file_path);
+
+  TextChunker::limits limits;
+  limits.max_size = 500;
+  std::vector<std::string> texts = extract(file_path, limits);
+  CHECK(texts.size() > 1);
+  for (const std::string& unit_text : texts)
+    CHECK(unit_text.size() <= limits.max_size);
+  CHECK(texts.front().compare(0, 19, "Paragraph number 0\n") == 0);
+  CHECK(texts.back().find("Paragraph number 199\n") != std::string::npos);
+}
+
+
+/*
+The units of a document with more text than the processor holds back are
+emitted as they are cut, so it fails instead of going to the office when
+it's broken past them.
+*/
+static void test_large(const TestDirectory& directory)
+{
+  std::string text;
+  size_t n_paragraphs = 0;
+  for (; text.size() < 8 * 1024 * 1024; n_paragraphs++)
+  {
+    text += "<text:p>Paragraph number " + std::to_string(n_paragraphs) +
+      "</text:p>";
+  }
+
+  std::string file_path = directory.path() / "large.odt";
+  ZipWriter writer;
+  writer.add("content.xml", make_odt_content(text), true);
+  writer.write(file_path);
+
+  TextChunker::limits limits;
+  limits.max_size = 1000;
+  std::string all_text;
+  for (const std::string& unit_text : extract(file_path, limits))
+    all_text += unit_text;
+  CHECK(all_text.compare(0, 19, "Paragraph number 0\n") == 0);
+  CHECK(all_text.find("Paragraph number " + std::to_string(n_paragraphs - 1)
+    + "\n") != std::string::npos);
+
+  file_path = directory.path() / "broken.odt";
+  ZipWriter broken_writer;
+  broken_writer.add("content.xml", make_odt_content(text + "</text:h>"),
+    true);
+  broken_writer.write(file_path);
+
+  LibreOfficePool::settings pool_settings{"soffice", 1, 0, 0,
+    std::chrono::seconds(60)};
+  LibreOfficePool office_pool(pool_settings);
+  size_t n_units = 0;
+  OfficeXmlProcessor processor(office_pool, limits,
+    [&n_units](TextUnit&&) { n_units++; });
+
+  bool broken_fails = false;
+  try
+  {
+    processor.process_file(file_path.c_str());
+  }
+  catch (const FileProcessor::file_error&)
+  {
+    broken_fails = true;
+  }
+  CHECK(broken_fails);
+  CHECK(n_units > 0);
+}
+
+
+int main()
+{
+  xmlInitParser();
+
+  TestDirectory directory("OfficeXmlProcessorTest");
+  test_odt(directory);
+  test_docx(directory);
+  test_limits(directory);
+  test_large(directory);
+  return EXIT_SUCCESS;
+}
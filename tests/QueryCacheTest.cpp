@@ -0,0 +1,144 @@
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "common.h"
+#include "QueryCache.h"
+
+
+namespace filesystem = std::filesystem;
+
+// Bytes an entry of model "m", a two-byte query and a 4-float embedding
+// counts for.
+static const size_t small_entry_bytes = 4 + 4 * sizeof(float) + 128;
+
+
+static Embedding make_embedding(float value)
+{
+  return Embedding(std::vector<float>(4, value));
+}
+
+
+static bool has_entry(QueryCache& cache, const std::string& query,
+  float value)
+{
+  std::vector<float> embedding;
+  return cache.get("m", query, embedding) &&
+    embedding == std::vector<float>(4, value);
+}
+
+
+static void test_normalize()
+{
+  CHECK(QueryCache::normalize("  two\t words \n") == "two words");
+  CHECK(QueryCache::normalize("a \r\n\t b  c") == "a b c");
+  CHECK(QueryCache::normalize(" \t ").empty());
+
+  // Queries typed differently share an entry, but not across models.
+  QueryCache cache("", 1 << 20);
+  cache.put("m", " some  query", make_embedding(1));
+  std::vector<float> embedding;
+  CHECK(cache.get("m", "some query\n", embedding));
+  CHECK(!cache.get("other", "some query", embedding));
+  CHECK(!cache.get("m", "somequery", embedding));
+}
+
+
+static void test_eviction()
+{
+  QueryCache cache("", 3 * small_entry_bytes);
+  cache.put("m", "q1", make_embedding(1));
+  cache.put("m", "q2", make_embedding(2));
+  cache.put("m", "q3", make_embedding(3));
+
+  // Used, so q2 is now the least recently used.
+  CHECK(has_entry(cache, "q1", 1));
+
+  cache.put("m", "q4", make_embedding(4));
+  CHECK(!has_entry(cache, "q2", 2));
+  CHECK(has_entry(cache, "q1", 1));
+  CHECK(has_entry(cache, "q3", 3));
+  CHECK(has_entry(cache, "q4", 4));
+
+  // Putting a query again replaces its entry.
+  cache.put("m", "q3", make_embedding(5));
+  CHECK(has_entry(cache, "q3", 5));
+  CHECK(cache.hits() == 5 && cache.misses() == 1);
+}
+
+
+static void test_save_load(const filesystem::path& directory)
+{
+  filesystem::path file_path = directory / "queries.cache";
+
+  {
+    QueryCache cache(file_path, 1 << 20);
+
+    // Nothing to save, so no file is written.
+    cache.save();
+    CHECK(!filesystem::exists(file_path));
+
+    cache.put("m", "q1", make_embedding(1));
+    cache.put("m", "q2", make_embedding(2));
+    CHECK(cache.unsaved());
+    cache.save();
+    CHECK(!cache.unsaved());
+  }
+
+  // The order of use is kept, so q1 is evicted first.
+  QueryCache cache(file_path, 2 * small_entry_bytes);
+  CHECK(has_entry(cache, "q2", 2));
+  cache.put("m", "q3", make_embedding(3));
+  CHECK(!has_entry(cache, "q1", 1));
+  CHECK(has_entry(cache, "q2", 2));
+  CHECK(cache.unsaved());
+}
+
+
+/*
+Two processes saving in turn keep each other's entries, their own coming
+first when they don't all fit.
+*/
+static void test_merge(const filesystem::path& directory)
+{
+  filesystem::path file_path = directory / "merged.cache";
+
+  QueryCache first(file_path, 1 << 20);
+  QueryCache second(file_path, 3 * small_entry_bytes);
+
+  first.put("m", "a1", make_embedding(1));
+  first.put("m", "a2", make_embedding(2));
+  second.put("m", "b1", make_embedding(3));
+  second.put("m", "a2", make_embedding(4));
+  first.save();
+  second.save();
+
+  // The second has all of its own entries, then the most recent of the
+  // first.
+  QueryCache reopened(file_path, 1 << 20);
+  CHECK(has_entry(reopened, "b1", 3));
+  CHECK(has_entry(reopened, "a2", 4));
+  CHECK(has_entry(reopened, "a1", 1));
+
+  // The entries merged are used as the process' own, so b1 is now the
+  // least recently used and makes room for b2, even in the file.
+  CHECK(has_entry(second, "a1", 1));
+  second.put("m", "b2", make_embedding(5));
+  second.save();
+  QueryCache last(file_path, 1 << 20);
+  CHECK(has_entry(last, "b2", 5));
+  CHECK(has_entry(last, "a1", 1));
+  CHECK(!has_entry(last, "b1", 3));
+}
+
+
+int main()
+{
+  TestDirectory directory("QueryCacheTest");
+  test_normalize();
+  test_eviction();
+  test_save_load(directory.path());
+  test_merge(directory.path());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "common.h"
+#include "TextChunker.h"
+
+
+/*
+Texts of the units the chunker cuts from text, appended a piece at a time
+as by the processors, then ended.
+*/
+static std::vector<std::string> chunk(const std::string& text,
+  size_t max_size, size_t overlap = 0, size_t piece_size = 7)
+{
+  std::vector<std::string> texts;
+  TextChunker::limits limits;
+  limits.max_size = max_size;
+  limits.overlap = overlap;
+  TextChunker chunker(limits,
+    [&texts](TextUnit&& unit) { texts.push_back(unit.text()); });
+
+  for (size_t pos = 0; pos < text.size(); pos += piece_size)
+    chunker.append(text.substr(pos, piece_size));
+  chunker.end_unit();
+  return texts;
+}
+
+
+static void test_cuts()
+{
+  // After a paragraph, before a sentence and a blank further on.
+  std::vector<std::string> units = chunk("aaaaaaaaaaa\nb. cc dd ee", 20);
+  CHECK(units == std::vector<std::string>({"aaaaaaaaaaa\n", "b. cc dd ee"}));
+
+  // After a sentence, before a blank further on.
+  units = chunk("aaaaaaaaaaaa. bb cc dd ee", 20);
+  CHECK(units == std::vector<std::string>({"aaaaaaaaaaaa. ", "bb cc dd ee"}));
+
+  // After the last blank.
+  units = chunk("aaaaaaaaaaaa bb cc dd ee", 20);
+  CHECK(units == std::vector<std::string>({"aaaaaaaaaaaa bb cc ", "dd ee"}));
+
+  // A paragraph in the first half of the limit would make a short unit.
+  units = chunk("aaaa\nbbbbbbbbbbbb cccccc", 20);
+  CHECK(units == std::vector<std::string>({"aaaa\nbbbbbbbbbbbb ", "cccccc"}));
+
+  // At the limit, without a blank.
+  units = chunk(std::string(30, 'a'), 20);
+  CHECK(units == std::vector<std::string>(
+    {std::string(20, 'a'), std::string(10, 'a')}));
+
+  // Before a multi-byte character across the limit.
+  units = chunk(std::string(19, 'a') + "\xc3\xa9" + "bbb", 20);
+  CHECK(units == std::vector<std::string>(
+    {std::string(19, 'a'), "\xc3\xa9" "bbb"}));
+
+  // Ended by the document, without a limit.
+  units = chunk("First unit. With words\nand lines", 0);
+  CHECK(units == std::vector<std::string>(
+    {"First unit. With words\nand lines"}));
+}
+
+
+static void test_overlap()
+{
+  std::string text;
+  for (size_t idx = 0; idx < 100; idx++)
+    text += "w" + std::to_string(idx % 10) + std::to_string(idx / 10) + " ";
+
+  const size_t max_size = 20, overlap = 6;
+  std::vector<std::string> units = chunk(text, max_size, overlap);
+  CHECK(units.size() > text.size() / max_size);
+
+  // Each unit starts with whole words ending the previous one, at most the
+  // overlap, then the text that follows them.
+  std::string joined = units[0];
+  for (size_t idx = 1; idx < units.size(); idx++)
+  {
+    const std::string& prev = units[idx - 1];
+    const std::string& unit = units[idx];
+    CHECK(unit.size() <= max_size);
+
+    size_t repeated = 0;
+    for (size_t size = 1; size <= overlap; size++)
+    {
+      if (prev.compare(prev.size() - size, size, unit, 0, size) == 0 &&
+        prev[prev.size() - size - 1] == ' ')
+        repeated = size;
+    }
+    CHECK(repeated > 0 && unit.size() > repeated);
+    joined += unit.substr(repeated);
+  }
+  CHECK(joined == text);
+}
+
+
+/*
+Bytes that aren't valid UTF-8 are cut at the limit, with no overlap to
+start on, so no unit repeats the previous one with a byte more.
+*/
+static void test_invalid_utf8()
+{
+  std::string text = "abc " + std::string(100, '\x80');
+  std::vector<std::string> units = chunk(text, 20, 6);
+
+  std::vector<std::string> expected({"abc " + std::string(16, '\x80')});
+  for (size_t idx = 0; idx < 4; idx++)
+    expected.push_back(std::string(20, '\x80'));
+  expected.push_back(std::string(4, '\x80'));
+  CHECK(units == expected);
+}
+
+
+int main()
+{
+  test_cuts();
+  test_overlap();
+  test_invalid_utf8();
+  return EXIT_SUCCESS;
+}
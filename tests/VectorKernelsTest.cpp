@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "VectorKernels.h"
+
+
+static bool in_base64_alphabet(int c)
+{
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+    (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+
+/*
+Decodes base64 without padding with the decoder picked for the CPU and the
+scalar one, which must agree, and returns whether it's valid. The bytes
+after the decoded ones must be left alone.
+*/
+static bool decode_both(const std::string& base64, std::vector<uint8_t>& out)
+{
+  size_t size = base64.size() * 3 / 4;
+  std::vector<uint8_t> expected(size + 32, 0xa5);
+  std::vector<uint8_t> actual(size + 32, 0xa5);
+
+  bool expected_valid = decode_base64_scalar(base64.data(), base64.size(),
+    expected.data());
+  bool valid = get_base64_decode_func()(base64.data(), base64.size(),
+    actual.data());
+  CHECK(valid == expected_valid);
+
+  for (size_t idx = size; idx < actual.size(); idx++)
+    CHECK(actual[idx] == 0xa5 && expected[idx] == 0xa5);
+  if (valid)
+    CHECK(std::equal(actual.begin(), actual.begin() + size, expected.begin()));
+
+  out.assign(actual.begin(), actual.begin() + size);
+  return valid;
+}
+
+
+static void test_base64()
+{
+  std::vector<uint8_t> decoded;
+  CHECK(decode_both("", decoded) && decoded.empty());
+  CHECK(decode_both("TWFu", decoded) &&
+    decoded == std::vector<uint8_t>({'M', 'a', 'n'}));
+  CHECK(decode_both("TWE", decoded) &&
+    decoded == std::vector<uint8_t>({'M', 'a'}));
+  CHECK(decode_both("TQ", decoded) && decoded == std::vector<uint8_t>({'M'}));
+  CHECK(!decode_both("T", decoded));
+  CHECK(!decode_both("TWFuT", decoded));
+
+  // Every length, so each block size and tail is covered.
+  std::mt19937 rng(42);
+  for (size_t size = 0; size <= 300; size++)
+  {
+    std::vector<uint8_t> bytes(size);
+    for (uint8_t& byte : bytes)
+      byte = rng();
+
+    std::string base64 = encode_base64(bytes.data(), size, false);
+    CHECK(decode_both(base64, decoded));
+    CHECK(decoded == bytes);
+  }
+
+  // Every character outside the alphabet, in a block or in the tail.
+  std::vector<uint8_t> bytes(150);
+  for (uint8_t& byte : bytes)
+    byte = rng();
+  std::string base64 = encode_base64(bytes.data(), bytes.size(), false);
+  for (size_t pos : {0, 1, 17, 31, 32, 45, 63, 64, 100, 150, 199})
+  {
+    for (int c = 0; c < 256; c++)
+    {
+      if (in_base64_alphabet(c))
+        continue;
+      std::string invalid = base64;
+      invalid[pos] = static_cast<char>(c);
+      CHECK(!decode_both(invalid, decoded));
+    }
+  }
+}
+
+
+static float float_from_bits(uint32_t bits)
+{
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+
+static bool is_half_nan(uint16_t half)
+{
+  return (half & 0x7c00) == 0x7c00 && (half & 0x3ff) != 0;
+}
+
+
+/*
+Checks the encoder picked for the CPU against the scalar one on values of
+every length up to a few vectors, so each tail is covered. NaNs only have to
+stay NaNs of the same sign, as the hardware keeps more of their payload.
+*/
+static void check_half_encoder(const std::vector<float>& values)
+{
+  HalfEncodeFunc encode_half = get_half_encode_func();
+
+  for (size_t n = 0; n <= values.size(); n++)
+  {
+    std::vector<uint16_t> expected(n);
+    std::vector<uint16_t> actual(n);
+    encode_half_scalar(values.data(), n, expected.data());
+    encode_half(values.data(), n, actual.data());
+
+    for (size_t idx = 0; idx < n; idx++)
+    {
+      if (is_half_nan(expected[idx]))
+      {
+        CHECK(is_half_nan(actual[idx]));
+        CHECK((actual[idx] & 0x8000) == (expected[idx] & 0x8000));
+      }
+      else
+      {
+        CHECK(actual[idx] == expected[idx]);
+      }
+    }
+  }
+}
+
+
+static uint16_t encode_one(float value)
+{
+  uint16_t half;
+  encode_half_scalar(&value, 1, &half);
+  return half;
+}
+
+
+static void test_half_scalar()
+{
+  CHECK(encode_one(0.0f) == 0x0000);
+  CHECK(encode_one(-0.0f) == 0x8000);
+  CHECK(encode_one(1.0f) == 0x3c00);
+  CHECK(encode_one(-2.0f) == 0xc000);
+  CHECK(encode_one(0.333333343f) == 0x3555);
+  CHECK(encode_one(65504.0f) == 0x7bff);
+  // Halfway to the next half, which is infinity.
+  CHECK(encode_one(65520.0f) == 0x7c00);
+  CHECK(encode_one(65519.99f) == 0x7bff);
+  CHECK(encode_one(1e10f) == 0x7c00);
+  CHECK(encode_one(-std::numeric_limits<float>::infinity()) == 0xfc00);
+  CHECK(is_half_nan(encode_one(std::numeric_limits<float>::quiet_NaN())));
+  CHECK(is_half_nan(encode_one(
+    std::numeric_limits<float>::signaling_NaN())));
+
+  // Ties round to even.
+  CHECK(encode_one(1.0f + std::ldexp(1.0f, -11)) == 0x3c00);
+  CHECK(encode_one(1.0f + 3 * std::ldexp(1.0f, -11)) == 0x3c02);
+  CHECK(encode_one(2047.5f) == 0x6800);
+  CHECK(encode_one(2048.0f + 1) == 0x6800);
+  CHECK(encode_one(2048.0f + 3) == 0x6802);
+
+  // Smallest normal, then subnormals down to half of the smallest one.
+  CHECK(encode_one(std::ldexp(1.0f, -14)) == 0x0400);
+  CHECK(encode_one(std::ldexp(1.0f, -15)) == 0x0200);
+  CHECK(encode_one(std::ldexp(1.0f, -24)) == 0x0001);
+  CHECK(encode_one(std::ldexp(1.5f, -24)) == 0x0002);
+  CHECK(encode_one(std::ldexp(1.0f, -25)) == 0x0000);
+  CHECK(encode_one(std::ldexp(1.0f, -25) * 1.01f) == 0x0001);
+  CHECK(encode_one(-std::ldexp(1.0f, -30)) == 0x8000);
+}
+
+
+static void test_half_encoder()
+{
+  check_half_encoder({0.0f, -0.0f, 1.0f, -1.0f, 65504.0f, 65520.0f,
+    -65520.0f, 65519.99f, std::ldexp(1.0f, -14), std::ldexp(1.0f, -24),
+    std::ldexp(1.0f, -25), std::ldexp(1.5f, -24),
+    1.0f + std::ldexp(1.0f, -11), 2047.5f,
+    std::numeric_limits<float>::infinity(),
+    -std::numeric_limits<float>::infinity(),
+    std::numeric_limits<float>::quiet_NaN(),
+    -std::numeric_limits<float>::quiet_NaN(),
+    std::numeric_limits<float>::denorm_min(), 1e-30f, -3.14159f, 0.1f,
+    std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest(),
+    1e5f, -7e-5f, 6e-8f, 3e-8f, 0.5f, 42.0f, -1e-3f, 1234.5678f, 2.0f, 3.0f,
+    -0.75f});
+
+  // Random bit patterns cover every exponent.
+  std::mt19937 rng(42);
+  std::vector<float> values(70);
+  for (size_t round = 0; round < 100; round++)
+  {
+    for (float& value : values)
+      value = float_from_bits(rng());
+    check_half_encoder(values);
+  }
+
+  // And embeddings are mostly small values.
+  std::normal_distribution<float> value;
+  for (size_t round = 0; round < 100; round++)
+  {
+    for (float& x : values)
+      x = value(rng) * 0.05f;
+    check_half_encoder(values);
+  }
+}
+
+
+static void check_sign_bits_encoder(const std::vector<float>& values)
+{
+  SignBitsFunc encode_sign_bits = get_sign_bits_func();
+
+  for (size_t n = 0; n <= values.size(); n++)
+  {
+    // A byte past the end checks that nothing is written there.
+    std::vector<uint8_t> expected((n + 7) / 8 + 1, 0xa5);
+    std::vector<uint8_t> actual((n + 7) / 8 + 1, 0xa5);
+    encode_sign_bits_scalar(values.data(), n, expected.data());
+    encode_sign_bits(values.data(), n, actual.data());
+    CHECK(actual == expected);
+    CHECK(actual.back() == 0xa5);
+  }
+}
+
+
+static void test_sign_bits()
+{
+  std::vector<float> values = {1.0f, -1.0f, 0.0f, 2.0f, -0.0f, 0.5f, -3.0f,
+    1e-30f, 4.0f, -4.0f, std::numeric_limits<float>::quiet_NaN(),
+    std::numeric_limits<float>::infinity()};
+  std::vector<uint8_t> bits(2);
+  encode_sign_bits_scalar(values.data(), values.size(), bits.data());
+  // The first value in the highest bit, as pgvector's binary_quantize().
+  CHECK(bits[0] == 0x95);
+  CHECK(bits[1] == 0x90);
+
+  check_sign_bits_encoder(values);
+
+  std::mt19937 rng(42);
+  std::normal_distribution<float> value;
+  values.resize(70);
+  for (size_t round = 0; round < 100; round++)
+  {
+    for (float& x : values)
+      x = value(rng);
+    // Zeros, which are not above 0, in a few places.
+    values[rng() % values.size()] = 0.0f;
+    values[rng() % values.size()] = -0.0f;
+    check_sign_bits_encoder(values);
+  }
+}
+
+
+int main()
+{
+  test_half_scalar();
+  test_half_encoder();
+  test_sign_bits();
+  test_base64();
+  return EXIT_SUCCESS;
+}
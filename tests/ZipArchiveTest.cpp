@@ -0,0 +1,211 @@
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "ZipArchive.h"
+#include "ZipWriter.h"
+
+
+// Largest chunk ZipArchive gives to on_data.
+static const size_t max_chunk_size = 64 * 1024;
+
+
+/*
+Content of the entry as read_entry() streams it, checking the size of each
+chunk.
+*/
+static std::string read_entry(const ZipArchive& archive,
+  const std::string& name, size_t* n_chunks = nullptr)
+{
+  std::string content;
+  size_t chunks = 0;
+  archive.read_entry(name, [&](const char* data, size_t size) {
+    CHECK(size > 0 && size <= max_chunk_size);
+    content.append(data, size);
+    chunks++;
+  });
+
+  if (n_chunks)
+    *n_chunks = chunks;
+  return content;
+}
+
+
+static bool read_fails(const ZipArchive& archive, const std::string& name)
+{
+  try
+  {
+    read_entry(archive, name);
+  }
+  catch (const ZipArchive::format_error&)
+  {
+    return true;
+  }
+  return false;
+}
+
+
+static bool open_fails(const std::string& file_path)
+{
+  try
+  {
+    ZipArchive archive(file_path.c_str());
+  }
+  catch (const ZipArchive::format_error&)
+  {
+    return true;
+  }
+  return false;
+}
+
+
+static void write_file(const std::string& file_path, const std::string& data)
+{
+  std::ofstream file(file_path, std::ios::binary);
+  file << data;
+  CHECK(file.flush());
+}
+
+
+static void test_entries(const TestDirectory& directory)
+{
+  // Text that compresses, then bytes that don't, both spanning several
+  // chunks.
+  std::string text;
+  while (text.size() < 300 * 1024)
+    text += "<text:p>Paragraph " + std::to_string(text.size()) + "</text:p>\n";
+  std::mt19937 rng(42);
+  std::string noise(200 * 1024, '\0');
+  for (char& c : noise)
+    c = static_cast<char>(rng());
+
+  ZipWriter writer;
+  writer.add("mimetype", "application/vnd.oasis.opendocument.text", false);
+  writer.add("content.xml", text, true);
+  writer.add("empty", "", false);
+  writer.add("empty.deflated", "", true);
+  writer.add("Pictures/noise.bin", noise, true);
+  writer.add("stored.bin", noise, false);
+  std::string file_path = directory.path() / "entries.zip";
+  // The end record is found before a comment.
+  writer.write(file_path, std::string(1000, 'c'));
+
+  ZipArchive archive(file_path.c_str());
+  CHECK(archive.has_entry("mimetype"));
+  CHECK(archive.has_entry("Pictures/noise.bin"));
+  CHECK(!archive.has_entry("Pictures"));
+  CHECK(!archive.has_entry("word/document.xml"));
+
+  CHECK(read_entry(archive, "mimetype") ==
+    "application/vnd.oasis.opendocument.text");
+  size_t n_chunks;
+  CHECK(read_entry(archive, "content.xml", &n_chunks) == text);
+  CHECK(n_chunks >= text.size() / max_chunk_size);
+  CHECK(read_entry(archive, "empty", &n_chunks).empty() && n_chunks == 0);
+  CHECK(read_entry(archive, "empty.deflated", &n_chunks).empty() &&
+    n_chunks == 0);
+  CHECK(read_entry(archive, "Pictures/noise.bin") == noise);
+  CHECK(read_entry(archive, "stored.bin", &n_chunks) == noise);
+  CHECK(n_chunks == (noise.size() + max_chunk_size - 1) / max_chunk_size);
+  CHECK(read_fails(archive, "missing.xml"));
+}
+
+
+static void test_broken_entries(const TestDirectory& directory)
+{
+  std::string content("<office:document-content/>\n");
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(content.data()),
+    content.size());
+  std::string deflated = ZipWriter::deflate(content);
+
+  ZipWriter writer;
+  writer.add_raw("bad-crc.stored", 0, ZipWriter::method_stored, crc + 1,
+    content, content.size());
+  writer.add_raw("bad-crc.deflated", 0, ZipWriter::method_deflated, crc + 1,
+    deflated, content.size());
+  writer.add_raw("short.deflated", 0, ZipWriter::method_deflated, crc,
+    deflated, content.size() - 1);
+  writer.add_raw("long.deflated", 0, ZipWriter::method_deflated, crc,
+    deflated, content.size() + 1);
+  writer.add_raw("cut.deflated", 0, ZipWriter::method_deflated, crc,
+    deflated.substr(0, deflated.size() / 2), content.size());
+  writer.add_raw("garbage.deflated", 0, ZipWriter::method_deflated, crc,
+    std::string(deflated.size(), '\xff'), content.size());
+  writer.add_raw("bzip2", 0, 12, crc, content, content.size());
+  writer.add_raw("encrypted", 1, ZipWriter::method_stored, crc, content,
+    content.size());
+  writer.add("good", content, true);
+  std::string file_path = directory.path() / "broken.zip";
+  writer.write(file_path);
+
+  ZipArchive archive(file_path.c_str());
+  CHECK(read_fails(archive, "bad-crc.stored"));
+  CHECK(read_fails(archive, "bad-crc.deflated"));
+  CHECK(read_fails(archive, "short.deflated"));
+  CHECK(read_fails(archive, "long.deflated"));
+  CHECK(read_fails(archive, "cut.deflated"));
+  CHECK(read_fails(archive, "garbage.deflated"));
+  CHECK(read_fails(archive, "bzip2"));
+  // Encrypted entries are left out.
+  CHECK(!archive.has_entry("encrypted"));
+  CHECK(read_entry(archive, "good") == content);
+
+  // A local header that isn't one.
+  std::string zip = writer.bytes();
+  zip[0] = 'X';
+  write_file(file_path, zip);
+  ZipArchive bad_header(file_path.c_str());
+  CHECK(bad_header.has_entry("bad-crc.stored"));
+  CHECK(read_fails(bad_header, "bad-crc.stored"));
+  CHECK(read_entry(bad_header, "good") == content);
+}
+
+
+static void test_not_zip(const TestDirectory& directory)
+{
+  std::string file_path = directory.path() / "not.zip";
+
+  write_file(file_path, "");
+  CHECK(open_fails(file_path));
+  write_file(file_path, "PK");
+  CHECK(open_fails(file_path));
+  write_file(file_path, std::string(100 * 1024, 'x'));
+  CHECK(open_fails(file_path));
+
+  // Cut in the central directory.
+  ZipWriter writer;
+  writer.add("content.xml", "<office:document-content/>", true);
+  std::string zip = writer.bytes();
+  std::string end_record = zip.substr(zip.size() - 22);
+  write_file(file_path, zip.substr(0, zip.size() - 40) + end_record);
+  CHECK(open_fails(file_path));
+
+  // No file is a runtime_error, not a format_error.
+  bool missing_fails = false;
+  try
+  {
+    ZipArchive archive((directory.path() / "missing.zip").c_str());
+  }
+  catch (const ZipArchive::format_error&)
+  {
+  }
+  catch (const std::runtime_error&)
+  {
+    missing_fails = true;
+  }
+  CHECK(missing_fails);
+}
+
+
+int main()
+{
+  TestDirectory directory("ZipArchiveTest");
+  test_entries(directory);
+  test_broken_entries(directory);
+  test_not_zip(directory);
+  return EXIT_SUCCESS;
+}
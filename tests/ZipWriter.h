@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+
+/*
+Zip file built in memory by the tests, with entries stored or deflated by
+zlib, or written as given to make broken ones.
+*/
+class ZipWriter
+{
+  struct central_entry
+  {
+    std::string name;
+    uint16_t flags;
+    uint16_t method;
+    uint32_t crc;
+    uint32_t compressed_size;
+    uint32_t size;
+    uint32_t offset;
+  };
+
+  std::string data;
+  std::vector<central_entry> entries;
+
+  static void put_u16(std::string& out, uint16_t value)
+  {
+    out += static_cast<char>(value);
+    out += static_cast<char>(value >> 8);
+  }
+
+  static void put_u32(std::string& out, uint32_t value)
+  {
+    put_u16(out, value);
+    put_u16(out, value >> 16);
+  }
+
+public:
+
+  static const uint16_t method_stored = 0;
+  static const uint16_t method_deflated = 8;
+
+  // Raw deflate data of content, without a zlib header, as in zip files.
+  static std::string deflate(const std::string& content)
+  {
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+      8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("deflateInit2() failed");
+
+    std::string compressed(deflateBound(&stream, content.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(
+      const_cast<char*>(content.data()));
+    stream.avail_in = content.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_out = compressed.size();
+    int ret = ::deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    if (ret != Z_STREAM_END)
+      throw std::runtime_error("deflate() failed");
+    return compressed;
+  }
+
+  // Adds an entry with content, compressed when deflated.
+  void add(const std::string& name, const std::string& content,
+    bool deflated)
+  {
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(content.data()),
+      content.size());
+    add_raw(name, 0, deflated ? method_deflated : method_stored, crc,
+      deflated ? deflate(content) : content, content.size());
+  }
+
+  // Adds an entry whose headers say what's given, whatever the bytes are.
+  void add_raw(const std::string& name, uint16_t flags, uint16_t method,
+    uint32_t crc, const std::string& compressed, uint32_t size)
+  {
+    central_entry entry{name, flags, method, crc,
+      static_cast<uint32_t>(compressed.size()), size,
+      static_cast<uint32_t>(data.size())};
+    entries.push_back(entry);
+
+    put_u32(data, 0x04034b50);
+    put_u16(data, 20);
+    put_u16(data, flags);
+    put_u16(data, method);
+    put_u32(data, 0);
+    put_u32(data, crc);
+    put_u32(data, entry.compressed_size);
+    put_u32(data, size);
+    put_u16(data, name.size());
+    // An extra field only in the local header, which readers must skip.
+    put_u16(data, 4);
+    data += name;
+    put_u16(data, 0xcafe);
+    put_u16(data, 0);
+    data += compressed;
+  }
+
+  // Bytes of the zip file, the entries followed by the central directory
+  // and the end record with comment.
+  std::string bytes(const std::string& comment = std::string()) const
+  {
+    std::string zip = data;
+    uint32_t dir_offset = zip.size();
+
+    for (const central_entry& entry : entries)
+    {
+      put_u32(zip, 0x02014b50);
+      put_u16(zip, 20);
+      put_u16(zip, 20);
+      put_u16(zip, entry.flags);
+      put_u16(zip, entry.method);
+      put_u32(zip, 0);
+      put_u32(zip, entry.crc);
+      put_u32(zip, entry.compressed_size);
+      put_u32(zip, entry.size);
+      put_u16(zip, entry.name.size());
+      put_u16(zip, 0);
+      put_u16(zip, 0);
+      put_u16(zip, 0);
+      put_u16(zip, 0);
+      put_u32(zip, 0);
+      put_u32(zip, entry.offset);
+      zip += entry.name;
+    }
+
+    uint32_t dir_size = zip.size() - dir_offset;
+    put_u32(zip, 0x06054b50);
+    put_u16(zip, 0);
+    put_u16(zip, 0);
+    put_u16(zip, entries.size());
+    put_u16(zip, entries.size());
+    put_u32(zip, dir_size);
+    put_u32(zip, dir_offset);
+    put_u16(zip, comment.size());
+    zip += comment;
+    return zip;
+  }
+
+  void write(const std::string& file_path,
+    const std::string& comment = std::string()) const
+  {
+    std::ofstream file(file_path, std::ios::binary);
+    file << bytes(comment);
+    if (!file.flush())
+      throw std::runtime_error("Cannot write " + file_path);
+  }
+};
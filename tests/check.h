@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+
+// Ends the test, naming the condition that failed and where. Unlike assert(),
+// it's also checked in release builds.
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " \
+        << #condition << std::endl; \
+      std::exit(EXIT_FAILURE); \
+    } \
+  } while (false)
+
+
+// Base64 of size bytes of data, with the padding when padded.
+inline std::string encode_base64(const void* data, size_t size, bool padded)
+{
+  static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+  std::string base64;
+  for (size_t idx = 0; idx < size; idx += 3)
+  {
+    uint32_t bits = bytes[idx] << 16;
+    if (idx + 1 < size)
+      bits |= bytes[idx + 1] << 8;
+    if (idx + 2 < size)
+      bits |= bytes[idx + 2];
+
+    size_t n_chars = std::min<size_t>(size - idx, 3) + 1;
+    for (size_t char_idx = 0; char_idx < n_chars; char_idx++)
+      base64 += alphabet[(bits >> (18 - 6 * char_idx)) & 0x3f];
+    if (padded)
+      base64.append(4 - n_chars, '=');
+  }
+  return base64;
+}
+
+
+// Empty directory of the test in the temporary directory, removed when the
+// test ends.
+class TestDirectory
+{
+  std::filesystem::path _path;
+
+public:
+
+  explicit TestDirectory(const char* name):
+    _path(std::filesystem::temp_directory_path() /
+      (std::string(name) + "-" + std::to_string(getpid())))
+  {
+    std::filesystem::remove_all(_path);
+    std::filesystem::create_directories(_path);
+  }
+
+  TestDirectory(const TestDirectory&) = delete;
+
+  TestDirectory& operator=(const TestDirectory&) = delete;
+
+  virtual ~TestDirectory()
+  {
+    std::error_code ec;
+    std::filesystem::remove_all(_path, ec);
+  }
+
+  const std::filesystem::path& path() const
+  {
+    return _path;
+  }
+};